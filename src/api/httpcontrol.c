@@ -26,6 +26,7 @@
 #include "event.h"
 #include "image/image.h"
 #include "misc/str.h"
+#include "misc/pool.h"
 #include "backend/backend.h"
 #include "notifications.h"
 #include "fileaccess/fileaccess.h"
@@ -359,6 +360,38 @@ hc_diagnostics(http_connection_t *hc, const char *remain, void *opaque,
 }
 
 
+/**
+ *
+ */
+static int
+hc_poolstats(http_connection_t *hc, const char *remain, void *opaque,
+             http_cmd_t method)
+{
+  pool_stats_t stats[64];
+  htsbuf_queue_t out;
+  int i, n;
+
+  n = pool_get_all_stats(stats, 64);
+
+  htsbuf_queue_init(&out, 0);
+  htsbuf_qprintf(&out, "%-20s %6s %8s %8s %8s %12s %6s\n",
+                 "Pool", "Size", "Segments", "In use", "Cached",
+                 "Allocs", "Hit%");
+
+  for(i = 0; i < n; i++) {
+    const pool_stats_t *ps = &stats[i];
+    htsbuf_qprintf(&out, "%-20s %6d %8d %8d %8d %12"PRId64" %6d\n",
+                   ps->ps_name, (int)ps->ps_item_size, ps->ps_segments,
+                   ps->ps_in_use, ps->ps_cached, ps->ps_gets,
+                   ps->ps_gets ?
+                   (int)(ps->ps_cache_hits * 100 / ps->ps_gets) : 0);
+  }
+
+  return http_send_reply(hc, 0, "text/plain; charset=utf-8",
+                         NULL, NULL, 0, &out);
+}
+
+
 /**
  *
  */
@@ -674,6 +707,7 @@ httpcontrol_init(void)
   http_path_add("/showtime/notifyuser", NULL, hc_notify_user, 1);
   http_path_add("/showtime/diag", NULL, hc_diagnostics, 1);
   http_path_add("/showtime/logfile", NULL, hc_logfile, 0);
+  http_path_add("/showtime/poolstats", NULL, hc_poolstats, 1);
   http_path_add("/showtime/replace", NULL, hc_binreplace, 1);
   http_add_websocket("/showtime/ws/echo",
 		     hc_echo_init, hc_echo_data, hc_echo_fini);
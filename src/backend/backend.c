@@ -231,6 +231,22 @@ backend_imageloader(rstr_t *url0, const image_meta_t *im0,
     im.im_want_thumb = 1;
   }
 
+  if(!strncmp(url, "tile:", 5)) {
+    // tile:<col>,<row>,<cols>,<rows>:<url> for zooming into huge images
+    int col, row, cols, rows, n = 0;
+    if(sscanf(url + 5, "%d,%d,%d,%d:%n", &col, &row, &cols, &rows, &n) != 4 ||
+       n == 0 || cols < 1 || rows < 1 || cols > 64 || rows > 64 ||
+       col < 0 || row < 0 || col >= cols || row >= rows) {
+      snprintf(errbuf, errlen, "Invalid tile");
+      return NULL;
+    }
+    url += 5 + n;
+    im.im_region[0] = (float)col / cols;
+    im.im_region[1] = (float)row / rows;
+    im.im_region[2] = 1.0f / cols;
+    im.im_region[3] = 1.0f / rows;
+  }
+
   if(!strncmp(url, "imageset:", 9)) {
 
     m = htsmsg_json_deserialize(url+9);
@@ -295,6 +311,7 @@ backend_imageloader(rstr_t *url0, const image_meta_t *im0,
   image_t *img = NULL;
 
   im.im_margin = MAX(im.im_shadow * 2, im.im_margin);
+  im.im_cancellable = c;
   backend_t *nb = backend_canhandle(url);
   if(nb == NULL || nb->be_imageloader == NULL) {
     snprintf(errbuf, errlen, "No backend for URL");
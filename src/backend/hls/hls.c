@@ -112,6 +112,7 @@ segment_destroy(hls_segment_t *hs)
 {
   if(hs->hs_fh != NULL)
     fa_close(hs->hs_fh);
+  buf_release(hs->hs_data);
   TAILQ_REMOVE(&hs->hs_variant->hv_segments, hs, hs_link);
   free(hs->hs_url);
   rstr_release(hs->hs_key_url);
@@ -487,23 +488,35 @@ hls_segment_open(hls_segment_t *hs)
   if(hs->hs_byte_offset != -1)
     flags &= ~FA_STREAMING;
 
-  hs->hs_opened_at = arch_get_ts();
   hs->hs_block_cnt = h->h_blocked;
 
-  fh = fa_open_ex(hs->hs_url, errbuf, sizeof(errbuf), flags, &foe);
+  buf_t *b = hls_prefetch_claim(hs);
 
-  if(fh == NULL) {
-    usleep(500000);
-    if(foe.foe_protocol_error == 404) {
-      return HLS_ERROR_SEGMENT_NOT_FOUND;
-    } else {
-      hs->hs_unavailable = 1;
-      return HLS_ERROR_SEGMENT_BROKEN;
+  if(b != NULL) {
+    // Already sliced and accounted for in the bandwidth estimate
+    hs->hs_opened_at = 0;
+    hs->hs_data = b;
+    fh = memfile_make(buf_data(b), buf_len(b));
+
+  } else {
+
+    hs->hs_opened_at = arch_get_ts();
+
+    fh = fa_open_ex(hs->hs_url, errbuf, sizeof(errbuf), flags, &foe);
+
+    if(fh == NULL) {
+      usleep(500000);
+      if(foe.foe_protocol_error == 404) {
+        return HLS_ERROR_SEGMENT_NOT_FOUND;
+      } else {
+        hs->hs_unavailable = 1;
+        return HLS_ERROR_SEGMENT_BROKEN;
+      }
     }
-  }
 
-  if(hs->hs_byte_size != -1 && hs->hs_byte_offset != -1)
-    fh = fa_slice_open(fh, hs->hs_byte_offset, hs->hs_byte_size);
+    if(hs->hs_byte_size != -1 && hs->hs_byte_offset != -1)
+      fh = fa_slice_open(fh, hs->hs_byte_offset, hs->hs_byte_size);
+  }
 
   hs->hs_size = fa_fsize(fh);
 
@@ -519,6 +532,8 @@ hls_segment_open(hls_segment_t *hs)
 	TRACE(TRACE_ERROR, "HLS", "Unable to load key file %s",
 	      rstr_get(hs->hs_key_url));
 	fa_close(fh);
+        buf_release(hs->hs_data);
+        hs->hs_data = NULL;
         hs->hs_unavailable = 1;
         return HLS_ERROR_SEGMENT_BAD_KEY;
       }
@@ -528,41 +543,57 @@ hls_segment_open(hls_segment_t *hs)
     fh = fa_aescbc_open(fh, hs->hs_iv, buf_c8(hv->hv_key));
   }
   hs->hs_fh = fh;
-  HLS_TRACE(h, "Opened %s (sequence %d) ranges:[%d + %d] OK",
-            hs->hs_url, hs->hs_seq, hs->hs_byte_offset, hs->hs_byte_size);
+  HLS_TRACE(h, "Opened %s (sequence %d) ranges:[%d + %d] OK%s",
+            hs->hs_url, hs->hs_seq, hs->hs_byte_offset, hs->hs_byte_size,
+            hs->hs_data ? " (prefetched)" : "");
   return 0;
 }
 
 
 /**
+ * Add a bandwidth sample. The estimate is the lower of the harmonic
+ * mean over the last HLS_BW_SAMPLES samples (weighted by size, which
+ * is just total bytes over total time) and a fast moving average.
+ * This way we back off quickly when throughput drops but need a few
+ * good segments before going up again.
  *
+ * Must be called with hd_prefetch_mutex locked
  */
-static void
-hls_variant_update_bw(hls_segment_t *hs)
+void
+hls_bw_add_sample(hls_demuxer_t *hd, int64_t bytes, int64_t duration)
 {
-  hls_variant_t *hv = hs->hs_variant;
-  hls_demuxer_t *hd = hv->hv_demuxer;
   const hls_t *h = hd->hd_hls;
+  int64_t total_bytes = 0, total_duration = 0;
+  int i;
 
-  if(hs == NULL || !hs->hs_opened_at)
+  if(bytes <= 0 || duration <= 0)
     return;
 
-  int ts = arch_get_ts() - hs->hs_opened_at;
-  if(h->h_blocked != hs->hs_block_cnt)
-    return;
-
-  int bw = 8000000LL * hs->hs_size / ts;
+  hls_bw_sample_t *hbs = &hd->hd_bw_samples[hd->hd_bw_sample_ptr];
+  hbs->hbs_bytes = bytes;
+  hbs->hbs_duration = duration;
+  hd->hd_bw_sample_ptr = (hd->hd_bw_sample_ptr + 1) % HLS_BW_SAMPLES;
+  if(hd->hd_bw_num_samples < HLS_BW_SAMPLES)
+    hd->hd_bw_num_samples++;
 
-  if(hd->hd_bw == 0) {
-    hd->hd_bw = bw;
-  } else if (bw < hd->hd_bw) {
-    hd->hd_bw = bw;
-  } else {
-    hd->hd_bw = (bw + hd->hd_bw * 3) / 4;
+  for(i = 0; i < hd->hd_bw_num_samples; i++) {
+    total_bytes    += hd->hd_bw_samples[i].hbs_bytes;
+    total_duration += hd->hd_bw_samples[i].hbs_duration;
   }
 
+  const int bw   = MIN(8000000LL * bytes / duration, INT32_MAX);
+  const int mean = MIN(8000000LL * total_bytes / total_duration, INT32_MAX);
+
+  if(hd->hd_bw_fast == 0)
+    hd->hd_bw_fast = bw;
+  else
+    hd->hd_bw_fast = (bw + (int64_t)hd->hd_bw_fast) / 2;
+
+  hd->hd_bw = MIN(mean, hd->hd_bw_fast);
 
-  HLS_TRACE(h, "Estimated bandwidth: %d bps (filtered: %d bps)", bw, hd->hd_bw);
+  HLS_TRACE(h, "%s: Estimated bandwidth: %d bps "
+            "(mean: %d bps, filtered: %d bps)",
+            hd->hd_type, bw, mean, hd->hd_bw);
 
   if(hd == &h->h_primary) {
     prop_set(h->h_mp->mp_prop_io, "bitrate", PROP_SET_INT, hd->hd_bw / 1000);
@@ -571,6 +602,30 @@ hls_variant_update_bw(hls_segment_t *hs)
 }
 
 
+/**
+ * Segments that were not prefetched are read at the pace of the
+ * demuxer so they can only be used for estimation if we never were
+ * blocked on a full buffer while reading
+ */
+static void
+hls_variant_update_bw(hls_segment_t *hs)
+{
+  hls_variant_t *hv = hs->hs_variant;
+  hls_demuxer_t *hd = hv->hv_demuxer;
+  const hls_t *h = hd->hd_hls;
+
+  if(!hs->hs_opened_at)
+    return;
+
+  if(h->h_blocked != hs->hs_block_cnt)
+    return;
+
+  hts_mutex_lock(&hd->hd_prefetch_mutex);
+  hls_bw_add_sample(hd, hs->hs_size, arch_get_ts() - hs->hs_opened_at);
+  hts_mutex_unlock(&hd->hd_prefetch_mutex);
+}
+
+
 /**
  *
  */
@@ -584,6 +639,8 @@ hls_segment_close(hls_segment_t *hs)
 
   fa_close(hs->hs_fh);
   hs->hs_fh = NULL;
+  buf_release(hs->hs_data);
+  hs->hs_data = NULL;
 }
 
 
@@ -687,6 +744,8 @@ hls_variant_close(hls_variant_t *hv)
     hls_segment_close(hv->hv_current_seg);
     hv->hv_current_seg = NULL;
   }
+
+  hls_prefetch_flush(hv->hv_demuxer);
 }
 
 
@@ -927,6 +986,8 @@ hls_event_callback(media_pipe_t *mp, void *aux, event_t *e)
 
     cancellable_cancel(&h->h_primary.hd_cancellable);
     cancellable_cancel(&h->h_audio.hd_cancellable);
+    hls_prefetch_flush(&h->h_primary);
+    hls_prefetch_flush(&h->h_audio);
 
     hts_mutex_lock(&h->h_mutex);
     h->h_pending_seek = ets->ts;
@@ -941,6 +1002,8 @@ hls_event_callback(media_pipe_t *mp, void *aux, event_t *e)
 
     cancellable_cancel(&h->h_primary.hd_cancellable);
     cancellable_cancel(&h->h_audio.hd_cancellable);
+    hls_prefetch_flush(&h->h_primary);
+    hls_prefetch_flush(&h->h_audio);
 
     hts_mutex_lock(&h->h_mutex);
 
@@ -1772,6 +1835,7 @@ hls_demuxer_init(hls_demuxer_t *hd, hls_t *h, const char *type)
   hd->hd_hls = h;
   hd->hd_type = type;
   hd->hd_seek_to_segment = PTS_UNSET;
+  hls_prefetch_init(hd);
 }
 
 
@@ -1782,6 +1846,7 @@ static void
 hls_demuxer_close(media_pipe_t *mp, hls_demuxer_t *hd)
 {
   variants_destroy(&hd->hd_variants);
+  hls_prefetch_fini(hd);
   if(hd->hd_audio_codec != NULL)
     media_codec_deref(hd->hd_audio_codec);
   hls_free_mbp(mp, &hd->hd_mb);
@@ -34,6 +34,7 @@ event_t *hls_play_extm3u(char *s, const char *url, media_pipe_t *mp,
 
 TAILQ_HEAD(hls_variant_queue, hls_variant);
 TAILQ_HEAD(hls_segment_queue, hls_segment);
+TAILQ_HEAD(hls_prefetch_queue, hls_prefetch);
 LIST_HEAD(hls_audio_track_list, hls_audio_track);
 
 #define HLS_CRYPTO_NONE   0
@@ -71,6 +72,7 @@ typedef struct hls_segment {
   char hs_mark;
 
   fa_handle_t *hs_fh;
+  buf_t *hs_data; // Prefetched segment, hs_fh reads from this if set
 
 } hls_segment_t;
 
@@ -156,6 +158,15 @@ typedef struct hls_variant {
 } hls_variant_t;
 
 
+#define HLS_PREFETCH_DEPTH 2   // Segments downloaded ahead of the demuxer
+#define HLS_BW_SAMPLES     5   // Size of bandwidth estimator window
+
+typedef struct hls_bw_sample {
+  int64_t hbs_bytes;
+  int64_t hbs_duration; // in usec
+} hls_bw_sample_t;
+
+
 /**
  *
  */
@@ -187,6 +198,28 @@ typedef struct hls_demuxer {
 
   media_buf_t *hd_mb;
 
+  /**
+   * Segment prefetching (see hls_prefetch.c). The mutex also
+   * protects the bandwidth estimator as samples are added from
+   * the prefetch threads
+   */
+  hts_mutex_t hd_prefetch_mutex;
+  hts_cond_t hd_prefetch_cond;
+  struct hls_prefetch_queue hd_prefetch_jobs;
+  hts_thread_t hd_prefetch_threads[HLS_PREFETCH_DEPTH];
+  char hd_prefetch_running;
+  char hd_prefetch_stop;
+
+  int hd_prefetch_active;        // Downloads in progress
+  int64_t hd_prefetch_busy_since;
+  int64_t hd_prefetch_busy;      // usec with at least one download running
+  int64_t hd_prefetch_bytes;     // bytes downloaded during hd_prefetch_busy
+
+  hls_bw_sample_t hd_bw_samples[HLS_BW_SAMPLES];
+  int hd_bw_num_samples;
+  int hd_bw_sample_ptr;
+  int hd_bw_fast;                // EWMA of the samples
+
 } hls_demuxer_t;
 
 
@@ -268,6 +301,20 @@ int hls_get_audio_track(hls_t *h, int pid, const char *name,
 
 hls_segment_t *hv_find_segment_by_seq(const hls_variant_t *hv, int seq);
 
+void hls_bw_add_sample(hls_demuxer_t *hd, int64_t bytes, int64_t duration);
+
+// Prefetcher
+
+void hls_prefetch_init(hls_demuxer_t *hd);
+
+void hls_prefetch_fini(hls_demuxer_t *hd);
+
+void hls_prefetch_schedule(hls_segment_t *hs);
+
+buf_t *hls_prefetch_claim(hls_segment_t *hs);
+
+void hls_prefetch_flush(hls_demuxer_t *hd);
+
 // TS demuxer
 
 media_buf_t *hls_ts_demuxer_read(hls_demuxer_t *hd);
@@ -0,0 +1,491 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "media/media.h"
+#include "backend/backend.h"
+#include "fileaccess/fileaccess.h"
+#include "misc/queue.h"
+#include "misc/minmax.h"
+#include "hls.h"
+
+/**
+ * Segment prefetcher
+ *
+ * When the demuxer starts on a segment the following HLS_PREFETCH_DEPTH
+ * segments are queued for download. Each demuxer has the same number
+ * of worker threads so all of them can be in flight at once. The raw
+ * (still encrypted) segment ends up in memory and hls_segment_open()
+ * reads from there instead of opening the URL itself.
+ *
+ * Jobs do not point to the segment, the playlist may be reloaded (and
+ * segments destroyed) while a download is running. Instead they are
+ * matched on variant and sequence number.
+ *
+ * Bandwidth is measured over the time at least one download is
+ * running so parallel downloads are not counted as being slower.
+ *
+ * Segments are held in RAM so each one is capped at
+ * HLS_PREFETCH_MAX_BYTES. Segments that are (or are estimated from the
+ * variant bitrate to be) larger are not prefetched at all and downloads
+ * that grow past the limit are abandoned. In both cases the demuxer
+ * just streams the segment itself. Thus a demuxer never holds more than
+ * (HLS_PREFETCH_DEPTH + 1) * HLS_PREFETCH_MAX_BYTES of segment data.
+ */
+
+#define HLS_BW_MIN_BYTES 65536  // Don't estimate bandwidth on less
+
+#define HLS_PREFETCH_MAX_BYTES (8 * 1024 * 1024)
+
+typedef enum {
+  HP_QUEUED,
+  HP_RUNNING,
+  HP_DONE,
+} hls_prefetch_state_t;
+
+typedef struct hls_prefetch {
+  TAILQ_ENTRY(hls_prefetch) hp_link;
+
+  const hls_variant_t *hp_variant; // Only for matching, never dereferenced
+  int hp_seq;
+
+  char *hp_url;
+  int hp_byte_offset;
+  int hp_byte_size;
+  int64_t hp_duration;
+
+  hls_prefetch_state_t hp_state;
+  char hp_cancelled;
+  int hp_refcount;
+
+  cancellable_t hp_cancellable;
+
+  buf_t *hp_data;
+
+} hls_prefetch_t;
+
+
+/**
+ * Must be called with hd_prefetch_mutex locked
+ */
+static void
+hls_prefetch_release(hls_prefetch_t *hp)
+{
+  if(--hp->hp_refcount)
+    return;
+  buf_release(hp->hp_data);
+  free(hp->hp_url);
+  free(hp);
+}
+
+
+/**
+ * Must be called with hd_prefetch_mutex locked
+ */
+static void
+hls_prefetch_drop(hls_demuxer_t *hd, hls_prefetch_t *hp)
+{
+  TAILQ_REMOVE(&hd->hd_prefetch_jobs, hp, hp_link);
+  hp->hp_cancelled = 1;
+  if(hp->hp_state == HP_RUNNING)
+    cancellable_cancel(&hp->hp_cancellable);
+  hls_prefetch_release(hp);
+}
+
+
+/**
+ * Must be called with hd_prefetch_mutex locked
+ */
+static hls_prefetch_t *
+hls_prefetch_find(hls_demuxer_t *hd, const hls_variant_t *hv, int seq)
+{
+  hls_prefetch_t *hp;
+  TAILQ_FOREACH(hp, &hd->hd_prefetch_jobs, hp_link)
+    if(hp->hp_variant == hv && hp->hp_seq == seq)
+      return hp;
+  return NULL;
+}
+
+
+/**
+ * Update the time we have had at least one download running.
+ * Must be called with hd_prefetch_mutex locked
+ */
+static void
+hls_prefetch_account(hls_demuxer_t *hd, int64_t now, int delta)
+{
+  if(hd->hd_prefetch_active)
+    hd->hd_prefetch_busy += now - hd->hd_prefetch_busy_since;
+  hd->hd_prefetch_busy_since = now;
+  hd->hd_prefetch_active += delta;
+}
+
+
+/**
+ * Publish how much is downloaded ahead of the demuxer (in seconds)
+ * Must be called with hd_prefetch_mutex locked
+ */
+static void
+hls_prefetch_update_level(hls_demuxer_t *hd)
+{
+  const hls_t *h = hd->hd_hls;
+  hls_prefetch_t *hp;
+  int64_t buffered = 0;
+
+  if(hd != &h->h_primary)
+    return;
+
+  TAILQ_FOREACH(hp, &hd->hd_prefetch_jobs, hp_link)
+    if(hp->hp_state == HP_DONE && hp->hp_data != NULL)
+      buffered += hp->hp_duration;
+
+  prop_set(h->h_mp->mp_prop_io, "prefetched", PROP_SET_FLOAT,
+           buffered / 1000000.0f);
+}
+
+
+/**
+ * Guess the size of a segment, returns -1 if we have no idea
+ */
+static int64_t
+hls_prefetch_estimate_size(const hls_segment_t *hs)
+{
+  if(hs->hs_byte_size != -1)
+    return hs->hs_byte_size;
+
+  if(hs->hs_variant->hv_bitrate > 0 && hs->hs_duration > 0)
+    return (int64_t)hs->hs_variant->hv_bitrate * hs->hs_duration / 8000000;
+
+  return -1;
+}
+
+
+/**
+ * Like fa_load_and_close() but gives up if the file is larger than
+ * HLS_PREFETCH_MAX_BYTES
+ */
+static buf_t *
+hls_prefetch_load(fa_handle_t *fh, const hls_prefetch_t *hp, const hls_t *h)
+{
+  const int64_t fsize = fa_fsize(fh);
+  size_t size = 0;
+  size_t alloced = fsize > 0 ? fsize : 65536;
+  uint8_t *mem;
+  int r;
+
+  if(fsize > HLS_PREFETCH_MAX_BYTES) {
+    HLS_TRACE(h, "Not prefetching sequence %d, %"PRId64" bytes is too big",
+              hp->hp_seq, fsize);
+    fa_close(fh);
+    return NULL;
+  }
+
+  if((mem = malloc(alloced + 1)) == NULL) {
+    fa_close(fh);
+    return NULL;
+  }
+
+  while(1) {
+    if(size == alloced) {
+      if(alloced == HLS_PREFETCH_MAX_BYTES) {
+        HLS_TRACE(h, "Prefetch of sequence %d exceeds %d bytes, giving up",
+                  hp->hp_seq, HLS_PREFETCH_MAX_BYTES);
+        free(mem);
+        fa_close(fh);
+        return NULL;
+      }
+      alloced = MIN(alloced * 2, HLS_PREFETCH_MAX_BYTES);
+      if((mem = myreallocf(mem, alloced + 1)) == NULL) {
+        fa_close(fh);
+        return NULL;
+      }
+    }
+
+    r = fa_read(fh, mem + size, alloced - size);
+    if(r < 0) {
+      free(mem);
+      fa_close(fh);
+      return NULL;
+    }
+    if(r == 0)
+      break;
+    size += r;
+  }
+
+  fa_close(fh);
+  mem[size] = 0;
+  return buf_create_from_malloced(size, mem);
+}
+
+
+/**
+ *
+ */
+static buf_t *
+hls_prefetch_download(hls_prefetch_t *hp, const hls_t *h)
+{
+  fa_open_extra_t foe = {0};
+  char errbuf[512];
+
+  foe.foe_open_timeout = 2000;
+  foe.foe_c = &hp->hp_cancellable;
+
+  fa_handle_t *fh = fa_open_ex(hp->hp_url, errbuf, sizeof(errbuf), 0, &foe);
+  if(fh == NULL) {
+    HLS_TRACE(h, "Unable to prefetch %s -- %s", hp->hp_url, errbuf);
+    return NULL;
+  }
+
+  if(hp->hp_byte_size != -1 && hp->hp_byte_offset != -1)
+    fh = fa_slice_open(fh, hp->hp_byte_offset, hp->hp_byte_size);
+
+  return hls_prefetch_load(fh, hp, h);
+}
+
+
+/**
+ *
+ */
+static void *
+hls_prefetch_thread(void *aux)
+{
+  hls_demuxer_t *hd = aux;
+  const hls_t *h = hd->hd_hls;
+  hls_prefetch_t *hp;
+
+  hts_mutex_lock(&hd->hd_prefetch_mutex);
+
+  while(!hd->hd_prefetch_stop) {
+
+    TAILQ_FOREACH(hp, &hd->hd_prefetch_jobs, hp_link)
+      if(hp->hp_state == HP_QUEUED)
+        break;
+
+    if(hp == NULL) {
+      hts_cond_wait(&hd->hd_prefetch_cond, &hd->hd_prefetch_mutex);
+      continue;
+    }
+
+    hp->hp_state = HP_RUNNING;
+    hp->hp_refcount++;
+
+    const int64_t ts = arch_get_ts();
+    hls_prefetch_account(hd, ts, 1);
+
+    hts_mutex_unlock(&hd->hd_prefetch_mutex);
+
+    buf_t *b = hls_prefetch_download(hp, h);
+
+    hts_mutex_lock(&hd->hd_prefetch_mutex);
+
+    const int64_t now = arch_get_ts();
+    hls_prefetch_account(hd, now, -1);
+
+    if(b != NULL) {
+      const int ms = (now - ts) / 1000;
+
+      HLS_TRACE(h, "%s: Prefetched sequence %d, %d bytes in %d ms",
+                hd->hd_type, hp->hp_seq, (int)buf_len(b), ms);
+
+      if(hd == &h->h_primary)
+        prop_set(h->h_mp->mp_prop_io, "segmentDownloadTime",
+                 PROP_SET_INT, ms);
+
+      hd->hd_prefetch_bytes += buf_len(b);
+      if(hd->hd_prefetch_bytes >= HLS_BW_MIN_BYTES) {
+        hls_bw_add_sample(hd, hd->hd_prefetch_bytes, hd->hd_prefetch_busy);
+        hd->hd_prefetch_bytes = 0;
+        hd->hd_prefetch_busy = 0;
+      }
+    }
+
+    hp->hp_data = b;
+    hp->hp_state = HP_DONE;
+    hls_prefetch_update_level(hd);
+    hts_cond_broadcast(&hd->hd_prefetch_cond);
+    hls_prefetch_release(hp);
+  }
+
+  hts_mutex_unlock(&hd->hd_prefetch_mutex);
+  return NULL;
+}
+
+
+/**
+ * Queue download of the segments following 'cur' (which the demuxer
+ * has just opened) and forget about those we no longer need
+ */
+void
+hls_prefetch_schedule(hls_segment_t *cur)
+{
+  hls_variant_t *hv = cur->hs_variant;
+  hls_demuxer_t *hd = hv->hv_demuxer;
+  hls_prefetch_t *hp, *next;
+  hls_segment_t *hs = cur;
+  int i;
+
+  hts_mutex_lock(&hd->hd_prefetch_mutex);
+
+  for(hp = TAILQ_FIRST(&hd->hd_prefetch_jobs); hp != NULL; hp = next) {
+    next = TAILQ_NEXT(hp, hp_link);
+    if(hp->hp_variant != hv || hp->hp_seq <= cur->hs_seq ||
+       hp->hp_seq > cur->hs_seq + HLS_PREFETCH_DEPTH)
+      hls_prefetch_drop(hd, hp);
+  }
+
+  for(i = 0; i < HLS_PREFETCH_DEPTH; i++) {
+    hs = TAILQ_NEXT(hs, hs_link);
+    if(hs == NULL)
+      break;
+
+    if(hls_prefetch_find(hd, hv, hs->hs_seq) != NULL)
+      continue;
+
+    if(hls_prefetch_estimate_size(hs) > HLS_PREFETCH_MAX_BYTES)
+      continue;
+
+    hp = calloc(1, sizeof(hls_prefetch_t));
+    hp->hp_variant     = hv;
+    hp->hp_seq         = hs->hs_seq;
+    hp->hp_url         = strdup(hs->hs_url);
+    hp->hp_byte_offset = hs->hs_byte_offset;
+    hp->hp_byte_size   = hs->hs_byte_size;
+    hp->hp_duration    = hs->hs_duration;
+    hp->hp_state       = HP_QUEUED;
+    hp->hp_refcount    = 1;
+    TAILQ_INSERT_TAIL(&hd->hd_prefetch_jobs, hp, hp_link);
+  }
+
+  if(!hd->hd_prefetch_running) {
+    hd->hd_prefetch_running = 1;
+    for(i = 0; i < HLS_PREFETCH_DEPTH; i++)
+      hts_thread_create_joinable("HLS prefetch", &hd->hd_prefetch_threads[i],
+                                 hls_prefetch_thread, hd,
+                                 THREAD_PRIO_DEMUXER);
+  }
+
+  hts_cond_broadcast(&hd->hd_prefetch_cond);
+  hts_mutex_unlock(&hd->hd_prefetch_mutex);
+}
+
+
+/**
+ * Return the prefetched data for a segment (waiting for the download
+ * to finish if it's running). Returns NULL if the segment was never
+ * queued, if the download failed or if it was flushed while waiting.
+ * The caller should open the segment itself in that case.
+ */
+buf_t *
+hls_prefetch_claim(hls_segment_t *hs)
+{
+  hls_variant_t *hv = hs->hs_variant;
+  hls_demuxer_t *hd = hv->hv_demuxer;
+  const hls_t *h = hd->hd_hls;
+  buf_t *b = NULL;
+
+  hts_mutex_lock(&hd->hd_prefetch_mutex);
+
+  hls_prefetch_t *hp = hls_prefetch_find(hd, hv, hs->hs_seq);
+  if(hp != NULL) {
+    hp->hp_refcount++;
+
+    if(hp->hp_state != HP_DONE)
+      HLS_TRACE(h, "%s: Waiting for prefetch of sequence %d",
+                hd->hd_type, hs->hs_seq);
+
+    while(hp->hp_state != HP_DONE && !hp->hp_cancelled)
+      hts_cond_wait(&hd->hd_prefetch_cond, &hd->hd_prefetch_mutex);
+
+    if(!hp->hp_cancelled) {
+      b = hp->hp_data;
+      hp->hp_data = NULL;
+      hls_prefetch_drop(hd, hp);
+      hls_prefetch_update_level(hd);
+    }
+    hls_prefetch_release(hp);
+  }
+
+  hts_mutex_unlock(&hd->hd_prefetch_mutex);
+  return b;
+}
+
+
+/**
+ * Drop all queued and running downloads. Used when switching variant
+ * and seeking. Can be called from any thread
+ */
+void
+hls_prefetch_flush(hls_demuxer_t *hd)
+{
+  hls_prefetch_t *hp;
+
+  hts_mutex_lock(&hd->hd_prefetch_mutex);
+
+  while((hp = TAILQ_FIRST(&hd->hd_prefetch_jobs)) != NULL)
+    hls_prefetch_drop(hd, hp);
+
+  // Aborted downloads would just make the estimate lower
+  hd->hd_prefetch_busy = 0;
+  hd->hd_prefetch_bytes = 0;
+  hd->hd_prefetch_busy_since = arch_get_ts();
+
+  hls_prefetch_update_level(hd);
+  hts_cond_broadcast(&hd->hd_prefetch_cond);
+  hts_mutex_unlock(&hd->hd_prefetch_mutex);
+}
+
+
+/**
+ *
+ */
+void
+hls_prefetch_init(hls_demuxer_t *hd)
+{
+  TAILQ_INIT(&hd->hd_prefetch_jobs);
+  hts_mutex_init(&hd->hd_prefetch_mutex);
+  hts_cond_init(&hd->hd_prefetch_cond, &hd->hd_prefetch_mutex);
+}
+
+
+/**
+ *
+ */
+void
+hls_prefetch_fini(hls_demuxer_t *hd)
+{
+  int i;
+
+  hls_prefetch_flush(hd);
+
+  if(hd->hd_prefetch_running) {
+    hts_mutex_lock(&hd->hd_prefetch_mutex);
+    hd->hd_prefetch_stop = 1;
+    hts_cond_broadcast(&hd->hd_prefetch_cond);
+    hts_mutex_unlock(&hd->hd_prefetch_mutex);
+
+    for(i = 0; i < HLS_PREFETCH_DEPTH; i++)
+      hts_thread_join(&hd->hd_prefetch_threads[i]);
+  }
+
+  hts_cond_destroy(&hd->hd_prefetch_cond);
+  hts_mutex_destroy(&hd->hd_prefetch_mutex);
+}
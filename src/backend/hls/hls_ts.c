@@ -47,6 +47,10 @@ typedef struct ts_table {
 
 static const AVRational mpeg_tc = {1, 90000};
 
+#define TS_NUM_PIDS    8192
+#define TS_PROBE_SIZE  2048
+#define TS_BATCH_SIZE  (188 * 64) // Read (and parse) this much at once
+
 typedef struct ts_demuxer {
   struct ts_service_list td_services;
   struct ts_es_list td_elemtary_streams;
@@ -62,9 +66,11 @@ typedef struct ts_demuxer {
     TD_MUX_MODE_RAW,
   } td_mux_mode;
 
-  uint8_t td_buf[2048];
+  uint8_t td_buf[TS_BATCH_SIZE];
   int td_buf_bytes;
 
+  struct ts_es *td_es_by_pid[TS_NUM_PIDS];
+
 } ts_demuxer_t;
 
 
@@ -281,15 +287,12 @@ find_service(ts_demuxer_t *td, uint16_t pmtpid, int create)
 static ts_es_t *
 find_es(ts_demuxer_t *td, uint16_t pid, int create)
 {
-  ts_es_t *te;
-  LIST_FOREACH(te, &td->td_elemtary_streams, te_link) {
-    if(te->te_pid == pid)
-      return te;
-  }
-  if(create) {
+  ts_es_t *te = td->td_es_by_pid[pid & (TS_NUM_PIDS - 1)];
+  if(te == NULL && create) {
     te = calloc(1, sizeof(ts_es_t));
     te->te_pid = pid;
     LIST_INSERT_HEAD(&td->td_elemtary_streams, te, te_link);
+    td->td_es_by_pid[pid & (TS_NUM_PIDS - 1)] = te;
   }
   return te;
 }
@@ -781,6 +784,8 @@ process_es(ts_es_t *te, const uint8_t *tsb, ts_demuxer_t *td, hls_segment_t *hs)
   const uint8_t *data = tsb + off;
   int size            = 188 - off;
 
+  if(size < 0)
+    return; // Broken adaptation field length
 
   if(pusi) {
     if(te->te_buf != NULL)
@@ -813,18 +818,18 @@ process_tsb(ts_demuxer_t *td, const uint8_t *tsb, hls_segment_t *hs)
 {
   ts_service_t *tss;
   ts_es_t *te;
-  if(tsb[0] != 0x47)
-    return;
 
   const unsigned int pid = (tsb[1] & 0x1f) << 8 | tsb[2];
 
-  LIST_FOREACH(te, &td->td_elemtary_streams, te_link) {
-    if(pid == te->te_pid) {
-      process_es(te, tsb, td, hs);
-      return;
-    }
+  te = td->td_es_by_pid[pid];
+  if(te != NULL) {
+    process_es(te, tsb, td, hs);
+    return;
   }
 
+  if(pid == 0x1fff)
+    return; // Null packet
+
 
   LIST_FOREACH(tss, &td->td_services, tss_link) {
     if(pid == tss->tss_pmtpid) {
@@ -841,6 +846,46 @@ process_tsb(ts_demuxer_t *td, const uint8_t *tsb, hls_segment_t *hs)
 
 
 
+/**
+ * Process all complete packets in td_buf and move any trailing partial
+ * packet to the start of the buffer.
+ *
+ * Packets are expected to be back to back so we only look at the sync
+ * byte where each packet should start. If the sync is lost we search
+ * for the next sync byte (memchr() is vectorized in most libcs) that
+ * is followed by another one a packet later.
+ */
+static void
+process_tsbuf(ts_demuxer_t *td, hls_segment_t *hs)
+{
+  const uint8_t *p = td->td_buf;
+  const uint8_t *end = td->td_buf + td->td_buf_bytes;
+
+  while(end - p >= 188) {
+
+    if(p[0] == 0x47) {
+      process_tsb(td, p, hs);
+      p += 188;
+      continue;
+    }
+
+    p = memchr(p + 1, 0x47, end - p - 1);
+    if(p == NULL) {
+      p = end;
+      break;
+    }
+
+    if(end - p > 188 && p[188] != 0x47)
+      p++;
+  }
+
+  const int spill = end - p;
+  assert(spill < 188);
+  memmove(td->td_buf, p, spill);
+  td->td_buf_bytes = spill;
+}
+
+
 /**
  *
  */
@@ -1135,6 +1180,7 @@ hls_ts_demuxer_read(hls_demuxer_t *hd)
           return NULL;
         }
         hv->hv_current_seg = hs;
+        hls_prefetch_schedule(hs);
         td->td_mux_mode = TD_MUX_MODE_UNSET;
         break;
       }
@@ -1151,10 +1197,10 @@ hls_ts_demuxer_read(hls_demuxer_t *hd)
       HLS_TRACE(h, "Probing variant %s, sequence %d",
                 hv->hv_name, hs->hs_seq);
 
-      while(td->td_buf_bytes < sizeof(td->td_buf)) {
+      while(td->td_buf_bytes < TS_PROBE_SIZE) {
         r = fa_read(hs->hs_fh,
                     td->td_buf + td->td_buf_bytes,
-                    sizeof(td->td_buf) - td->td_buf_bytes);
+                    TS_PROBE_SIZE - td->td_buf_bytes);
         if(r <= 0) {
           bad_variant(hv, HLS_ERROR_VARIANT_PROBE_ERROR);
           return NULL;
@@ -1166,26 +1212,19 @@ hls_ts_demuxer_read(hls_demuxer_t *hd)
       // Search stream for TS mux lock, we want two continous packets
 
       int i;
-      for(i = 0; i < sizeof(td->td_buf) - 188 * 2; i++)
+      for(i = 0; i < TS_PROBE_SIZE - 188 * 2; i++)
         if(td->td_buf[i] == 0x47 &&
            td->td_buf[i + 188] == 0x47 &&
            td->td_buf[i + 188 * 2] == 0x47)
           break;
 
-      if(i != sizeof(td->td_buf) - 188 * 2) {
+      if(i != TS_PROBE_SIZE - 188 * 2) {
 
         td->td_mux_mode = TD_MUX_MODE_TS;
 
-        while(i <= sizeof(td->td_buf) - 188) {
-          process_tsb(td, td->td_buf + i, hs);
-          i += 188;
-        }
-
-        int spill = sizeof(td->td_buf) - i;
-        assert(spill < 188);
-
-        td->td_buf_bytes = spill;
-        memmove(td->td_buf, td->td_buf + i, spill);
+        td->td_buf_bytes = TS_PROBE_SIZE - i;
+        memmove(td->td_buf, td->td_buf + i, td->td_buf_bytes);
+        process_tsbuf(td, hs);
         break;
       }
 
@@ -1195,7 +1234,7 @@ hls_ts_demuxer_read(hls_demuxer_t *hd)
         return NULL;
       }
 
-      if(probe_non_muxed(td, td->td_buf, sizeof(td->td_buf), hs)) {
+      if(probe_non_muxed(td, td->td_buf, TS_PROBE_SIZE, hs)) {
         bad_variant(hv, HLS_ERROR_VARIANT_UNKNOWN_AUDIO);
         return NULL;
       }
@@ -1223,7 +1262,7 @@ hls_ts_demuxer_read(hls_demuxer_t *hd)
       assert(td->td_buf_bytes < 188);
       r = fa_read(hs->hs_fh,
                   td->td_buf + td->td_buf_bytes,
-                  188 - td->td_buf_bytes);
+                  sizeof(td->td_buf) - td->td_buf_bytes);
 
       if(r < 0)
         return HLS_EOF;
@@ -1234,11 +1273,7 @@ hls_ts_demuxer_read(hls_demuxer_t *hd)
       }
 
       td->td_buf_bytes += r;
-
-      if(td->td_buf_bytes == 188) {
-        td->td_buf_bytes = 0;
-        process_tsb(td, td->td_buf, hs);
-      }
+      process_tsbuf(td, hs);
       break;
     }
   }
@@ -28,6 +28,10 @@ buf_t *blobcache_get(const char *key, const char *stash, int pad,
 int blobcache_get_meta(const char *key, const char *stash,
 		       char **etag, time_t *mtime);
 
+const void *blobcache_map(const char *key, const char *stash, size_t *sizep);
+
+void blobcache_unmap(const void *data, size_t size);
+
 int blobcache_put(const char *key, const char *stash, buf_t *buf,
 		  int maxage, const char *etag, time_t mtime,
                   int flags);
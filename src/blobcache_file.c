@@ -33,26 +33,95 @@
 #include "misc/minmax.h"
 #include "fileaccess/fileaccess.h"
 
+#include "prop/prop.h"
+
+#if defined(linux) || defined(__APPLE__)
+#define BLOBCACHE_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #define bcprintf(x...) // printf(x)
 
-// Flags
+// Legacy index formats, only read when upgrading
 
 #define BC2_MAGIC_07      0x62630207
 #define BC2_MAGIC_06      0x62630206
 #define BC2_MAGIC_05      0x62630205
 
+#define BC3_MAGIC         0x62630301
+
+/**
+ * The index is a fixed size table split into shards selected by the
+ * top bits of the key digest. Each shard is an open addressed hash
+ * table (linear probing) with its own lock, so lookups for different
+ * items rarely contend.
+ *
+ * The table lives in a memory mapped file and is used in place, there
+ * is nothing to parse at startup and nothing to serialize on save.
+ * Where we can't mmap, only the shards that changed are written back.
+ *
+ * The number of slots per shard is picked from the size budget when
+ * the index is created, assuming items of BC_AVG_ITEM_SIZE. If shards
+ * fill up while the cache is well below its budget (lots of small
+ * items) the flush thread doubles the table.
+ */
+#define BC_NUM_SHARDS       16
+#define BC_MIN_SHARD_SLOTS  256
+#ifdef BLOBCACHE_USE_MMAP
+#define BC_MAX_SHARD_SLOTS  16384
+#else
+#define BC_MAX_SHARD_SLOTS  4096  // Index is held in RAM
+#endif
+#define BC_AVG_ITEM_SIZE    16384
+#define BC_SLOT_MASK        (bc_shard_slots - 1)
+#define BC_SHARD_MAXFILL    (bc_shard_slots * 3 / 4)
+#define BC_ETAG_MAX         91
+
+#define BC_CLOCK_NORMAL    1
+#define BC_CLOCK_IMPORTANT 3
+
 typedef struct blobcache_item {
-  struct blobcache_item *bi_link;
-  char *bi_etag;
-  uint64_t bi_key_hash;
+  uint64_t bi_key_hash;    // 0 == free slot
   uint64_t bi_content_hash;
   uint32_t bi_lastaccess;
   uint32_t bi_expiry;
   uint32_t bi_modtime;
   uint32_t bi_size;
-  uint8_t bi_content_type_len;
   uint8_t bi_flags;
-} blobcache_item_t;
+  uint8_t bi_content_type_len;
+  uint8_t bi_clock;        // Second chance counter for CLOCK eviction
+  uint8_t bi_etaglen;
+  char bi_etag[BC_ETAG_MAX + 1];
+} __attribute__((packed)) blobcache_item_t;
+
+static_assert(sizeof(blobcache_item_t) == 128, "blobcache_item size");
+
+typedef struct blobcache_shard_hdr {
+  uint64_t bsh_size;       // Sum of bi_size for all items in shard
+  uint32_t bsh_items;
+  uint32_t bsh_clock_hand;
+} __attribute__((packed)) blobcache_shard_hdr_t;
+
+typedef struct blobcache_index_hdr {
+  uint32_t bih_magic;
+  uint32_t bih_shards;
+  uint32_t bih_slots;
+  uint32_t bih_item_size;
+  blobcache_shard_hdr_t bih_shard[BC_NUM_SHARDS];
+} __attribute__((packed)) blobcache_index_hdr_t;
+
+#define BC_INDEX_HDR_SIZE 4096
+
+static_assert(sizeof(blobcache_index_hdr_t) <= BC_INDEX_HDR_SIZE,
+              "blobcache index header too big");
+
+#define BC_INDEX_SIZE(slots) \
+  (BC_INDEX_HDR_SIZE + \
+   BC_NUM_SHARDS * (slots) * sizeof(blobcache_item_t))
+
 
 typedef struct blobcache_diskitem_06 {
   uint64_t di_key_hash;
@@ -89,38 +158,108 @@ typedef struct blobcache_flush {
 } blobcache_flush_t;
 
 
-
-#define ITEM_HASH_SIZE 256
-#define ITEM_HASH_MASK (ITEM_HASH_SIZE - 1)
-
-static blobcache_item_t *hashvector[ITEM_HASH_SIZE];
-
-static struct blobcache_flush_queue flush_queue;
-
-static pool_t *item_pool;
+/**
+ * In-memory state for a shard. Everything in here, including the
+ * part of the mapped index it covers, is protected by bs_mutex
+ */
+typedef struct blobcache_shard {
+  hts_mutex_t bs_mutex;
+  blobcache_shard_hdr_t *bs_hdr;
+  blobcache_item_t *bs_items;
+  struct blobcache_flush_queue bs_flush_queue;
+
+  unsigned int bs_hits;
+  unsigned int bs_misses;
+  unsigned int bs_evictions;
+  int bs_dirty;
+} blobcache_shard_t;
+
+static blobcache_shard_t shards[BC_NUM_SHARDS];
+
+// Changing the table layout requires index_lock and all shard locks,
+// holding a single shard lock is enough for reading it
+static hts_mutex_t index_lock;
+static unsigned int bc_shard_slots;
+static void *index_base;
+#ifdef BLOBCACHE_USE_MMAP
+static int index_fd = -1;
+#else
+static int index_rewrite;  // File must be rewritten from scratch
+#endif
+
+static atomic_t index_dirty;
+static atomic_t index_grow_wanted;
+
+// cache_lock protects bcstate, flush_pending and the stats props
+static pool_t *flush_pool;
 static hts_mutex_t cache_lock;
 static hts_cond_t cache_cond;
 static hts_thread_t bcthread;
+static int flush_pending;
 static enum {
   BLOBCACHE_RUN_BAD_CLOCK,
   BLOBCACHE_RUN,
   BLOBCACHE_STOPPING,
 } bcstate;
 
-static int loaded_cache_is_from;
-
-static int index_dirty;
+static prop_t *stats_items;
+static prop_t *stats_size;
+static prop_t *stats_hits;
+static prop_t *stats_misses;
+static prop_t *stats_evictions;
 
 #define BLOB_CACHE_MINSIZE   (10 * 1000 * 1000)
 #define BLOB_CACHE_MAXSIZE (1000 * 1000 * 1000)
 
-static uint64_t current_cache_size;
+
+/**
+ *
+ */
+static __inline blobcache_shard_t *
+shard_for_key(uint64_t dk)
+{
+  return &shards[(dk >> 56) & (BC_NUM_SHARDS - 1)];
+}
+
+
+/**
+ * Shard must be locked
+ */
+static void
+shard_set_dirty(blobcache_shard_t *bs)
+{
+  bs->bs_dirty = 1;
+  atomic_set(&index_dirty, 1);
+}
+
 
 /**
  *
  */
 static uint64_t
-blobcache_compute_maxsize(void)
+cache_size(int *itemsp)
+{
+  uint64_t size = 0;
+  int i, items = 0;
+
+  for(i = 0; i < BC_NUM_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    hts_mutex_lock(&bs->bs_mutex);
+    size  += bs->bs_hdr->bsh_size;
+    items += bs->bs_hdr->bsh_items;
+    hts_mutex_unlock(&bs->bs_mutex);
+  }
+  if(itemsp != NULL)
+    *itemsp = items;
+  return size;
+}
+
+
+/**
+ *
+ */
+static uint64_t
+blobcache_compute_maxsize(uint64_t current_cache_size)
 {
   char path[PATH_MAX];
   fa_fsinfo_t ffi;
@@ -150,7 +289,7 @@ digest_key(const char *key, const char *stash)
   sha1_update(shactx, (const uint8_t *)key, strlen(key));
   sha1_update(shactx, (const uint8_t *)stash, strlen(stash));
   sha1_final(shactx, u.d);
-  return u.u64;
+  return u.u64 ?: 1; // 0 is used to mark free slots
 }
 
 
@@ -191,112 +330,560 @@ make_filename(char *buf, size_t len, uint64_t hash, int for_write)
  *
  */
 static void
-save_index(void)
+unlink_item_file(uint64_t hash)
 {
-  char errbuf[512];
   char filename[PATH_MAX];
-  uint8_t *out, *base;
-  int i;
+  make_filename(filename, sizeof(filename), hash, 0);
+  fa_unlink(filename, NULL, 0);
+}
+
+
+/**
+ * Shard must be locked
+ */
+static blobcache_item_t *
+shard_lookup(blobcache_shard_t *bs, uint64_t dk)
+{
+  unsigned int i = dk & BC_SLOT_MASK;
+  int n;
+
+  for(n = 0; n < bc_shard_slots; n++) {
+    blobcache_item_t *p = &bs->bs_items[i];
+    if(p->bi_key_hash == dk)
+      return p;
+    if(p->bi_key_hash == 0)
+      return NULL;
+    i = (i + 1) & BC_SLOT_MASK;
+  }
+  return NULL;
+}
+
+
+/**
+ * Remove item and close the gap in the probe sequence by shifting
+ * following items back. Any pointer into the shard is invalid after
+ * this. Shard must be locked
+ */
+static void
+shard_remove(blobcache_shard_t *bs, blobcache_item_t *p)
+{
+  unsigned int i = p - bs->bs_items;
+  unsigned int j = i;
+
+  bs->bs_hdr->bsh_size -= p->bi_size;
+  bs->bs_hdr->bsh_items--;
+
+  while(1) {
+    j = (j + 1) & BC_SLOT_MASK;
+    blobcache_item_t *q = &bs->bs_items[j];
+    if(q->bi_key_hash == 0)
+      break;
+
+    const unsigned int home = q->bi_key_hash & BC_SLOT_MASK;
+
+    // If home is cyclically within (i, j] it can stay where it is
+    if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+
+    bs->bs_items[i] = *q;
+    i = j;
+  }
+  bs->bs_items[i].bi_key_hash = 0;
+  shard_set_dirty(bs);
+}
+
+
+/**
+ * Evict one item using the CLOCK algorithm. Items that have been
+ * accessed since the hand last passed get their counter decremented
+ * and survive. Returns 0 if shard is empty. Shard must be locked
+ */
+static int
+shard_evict_one(blobcache_shard_t *bs, uint64_t *hashp, uint32_t *sizep)
+{
+  int n;
+
+  if(bs->bs_hdr->bsh_items == 0)
+    return 0;
+
+  for(n = 0; n < bc_shard_slots * (BC_CLOCK_IMPORTANT + 1); n++) {
+    const unsigned int hand = bs->bs_hdr->bsh_clock_hand & BC_SLOT_MASK;
+    blobcache_item_t *p = &bs->bs_items[hand];
+    bs->bs_hdr->bsh_clock_hand = (hand + 1) & BC_SLOT_MASK;
+
+    if(p->bi_key_hash == 0)
+      continue;
+
+    if(p->bi_clock > 0) {
+      p->bi_clock--;
+      continue;
+    }
+
+    *hashp = p->bi_key_hash;
+    *sizep = p->bi_size;
+    shard_remove(bs, p);
+    bs->bs_evictions++;
+    return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Find or create slot for the given key. Shard must be locked.
+ * If an item had to be evicted to make room its hash is returned in
+ * *evictedp (otherwise *evictedp is set to 0) and the caller should
+ * unlink the file once the lock is released
+ */
+static blobcache_item_t *
+shard_insert(blobcache_shard_t *bs, uint64_t dk, uint64_t *evictedp)
+{
   blobcache_item_t *p;
-  blobcache_diskitem_07_t *di;
-  size_t siz;
+  uint32_t size;
 
-  if(!index_dirty)
-    return;
+  *evictedp = 0;
 
-  snprintf(filename, sizeof(filename), "%s/bc2/index.dat", gconf.cache_path);
+  if((p = shard_lookup(bs, dk)) != NULL)
+    return p;
 
-  fa_handle_t *fh = fa_open_ex(filename, errbuf, sizeof(errbuf),
-                               FA_WRITE, NULL);
+  if(bs->bs_hdr->bsh_items >= BC_SHARD_MAXFILL) {
+    shard_evict_one(bs, evictedp, &size);
+    // Let the flush thread decide if the table should grow instead
+    if(bc_shard_slots < BC_MAX_SHARD_SLOTS)
+      atomic_set(&index_grow_wanted, 1);
+  }
+
+  unsigned int i = dk & BC_SLOT_MASK;
+  while(bs->bs_items[i].bi_key_hash != 0)
+    i = (i + 1) & BC_SLOT_MASK;
+
+  p = &bs->bs_items[i];
+  memset(p, 0, sizeof(blobcache_item_t));
+  p->bi_key_hash = dk;
+  bs->bs_hdr->bsh_items++;
+  return p;
+}
+
+
+/**
+ *
+ */
+static void
+item_set_etag(blobcache_item_t *p, const char *etag)
+{
+  const int len = etag != NULL ? strlen(etag) : 0;
+  if(len > BC_ETAG_MAX) {
+    p->bi_etaglen = 0;
+  } else {
+    p->bi_etaglen = len;
+    memcpy(p->bi_etag, etag, len);
+  }
+  p->bi_etag[p->bi_etaglen] = 0;
+}
+
+
+/**
+ *
+ */
+static void
+item_touch(blobcache_item_t *p)
+{
+  p->bi_clock = p->bi_flags & BLOBCACHE_IMPORTANT_ITEM ?
+    BC_CLOCK_IMPORTANT : BC_CLOCK_NORMAL;
+}
+
+
+/**
+ * Number of slots per shard for a cache of 'maxsize' bytes
+ */
+static unsigned int
+index_slots_for_size(uint64_t maxsize)
+{
+  const uint64_t items = maxsize / BC_AVG_ITEM_SIZE / BC_NUM_SHARDS;
+  unsigned int slots = BC_MIN_SHARD_SLOTS;
+
+  while(slots < BC_MAX_SHARD_SLOTS && slots * 3 / 4 < items)
+    slots *= 2;
+  return slots;
+}
+
+
+/**
+ *
+ */
+static void
+index_init_empty(int zeroed)
+{
+  blobcache_index_hdr_t *bih = index_base;
+
+  // A freshly truncated file is already zero, don't touch every page
+  memset(index_base, 0,
+         zeroed ? BC_INDEX_HDR_SIZE : BC_INDEX_SIZE(bc_shard_slots));
+  bih->bih_magic = BC3_MAGIC;
+  bih->bih_shards = BC_NUM_SHARDS;
+  bih->bih_slots = bc_shard_slots;
+  bih->bih_item_size = sizeof(blobcache_item_t);
+  atomic_set(&index_dirty, 1);
+}
+
+
+/**
+ * Returns number of slots per shard if the header is valid, 0 if not
+ */
+static unsigned int
+index_hdr_slots(const blobcache_index_hdr_t *bih)
+{
+  const unsigned int slots = bih->bih_slots;
+
+  if(bih->bih_magic != BC3_MAGIC ||
+     bih->bih_shards != BC_NUM_SHARDS ||
+     bih->bih_item_size != sizeof(blobcache_item_t) ||
+     slots < BC_MIN_SHARD_SLOTS || slots > BC_MAX_SHARD_SLOTS ||
+     (slots & (slots - 1)))
+    return 0;
+  return slots;
+}
+
+
+/**
+ * Point the shards at their part of the index
+ */
+static void
+index_attach(void)
+{
+  blobcache_index_hdr_t *bih = index_base;
+  blobcache_item_t *items = index_base + BC_INDEX_HDR_SIZE;
+
+  for(int i = 0; i < BC_NUM_SHARDS; i++) {
+    shards[i].bs_hdr = &bih->bih_shard[i];
+    shards[i].bs_items = items + i * bc_shard_slots;
+  }
+}
+
+
+/**
+ * Map the index into memory. 'slots' is the number of slots per shard
+ * to use if a new index is created. Returns 1 if that's the case
+ */
+static int
+index_open(unsigned int slots)
+{
+  char filename[PATH_MAX];
+  blobcache_index_hdr_t hdr;
+  int fresh = 1;
+  int zeroed = 0;
+
+  snprintf(filename, sizeof(filename), "%s/bc2/index.map", gconf.cache_path);
+
+#ifdef BLOBCACHE_USE_MMAP
+  struct stat st;
+
+  index_fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(index_fd != -1) {
+    if(!fstat(index_fd, &st) &&
+       pread(index_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+       index_hdr_slots(&hdr) &&
+       st.st_size == BC_INDEX_SIZE(index_hdr_slots(&hdr))) {
+      slots = index_hdr_slots(&hdr);
+      fresh = 0;
+    } else {
+      if(st.st_size > 0)
+        TRACE(TRACE_INFO, "blobcache",
+              "Index file corrupt, throwing away cache");
+
+      if(ftruncate(index_fd, 0) || ftruncate(index_fd, BC_INDEX_SIZE(slots))) {
+        close(index_fd);
+        index_fd = -1;
+      }
+      zeroed = 1;
+    }
+  }
+
+  bc_shard_slots = slots;
+
+  if(index_fd != -1) {
+    index_base = mmap(NULL, BC_INDEX_SIZE(slots), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, index_fd, 0);
+    if(index_base == MAP_FAILED) {
+      index_base = NULL;
+      close(index_fd);
+      index_fd = -1;
+    }
+  }
+
+  if(index_base == NULL) {
+    TRACE(TRACE_ERROR, "blobcache", "Unable to map index %s -- %s",
+          filename, strerror(errno));
+    index_base = calloc(1, BC_INDEX_SIZE(slots));
+    fresh = 1;
+    zeroed = 1;
+  }
+#else
+  char errbuf[512];
+
+  fa_handle_t *fh = fa_open(filename, errbuf, sizeof(errbuf));
   if(fh == NULL) {
-    TRACE(TRACE_ERROR, "cache", "Unable to write index %s -- %s",
+    TRACE(TRACE_DEBUG, "blobcache", "Unable to open index %s -- %s",
           filename, errbuf);
+  } else if(fa_read(fh, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+            index_hdr_slots(&hdr) &&
+            fa_fsize(fh) == BC_INDEX_SIZE(index_hdr_slots(&hdr))) {
+    slots = index_hdr_slots(&hdr);
+    fresh = 0;
+  } else {
+    TRACE(TRACE_INFO, "blobcache", "Index file corrupt, throwing away cache");
+  }
+
+  bc_shard_slots = slots;
+  index_base = malloc(BC_INDEX_SIZE(slots));
+
+  if(fh != NULL) {
+    if(!fresh &&
+       (fa_seek(fh, 0, SEEK_SET) != 0 ||
+        fa_read(fh, index_base, BC_INDEX_SIZE(slots)) != BC_INDEX_SIZE(slots)))
+      fresh = 1;
+    fa_close(fh);
+  }
+  index_rewrite = fresh;
+#endif
+
+  if(fresh)
+    index_init_empty(zeroed);
+
+  for(int i = 0; i < BC_NUM_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    hts_mutex_init(&bs->bs_mutex);
+    TAILQ_INIT(&bs->bs_flush_queue);
+  }
+  index_attach();
+  return fresh;
+}
+
+
+/**
+ * Double the number of slots in every shard. Done when shards have
+ * to evict because they are full while the cache is still well below
+ * its size budget
+ */
+static void
+index_grow(void)
+{
+  const unsigned int slots = bc_shard_slots * 2;
+  const size_t size = BC_INDEX_SIZE(slots);
+  void *base = NULL;
+  int i;
+
+  if(bc_shard_slots >= BC_MAX_SHARD_SLOTS)
     return;
+
+  hts_mutex_lock(&index_lock);
+  for(i = 0; i < BC_NUM_SHARDS; i++)
+    hts_mutex_lock(&shards[i].bs_mutex);
+
+#ifdef BLOBCACHE_USE_MMAP
+  char filename[PATH_MAX];
+  char tmpname[PATH_MAX];
+  int fd = -1;
+
+  if(index_fd != -1) {
+    // Build the new index next to the old one and swap them
+    snprintf(filename, sizeof(filename), "%s/bc2/index.map",
+             gconf.cache_path);
+    snprintf(tmpname, sizeof(tmpname), "%s/bc2/index.map.new",
+             gconf.cache_path);
+
+    fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1 || ftruncate(fd, size))
+      goto fail;
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED) {
+      base = NULL;
+      goto fail;
+    }
+  } else {
+    base = calloc(1, size);
   }
+#else
+  base = calloc(1, size);
+#endif
+
+  if(base == NULL)
+    goto fail;
 
-  int items = 0;
-  siz = 12 + 20;
+  memcpy(base, index_base, BC_INDEX_HDR_SIZE);
+  ((blobcache_index_hdr_t *)base)->bih_slots = slots;
+
+  blobcache_item_t *items = base + BC_INDEX_HDR_SIZE;
+
+  for(i = 0; i < BC_NUM_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    blobcache_item_t *dst = items + i * slots;
+
+    for(unsigned int j = 0; j < bc_shard_slots; j++) {
+      const blobcache_item_t *p = &bs->bs_items[j];
+      if(p->bi_key_hash == 0)
+        continue;
+
+      unsigned int k = p->bi_key_hash & (slots - 1);
+      while(dst[k].bi_key_hash != 0)
+        k = (k + 1) & (slots - 1);
+      dst[k] = *p;
+    }
+    bs->bs_dirty = 1;
+  }
 
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      siz += sizeof(blobcache_diskitem_07_t);
-      siz += p->bi_etag ? strlen(p->bi_etag) : 0;
-      items++;
+#ifdef BLOBCACHE_USE_MMAP
+  if(fd != -1) {
+    if(rename(tmpname, filename)) {
+      munmap(base, size);
+      goto fail;
     }
+    munmap(index_base, BC_INDEX_SIZE(bc_shard_slots));
+    close(index_fd);
+    index_fd = fd;
+  } else {
+    free(index_base);
+  }
+#else
+  free(index_base);
+  index_rewrite = 1;
+#endif
+
+  index_base = base;
+  bc_shard_slots = slots;
+  index_attach();
+  atomic_set(&index_dirty, 1);
+
+  TRACE(TRACE_DEBUG, "blobcache", "Index grown to %d slots per shard", slots);
+  goto out;
+
+ fail:
+  TRACE(TRACE_ERROR, "blobcache", "Unable to grow index -- %s",
+        strerror(errno));
+#ifdef BLOBCACHE_USE_MMAP
+  if(fd != -1) {
+    close(fd);
+    unlink(tmpname);
+  }
+#endif
+ out:
+  for(i = BC_NUM_SHARDS - 1; i >= 0; i--)
+    hts_mutex_unlock(&shards[i].bs_mutex);
+  hts_mutex_unlock(&index_lock);
+}
+
+
+/**
+ * Make sure index is on stable storage
+ */
+static void
+save_index(void)
+{
+  hts_mutex_lock(&index_lock);
+
+  if(!atomic_get(&index_dirty)) {
+    hts_mutex_unlock(&index_lock);
+    return;
   }
+  atomic_set(&index_dirty, 0);
 
-  base = out = mymalloc(siz);
-  if(out == NULL) {
+#ifdef BLOBCACHE_USE_MMAP
+  if(index_fd != -1)
+    msync(index_base, BC_INDEX_SIZE(bc_shard_slots), MS_ASYNC);
+#else
+  char errbuf[512];
+  char filename[PATH_MAX];
+  const size_t shard_size = bc_shard_slots * sizeof(blobcache_item_t);
+  blobcache_index_hdr_t hdr;
+  int i, err = 0;
+
+  snprintf(filename, sizeof(filename), "%s/bc2/index.map", gconf.cache_path);
+
+  // Unless the layout changed only the shards touched since last
+  // time are written, in place
+  fa_handle_t *fh = fa_open_ex(filename, errbuf, sizeof(errbuf),
+                               FA_WRITE | (index_rewrite ? 0 : FA_APPEND),
+                               NULL);
+  if(fh == NULL) {
+    TRACE(TRACE_ERROR, "cache", "Unable to write index %s -- %s",
+          filename, errbuf);
+    atomic_set(&index_dirty, 1);
+    hts_mutex_unlock(&index_lock);
+    return;
+  }
+
+  void *copy = mymalloc(shard_size);
+  if(copy == NULL) {
     fa_close(fh);
+    atomic_set(&index_dirty, 1);
+    hts_mutex_unlock(&index_lock);
     return;
   }
-  *(uint32_t *)out = BC2_MAGIC_07;
-  out += 4;
-  *(uint32_t *)out = items;
-  out += 4;
-  *(uint32_t *)out = time(NULL);
-  out += 4;
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      const int etaglen = p->bi_etag ? strlen(p->bi_etag) : 0;
-      di = (blobcache_diskitem_07_t *)out;
-      di->di_key_hash     = p->bi_key_hash;
-      di->di_content_hash = p->bi_content_hash;
-      di->di_lastaccess   = p->bi_lastaccess;
-      di->di_expiry       = p->bi_expiry;
-      di->di_modtime      = p->bi_modtime;
-      di->di_size         = p->bi_size;
-      di->di_flags        = p->bi_flags;
-      di->di_etaglen      = etaglen;
-      di->di_content_type_len = p->bi_content_type_len;
-      out += sizeof(blobcache_diskitem_07_t);
-      if(etaglen) {
-	memcpy(out, p->bi_etag, etaglen);
-	out += etaglen;
-      }
 
-    }
+  memcpy(&hdr, index_base, sizeof(hdr));
+
+  // Shards are copied one by one so we never hold more than one lock
+  for(i = 0; i < BC_NUM_SHARDS && !err; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    const int64_t offset = (void *)bs->bs_items - index_base;
+
+    hts_mutex_lock(&bs->bs_mutex);
+    hdr.bih_shard[i] = *bs->bs_hdr;
+    const int dirty = bs->bs_dirty || index_rewrite;
+    if(dirty)
+      memcpy(copy, bs->bs_items, shard_size);
+    bs->bs_dirty = 0;
+    hts_mutex_unlock(&bs->bs_mutex);
+
+    if(dirty && (fa_seek(fh, offset, SEEK_SET) != offset ||
+                 fa_write(fh, copy, shard_size) != shard_size))
+      err = 1;
   }
 
-  sha1_decl(shactx);
-  sha1_init(shactx);
-  sha1_update(shactx, base, siz - 20);
-  sha1_final(shactx, out);
+  // Header goes last, it has the item counts and sizes of every shard
+  if(!err) {
+    memset(copy, 0, BC_INDEX_HDR_SIZE);
+    memcpy(copy, &hdr, sizeof(hdr));
+    if(fa_seek(fh, 0, SEEK_SET) != 0 ||
+       fa_write(fh, copy, BC_INDEX_HDR_SIZE) != BC_INDEX_HDR_SIZE)
+      err = 1;
+  }
 
-  if(fa_write(fh, base, siz) != siz) {
+  if(err) {
     TRACE(TRACE_INFO, "blobcache", "Unable to store index file %s -- %s",
-	  filename, strerror(errno));
+          filename, strerror(errno));
+    // We don't know what made it to disk, start over next time
+    index_rewrite = 1;
+    atomic_set(&index_dirty, 1);
   } else {
-    index_dirty = 0;
+    index_rewrite = 0;
   }
-
-  free(base);
+  free(copy);
   fa_close(fh);
+#endif
+  hts_mutex_unlock(&index_lock);
 }
 
 
 /**
- *
+ * Import index from the old serialized format
  */
 static void
-load_index(void)
+load_legacy_index(void)
 {
   char errbuf[512];
   char filename[PATH_MAX];
   const uint8_t *in;
   void *base;
   int i;
-  blobcache_item_t *p;
   uint8_t digest[20];
 
   snprintf(filename, sizeof(filename), "%s/bc2/index.dat", gconf.cache_path);
 
   fa_handle_t *fh = fa_open(filename, errbuf, sizeof(errbuf));
-  if(fh == NULL) {
-    TRACE(TRACE_DEBUG, "cache", "Unable to open index %s -- %s",
-          filename, errbuf);
+  if(fh == NULL)
     return;
-  }
 
   int64_t size = fa_fsize(fh);
 
@@ -313,6 +900,7 @@ load_index(void)
 
   size_t r = fa_read(fh, base, size);
   fa_close(fh);
+  fa_unlink(filename, NULL, 0);
   if(r != size) {
     free(base);
     return;
@@ -335,19 +923,16 @@ load_index(void)
   int items = *(uint32_t *)in;
   in += 4;
 
-  TRACE(TRACE_DEBUG, "blobcache", "Cache magic 0x%08x %d items", magic, items);
+  TRACE(TRACE_INFO, "blobcache",
+        "Upgrading from older format 0x%08x %d items", magic, items);
 
   switch(magic) {
   case BC2_MAGIC_06:
-    TRACE(TRACE_INFO, "blobcache", "Upgrading from older format 0x%08x", magic);
-    // FALLTHRU
   case BC2_MAGIC_07:
-    loaded_cache_is_from = *(uint32_t *)in;
     in += 4;
     break;
 
   case BC2_MAGIC_05:
-    TRACE(TRACE_INFO, "blobcache", "Upgrading from older format 0x%08x", magic);
     break;
 
   default:
@@ -356,9 +941,8 @@ load_index(void)
     return;
   }
 
-
   for(i = 0; i < items; i++) {
-    p = pool_get(item_pool);
+    blobcache_item_t tmp;
     int etaglen;
 
     switch(magic) {
@@ -366,15 +950,15 @@ load_index(void)
     case BC2_MAGIC_06: {
       const blobcache_diskitem_06_t *di = (blobcache_diskitem_06_t *)in;
 
-      p->bi_key_hash         = di->di_key_hash;
-      p->bi_content_hash     = di->di_content_hash;
-      p->bi_lastaccess       = di->di_lastaccess;
-      p->bi_expiry           = di->di_expiry;
-      p->bi_modtime          = di->di_modtime;
-      p->bi_size             = di->di_size;
-      p->bi_content_type_len = di->di_content_type_len;
-      p->bi_flags            = 0;
-      etaglen                = di->di_etaglen;
+      tmp.bi_key_hash         = di->di_key_hash;
+      tmp.bi_content_hash     = di->di_content_hash;
+      tmp.bi_lastaccess       = di->di_lastaccess;
+      tmp.bi_expiry           = di->di_expiry;
+      tmp.bi_modtime          = di->di_modtime;
+      tmp.bi_size             = di->di_size;
+      tmp.bi_content_type_len = di->di_content_type_len;
+      tmp.bi_flags            = 0;
+      etaglen                 = di->di_etaglen;
       in += sizeof(blobcache_diskitem_06_t);
     }
       break;
@@ -382,15 +966,15 @@ load_index(void)
     case BC2_MAGIC_07: {
       const blobcache_diskitem_07_t *di = (blobcache_diskitem_07_t *)in;
 
-      p->bi_key_hash         = di->di_key_hash;
-      p->bi_content_hash     = di->di_content_hash;
-      p->bi_lastaccess       = di->di_lastaccess;
-      p->bi_expiry           = di->di_expiry;
-      p->bi_modtime          = di->di_modtime;
-      p->bi_size             = di->di_size;
-      p->bi_content_type_len = di->di_content_type_len;
-      p->bi_flags            = di->di_flags;
-      etaglen                = di->di_etaglen;
+      tmp.bi_key_hash         = di->di_key_hash;
+      tmp.bi_content_hash     = di->di_content_hash;
+      tmp.bi_lastaccess       = di->di_lastaccess;
+      tmp.bi_expiry           = di->di_expiry;
+      tmp.bi_modtime          = di->di_modtime;
+      tmp.bi_size             = di->di_size;
+      tmp.bi_content_type_len = di->di_content_type_len;
+      tmp.bi_flags            = di->di_flags;
+      etaglen                 = di->di_etaglen;
       in += sizeof(blobcache_diskitem_07_t);
     }
       break;
@@ -398,17 +982,28 @@ load_index(void)
       abort(); // Prevent compilers whining about etaglen not initialized
     }
 
-    if(etaglen) {
-      p->bi_etag = malloc(etaglen+1);
-      memcpy(p->bi_etag, in, etaglen);
-      p->bi_etag[etaglen] = 0;
-      in += etaglen;
+    if(etaglen <= BC_ETAG_MAX) {
+      memcpy(tmp.bi_etag, in, etaglen);
+      tmp.bi_etaglen = etaglen;
     } else {
-      p->bi_etag = NULL;
+      tmp.bi_etaglen = 0;
     }
-    p->bi_link = hashvector[p->bi_key_hash & ITEM_HASH_MASK];
-    hashvector[p->bi_key_hash & ITEM_HASH_MASK] = p;
-    current_cache_size += p->bi_size;
+    tmp.bi_etag[tmp.bi_etaglen] = 0;
+    in += etaglen;
+
+    if(tmp.bi_key_hash == 0)
+      continue;
+
+    blobcache_shard_t *bs = shard_for_key(tmp.bi_key_hash);
+    uint64_t evicted;
+    blobcache_item_t *p = shard_insert(bs, tmp.bi_key_hash, &evicted);
+    if(evicted)
+      unlink_item_file(evicted);
+
+    bs->bs_hdr->bsh_size -= p->bi_size;
+    *p = tmp;
+    item_touch(p);
+    bs->bs_hdr->bsh_size += p->bi_size;
   }
   free(base);
 }
@@ -426,69 +1021,69 @@ blobcache_put(const char *key, const char *stash, buf_t *b,
   uint64_t dk = digest_key(key, stash);
   uint64_t dc = digest_content(b->b_ptr, b->b_size);
   uint32_t now = time(NULL);
+  blobcache_shard_t *bs = shard_for_key(dk);
   blobcache_item_t *p;
-
-  if(etag != NULL && strlen(etag) > 255)
-    etag = NULL;
+  uint64_t evicted;
 
   bcprintf("cache: Writing %s ... ", key);
 
-  hts_mutex_lock(&cache_lock);
   if(bcstate != BLOBCACHE_RUN) {
     bcprintf("Cache not running\n");
-    hts_mutex_unlock(&cache_lock);
     return 0;
   }
 
-  for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-    if(p->bi_key_hash == dk)
-      break;
+  hts_mutex_lock(&bs->bs_mutex);
 
-  hts_cond_signal(&cache_cond);
-  index_dirty = 1;
+  shard_set_dirty(bs);
+
+  p = shard_lookup(bs, dk);
 
   if(p != NULL && p->bi_content_hash == dc && p->bi_size == b->b_size) {
     p->bi_modtime = mtime;
     p->bi_expiry = now + maxage;
     p->bi_lastaccess = now;
     p->bi_flags = flags;
-    mystrset(&p->bi_etag, etag);
-    hts_mutex_unlock(&cache_lock);
+    item_set_etag(p, etag);
+    item_touch(p);
+    hts_mutex_unlock(&bs->bs_mutex);
     bcprintf("Already in\n");
     return 1;
   }
 
   bcprintf("Ok\n");
 
-  blobcache_flush_t *bf = pool_get(item_pool);
-  bf->bf_key_hash = dk;
-  bf->bf_buf = buf_retain(b);
-  TAILQ_INSERT_TAIL(&flush_queue, bf, bf_link);
-  hts_cond_signal(&cache_cond);
-
-  if(p == NULL) {
-    p = pool_get(item_pool);
-    p->bi_key_hash = dk;
-    p->bi_size = 0;
-    p->bi_content_type_len = 0;
-    p->bi_link = hashvector[dk & ITEM_HASH_MASK];
-    p->bi_etag = NULL;
-    hashvector[dk & ITEM_HASH_MASK] = p;
-  }
+  p = shard_insert(bs, dk, &evicted);
 
   int64_t expiry = (int64_t)maxage + now;
 
   p->bi_modtime = mtime;
-  mystrset(&p->bi_etag, etag);
+  item_set_etag(p, etag);
   p->bi_expiry = MIN(INT32_MAX, expiry);
   p->bi_lastaccess = now;
   p->bi_content_hash = dc;
-  current_cache_size -= p->bi_size;
+  bs->bs_hdr->bsh_size -= p->bi_size;
   p->bi_size = b->b_size;
-  current_cache_size += p->bi_size;
+  bs->bs_hdr->bsh_size += p->bi_size;
   p->bi_content_type_len = b->b_content_type ?
     strlen(rstr_get(b->b_content_type)) : 0;
   p->bi_flags = flags;
+  item_touch(p);
+
+  hts_mutex_lock(&cache_lock);
+  blobcache_flush_t *bf = pool_get(flush_pool);
+  hts_mutex_unlock(&cache_lock);
+
+  bf->bf_key_hash = dk;
+  bf->bf_buf = buf_retain(b);
+  TAILQ_INSERT_TAIL(&bs->bs_flush_queue, bf, bf_link);
+  hts_mutex_unlock(&bs->bs_mutex);
+
+  if(evicted)
+    unlink_item_file(evicted);
+
+  hts_mutex_lock(&cache_lock);
+  flush_pending++;
+  hts_cond_signal(&cache_cond);
   hts_mutex_unlock(&cache_lock);
   return 0;
 }
@@ -502,26 +1097,26 @@ blobcache_get(const char *key, const char *stash, int pad,
 	      int *ignore_expiry, char **etagp, time_t *mtimep)
 {
   uint64_t dk = digest_key(key, stash);
-  blobcache_item_t *p, **q;
+  blobcache_shard_t *bs = shard_for_key(dk);
+  blobcache_item_t *p;
   char filename[PATH_MAX];
   uint32_t now;
 
   bcprintf("cache: Reading %s ... ", key);
 
-  hts_mutex_lock(&cache_lock);
+  hts_mutex_lock(&bs->bs_mutex);
 
   if(bcstate == BLOBCACHE_STOPPING) {
     bcprintf("Cache stopped ... ");
     p = NULL;
   } else {
-    for(q = &hashvector[dk & ITEM_HASH_MASK]; (p = *q); q = &p->bi_link)
-      if(p->bi_key_hash == dk)
-	break;
+    p = shard_lookup(bs, dk);
   }
 
   if(p == NULL) {
     bcprintf("Item not found\n");
-    hts_mutex_unlock(&cache_lock);
+    bs->bs_misses++;
+    hts_mutex_unlock(&bs->bs_mutex);
     return NULL;
   }
 
@@ -540,8 +1135,9 @@ blobcache_get(const char *key, const char *stash, int pad,
   blobcache_flush_t *bf;
   buf_t *b = NULL;
   fa_handle_t *fh = NULL;
-  TAILQ_FOREACH_REVERSE(bf, &flush_queue, blobcache_flush_queue, bf_link) {
-    if(bf->bf_key_hash == p->bi_key_hash) {
+  TAILQ_FOREACH_REVERSE(bf, &bs->bs_flush_queue, blobcache_flush_queue,
+                        bf_link) {
+    if(bf->bf_key_hash == dk) {
       // Item is not yet written to disk
       b = buf_retain(bf->bf_buf);
       break;
@@ -549,19 +1145,20 @@ blobcache_get(const char *key, const char *stash, int pad,
   }
 
   if(b == NULL) {
-    make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
+    make_filename(filename, sizeof(filename), dk, 0);
     fh = fa_open(filename, NULL, 0);
     if(fh == NULL) {
     bad:
-      *q = p->bi_link;
-      pool_put(item_pool, p);
-      hts_mutex_unlock(&cache_lock);
+      shard_remove(bs, p);
+      bs->bs_misses++;
+      hts_mutex_unlock(&bs->bs_mutex);
       return NULL;
     }
 
     int64_t size = fa_fsize(fh);
 
     if(size != p->bi_size + p->bi_content_type_len) {
+      fa_close(fh);
       fa_unlink(filename, NULL, 0);
       goto bad;
     }
@@ -571,43 +1168,48 @@ blobcache_get(const char *key, const char *stash, int pad,
     *mtimep = p->bi_modtime;
 
   if(etagp != NULL)
-    *etagp = p->bi_etag ? strdup(p->bi_etag) : NULL;
+    *etagp = p->bi_etaglen ? strdup(p->bi_etag) : NULL;
 
   // Only mark lastaccess if clock is good
   if(bcstate == BLOBCACHE_RUN)
     p->bi_lastaccess = now;
 
-  index_dirty = 1; // We don't deem it important enough to wakeup on get
+  item_touch(p);
 
   if(ignore_expiry != NULL)
     *ignore_expiry = expired;
 
-  hts_mutex_unlock(&cache_lock);
+  // Slots may move once we unlock
+  const uint32_t item_size = p->bi_size;
+  const uint8_t content_type_len = p->bi_content_type_len;
+
+  bs->bs_hits++;
+  hts_mutex_unlock(&bs->bs_mutex);
 
   if(b == NULL) {
 
-    b = buf_create(p->bi_size + pad);
+    b = buf_create(item_size + pad);
     if(b == NULL) {
       fa_close(fh);
       return NULL;
     }
 
-    if(p->bi_content_type_len) {
-      b->b_content_type = rstr_allocl(NULL, p->bi_content_type_len);
-      if(fa_read(fh, rstr_data(b->b_content_type), p->bi_content_type_len) !=
-	 p->bi_content_type_len) {
+    if(content_type_len) {
+      b->b_content_type = rstr_allocl(NULL, content_type_len);
+      if(fa_read(fh, rstr_data(b->b_content_type), content_type_len) !=
+	 content_type_len) {
 	buf_release(b);
 	fa_close(fh);
 	return NULL;
       }
     }
 
-    if(fa_read(fh, b->b_ptr, p->bi_size) != p->bi_size) {
+    if(fa_read(fh, b->b_ptr, item_size) != item_size) {
       buf_release(b);
       fa_close(fh);
       return NULL;
     }
-    memset(b->b_ptr + p->bi_size, 0, pad);
+    memset(b->b_ptr + item_size, 0, pad);
     fa_close(fh);
   }
   return b;
@@ -617,6 +1219,135 @@ blobcache_get(const char *key, const char *stash, int pad,
 
 
 
+#ifdef BLOBCACHE_USE_MMAP
+
+static void *
+map_alloc(size_t size)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+#define map_free(p, size) munmap(p, size)
+
+#else
+
+#define map_alloc(size) malloc(size)
+
+#define map_free(p, size) free(p)
+
+#endif
+
+
+/**
+ * Map the item read only into memory instead of reading it into a
+ * buffer. Returns NULL if the item does not exist or is expired.
+ *
+ * The mapping must be released with blobcache_unmap() and should be
+ * short lived as the item may be rewritten behind our back.
+ */
+const void *
+blobcache_map(const char *key, const char *stash, size_t *sizep)
+{
+  uint64_t dk = digest_key(key, stash);
+  blobcache_shard_t *bs = shard_for_key(dk);
+  blobcache_item_t *p;
+  blobcache_flush_t *bf;
+  char filename[PATH_MAX];
+  void *data;
+
+  hts_mutex_lock(&bs->bs_mutex);
+
+  p = bcstate == BLOBCACHE_STOPPING ? NULL : shard_lookup(bs, dk);
+
+  if(p == NULL || p->bi_size == 0 ||
+     (bcstate == BLOBCACHE_RUN && time(NULL) > p->bi_expiry)) {
+    if(p != NULL)
+      shard_remove(bs, p);
+    bs->bs_misses++;
+    hts_mutex_unlock(&bs->bs_mutex);
+    return NULL;
+  }
+
+  item_touch(p);
+  bs->bs_hits++;
+
+  const uint32_t item_size = p->bi_size;
+  const uint8_t content_type_len = p->bi_content_type_len;
+
+  TAILQ_FOREACH_REVERSE(bf, &bs->bs_flush_queue, blobcache_flush_queue,
+                        bf_link) {
+    if(bf->bf_key_hash == dk) {
+      // Item is not yet written to disk
+      data = map_alloc(item_size);
+      if(data != NULL)
+        memcpy(data, bf->bf_buf->b_ptr, item_size);
+      hts_mutex_unlock(&bs->bs_mutex);
+      *sizep = item_size;
+      return data;
+    }
+  }
+  hts_mutex_unlock(&bs->bs_mutex);
+
+  make_filename(filename, sizeof(filename), dk, 0);
+
+#ifdef BLOBCACHE_USE_MMAP
+  struct stat st;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if(fd == -1)
+    return NULL;
+
+  if(fstat(fd, &st) || st.st_size != item_size + content_type_len) {
+    close(fd);
+    return NULL;
+  }
+
+  if(content_type_len == 0) {
+    data = mmap(NULL, item_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+      data = NULL;
+  } else {
+    // Payload is not page aligned, copy it
+    data = map_alloc(item_size);
+    if(data != NULL &&
+       pread(fd, data, item_size, content_type_len) != item_size) {
+      map_free(data, item_size);
+      data = NULL;
+    }
+  }
+  close(fd);
+#else
+  fa_handle_t *fh = fa_open(filename, NULL, 0);
+  if(fh == NULL)
+    return NULL;
+
+  data = map_alloc(item_size);
+  if(data != NULL &&
+     (fa_fsize(fh) != item_size + content_type_len ||
+      fa_seek(fh, content_type_len, SEEK_SET) != content_type_len ||
+      fa_read(fh, data, item_size) != item_size)) {
+    map_free(data, item_size);
+    data = NULL;
+  }
+  fa_close(fh);
+#endif
+  *sizep = item_size;
+  return data;
+}
+
+
+/**
+ *
+ */
+void
+blobcache_unmap(const void *data, size_t size)
+{
+  if(data != NULL)
+    map_free((void *)data, size);
+}
+
+
 /**
  *
  */
@@ -625,16 +1356,16 @@ blobcache_get_meta(const char *key, const char *stash,
 		   char **etagp, time_t *mtimep)
 {
   uint64_t dk = digest_key(key, stash);
+  blobcache_shard_t *bs = shard_for_key(dk);
   blobcache_item_t *p;
   int r;
-  hts_mutex_lock(&cache_lock);
+
+  hts_mutex_lock(&bs->bs_mutex);
 
   if(bcstate == BLOBCACHE_STOPPING) {
     p = NULL;
   } else {
-    for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-      if(p->bi_key_hash == dk)
-	break;
+    p = shard_lookup(bs, dk);
   }
 
   if(p != NULL) {
@@ -644,30 +1375,31 @@ blobcache_get_meta(const char *key, const char *stash,
       *mtimep = p->bi_modtime;
 
     if(etagp != NULL)
-      *etagp = p->bi_etag ? strdup(p->bi_etag) : NULL;
+      *etagp = p->bi_etaglen ? strdup(p->bi_etag) : NULL;
 
   } else {
     r = -1;
   }
 
-  hts_mutex_unlock(&cache_lock);
+  hts_mutex_unlock(&bs->bs_mutex);
   return r;
 }
 
 
 /**
- * Assume we're locked
+ *
  */
-static blobcache_item_t *
-lookup_item(uint64_t dk)
+static int
+item_exists(uint64_t dk)
 {
-  blobcache_item_t *p;
-  for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-    if(p->bi_key_hash == dk)
-      return p;
-  return NULL;
+  blobcache_shard_t *bs = shard_for_key(dk);
+  hts_mutex_lock(&bs->bs_mutex);
+  int r = shard_lookup(bs, dk) != NULL;
+  hts_mutex_unlock(&bs->bs_mutex);
+  return r;
 }
 
+
 /**
  *
  */
@@ -701,8 +1433,7 @@ prune_stale(void)
 	    snprintf(path3, sizeof(path3), "%s/bc2/%s/%s",
 		     gconf.cache_path, n1, n2);
 
-	    if(sscanf(n2, "%016"PRIx64, &k) != 1 ||
-	       lookup_item(k) == NULL) {
+	    if(sscanf(n2, "%016"PRIx64, &k) != 1 || !item_exists(k)) {
 	      TRACE(TRACE_DEBUG, "Blobcache", "Removed stale file %s", path3);
 	      fa_unlink(path3, NULL, 0);
 	    }
@@ -717,82 +1448,33 @@ prune_stale(void)
 }
 
 
-
-/**
- *
- */
-static void
-prune_item(blobcache_item_t *p)
-{
-  char filename[PATH_MAX];
-  make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
-  fa_unlink(filename, NULL, 0);
-  pool_put(item_pool, p);
-}
-
-
-/**
- *
- */
-static int
-accesstimecmp(const void *A, const void *B)
-{
-  const blobcache_item_t *a = *(const blobcache_item_t **)A;
-  const blobcache_item_t *b = *(const blobcache_item_t **)B;
-
-  const int a_imp = !!(a->bi_flags & BLOBCACHE_IMPORTANT_ITEM);
-  const int b_imp = !!(b->bi_flags & BLOBCACHE_IMPORTANT_ITEM);
-
-  if(a_imp != b_imp)
-    return a_imp - b_imp;
-
-  return a->bi_lastaccess - b->bi_lastaccess;
-}
-
-
 /**
- *
+ * Evict items round robin over the shards until we are below maxsize
  */
 static void
 prune_to_size(uint64_t maxsize)
 {
-  int i, tot = 0, j = 0;
-  blobcache_item_t *p, **sv;
-
-  for(i = 0; i < ITEM_HASH_SIZE; i++)
-    for(p = hashvector[i]; p != NULL; p = p->bi_link)
-      tot++;
-
-  sv = malloc(sizeof(blobcache_item_t *) * tot);
-  current_cache_size = 0;
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      sv[j++] = p;
-      current_cache_size += p->bi_size;
-    }
-    hashvector[i] = NULL;
-  }
+  static unsigned int next_shard;
+  uint64_t current_cache_size = cache_size(NULL);
+  int idle = 0;
 
-  assert(j == tot);
+  while(current_cache_size > maxsize && idle < BC_NUM_SHARDS) {
+    blobcache_shard_t *bs = &shards[next_shard++ & (BC_NUM_SHARDS - 1)];
+    uint64_t hash;
+    uint32_t size;
 
-  qsort(sv, j, sizeof(blobcache_item_t *), accesstimecmp);
-  for(i = 0; i < j; i++) {
-    p = sv[i];
-    if(current_cache_size < maxsize)
-      break;
-    current_cache_size -= p->bi_size;
-    prune_item(p);
-    index_dirty = 1;
-  }
+    hts_mutex_lock(&bs->bs_mutex);
+    int r = shard_evict_one(bs, &hash, &size);
+    hts_mutex_unlock(&bs->bs_mutex);
 
-  for(; i < j; i++) {
-    p = sv[i];
-    p->bi_link = hashvector[p->bi_key_hash & ITEM_HASH_MASK];
-    hashvector[p->bi_key_hash & ITEM_HASH_MASK] = p;
+    if(!r) {
+      idle++;
+      continue;
+    }
+    idle = 0;
+    current_cache_size -= size;
+    unlink_item_file(hash);
   }
-
-  free(sv);
-  save_index();
 }
 
 
@@ -823,26 +1505,72 @@ blobcache_prune_old(void)
 static void
 cache_clear(void *opaque, prop_event_t event, ...)
 {
-  int i;
-  blobcache_item_t *p, *n;
-
-  hts_mutex_lock(&cache_lock);
-
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = n) {
-      n = p->bi_link;
-      prune_item(p);
-      index_dirty = 1;
+  int i, j;
+
+  for(i = 0; i < BC_NUM_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    hts_mutex_lock(&bs->bs_mutex);
+    for(j = 0; j < bc_shard_slots; j++) {
+      blobcache_item_t *p = &bs->bs_items[j];
+      if(p->bi_key_hash == 0)
+        continue;
+      unlink_item_file(p->bi_key_hash);
+      p->bi_key_hash = 0;
     }
-    hashvector[i] = NULL;
+    bs->bs_hdr->bsh_size = 0;
+    bs->bs_hdr->bsh_items = 0;
+    shard_set_dirty(bs);
+    hts_mutex_unlock(&bs->bs_mutex);
   }
-  current_cache_size = 0;
   save_index();
-  hts_mutex_unlock(&cache_lock);
   notify_add(NULL, NOTIFY_INFO, NULL, 3, _("Cache cleared"));
 }
 
 
+/**
+ *
+ */
+static void
+update_stats(void)
+{
+  unsigned int hits = 0, misses = 0, evictions = 0;
+  int items;
+  uint64_t size = cache_size(&items);
+
+  for(int i = 0; i < BC_NUM_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    hts_mutex_lock(&bs->bs_mutex);
+    hits      += bs->bs_hits;
+    misses    += bs->bs_misses;
+    evictions += bs->bs_evictions;
+    hts_mutex_unlock(&bs->bs_mutex);
+  }
+
+  prop_set_int(stats_items, items);
+  prop_set_int(stats_size, size / 1024);
+  prop_set_int(stats_hits, hits);
+  prop_set_int(stats_misses, misses);
+  prop_set_int(stats_evictions, evictions);
+}
+
+
+/**
+ *
+ */
+static blobcache_flush_t *
+flush_dequeue(void)
+{
+  for(int i = 0; i < BC_NUM_SHARDS; i++) {
+    blobcache_shard_t *bs = &shards[i];
+    hts_mutex_lock(&bs->bs_mutex);
+    blobcache_flush_t *bf = TAILQ_FIRST(&bs->bs_flush_queue);
+    hts_mutex_unlock(&bs->bs_mutex);
+    if(bf != NULL)
+      return bf;
+  }
+  return NULL;
+}
+
 
 /**
  *
@@ -852,6 +1580,8 @@ flushthread(void *aux)
 {
   blobcache_flush_t *bf;
 
+  prune_stale();
+
   hts_mutex_lock(&cache_lock);
 
   // First make sure clock is valid
@@ -870,18 +1600,22 @@ flushthread(void *aux)
 
   while(bcstate != BLOBCACHE_STOPPING) {
 
-    if((bf = TAILQ_FIRST(&flush_queue)) == NULL) {
-
-      if(index_dirty) {
-        if(hts_cond_wait_timeout(&cache_cond, &cache_lock, 5000))
-          save_index();
-      } else {
-        hts_cond_wait(&cache_cond, &cache_lock);
+    if(flush_pending == 0) {
+      if(hts_cond_wait_timeout(&cache_cond, &cache_lock, 5000)) {
+        hts_mutex_unlock(&cache_lock);
+        save_index();
+        update_stats();
+        hts_mutex_lock(&cache_lock);
       }
       continue;
     }
 
     hts_mutex_unlock(&cache_lock);
+
+    // Only we remove items from the flush queues so bf stays valid
+    bf = flush_dequeue();
+    assert(bf != NULL);
+
     char filename[PATH_MAX];
     make_filename(filename, sizeof(filename), bf->bf_key_hash, 1);
     buf_t *b = bf->bf_buf;
@@ -901,25 +1635,40 @@ flushthread(void *aux)
 
       fa_close(fh);
     }
-    hts_mutex_lock(&cache_lock);
 
-    assert(TAILQ_FIRST(&flush_queue) == bf);
-    TAILQ_REMOVE(&flush_queue, bf, bf_link);
+    blobcache_shard_t *bs = shard_for_key(bf->bf_key_hash);
+    hts_mutex_lock(&bs->bs_mutex);
+    TAILQ_REMOVE(&bs->bs_flush_queue, bf, bf_link);
+    // Item might have been evicted while we were writing
+    if(shard_lookup(bs, bf->bf_key_hash) == NULL)
+      fa_unlink(filename, NULL, 0);
+    hts_mutex_unlock(&bs->bs_mutex);
+
     buf_release(bf->bf_buf);
-    pool_put(item_pool, bf);
 
-    uint64_t maxsize = blobcache_compute_maxsize();
+    uint64_t current_cache_size = cache_size(NULL);
+    uint64_t maxsize = blobcache_compute_maxsize(current_cache_size);
 
     if(maxsize < current_cache_size)
       prune_to_size(maxsize);
+
+    if(atomic_get(&index_grow_wanted)) {
+      atomic_set(&index_grow_wanted, 0);
+      // Shards evict because they are full of small items, not
+      // because we are out of space. Give them more slots
+      if(current_cache_size < maxsize / 2)
+        index_grow();
+    }
+
+    hts_mutex_lock(&cache_lock);
+    pool_put(flush_pool, bf);
+    flush_pending--;
   }
-  save_index();
   hts_mutex_unlock(&cache_lock);
+  save_index();
   return NULL;
 }
 
-static_assert(sizeof(blobcache_flush_t) <= sizeof(blobcache_item_t),
-              "blobcache_flush too big");
 
 /**
  *
@@ -930,8 +1679,6 @@ blobcache_init(void)
   char buf[256];
   char errbuf[512];
 
-  TAILQ_INIT(&flush_queue);
-
   blobcache_prune_old();
   snprintf(buf, sizeof(buf), "%s/bc2", gconf.cache_path);
 
@@ -941,21 +1688,33 @@ blobcache_init(void)
 
   hts_mutex_init(&cache_lock);
   hts_cond_init(&cache_cond, &cache_lock);
-  item_pool = pool_create("blobcacheitems", sizeof(blobcache_item_t), 0);
+  flush_pool = pool_create("blobcacheflush", sizeof(blobcache_flush_t), 0);
 
+  hts_mutex_init(&index_lock);
 
-  load_index();
-  prune_stale();
+  if(index_open(index_slots_for_size(blobcache_compute_maxsize(0))))
+    load_legacy_index();
 
-  uint64_t maxsize = blobcache_compute_maxsize();
+  int items;
+  uint64_t current_cache_size = cache_size(&items);
+  uint64_t maxsize = blobcache_compute_maxsize(current_cache_size);
   prune_to_size(maxsize);
 
   TRACE(TRACE_INFO, "blobcache",
 	"Initialized: %d items consuming %.2f MB "
         "(out of maximum %.2f MB) on disk in %s",
-	pool_num(item_pool), current_cache_size / 1000000.0,
+	items, current_cache_size / 1000000.0,
         maxsize / 1000000.0, buf);
 
+  prop_t *p = prop_create(prop_create(prop_get_global(), "system"),
+                          "blobcache");
+  stats_items     = prop_create(p, "items");
+  stats_size      = prop_create(p, "size");
+  stats_hits      = prop_create(p, "hits");
+  stats_misses    = prop_create(p, "misses");
+  stats_evictions = prop_create(p, "evictions");
+  update_stats();
+
   settings_create_action(gconf.settings_general, _p("Clear cached files"),
 			 cache_clear, NULL, 0, NULL);
 
@@ -972,4 +1731,8 @@ blobcache_fini(void)
   hts_cond_signal(&cache_cond);
   hts_mutex_unlock(&cache_lock);
   hts_thread_join(&bcthread);
+#ifdef BLOBCACHE_USE_MMAP
+  if(index_fd != -1)
+    msync(index_base, BC_INDEX_SIZE(bc_shard_slots), MS_SYNC);
+#endif
 }
@@ -24,6 +24,7 @@
 #include "main.h"
 #include "fileaccess/fileaccess.h"
 #include "misc/minmax.h"
+#include "misc/queue.h"
 
 #include "db_support.h"
 
@@ -104,6 +105,184 @@ db_preparex(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
   return rc;
 }
 
+
+/**
+ * Prepared statement cache
+ *
+ * Statements are cached per connection, keyed on their SQL text, and
+ * handed out to one user at a time. On release they are reset and have
+ * their bindings cleared (callers rely on unbound parameters being NULL)
+ * so next user sees a pristine statement. If a cached statement is
+ * already in use (nested use of the same query) we fall back to a
+ * regular one-shot prepare.
+ *
+ * Connections are only ever used by one thread at a time so the
+ * entries themselves need no locking, only the list of caches does.
+ */
+#define DB_STMT_CACHE_SIZE 32
+
+typedef struct db_cached_stmt {
+  sqlite3_stmt *dcs_stmt;
+  unsigned int dcs_hash;
+  unsigned int dcs_used;
+  int dcs_busy;
+} db_cached_stmt_t;
+
+typedef struct db_stmt_cache {
+  LIST_ENTRY(db_stmt_cache) dsc_link;
+  sqlite3 *dsc_db;
+  unsigned int dsc_tally;
+  db_cached_stmt_t dsc_stmts[DB_STMT_CACHE_SIZE];
+} db_stmt_cache_t;
+
+static LIST_HEAD(, db_stmt_cache) db_stmt_caches;
+static HTS_MUTEX_DECL(db_stmt_cache_mutex);
+
+
+/**
+ *
+ */
+static db_stmt_cache_t *
+db_stmt_cache_find(sqlite3 *db, int create)
+{
+  db_stmt_cache_t *dsc;
+
+  hts_mutex_lock(&db_stmt_cache_mutex);
+  LIST_FOREACH(dsc, &db_stmt_caches, dsc_link)
+    if(dsc->dsc_db == db)
+      break;
+
+  if(dsc == NULL && create) {
+    dsc = calloc(1, sizeof(db_stmt_cache_t));
+    dsc->dsc_db = db;
+    LIST_INSERT_HEAD(&db_stmt_caches, dsc, dsc_link);
+  }
+  hts_mutex_unlock(&db_stmt_cache_mutex);
+  return dsc;
+}
+
+
+/**
+ *
+ */
+static unsigned int
+db_sql_hash(const char *s)
+{
+  unsigned int h = 5381;
+  while(*s)
+    h = h * 33 + (unsigned char)*s++;
+  return h;
+}
+
+
+/**
+ *
+ */
+int
+db_prepare_cachedx(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
+                   const char *file, int line)
+{
+  db_stmt_cache_t *dsc = db_stmt_cache_find(db, 1);
+  db_cached_stmt_t *dcs, *victim, *empty = NULL, *lru = NULL;
+  const unsigned int hash = db_sql_hash(zSql);
+  int i, rc;
+
+  for(i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+    dcs = &dsc->dsc_stmts[i];
+
+    if(dcs->dcs_stmt == NULL) {
+      if(empty == NULL)
+        empty = dcs;
+      continue;
+    }
+
+    if(dcs->dcs_hash == hash && !strcmp(sqlite3_sql(dcs->dcs_stmt), zSql)) {
+      if(dcs->dcs_busy)
+        return db_preparex(db, ppStmt, zSql, file, line);
+      dcs->dcs_busy = 1;
+      dcs->dcs_used = ++dsc->dsc_tally;
+      *ppStmt = dcs->dcs_stmt;
+      return SQLITE_OK;
+    }
+
+    if(!dcs->dcs_busy && (lru == NULL || dcs->dcs_used < lru->dcs_used))
+      lru = dcs;
+  }
+
+  victim = empty ?: lru;
+
+  rc = db_preparex(db, ppStmt, zSql, file, line);
+  if(rc != SQLITE_OK || victim == NULL)
+    return rc;
+
+  if(victim->dcs_stmt != NULL)
+    sqlite3_finalize(victim->dcs_stmt);
+
+  victim->dcs_stmt = *ppStmt;
+  victim->dcs_hash = hash;
+  victim->dcs_busy = 1;
+  victim->dcs_used = ++dsc->dsc_tally;
+  return SQLITE_OK;
+}
+
+
+/**
+ *
+ */
+void
+db_stmt_release(sqlite3_stmt *stmt)
+{
+  db_stmt_cache_t *dsc;
+  int i;
+
+  if(stmt == NULL)
+    return;
+
+  dsc = db_stmt_cache_find(sqlite3_db_handle(stmt), 0);
+  if(dsc != NULL) {
+    for(i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+      db_cached_stmt_t *dcs = &dsc->dsc_stmts[i];
+      if(dcs->dcs_stmt == stmt) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        dcs->dcs_busy = 0;
+        return;
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+}
+
+
+/**
+ * Close a connection, finalizing any statements cached for it
+ */
+void
+db_close(sqlite3 *db)
+{
+  db_stmt_cache_t *dsc;
+  int i;
+
+  if(db == NULL)
+    return;
+
+  hts_mutex_lock(&db_stmt_cache_mutex);
+  LIST_FOREACH(dsc, &db_stmt_caches, dsc_link)
+    if(dsc->dsc_db == db)
+      break;
+  if(dsc != NULL)
+    LIST_REMOVE(dsc, dsc_link);
+  hts_mutex_unlock(&db_stmt_cache_mutex);
+
+  if(dsc != NULL) {
+    for(i = 0; i < DB_STMT_CACHE_SIZE; i++)
+      if(dsc->dsc_stmts[i].dcs_stmt != NULL)
+        sqlite3_finalize(dsc->dsc_stmts[i].dcs_stmt);
+    free(dsc);
+  }
+  sqlite3_close(db);
+}
+
 /**
  *
  */
@@ -386,7 +565,7 @@ db_open(const char *path, int flags)
   if(rc) {
     TRACE(TRACE_ERROR, "DB", "%s: Unable to open database: %s",
 	  path, sqlite3_errmsg(db));
-    sqlite3_close(db);
+    db_close(db);
     return NULL;
   }
 
@@ -455,7 +634,7 @@ db_pool_put(db_pool_t *dp, sqlite3 *db)
     TRACE(TRACE_ERROR, "DB",
 	  "%s: db handle returned to pool while in transaction, closing handle",
 	  dp->dp_path);
-    sqlite3_close(db);
+    db_close(db);
     return;
   }
 
@@ -469,7 +648,7 @@ db_pool_put(db_pool_t *dp, sqlite3 *db)
   }
 
   hts_mutex_unlock(&dp->dp_mutex);
-  sqlite3_close(db);
+  db_close(db);
 }
 
 
@@ -487,7 +666,7 @@ db_pool_close(db_pool_t *dp)
   dp->dp_closed = 1;
   for(i = 0; i < dp->dp_size; i++)
     if(dp->dp_pool[i] != NULL)
-      sqlite3_close(dp->dp_pool[i]);
+      db_close(dp->dp_pool[i]);
   hts_mutex_unlock(&dp->dp_mutex);
 }
 
@@ -49,7 +49,7 @@ es_sqlite_destroy(es_resource_t *eres)
     sqlite3_finalize(es->es_stmt);
 
   if(es->es_db != NULL)
-    sqlite3_close(es->es_db);
+    db_close(es->es_db);
 
   if(es->es_debug)
     TRACE(TRACE_DEBUG, "JS", "Database %s finalized", es->es_name);
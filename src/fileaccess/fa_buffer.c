@@ -23,6 +23,9 @@
 #include "fileaccess.h"
 #include "fa_proto.h"
 #include "misc/minmax.h"
+#include "arch/atomic.h"
+#include "prop/prop.h"
+#include "task.h"
 
 #define FILE_PARKING 1
 
@@ -31,8 +34,31 @@
 #define BF_ZONES 8
 #define BF_MASK (BF_ZONES - 1)
 
+// Prefetch window should cover this much time beyond the request latency
+#define BF_PREFETCH_HORIZON 250000
+
 static HTS_MUTEX_DECL(buffered_global_mutex);
 
+static prop_t *buffered_stats_root;
+
+/**
+ * Access pattern learned from the reads issued on a handle.
+ * Decides where background read-ahead is aimed
+ */
+typedef enum {
+  BF_PATTERN_NONE,
+  BF_PATTERN_SEQUENTIAL,
+  BF_PATTERN_STRIDED,   // Fixed size jumps forward, ie. index walks
+  BF_PATTERN_TAIL,      // Jumped to end of file, probably for MP4/MKV index
+} bf_pattern_t;
+
+static const char *bf_pattern_names[] = {
+  [BF_PATTERN_NONE]       = "random",
+  [BF_PATTERN_SEQUENTIAL] = "sequential",
+  [BF_PATTERN_STRIDED]    = "strided",
+  [BF_PATTERN_TAIL]       = "tail",
+};
+
 typedef struct buffered_zone {
   int64_t bz_fpos;
   int bz_mpos;
@@ -45,6 +71,16 @@ typedef struct buffered_zone {
 typedef struct buffered_file {
   fa_handle_t h;
 
+  atomic_t bf_refcount;
+
+  /**
+   * bf_src_mutex serializes all access to bf_src and all writes into
+   * bf_mem. bf_mutex protects zones, positions and stats. Lock order
+   * is bf_src_mutex before bf_mutex
+   */
+  hts_mutex_t bf_src_mutex;
+  hts_mutex_t bf_mutex;
+
   time_t bf_park_time;
 
   fa_handle_t *bf_src;
@@ -69,6 +105,28 @@ typedef struct buffered_file {
 
   buffered_zone_t bf_zones[BF_ZONES];
 
+  // Access pattern tracking
+  bf_pattern_t bf_pattern;
+  bf_pattern_t bf_pattern_guess;
+  int bf_pattern_hits;
+  int64_t bf_last_fpos;
+  int64_t bf_last_end;
+  int64_t bf_stride;
+
+  // Read-ahead
+  int bf_prefetch_pending;
+  int64_t bf_pf_fpos;
+  int bf_pf_len;
+  int bf_window;
+  int64_t bf_bw;        // Bytes per second
+  int64_t bf_latency;   // Microseconds per source request
+
+  // Stats
+  int bf_hits;
+  int bf_misses;
+  int64_t bf_prefetched;
+  prop_t *bf_prop;
+
 } buffered_file_t;
 
 
@@ -236,11 +294,54 @@ fab_destroy(buffered_file_t *bf)
 
   if(bf->bf_mem != NULL)
     hfree(bf->bf_mem, bf->bf_mem_size);
+  prop_destroy(bf->bf_prop);
+  hts_mutex_destroy(&bf->bf_mutex);
+  hts_mutex_destroy(&bf->bf_src_mutex);
   free(bf->bf_url);
   free(bf);
 }
 
 
+/**
+ * A pending prefetch task holds a reference, so the last one out
+ * closes the source
+ */
+static void
+fab_release(buffered_file_t *bf)
+{
+  if(atomic_dec(&bf->bf_refcount))
+    return;
+  fab_destroy(bf);
+}
+
+
+/**
+ *
+ */
+static void
+fab_update_stats(buffered_file_t *bf)
+{
+  hts_mutex_lock(&bf->bf_mutex);
+  const char *pattern = bf_pattern_names[bf->bf_pattern];
+  int window   = bf->bf_window;
+  int bw       = bf->bf_bw;
+  int latency  = bf->bf_latency;
+  int hits     = bf->bf_hits;
+  int misses   = bf->bf_misses;
+  int64_t prefetched = bf->bf_prefetched;
+  hts_mutex_unlock(&bf->bf_mutex);
+
+  prop_set(bf->bf_prop, "pattern",    PROP_SET_STRING, pattern);
+  prop_set(bf->bf_prop, "window",     PROP_SET_INT, window / 1024);
+  prop_set(bf->bf_prop, "throughput", PROP_SET_INT, bw / 1024);
+  prop_set(bf->bf_prop, "latency",    PROP_SET_INT, latency / 1000);
+  prop_set(bf->bf_prop, "hits",       PROP_SET_INT, hits);
+  prop_set(bf->bf_prop, "misses",     PROP_SET_INT, misses);
+  prop_set(bf->bf_prop, "prefetched", PROP_SET_INT,
+           (int)(prefetched / 1024));
+}
+
+
 
 /**
  *
@@ -256,10 +357,13 @@ fab_close(fa_handle_t *handle)
   if((src->fh_proto->fap_no_parking != NULL &&
       src->fh_proto->fap_no_parking(src)) ||
      bf->bf_flags & FA_NO_PARKING) {
-    fab_destroy((buffered_file_t *)handle);
+    fab_update_stats(bf);
+    fab_release(bf);
     return;
   }
 
+  fab_update_stats(bf);
+
   hts_mutex_lock(&buffered_global_mutex);
   if(parked)
     closeme = parked;
@@ -269,9 +373,9 @@ fab_close(fa_handle_t *handle)
   hts_mutex_unlock(&buffered_global_mutex);
 
   if(closeme)
-    fab_destroy(closeme);
+    fab_release(closeme);
 #else
-  fab_destroy((buffered_file_t *)handle);
+  fab_release((buffered_file_t *)handle);
 #endif
 }
 
@@ -297,7 +401,9 @@ fab_seek(fa_handle_t *handle, int64_t pos, int whence, int lazy)
     break;
 
   case SEEK_END:
+    hts_mutex_lock(&bf->bf_src_mutex);
     np = src->fh_proto->fap_seek(src, pos, whence, lazy);
+    hts_mutex_unlock(&bf->bf_src_mutex);
     break;
 
   default:
@@ -308,17 +414,24 @@ fab_seek(fa_handle_t *handle, int64_t pos, int whence, int lazy)
     return -1;
 
   int mpos;
+  hts_mutex_lock(&bf->bf_mutex);
   int cs = resolve_zone(bf, np, 1, &mpos);
+  hts_mutex_unlock(&bf->bf_mutex);
 
   if(cs == -1) {
     // If seeked to position is not mapped in our buffers, seek in
     // source to check if it's possible to reach position at all.
 
-    if(src->fh_proto->fap_seek(src, np, SEEK_SET, lazy) != np)
+    hts_mutex_lock(&bf->bf_src_mutex);
+    np = src->fh_proto->fap_seek(src, np, SEEK_SET, lazy) == np ? np : -1;
+    hts_mutex_unlock(&bf->bf_src_mutex);
+    if(np == -1)
       return -1;
   }
 
+  hts_mutex_lock(&bf->bf_mutex);
   bf->bf_fpos = np;
+  hts_mutex_unlock(&bf->bf_mutex);
   return np;
 }
 
@@ -330,12 +443,25 @@ static int64_t
 fab_fsize(fa_handle_t *handle)
 {
   buffered_file_t *bf = (buffered_file_t *)handle;
-  if(bf->bf_size != -1)
-    return bf->bf_size;
+  int64_t size;
+
+  hts_mutex_lock(&bf->bf_mutex);
+  size = bf->bf_size;
+  hts_mutex_unlock(&bf->bf_mutex);
+  if(size != -1)
+    return size;
 
   fa_handle_t *src = bf->bf_src;
-  bf->bf_size = src->fh_proto->fap_fsize(src);
-  return bf->bf_size;
+  hts_mutex_lock(&bf->bf_src_mutex);
+  size = src->fh_proto->fap_fsize(src);
+  hts_mutex_unlock(&bf->bf_src_mutex);
+
+  hts_mutex_lock(&bf->bf_mutex);
+  if(bf->bf_size == -1)
+    bf->bf_size = size;
+  size = bf->bf_size;
+  hts_mutex_unlock(&bf->bf_mutex);
+  return size;
 }
 
 
@@ -380,6 +506,192 @@ store_in_cache(buffered_file_t *bf, const void *buf, size_t size)
 
 
 
+/**
+ * Feed the throughput and latency estimators with a completed source
+ * request and resize the read-ahead window.
+ *
+ * The window should cover the bandwidth-delay product plus some margin
+ * so the prefetcher stays ahead of a consumer reading at the rate the
+ * source can deliver
+ */
+static void
+fab_account(buffered_file_t *bf, int bytes, int64_t us)
+{
+  if(us < 1)
+    us = 1;
+
+  bf->bf_latency = bf->bf_latency ? (bf->bf_latency * 3 + us) / 4 : us;
+
+  if(bytes >= 16384) {
+    int64_t bw = bytes * 1000000LL / us;
+    bf->bf_bw = bf->bf_bw ? (bf->bf_bw * 3 + bw) / 4 : bw;
+  }
+
+  int64_t w = bf->bf_bw * (bf->bf_latency + BF_PREFETCH_HORIZON) / 1000000;
+  w = MAX(w, bf->bf_min_request);
+  w = MIN(w, bf->bf_mem_size / 4);
+  bf->bf_window = w;
+}
+
+
+/**
+ *
+ */
+static int
+fab_src_read(buffered_file_t *bf, int64_t fpos, void *buf, size_t size,
+             int64_t *us)
+{
+  fa_handle_t *src = bf->bf_src;
+  int64_t ts = arch_get_ts();
+  int r;
+
+  if(src->fh_proto->fap_seek(src, fpos, SEEK_SET, 0) != fpos)
+    r = -1;
+  else
+    r = src->fh_proto->fap_read(src, buf, size);
+  *us = arch_get_ts() - ts;
+  return r;
+}
+
+
+/**
+ * Classify the read at 'fpos'. A pattern needs to repeat before we
+ * trust it, except for jumps to the end of the file which almost always
+ * mean a demuxer is about to walk an index there (MP4 moov, MKV cues)
+ */
+static void
+fab_track_access(buffered_file_t *bf, int64_t fpos)
+{
+  const int64_t delta = fpos - bf->bf_last_fpos;
+  bf_pattern_t p;
+
+  if(fpos == bf->bf_last_end) {
+    p = bf->bf_pattern == BF_PATTERN_TAIL ?
+      BF_PATTERN_TAIL : BF_PATTERN_SEQUENTIAL;
+  } else if(delta > 0 && delta == bf->bf_stride) {
+    p = BF_PATTERN_STRIDED;
+  } else if(bf->bf_size != -1 && fpos > bf->bf_last_end &&
+            fpos >= bf->bf_size - (int64_t)bf->bf_mem_size / 4) {
+    p = BF_PATTERN_TAIL;
+  } else {
+    p = BF_PATTERN_NONE;
+  }
+
+  if(p == bf->bf_pattern_guess) {
+    bf->bf_pattern_hits++;
+  } else {
+    bf->bf_pattern_guess = p;
+    bf->bf_pattern_hits = 1;
+  }
+
+  bf->bf_pattern = bf->bf_pattern_hits >= 2 || p == BF_PATTERN_TAIL ?
+    p : BF_PATTERN_NONE;
+
+  bf->bf_stride = delta;
+  bf->bf_last_fpos = fpos;
+}
+
+
+/**
+ * Runs on the task pool. Reads straight into a reserved part of the
+ * ring. That region is unmapped while we're busy so readers won't look
+ * at it, and every other writer needs bf_src_mutex which we hold
+ */
+static void
+fab_prefetch_task(void *aux)
+{
+  buffered_file_t *bf = aux;
+  int64_t us;
+  int mpos;
+
+  hts_mutex_lock(&bf->bf_src_mutex);
+  hts_mutex_lock(&bf->bf_mutex);
+
+  const int64_t fpos = bf->bf_pf_fpos;
+  const int len = bf->bf_pf_len;
+
+  if(resolve_zone(bf, fpos, 1, &mpos) == -1) {
+
+    if(bf->bf_mem_ptr + len > bf->bf_mem_size)
+      bf->bf_mem_ptr = 0;
+    mpos = bf->bf_mem_ptr;
+    erase_zone(bf, mpos, len);
+    hts_mutex_unlock(&bf->bf_mutex);
+
+    int r = fab_src_read(bf, fpos, bf->bf_mem + mpos, len, &us);
+
+    hts_mutex_lock(&bf->bf_mutex);
+    if(r > 0) {
+      map_zone(bf, mpos, r, fpos);
+      bf->bf_mem_ptr = mpos + r;
+      bf->bf_prefetched += r;
+      fab_account(bf, r, us);
+    }
+    if(r >= 0 && r < len)
+      bf->bf_size = fpos + r;
+  }
+
+  bf->bf_prefetch_pending = 0;
+  hts_mutex_unlock(&bf->bf_mutex);
+  hts_mutex_unlock(&bf->bf_src_mutex);
+
+  fab_update_stats(bf);
+  fab_release(bf);
+}
+
+
+/**
+ * Decide if we should read ahead based on the learned access pattern.
+ * Called with bf_mutex held after each read
+ */
+static void
+fab_prefetch_check(buffered_file_t *bf)
+{
+  int64_t start;
+  int len, cs, mpos;
+
+  if(bf->bf_min_request == 0 || bf->bf_prefetch_pending)
+    return;
+
+  switch(bf->bf_pattern) {
+  case BF_PATTERN_SEQUENTIAL:
+  case BF_PATTERN_TAIL:
+    start = bf->bf_fpos;
+    while((cs = resolve_zone(bf, start, INT32_MAX, &mpos)) > 0)
+      start += cs;
+
+    if(start - bf->bf_fpos >= bf->bf_window)
+      return; // Far enough ahead already
+    len = bf->bf_window;
+    break;
+
+  case BF_PATTERN_STRIDED:
+    start = bf->bf_last_fpos + bf->bf_stride;
+    if(resolve_zone(bf, start, 1, &mpos) != -1)
+      return;
+    len = bf->bf_last_end - bf->bf_last_fpos;
+    len = MAX(len, bf->bf_min_request);
+    len = MIN(len, bf->bf_window);
+    break;
+
+  default:
+    return;
+  }
+
+  if(bf->bf_size != -1) {
+    if(start >= bf->bf_size)
+      return;
+    len = MIN(len, bf->bf_size - start);
+  }
+
+  bf->bf_pf_fpos = start;
+  bf->bf_pf_len = len;
+  bf->bf_prefetch_pending = 1;
+  atomic_inc(&bf->bf_refcount);
+  task_run_ex(fab_prefetch_task, bf, TASK_PRIO_BACKGROUND, NULL, NULL);
+}
+
+
 /**
  *
  */
@@ -387,18 +699,26 @@ static int
 fab_read(fa_handle_t *handle, void *buf, size_t size)
 {
   buffered_file_t *bf = (buffered_file_t *)handle;
-  fa_handle_t *src = bf->bf_src;
+  int have_src = 0;
+  int64_t us;
+  int r;
+
+  hts_mutex_lock(&bf->bf_mutex);
 
   if(bf->bf_mem == NULL) {
     bf->bf_mem = halloc(bf->bf_mem_size);
-    if(bf->bf_mem == NULL)
+    if(bf->bf_mem == NULL) {
+      hts_mutex_unlock(&bf->bf_mutex);
       return -1;
+    }
   }
 
+  fab_track_access(bf, bf->bf_fpos);
+
   if(bf->bf_size != -1 && bf->bf_fpos + size > bf->bf_size)
     size = bf->bf_size - bf->bf_fpos;
 
-  size_t rval = 0;
+  ssize_t rval = 0;
   while(size > 0) {
     int mpos = -1;
     int cs = resolve_zone(bf, bf->bf_fpos, size, &mpos);
@@ -412,14 +732,22 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
       continue;
     }
 
+    if(!have_src) {
+      // Respect lock order. A prefetch may complete while we wait so
+      // check the zones again once we have the source
+      hts_mutex_unlock(&bf->bf_mutex);
+      hts_mutex_lock(&bf->bf_src_mutex);
+      hts_mutex_lock(&bf->bf_mutex);
+      have_src = 1;
+      continue;
+    }
+
     int rreq = need_to_fill(bf, bf->bf_fpos, size);
     if(rreq >= bf->bf_min_request) {
 
-      if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET, 0) != bf->bf_fpos)
-	return -1;
-
-      int r = src->fh_proto->fap_read(src, buf, rreq);
+      r = fab_src_read(bf, bf->bf_fpos, buf, rreq, &us);
       if(r > 0) {
+        fab_account(bf, r, us);
 	store_in_cache(bf, buf, r);
 	rval += r;
 	buf += r;
@@ -428,7 +756,9 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
       }
       if(r != rreq) {
 	bf->bf_size = bf->bf_fpos;
-	return r < 0 ? r : rval;
+        if(r < 0)
+          rval = r;
+        break;
       }
       continue;
     }
@@ -438,16 +768,16 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
     
     erase_zone(bf, bf->bf_mem_ptr, bf->bf_min_request);
 
-    if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET, 0) != bf->bf_fpos)
-      return -1;
-
-    int r = src->fh_proto->fap_read(src, bf->bf_mem + bf->bf_mem_ptr,
-				    bf->bf_min_request);
+    r = fab_src_read(bf, bf->bf_fpos, bf->bf_mem + bf->bf_mem_ptr,
+                     bf->bf_min_request, &us);
     if(r < 1) {
       bf->bf_size = bf->bf_fpos;
-      return r < 0 ? r : rval;
+      if(r < 0)
+        rval = r;
+      break;
     }
 
+    fab_account(bf, r, us);
     map_zone(bf, bf->bf_mem_ptr, r, bf->bf_fpos);
 
     if(r != bf->bf_min_request) {
@@ -460,13 +790,26 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
       rval += r2;
 
       bf->bf_fpos += r2;
-
-      return rval;
+      break;
     } else {
       bf->bf_mem_ptr += r;
     }
 
   }
+
+  if(have_src)
+    bf->bf_misses++;
+  else
+    bf->bf_hits++;
+
+  bf->bf_last_end = bf->bf_fpos;
+
+  if(rval >= 0)
+    fab_prefetch_check(bf);
+
+  hts_mutex_unlock(&bf->bf_mutex);
+  if(have_src)
+    hts_mutex_unlock(&bf->bf_src_mutex);
   return rval;
 }
 
@@ -519,8 +862,11 @@ fab_set_read_timeout(fa_handle_t *handle, int ms)
 {
   buffered_file_t *bf = (buffered_file_t *)handle;
   fa_handle_t *fh = bf->bf_src;
-  if(fh->fh_proto->fap_set_read_timeout != NULL)
+  if(fh->fh_proto->fap_set_read_timeout != NULL) {
+    hts_mutex_lock(&bf->bf_src_mutex);
     fh->fh_proto->fap_set_read_timeout(fh, ms);
+    hts_mutex_unlock(&bf->bf_src_mutex);
+  }
 }
 
 
@@ -564,7 +910,10 @@ fa_buffered_open(const char *url, char *errbuf, size_t errsize, int flags,
 
 
   if(parked && !strcmp(parked->bf_url, url)) {
+    hts_mutex_lock(&parked->bf_mutex);
     parked->bf_fpos = 0;
+    parked->bf_last_end = 0;
+    hts_mutex_unlock(&parked->bf_mutex);
     fh = (fa_handle_t *)parked;
     parked = NULL;
   }
@@ -573,7 +922,7 @@ fa_buffered_open(const char *url, char *errbuf, size_t errsize, int flags,
   hts_mutex_unlock(&buffered_global_mutex);
     
   if(closeme != NULL)
-    fab_destroy(closeme);
+    fab_release(closeme);
 
   if(fh != NULL)
     return fh;
@@ -586,9 +935,22 @@ fa_buffered_open(const char *url, char *errbuf, size_t errsize, int flags,
   if(fh == NULL)
     return NULL;
 
+  return fa_buffered_wrap(fh, url, mflags);
+}
+
+
+/**
+ * Put a buffer in front of an already opened handle. Takes over 'fh'
+ */
+fa_handle_t *
+fa_buffered_wrap(fa_handle_t *fh, const char *url, int flags)
+{
   if(!(fh->fh_proto->fap_flags & FAP_ALLOW_CACHE))
     return fh;
 
+  int mflags = flags;
+  flags &= ~ (FA_BUFFERED_SMALL | FA_BUFFERED_BIG | FA_BUFFERED_NO_PREFETCH);
+
   buffered_file_t *bf = calloc(1, sizeof(buffered_file_t));
   bf->bf_url = strdup(url);
   if(!(mflags & FA_BUFFERED_NO_PREFETCH))
@@ -596,9 +958,26 @@ fa_buffered_open(const char *url, char *errbuf, size_t errsize, int flags,
   bf->bf_mem_size = 1024 * 1024;
   bf->bf_flags = flags;
 
+  bf->bf_window = bf->bf_min_request;
+
   bf->bf_src = fh;
   bf->bf_size = -1;
   bf->h.fh_proto = &fa_protocol_buffered;
+  atomic_set(&bf->bf_refcount, 1);
+  hts_mutex_init(&bf->bf_mutex);
+  hts_mutex_init(&bf->bf_src_mutex);
+
+  hts_mutex_lock(&buffered_global_mutex);
+  if(buffered_stats_root == NULL)
+    buffered_stats_root =
+      prop_create(prop_create(prop_create(prop_get_global(), "system"),
+                              "io"), "buffered");
+  hts_mutex_unlock(&buffered_global_mutex);
+
+  bf->bf_prop = prop_create_root(NULL);
+  prop_set(bf->bf_prop, "url", PROP_SET_STRING, url);
+  if(prop_set_parent(bf->bf_prop, buffered_stats_root))
+    abort();
 #if BF_CHK
   bf->bf_chk = fa_open_ex(url, NULL, 0, 0, NULL);
 #endif
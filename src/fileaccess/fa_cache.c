@@ -24,36 +24,109 @@
 #include <unistd.h>
 #include <stdio.h>
 
-#include <arch/threads.h>
+#include "arch/threads.h"
+#include "arch/atomic.h"
 #include "main.h"
 #include "fileaccess.h"
 #include "fa_proto.h"
-#include "misc/redblack.h"
+#include "task.h"
+#include "misc/sha.h"
+#include "misc/pool.h"
+#include "misc/minmax.h"
+#include "misc/cancellable.h"
+#include "misc/callout.h"
+#include "prop/prop.h"
 
+/**
+ * Persistent chunk cache for remote files
+ *
+ * Files are split into CHUNK_SIZE chunks. Each chunk is stored in a
+ * file named by a digest of the URL, the validator the server handed
+ * out (ETag or Last-Modified) and the chunk number. Thus chunks are
+ * shared by all handles to the same content and survive restarts. All
+ * chunks share a single size budget and are evicted in LRU order.
+ */
 
-TAILQ_HEAD(cached_segment_queue, cached_segment);
-RB_HEAD(cached_segment_tree, cached_segment);
-TAILQ_HEAD(cache_request_queue, cache_request);
-TAILQ_HEAD(cached_file_queue, cached_file);
+#define CHUNK_SHIFT 19
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
 
-LIST_HEAD(cached_file_handle_list, cached_file_handle);
+#define FAC_HASH_SIZE 1024
+#define FAC_HASH_MASK (FAC_HASH_SIZE - 1)
 
-static char *cachefile;
+#define FAC_READAHEAD 4 // In chunks
 
-static hts_mutex_t cache_mutex;
+#define FAC_INDEX_SAVE_DELAY 5 // Seconds after a chunk was added
+
+#define FAC_MINSIZE (100 * 1000 * 1000)
+#define FAC_MAXSIZE (2000LL * 1000 * 1000)
+
+#define FAC_INDEX_MAGIC 0x66630101
 
-static struct cached_file_queue cached_files;
+TAILQ_HEAD(fac_chunk_queue, fac_chunk);
+LIST_HEAD(fac_chunk_list, fac_chunk);
 
-#define PAGE_SHIFT 19
-#define PAGE_SIZE (1 << PAGE_SHIFT)
-#define PAGE_MASK (PAGE_SIZE - 1)
 
 /**
  *
  */
-typedef struct cached_page {
-  int cp_file_offset;
-} cached_page_t;
+typedef struct fac_chunk {
+  LIST_ENTRY(fac_chunk) fc_hash_link;
+  TAILQ_ENTRY(fac_chunk) fc_lru_link;
+  uint64_t fc_id;
+  uint32_t fc_size;
+} fac_chunk_t;
+
+
+/**
+ * A chunk that is being downloaded. Lives on the stack of the fetcher
+ */
+typedef struct fac_inflight {
+  LIST_ENTRY(fac_inflight) fi_link;
+  uint64_t fi_id;
+} fac_inflight_t;
+
+LIST_HEAD(fac_inflight_list, fac_inflight);
+
+
+/**
+ * On disk index, stored most recently used first
+ */
+typedef struct fac_index_entry {
+  uint64_t fie_id;
+  uint32_t fie_size;
+  uint32_t fie_reserved;
+} fac_index_entry_t;
+
+typedef struct fac_index_hdr {
+  uint32_t fih_magic;
+  uint32_t fih_items;
+} fac_index_hdr_t;
+
+
+static hts_mutex_t cache_mutex;
+static hts_cond_t cache_cond;  // Signalled when a fetch completes
+static HTS_MUTEX_DECL(index_write_mutex);
+static struct fac_inflight_list chunks_inflight;
+static callout_t index_save_callout;
+static int index_save_scheduled;
+static struct fac_chunk_list chunk_hash[FAC_HASH_SIZE];
+static struct fac_chunk_queue chunk_lru;
+static pool_t *chunk_pool;
+static uint64_t cache_size;
+static uint64_t cache_maxsize;
+static int cache_items;
+static int cache_dirty;
+static unsigned int cache_hits;
+static unsigned int cache_misses;
+static unsigned int cache_evictions;
+static atomic_t tmpfile_tally;
+
+static prop_t *stats_items;
+static prop_t *stats_size;
+static prop_t *stats_hits;
+static prop_t *stats_misses;
+static prop_t *stats_evictions;
 
 
 /**
@@ -62,93 +135,233 @@ typedef struct cached_page {
 typedef struct cached_file {
   fa_handle_t h;
 
-  int cf_ref_count;
-
-  uint64_t cf_pos;
-  hts_cond_t cf_cond_req;
-  hts_cond_t cf_cond_resp;
-  int cf_pending;
+  atomic_t cf_refcount;
 
-  fa_handle_t *cf_src;
-  uint64_t cf_src_pos;
+  /**
+   * cf_src_mutex serializes access to cf_src and cf_buf, cf_mutex
+   * protects the rest. Lock order is cf_src_mutex, cf_mutex, cache_mutex
+   */
+  hts_mutex_t cf_src_mutex;
+  hts_mutex_t cf_mutex;
 
-  uint64_t cf_size;
-  int cf_fd[2];
-  struct cached_segment_tree cf_segments;
+  fa_handle_t *cf_src;  // Opened with the caller's cancellable
+  void *cf_buf;
 
-  struct cached_segment_queue cf_active_segments;
-  struct cached_segment_queue cf_idle_segments;
+  char *cf_url;
+  int cf_flags;
 
-  hts_mutex_t cf_mutex;
+  uint8_t cf_digest[20];
 
-  int cf_thread_running;
+  int64_t cf_size;
+  int64_t cf_pos;
 
-  struct cached_file_handle_list cf_fhs;
+  int cf_fd;
+  int64_t cf_fd_chunk;
 
-  cached_page_t *cf_pages;
+  int cf_closed;
 
-  int cf_page_mask;
-  int cf_num_pages;
+  // Read-ahead
+  int cf_prefetch_pending;
+  int64_t cf_ra_start;
+  int64_t cf_ra_end;
 
-  prop_t *cf_stats_cachesize;
-  prop_t *cf_stats_cachemax;
+  /**
+   * The read-ahead task may outlive the caller (and its cancellable)
+   * so it reads from a source of its own, opened on first use.
+   * Only touched by the (single) read-ahead task
+   */
+  fa_handle_t *cf_ra_src;
+  void *cf_ra_buf;
+  cancellable_t cf_ra_cancellable;
 
 } cached_file_t;
 
 
+/**
+ *
+ */
+static uint64_t
+chunk_id(const cached_file_t *cf, int64_t chunk)
+{
+  union {
+    uint8_t d[20];
+    uint64_t u64;
+  } u;
+  uint8_t n[8];
+  int i;
+
+  for(i = 0; i < 8; i++)
+    n[i] = chunk >> (i * 8);
+
+  sha1_decl(shactx);
+  sha1_init(shactx);
+  sha1_update(shactx, cf->cf_digest, sizeof(cf->cf_digest));
+  sha1_update(shactx, n, sizeof(n));
+  sha1_final(shactx, u.d);
+  return u.u64 ?: 1;
+}
+
 
-#if 0
 /**
  *
  */
 static void
-clear_segments(struct cached_segment_queue *q)
+make_filename(char *buf, size_t len, uint64_t id, int for_write)
 {
-  cached_segment_t *cs;
-  while((cs = TAILQ_FIRST(q)) != NULL) {
-    TAILQ_REMOVE(q, cs, cs_link);
-    free(cs);
+  uint8_t dir = id;
+  if(for_write) {
+    snprintf(buf, len, "%s/facache/%02x", gconf.cache_path, dir);
+    fa_makedir(buf);
   }
+  snprintf(buf, len, "%s/facache/%02x/%016"PRIx64, gconf.cache_path, dir, id);
+}
+
+
+/**
+ *
+ */
+static fac_chunk_t *
+chunk_lookup(uint64_t id)
+{
+  fac_chunk_t *fc;
+  LIST_FOREACH(fc, &chunk_hash[id & FAC_HASH_MASK], fc_hash_link)
+    if(fc->fc_id == id)
+      return fc;
+  return NULL;
 }
-#endif
 
 
 /**
  *
  */
 static void
-cf_setup_segment_vector(cached_file_t *cf)
+chunk_remove(fac_chunk_t *fc)
 {
-  int cache_size = 256 * 1024 * 1024;
-  int num_pages = cache_size / PAGE_SIZE;
-  cf->cf_pages = malloc(sizeof(cached_page_t) * num_pages);
-  memset(cf->cf_pages, 0xff, sizeof(cached_page_t) * num_pages);
-  cf->cf_page_mask = num_pages - 1;
-  cf->cf_num_pages = num_pages;
+  LIST_REMOVE(fc, fc_hash_link);
+  TAILQ_REMOVE(&chunk_lru, fc, fc_lru_link);
+  cache_size -= fc->fc_size;
+  cache_items--;
+  cache_dirty = 1;
+  pool_put(chunk_pool, fc);
 }
 
+
+/**
+ * Files are unlinked with cache_mutex held so a chunk never exists in
+ * the index without its file
+ */
+static void
+chunk_evict(void)
+{
+  char filename[PATH_MAX];
+  fac_chunk_t *fc;
+
+  while(cache_size > cache_maxsize &&
+        (fc = TAILQ_LAST(&chunk_lru, fac_chunk_queue)) != NULL) {
+    make_filename(filename, sizeof(filename), fc->fc_id, 0);
+    fa_unlink(filename, NULL, 0);
+    chunk_remove(fc);
+    cache_evictions++;
+  }
+}
+
+
 /**
  *
  */
-static int
-get_anon_file(int fd[2])
+static void
+chunk_insert(uint64_t id, uint32_t size, int tail)
+{
+  fac_chunk_t *fc = pool_get(chunk_pool);
+  fc->fc_id = id;
+  fc->fc_size = size;
+  LIST_INSERT_HEAD(&chunk_hash[id & FAC_HASH_MASK], fc, fc_hash_link);
+  if(tail)
+    TAILQ_INSERT_TAIL(&chunk_lru, fc, fc_lru_link);
+  else
+    TAILQ_INSERT_HEAD(&chunk_lru, fc, fc_lru_link);
+  cache_size += size;
+  cache_items++;
+  cache_dirty = 1;
+}
+
+
+/**
+ *
+ */
+static void
+update_stats(void)
 {
-  int rval = 0;
   hts_mutex_lock(&cache_mutex);
+  int items = cache_items;
+  int size = cache_size / 1024;
+  unsigned int hits = cache_hits;
+  unsigned int misses = cache_misses;
+  unsigned int evictions = cache_evictions;
+  hts_mutex_unlock(&cache_mutex);
+
+  prop_set_int(stats_items, items);
+  prop_set_int(stats_size, size);
+  prop_set_int(stats_hits, hits);
+  prop_set_int(stats_misses, misses);
+  prop_set_int(stats_evictions, evictions);
+}
+
+
+/**
+ *
+ */
+static void
+save_index(void)
+{
+  char filename[PATH_MAX];
+  char tmpname[PATH_MAX];
+  fac_index_hdr_t hdr;
+  fac_index_entry_t *vec;
+  fac_chunk_t *fc;
+  int i = 0;
 
-  fd[0] = open(cachefile, O_CREAT | O_TRUNC | O_WRONLY, 0666);
-  fd[1] = open(cachefile, O_RDONLY);
-  
-  if(fd[0] == -1 || fd[1] == -1 || unlink(cachefile)) {
-    
-    if(fd[0] != -1)
-      close(fd[0]);
-    if(fd[1] != -1)
-      close(fd[1]);
-    rval = 1;
+  hts_mutex_lock(&cache_mutex);
+  if(!cache_dirty) {
+    hts_mutex_unlock(&cache_mutex);
+    return;
+  }
+  cache_dirty = 0;
+
+  hdr.fih_magic = FAC_INDEX_MAGIC;
+  hdr.fih_items = cache_items;
+  vec = malloc(sizeof(fac_index_entry_t) * MAX(cache_items, 1));
+  TAILQ_FOREACH(fc, &chunk_lru, fc_lru_link) {
+    vec[i].fie_id = fc->fc_id;
+    vec[i].fie_size = fc->fc_size;
+    vec[i].fie_reserved = 0;
+    i++;
   }
   hts_mutex_unlock(&cache_mutex);
-  return rval;
+
+  snprintf(filename, sizeof(filename), "%s/facache/index.dat",
+           gconf.cache_path);
+  if(snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >=
+     sizeof(tmpname)) {
+    free(vec);
+    return;
+  }
+
+  hts_mutex_lock(&index_write_mutex);
+  int fd = open(tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if(fd != -1) {
+    size_t len = sizeof(fac_index_entry_t) * i;
+    if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+       write(fd, vec, len) != len) {
+      close(fd);
+      unlink(tmpname);
+    } else {
+      close(fd);
+      rename(tmpname, filename);
+    }
+  }
+  hts_mutex_unlock(&index_write_mutex);
+  free(vec);
 }
 
 
@@ -156,19 +369,79 @@ get_anon_file(int fd[2])
  *
  */
 static void
-cf_release(cached_file_t *cf)
+load_index(void)
 {
-  if(atomic_add(&cf->cf_ref_count, -1) > 1)
+  char filename[PATH_MAX];
+  fac_index_hdr_t hdr;
+  fac_index_entry_t fie;
+  int i;
+
+  snprintf(filename, sizeof(filename), "%s/facache/index.dat",
+           gconf.cache_path);
+
+  int fd = open(filename, O_RDONLY);
+  if(fd == -1)
     return;
-  
-  close(cf->cf_fd[0]);
-  close(cf->cf_fd[1]);
-  fa_close(cf->cf_src);
-  hts_mutex_destroy(&cf->cf_mutex);
-  hts_cond_destroy(&cf->cf_cond_req);
-  hts_cond_destroy(&cf->cf_cond_resp);
-  prop_ref_dec(cf->cf_stats_cachesize);
-  free(cf);
+
+  if(read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+     hdr.fih_magic == FAC_INDEX_MAGIC) {
+
+    for(i = 0; i < hdr.fih_items; i++) {
+      if(read(fd, &fie, sizeof(fie)) != sizeof(fie))
+        break;
+      if(fie.fie_size > CHUNK_SIZE || chunk_lookup(fie.fie_id) != NULL)
+        continue;
+      chunk_insert(fie.fie_id, fie.fie_size, 1);
+    }
+  }
+  close(fd);
+}
+
+
+/**
+ * Remove chunk files not present in the index. Runs before any
+ * handle can be opened so there are no writes in flight
+ */
+static void
+prune_stale(void)
+{
+  fa_dir_t *d1, *d2;
+  fa_dir_entry_t *de1, *de2;
+  char path[PATH_MAX];
+  char path2[PATH_MAX];
+  char path3[PATH_MAX];
+  uint64_t id;
+
+  snprintf(path, sizeof(path), "%s/facache", gconf.cache_path);
+
+  if((d1 = fa_scandir(path, NULL, 0)) == NULL)
+    return;
+
+  RB_FOREACH(de1, &d1->fd_entries, fde_link) {
+    const char *n1 = rstr_get(de1->fde_filename);
+    if(n1[0] == '.' || de1->fde_type != CONTENT_DIR)
+      continue;
+
+    if(snprintf(path2, sizeof(path2), "%s/%s", path, n1) >= sizeof(path2))
+      continue;
+
+    if((d2 = fa_scandir(path2, NULL, 0)) != NULL) {
+      RB_FOREACH(de2, &d2->fd_entries, fde_link) {
+        const char *n2 = rstr_get(de2->fde_filename);
+        if(n2[0] == '.')
+          continue;
+
+        if(strlen(n2) != 16 || sscanf(n2, "%016"PRIx64, &id) != 1 ||
+           chunk_lookup(id) == NULL) {
+          if(snprintf(path3, sizeof(path3), "%s/%s", path2, n2) <
+             sizeof(path3))
+            fa_unlink(path3, NULL, 0);
+        }
+      }
+      fa_dir_free(d2);
+    }
+  }
+  fa_dir_free(d1);
 }
 
 
@@ -176,216 +449,407 @@ cf_release(cached_file_t *cf)
  *
  */
 static void
-fac_close(fa_handle_t *handle)
+index_save_task(void *aux)
 {
-  cached_file_t *cf = (cached_file_t *)handle;
+  hts_mutex_lock(&cache_mutex);
+  index_save_scheduled = 0;
+  hts_mutex_unlock(&cache_mutex);
 
-  hts_mutex_lock(&cf->cf_mutex);
-  cf->cf_thread_running = 0;
-  hts_cond_signal(&cf->cf_cond_req);
-  hts_mutex_unlock(&cf->cf_mutex);
-  cf_release(cf);
+  save_index();
+  update_stats();
 }
 
 
 /**
  *
  */
-static int64_t
-fac_seek(fa_handle_t *handle, int64_t pos, int whence)
+static void
+index_save_timer(callout_t *c, void *aux)
 {
-  cached_file_t *cf = (cached_file_t *)handle;
-  uint64_t np;
+  task_run(index_save_task, NULL);
+}
 
-  hts_mutex_lock(&cf->cf_mutex);
 
-  switch(whence) {
-  case SEEK_SET:
-    np = pos;
-    break;
+/**
+ * Write the index a while after chunks have been added so a crash
+ * doesn't lose the cache, without rewriting it for every chunk.
+ * Called with cache_mutex held
+ */
+static void
+index_save_schedule(void)
+{
+  if(index_save_scheduled)
+    return;
+  index_save_scheduled = 1;
+  callout_arm(&index_save_callout, index_save_timer, NULL,
+              FAC_INDEX_SAVE_DELAY);
+}
 
-  case SEEK_CUR:
-    np = cf->cf_pos + pos;
-    break;
 
-  case SEEK_END:
-    np = cf->cf_size + pos;
-    break;
+/**
+ * Called with cache_mutex held
+ */
+static int
+chunk_is_inflight(uint64_t id)
+{
+  fac_inflight_t *fi;
+  LIST_FOREACH(fi, &chunks_inflight, fi_link)
+    if(fi->fi_id == id)
+      return 1;
+  return 0;
+}
 
-  default:
-    hts_mutex_unlock(&cf->cf_mutex);
-    return -1;
+
+/**
+ *
+ */
+static uint64_t
+compute_maxsize(void)
+{
+  fa_fsinfo_t ffi;
+
+  if(!fa_fsinfo(gconf.cache_path, &ffi)) {
+    uint64_t avail = ffi.ffi_avail + cache_size;
+    return MAX(FAC_MINSIZE, MIN(avail / 10, FAC_MAXSIZE));
+  }
+  return FAC_MINSIZE;
+}
+
+
+/**
+ * Read 'chunk' from 'src' into '*bufp' and store it as 'id'
+ */
+static int
+fac_fetch0(cached_file_t *cf, fa_handle_t *src, void **bufp, int64_t chunk,
+           uint64_t id)
+{
+  const int64_t offset = chunk << CHUNK_SHIFT;
+  const int size = MIN(CHUNK_SIZE, cf->cf_size - offset);
+  char filename[PATH_MAX];
+  char tmpname[PATH_MAX];
+  int got, r;
+
+  if(*bufp == NULL) {
+    *bufp = malloc(CHUNK_SIZE);
+    if(*bufp == NULL)
+      return -1;
   }
 
-  if(np < 0) {
-    hts_mutex_unlock(&cf->cf_mutex);
+  if(fa_seek(src, offset, SEEK_SET) != offset)
     return -1;
+
+  for(got = 0; got < size; got += r) {
+    r = fa_read(src, *bufp + got, size - got);
+    if(r <= 0)
+      return -1;
   }
 
-  if(cf->cf_pos != np) {
-    cf->cf_pos = np;
-    hts_cond_signal(&cf->cf_cond_req);
+  // Written to a temp file first so a crash never leaves a partial
+  // chunk under its real name
+  make_filename(filename, sizeof(filename), id, 1);
+  if(snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", filename,
+              atomic_add_and_fetch(&tmpfile_tally, 1)) >= sizeof(tmpname))
+    return -1;
+
+  int fd = open(tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if(fd == -1)
+    return -1;
+  r = write(fd, *bufp, size) != size;
+  close(fd);
+
+  hts_mutex_lock(&cache_mutex);
+  if(!r)
+    r = rename(tmpname, filename);
+  if(r) {
+    unlink(tmpname);
+  } else {
+    cache_misses++;
+    chunk_insert(id, size, 0);
+    chunk_evict();
+    index_save_schedule();
   }
-  hts_mutex_unlock(&cf->cf_mutex);
-  return np;
+  hts_mutex_unlock(&cache_mutex);
+  return r ? -1 : 0;
 }
 
 
 /**
+ * Make sure 'chunk' is on disk, reading it from 'src' into '*bufp'.
+ * The caller must have exclusive access to 'src' and '*bufp'.
  *
+ * If another handle (or our own read-ahead) is already downloading
+ * the chunk we wait for it instead of fetching the same range twice.
+ * Should that fetch fail we try ourselves.
  */
-static int64_t
-fac_fsize(fa_handle_t *handle)
+static int
+fac_fetch(cached_file_t *cf, fa_handle_t *src, void **bufp, int64_t chunk)
 {
-  cached_file_t *cf = (cached_file_t *)handle;
-  return cf->cf_size;
+  const uint64_t id = chunk_id(cf, chunk);
+  fac_inflight_t fi;
+  int r;
+
+  hts_mutex_lock(&cache_mutex);
+  while(chunk_is_inflight(id))
+    hts_cond_wait(&cache_cond, &cache_mutex);
+
+  if(chunk_lookup(id) != NULL) {
+    hts_mutex_unlock(&cache_mutex);
+    return 0;
+  }
+
+  fi.fi_id = id;
+  LIST_INSERT_HEAD(&chunks_inflight, &fi, fi_link);
+  hts_mutex_unlock(&cache_mutex);
+
+  r = fac_fetch0(cf, src, bufp, chunk, id);
+
+  hts_mutex_lock(&cache_mutex);
+  LIST_REMOVE(&fi, fi_link);
+  hts_cond_broadcast(&cache_cond);
+  hts_mutex_unlock(&cache_mutex);
+  return r;
 }
 
 
 /**
  *
  */
+static void
+fac_close_chunk(cached_file_t *cf)
+{
+  if(cf->cf_fd != -1)
+    close(cf->cf_fd);
+  cf->cf_fd = -1;
+  cf->cf_fd_chunk = -1;
+}
+
+
+/**
+ * Open the file backing 'chunk'. Called with cf_mutex held.
+ * Returns 0 if the chunk is not cached
+ */
 static int
-cache_page(cached_file_t *cf, int vpage, void *buf)
+fac_open_chunk(cached_file_t *cf, int64_t chunk)
 {
-  int dpage = vpage & cf->cf_page_mask;
-  cached_page_t *cp = cf->cf_pages + dpage;
-  
-  if(cp->cp_file_offset == vpage)
-    return 0;
+  char filename[PATH_MAX];
 
-  int64_t srcoffset = (int64_t) vpage << PAGE_SHIFT;
-  
-  if(srcoffset >= cf->cf_size)
-    return 0;
+  if(cf->cf_fd_chunk == chunk)
+    return 1;
 
-  cp->cp_file_offset = -1;
-  hts_mutex_unlock(&cf->cf_mutex);
+  fac_close_chunk(cf);
 
-  int r;
+  const uint64_t id = chunk_id(cf, chunk);
 
-  if(fa_seek(cf->cf_src, srcoffset, SEEK_SET) == srcoffset) {
-    r = fa_read(cf->cf_src, buf, PAGE_SIZE);
-  } else {
-    r = -1;
+  hts_mutex_lock(&cache_mutex);
+  fac_chunk_t *fc = chunk_lookup(id);
+  if(fc != NULL) {
+    make_filename(filename, sizeof(filename), id, 0);
+    cf->cf_fd = open(filename, O_RDONLY);
+    if(cf->cf_fd == -1) {
+      // File went missing behind our back
+      chunk_remove(fc);
+    } else {
+      TAILQ_REMOVE(&chunk_lru, fc, fc_lru_link);
+      TAILQ_INSERT_HEAD(&chunk_lru, fc, fc_lru_link);
+      cf->cf_fd_chunk = chunk;
+      cache_hits++;
+    }
   }
+  hts_mutex_unlock(&cache_mutex);
+  return cf->cf_fd != -1;
+}
 
-  if(r <= 0) {
-    hts_mutex_lock(&cf->cf_mutex);
-    return -1;
-  }
 
-  int64_t voff = dpage << PAGE_SHIFT;
+/**
+ *
+ */
+static void
+cf_release(cached_file_t *cf)
+{
+  if(atomic_dec(&cf->cf_refcount))
+    return;
 
-  r = lseek(cf->cf_fd[0], voff, SEEK_SET) != voff ||
-    write(cf->cf_fd[0], buf, r) <= 0;
-  
-  hts_mutex_lock(&cf->cf_mutex);
-  if(r)
+  fac_close_chunk(cf);
+  fa_close(cf->cf_src);
+  if(cf->cf_ra_src != NULL)
+    fa_close(cf->cf_ra_src);
+  free(cf->cf_buf);
+  free(cf->cf_ra_buf);
+  free(cf->cf_url);
+  hts_mutex_destroy(&cf->cf_mutex);
+  hts_mutex_destroy(&cf->cf_src_mutex);
+  free(cf);
+}
+
+
+/**
+ * Open the read-ahead source. It must be the same content as the one
+ * the chunk ids were derived from
+ */
+static int
+fac_open_ra_src(cached_file_t *cf)
+{
+  fa_open_extra_t foe = {0};
+  char errbuf[256];
+  char validator[256];
+  char expected[256];
+
+  if(cf->cf_ra_src != NULL)
+    return 0;
+
+  foe.foe_c = &cf->cf_ra_cancellable;
+
+  fa_handle_t *fh = fa_open_ex(cf->cf_url, errbuf, sizeof(errbuf),
+                               cf->cf_flags, &foe);
+  if(fh == NULL)
+    return -1;
+
+  if(fa_fsize(fh) != cf->cf_size ||
+     fh->fh_proto->fap_get_validator == NULL ||
+     fh->fh_proto->fap_get_validator(fh, validator, sizeof(validator)) ||
+     cf->cf_src->fh_proto->fap_get_validator(cf->cf_src, expected,
+                                             sizeof(expected)) ||
+     strcmp(validator, expected)) {
+    fa_close(fh);
     return -1;
+  }
 
-  cp->cp_file_offset = vpage;
-  return 1;
+  cf->cf_ra_src = fh;
+  return 0;
 }
 
 
 /**
- *
+ * Fetch the chunks following the read position on the task pool. The
+ * read-ahead uses a source of its own so foreground reads don't queue
+ * behind it on the source. A foreground read of a chunk that is being
+ * read ahead waits for that download instead of starting another one
  */
 static void
-cache_pages(cached_file_t *cf, void *buf)
+fac_prefetch_task(void *aux)
 {
-  int i;
-  int basepage = cf->cf_pos >> PAGE_SHIFT;
-  int ra = 0;
+  cached_file_t *cf = aux;
+  int64_t last = (cf->cf_size + CHUNK_MASK) >> CHUNK_SHIFT;
+  int64_t start, chunk;
 
-  for(i = 0; i < cf->cf_num_pages - 10; i++) {
-    if(cf->cf_pending == 1 || cf->cf_thread_running == 0)
+  hts_mutex_lock(&cf->cf_mutex);
+  start = chunk = cf->cf_ra_start;
+  last = MIN(last, start + FAC_READAHEAD);
+  hts_mutex_unlock(&cf->cf_mutex);
+
+  for(; chunk < last; chunk++) {
+    hts_mutex_lock(&cf->cf_mutex);
+    int closed = cf->cf_closed;
+    hts_mutex_unlock(&cf->cf_mutex);
+    if(closed)
       break;
-    int r = cache_page(cf, basepage + i, buf);
-    if(r == -1)
+
+    if(fac_open_ra_src(cf) ||
+       fac_fetch(cf, cf->cf_ra_src, &cf->cf_ra_buf, chunk))
       break;
-    if(r == 1)
-      prop_set_int(cf->cf_stats_cachesize, ra * PAGE_SIZE);
-    ra++;
   }
+
+  hts_mutex_lock(&cf->cf_mutex);
+  if(cf->cf_ra_start == start)
+    cf->cf_ra_end = chunk;
+  cf->cf_prefetch_pending = 0;
+  hts_mutex_unlock(&cf->cf_mutex);
+
+  update_stats();
+  cf_release(cf);
 }
 
 
 /**
- *
+ * Called with cf_mutex held
  */
-static void *
-fac_thread(void *aux)
+static void
+fac_prefetch_check(cached_file_t *cf)
 {
-  cached_file_t *cf = aux;
-  void *buf = malloc(PAGE_SIZE);
-
-  hts_mutex_lock(&cf->cf_mutex);
+  int64_t next = (cf->cf_pos >> CHUNK_SHIFT) + 1;
 
-  while(cf->cf_thread_running == 1) {
+  if(cf->cf_prefetch_pending)
+    return;
 
-    if(cf->cf_pending == 1) {
-      TRACE(TRACE_DEBUG, "Read-ahead", "Cache miss at position %"PRId64,
-	    cf->cf_pos);
+  if(next >= cf->cf_ra_start && next + FAC_READAHEAD / 2 <= cf->cf_ra_end)
+    return; // Still well covered by what we fetched last time
 
-      if(cache_page(cf, cf->cf_pos >> PAGE_SHIFT, buf) == -1) {
-	cf->cf_pending = 2;
-      } else {
-	cf->cf_pending = 0;
-      }
-      hts_cond_signal(&cf->cf_cond_resp);
-      continue;
-    }
+  if(next << CHUNK_SHIFT >= cf->cf_size)
+    return;
 
-    cache_pages(cf, buf);
+  cf->cf_ra_start = next;
+  cf->cf_ra_end = next;
+  cf->cf_prefetch_pending = 1;
+  atomic_inc(&cf->cf_refcount);
+  task_run_ex(fac_prefetch_task, cf, TASK_PRIO_BACKGROUND, NULL, NULL);
+}
 
-    if(cf->cf_pending)
-      continue;
 
-    if(cf->cf_thread_running == 0)
-      break;
+/**
+ *
+ */
+static void
+fac_close(fa_handle_t *handle)
+{
+  cached_file_t *cf = (cached_file_t *)handle;
 
-    hts_cond_wait(&cf->cf_cond_req, &cf->cf_mutex);
-  }
+  hts_mutex_lock(&cf->cf_mutex);
+  cf->cf_closed = 1;
   hts_mutex_unlock(&cf->cf_mutex);
-  free(buf);
+
+  // Abort any running read-ahead
+  cancellable_cancel(&cf->cf_ra_cancellable);
+
+  save_index();
+  update_stats();
   cf_release(cf);
-  return NULL; 
 }
 
 
 /**
  *
  */
-static int
-fac_load(cached_file_t *cf, void *buf, int64_t offset, int size)
+static int64_t
+fac_seek(fa_handle_t *handle, int64_t pos, int whence, int lazy)
 {
-  int poffset = offset & PAGE_MASK;
-  int vpage = offset >> PAGE_SHIFT;
-  int dpage = vpage & cf->cf_page_mask;
-  
-  cached_page_t *cp = cf->cf_pages + dpage;
+  cached_file_t *cf = (cached_file_t *)handle;
+  int64_t np;
 
-  if(cp->cp_file_offset != vpage)
-    return 0;
+  hts_mutex_lock(&cf->cf_mutex);
 
-  int count = MIN(size, PAGE_SIZE - poffset);
-  int64_t voff = (dpage << PAGE_SHIFT) + poffset;
+  switch(whence) {
+  case SEEK_SET:
+    np = pos;
+    break;
 
-  hts_mutex_unlock(&cf->cf_mutex);
+  case SEEK_CUR:
+    np = cf->cf_pos + pos;
+    break;
 
-  int r;
+  case SEEK_END:
+    np = cf->cf_size + pos;
+    break;
 
-  if(lseek(cf->cf_fd[1], voff, SEEK_SET) != voff) {
-    r = 1;
-  } else {
-    r = read(cf->cf_fd[1], buf, count) != count;
+  default:
+    np = -1;
+    break;
   }
 
-  hts_mutex_lock(&cf->cf_mutex);
-  
-  return r ? -1 : count;
+  if(np >= 0)
+    cf->cf_pos = np;
+  hts_mutex_unlock(&cf->cf_mutex);
+  return np < 0 ? -1 : np;
+}
+
+
+/**
+ *
+ */
+static int64_t
+fac_fsize(fa_handle_t *handle)
+{
+  cached_file_t *cf = (cached_file_t *)handle;
+  return cf->cf_size;
 }
 
 
@@ -396,46 +860,60 @@ static int
 fac_read(fa_handle_t *handle, void *buf, size_t size)
 {
   cached_file_t *cf = (cached_file_t *)handle;
-  uint64_t off = cf->cf_pos;
+  int total = 0;
+  int retries = 0;
 
-  if(off > cf->cf_size) 
+  hts_mutex_lock(&cf->cf_mutex);
+
+  if(cf->cf_pos >= cf->cf_size) {
+    hts_mutex_unlock(&cf->cf_mutex);
     return 0;
+  }
 
-  if(off + size > cf->cf_size)
-    size = cf->cf_size - off;
+  size = MIN(size, cf->cf_size - cf->cf_pos);
 
-  int total = size;
+  while(size > 0) {
+    const int64_t chunk = cf->cf_pos >> CHUNK_SHIFT;
 
-  hts_mutex_lock(&cf->cf_mutex);
+    if(!fac_open_chunk(cf, chunk)) {
 
-  while(size > 0) {
-    int r = fac_load(cf, buf, off, size);
+      if(retries++ == 2) {
+        total = total ?: -1;
+        break;
+      }
 
-    if(r == -1) {
       hts_mutex_unlock(&cf->cf_mutex);
-      return -1;
-    }
-
-    if(r > 0) {
-      size -= r;
-      buf += r;
-      off += r;
-      cf->cf_pos += r;
+      hts_mutex_lock(&cf->cf_src_mutex);
+      int r = fac_fetch(cf, cf->cf_src, &cf->cf_buf, chunk);
+      hts_mutex_unlock(&cf->cf_src_mutex);
+      hts_mutex_lock(&cf->cf_mutex);
+
+      if(r) {
+        total = total ?: -1;
+        break;
+      }
       continue;
     }
 
-    cf->cf_pending = 1;
-    hts_cond_signal(&cf->cf_cond_req);
-    while(cf->cf_pending == 1)
-      hts_cond_wait(&cf->cf_cond_resp, &cf->cf_mutex);
-  
-    if(cf->cf_pending == 2) {
-      hts_mutex_unlock(&cf->cf_mutex);
-      return -1;
+    const int offset = cf->cf_pos & CHUNK_MASK;
+    const int count = MIN(size, CHUNK_SIZE - offset);
+
+    if(pread(cf->cf_fd, buf, count, offset) != count) {
+      fac_close_chunk(cf);
+      total = total ?: -1;
+      break;
     }
+
+    retries = 0;
+    buf += count;
+    size -= count;
+    total += count;
+    cf->cf_pos += count;
   }
 
-  hts_cond_signal(&cf->cf_cond_req);
+  if(total > 0)
+    fac_prefetch_check(cf);
+
   hts_mutex_unlock(&cf->cf_mutex);
   return total;
 }
@@ -458,49 +936,50 @@ static fa_protocol_t fa_protocol_cache = {
  */
 fa_handle_t *
 fa_cache_open(const char *url, char *errbuf, size_t errsize, int flags,
-	      struct prop *stats)
+	      struct fa_open_extra *foe)
 {
-  fa_handle_t *fh = fa_open_ex(url, errbuf, errsize, flags | FA_HUGE_BUFFER,
-			       stats);
+  char validator[256];
+  char size[32];
+
+  const int src_flags =
+    flags & ~(FA_BUFFERED_SMALL | FA_BUFFERED_BIG | FA_BUFFERED_NO_PREFETCH);
+
+  fa_handle_t *fh = fa_open_ex(url, errbuf, errsize, src_flags, foe);
   if(fh == NULL)
     return NULL;
 
   if(!(fh->fh_proto->fap_flags & FAP_ALLOW_CACHE))
     return fh;
 
-  TRACE(TRACE_INFO, "RA", "Enabling read-ahead cache for %s", url);
+  int64_t fsize = fa_fsize(fh);
 
-  cached_file_t *cf = calloc(1, sizeof(cached_file_t));
-  if(get_anon_file(cf->cf_fd)) {
-    TRACE(TRACE_ERROR, "RA", "Unable to create page file for %s", url);
-    free(cf);
-    return fh;
+  if(fsize <= 0 || fh->fh_proto->fap_get_validator == NULL ||
+     fh->fh_proto->fap_get_validator(fh, validator, sizeof(validator))) {
+    // Can't tell if stored content is still valid, just buffer it
+    return fa_buffered_wrap(fh, url, flags);
   }
 
-  hts_mutex_init(&cf->cf_mutex);
-  hts_cond_init(&cf->cf_cond_req, &cf->cf_mutex);
-  hts_cond_init(&cf->cf_cond_resp, &cf->cf_mutex);
-
-  cf_setup_segment_vector(cf);
+  TRACE(TRACE_DEBUG, "FACache", "Caching %s (%s)", url, validator);
 
-  // File we cache 
+  cached_file_t *cf = calloc(1, sizeof(cached_file_t));
 
-  if(stats != NULL) {
-    cf->cf_stats_cachesize =
-      prop_ref_inc(prop_create(stats, "cacheSizeCurrent"));
-    prop_set_int(prop_create(stats, "cacheSizeValid"), 1);
-    prop_set_int(prop_create(stats, "cacheSizeMax"),
-		 cf->cf_num_pages * PAGE_SIZE);
-  }
+  snprintf(size, sizeof(size), "%"PRId64, fsize);
+  sha1_decl(shactx);
+  sha1_init(shactx);
+  sha1_update(shactx, (const uint8_t *)url, strlen(url) + 1);
+  sha1_update(shactx, (const uint8_t *)validator, strlen(validator) + 1);
+  sha1_update(shactx, (const uint8_t *)size, strlen(size));
+  sha1_final(shactx, cf->cf_digest);
 
+  hts_mutex_init(&cf->cf_mutex);
+  hts_mutex_init(&cf->cf_src_mutex);
+  atomic_set(&cf->cf_refcount, 1);
   cf->cf_src = fh;
-  cf->cf_size = fa_fsize(fh);
-  // Boot thread
-
-  cf->cf_ref_count = 2;
-  cf->cf_thread_running = 1;
-  hts_thread_create_detached("facache", fac_thread, cf, THREAD_PRIO_NORMAL);
-
+  cf->cf_url = strdup(url);
+  cf->cf_flags = src_flags;
+  cf->cf_size = fsize;
+  cf->cf_fd = -1;
+  cf->cf_fd_chunk = -1;
   cf->h.fh_proto = &fa_protocol_cache;
   return &cf->h;
 }
@@ -512,14 +991,43 @@ fa_cache_open(const char *url, char *errbuf, size_t errsize, int flags,
 void
 fa_cache_init(void)
 {
-  char path[200];
-
-  snprintf(path, sizeof(path), "%s/facache", showtime_cache_path);
-  mkdir(path, 0777);
-  snprintf(path, sizeof(path), "%s/facache/tmp", showtime_cache_path);
+  char path[PATH_MAX];
+  char errbuf[512];
+  int i;
 
-  cachefile = strdup(path);
-  
   hts_mutex_init(&cache_mutex);
-  TAILQ_INIT(&cached_files);
+  hts_cond_init(&cache_cond, &cache_mutex);
+  LIST_INIT(&chunks_inflight);
+  TAILQ_INIT(&chunk_lru);
+  for(i = 0; i < FAC_HASH_SIZE; i++)
+    LIST_INIT(&chunk_hash[i]);
+  chunk_pool = pool_create("facachechunks", sizeof(fac_chunk_t), 0);
+
+  snprintf(path, sizeof(path), "%s/facache", gconf.cache_path);
+  if(fa_makedirs(path, errbuf, sizeof(errbuf)))
+    TRACE(TRACE_ERROR, "FACache", "Unable to create cache dir %s -- %s",
+	  path, errbuf);
+
+  load_index();
+  prune_stale();
+
+  hts_mutex_lock(&cache_mutex);
+  cache_maxsize = compute_maxsize();
+  chunk_evict();
+  hts_mutex_unlock(&cache_mutex);
+  save_index();
+
+  TRACE(TRACE_INFO, "FACache",
+	"Initialized: %d chunks consuming %.2f MB "
+        "(out of maximum %.2f MB) on disk in %s",
+	cache_items, cache_size / 1000000.0, cache_maxsize / 1000000.0, path);
+
+  prop_t *p = prop_create(prop_create(prop_get_global(), "system"),
+                          "facache");
+  stats_items     = prop_create(p, "items");
+  stats_size      = prop_create(p, "size");
+  stats_hits      = prop_create(p, "hits");
+  stats_misses    = prop_create(p, "misses");
+  stats_evictions = prop_create(p, "evictions");
+  update_stats();
 }
@@ -36,6 +36,7 @@
 #include "networking/net.h"
 #include "fa_proto.h"
 #include "task.h"
+#include "settings.h"
 #include "htsmsg/htsmsg_xml.h"
 #include "htsmsg/htsmsg_store.h"
 #include "misc/str.h"
@@ -99,9 +100,30 @@ static int http_tokenize(char *buf, char **vec, int vecsize, int delimiter);
 
 
 /**
- * Connection parking
+ * Connection pooling
+ *
+ * Connections are pooled per origin (hostname, port and TLS or not).
+ * The number of connections in use towards an origin is limited by a
+ * setting. Requests over the limit wait for a connection to become
+ * available, or, if it's an idempotent request done via http_req(),
+ * is pipelined on a connection that is already busy.
+ *
+ * The limit is soft, after HTTP_ORIGIN_WAIT ms a request will connect
+ * anyway. Otherwise a few long running streams could block everything
+ * else towards the same server. The same deadline applies to a
+ * pipelined request waiting for the responses ahead of it, once it
+ * passes the request is retried on a connection of its own.
+ *
+ * Parked connections are also kept on a global list, oldest first, to
+ * limit the total number of idle connections.
  */
 TAILQ_HEAD(http_connection_queue , http_connection);
+LIST_HEAD(http_origin_list, http_origin);
+
+#define HTTP_MAX_PARKED_CONNECTIONS 8
+#define HTTP_MAX_ORIGINS            32
+#define HTTP_ORIGIN_WAIT            3000
+#define HTTP_PIPELINE_DEPTH         4
 
 static struct http_connection_queue http_connections;
 static int http_parked_connections;
@@ -109,16 +131,66 @@ static hts_mutex_t http_connections_mutex;
 static atomic_t http_connection_tally;
 static atomic_t http_file_tally;
 
+static struct http_origin_list http_origins;
+static int http_num_origins;
+static prop_t *http_origins_prop;
+
+static int http_max_connections = 6;
+static int http_pipelining = 1;
+
+typedef struct http_origin {
+  LIST_ENTRY(http_origin) ho_link;
+  char *ho_hostname;
+  int ho_port;
+  char ho_ssl;
+
+  struct http_connection_queue ho_idle;
+  struct http_connection_queue ho_busy;
+  int ho_num_idle;
+  int ho_active;   // Connections in use, including those connecting
+  int ho_waiters;
+
+  hts_cond_t ho_cond;
+
+  // Statistics
+
+  int ho_requests;
+  int ho_reused;
+  int ho_pipelined;
+  int ho_queued;             // Number of requests that had to wait
+  int ho_connects;
+  int64_t ho_connect_time;   // µs, sum over all ho_connects
+
+  prop_t *ho_prop;
+
+} http_origin_t;
+
+
 typedef struct http_connection {
   char hc_hostname[HOSTNAME_MAX];
   int hc_port;
   int hc_id;
   tcpcon_t *hc_tc;
+  http_origin_t *hc_origin;
 
-  TAILQ_ENTRY(http_connection) hc_link;
+  TAILQ_ENTRY(http_connection) hc_link;         // Global list of parked
+  TAILQ_ENTRY(http_connection) hc_origin_link;  // ho_idle or ho_busy
 
   char hc_ssl;
   char hc_reused;
+  char hc_pipelinable;  // More requests may be written while busy
+  char hc_broken;       // Close when last user is done with it
+
+  /**
+   * Requests written on the connection are numbered in order. Since
+   * responses arrive in the same order hc_served (number of responses
+   * read to completion) is also the number of the request whose
+   * response is next on the wire.
+   */
+  int hc_users;
+  int hc_tickets;
+  int hc_served;
+  hts_mutex_t hc_write_mutex;
 
   time_t hc_reuse_before;
 
@@ -163,6 +235,7 @@ typedef struct http_file {
   } hf_connection_mode;
 
   time_t hf_mtime;
+  char *hf_etag;
 
   char hf_chunked_transfer;
   char hf_isdir;
@@ -207,6 +280,10 @@ typedef struct http_file {
 
   cancellable_t *hf_c;
 
+  int hf_ticket;       // Our request number on hf_connection, -1 if not sent
+  char hf_pipelining;  // Request may be pipelined on a busy connection
+  int64_t hf_origin_deadline; // Stop waiting for the origin limit at this time
+
   uint64_t hf_bytes_downloaded;
 
   average_t hf_download_rate;
@@ -260,44 +337,207 @@ http_connection_destroy(http_connection_t *hc, int dbg, const char *reason)
   HTTP_TRACE(dbg, "Disconnected from %s:%d (cid=%d) %s",
 	     hc->hc_hostname, hc->hc_port, hc->hc_id, reason);
   tcp_close(hc->hc_tc);
+  hts_mutex_destroy(&hc->hc_write_mutex);
   free(hc);
 }
 
 
+/**
+ * Must be called with http_connections_mutex locked
+ */
+static void
+http_origin_update_stats(http_origin_t *ho)
+{
+  prop_t *p = ho->ho_prop;
+
+  prop_set(p, "active",    PROP_SET_INT, ho->ho_active);
+  prop_set(p, "idle",      PROP_SET_INT, ho->ho_num_idle);
+  prop_set(p, "waiting",   PROP_SET_INT, ho->ho_waiters);
+  prop_set(p, "requests",  PROP_SET_INT, ho->ho_requests);
+  prop_set(p, "queued",    PROP_SET_INT, ho->ho_queued);
+  prop_set(p, "pipelined", PROP_SET_INT, ho->ho_pipelined);
+  prop_set(p, "connects",  PROP_SET_INT, ho->ho_connects);
+
+  if(ho->ho_requests)
+    prop_set(p, "reuseRate", PROP_SET_FLOAT,
+             100.0f * (ho->ho_reused + ho->ho_pipelined) / ho->ho_requests);
+
+  if(ho->ho_connects)  // Average in ms
+    prop_set(p, "connectTime", PROP_SET_FLOAT,
+             ho->ho_connect_time / 1000.0f / ho->ho_connects);
+}
+
 
 /**
- *
+ * Remove origins that are not used by anyone, their statistics go
+ * with them. Must be called with http_connections_mutex locked
+ */
+static void
+http_origin_prune(void)
+{
+  http_origin_t *ho, *next;
+
+  for(ho = LIST_FIRST(&http_origins); ho != NULL; ho = next) {
+    next = LIST_NEXT(ho, ho_link);
+    if(ho->ho_active || ho->ho_num_idle || ho->ho_waiters)
+      continue;
+    LIST_REMOVE(ho, ho_link);
+    http_num_origins--;
+    prop_destroy(ho->ho_prop);
+    hts_cond_destroy(&ho->ho_cond);
+    free(ho->ho_hostname);
+    free(ho);
+  }
+}
+
+
+/**
+ * Must be called with http_connections_mutex locked
+ */
+static http_origin_t *
+http_origin_get(const char *hostname, int port, int ssl)
+{
+  http_origin_t *ho;
+
+  LIST_FOREACH(ho, &http_origins, ho_link)
+    if(!strcmp(ho->ho_hostname, hostname) && ho->ho_port == port &&
+       ho->ho_ssl == ssl)
+      return ho;
+
+  if(http_num_origins >= HTTP_MAX_ORIGINS)
+    http_origin_prune();
+
+  if(http_origins_prop == NULL)
+    http_origins_prop =
+      prop_create(prop_create(prop_create(prop_get_global(), "system"),
+                              "io"), "http");
+
+  ho = calloc(1, sizeof(http_origin_t));
+  ho->ho_hostname = strdup(hostname);
+  ho->ho_port = port;
+  ho->ho_ssl = ssl;
+  TAILQ_INIT(&ho->ho_idle);
+  TAILQ_INIT(&ho->ho_busy);
+  hts_cond_init(&ho->ho_cond, &http_connections_mutex);
+
+  ho->ho_prop = prop_create_root(NULL);
+  prop_set_stringf(prop_create(ho->ho_prop, "origin"), "%s://%s:%d",
+                   ssl ? "https" : "http", hostname, port);
+  if(prop_set_parent(ho->ho_prop, http_origins_prop))
+    abort();
+
+  LIST_INSERT_HEAD(&http_origins, ho, ho_link);
+  http_num_origins++;
+  return ho;
+}
+
+
+/**
+ * Remove a parked connection from the idle lists.
+ * Must be called with http_connections_mutex locked
+ */
+static void
+http_connection_unpark(http_connection_t *hc)
+{
+  http_origin_t *ho = hc->hc_origin;
+
+  TAILQ_REMOVE(&http_connections, hc, hc_link);
+  http_parked_connections--;
+  TAILQ_REMOVE(&ho->ho_idle, hc, hc_origin_link);
+  ho->ho_num_idle--;
+}
+
+
+/**
+ * Take a connection into use. Must be called with
+ * http_connections_mutex locked
+ */
+static void
+http_connection_checkout(http_connection_t *hc)
+{
+  http_origin_t *ho = hc->hc_origin;
+
+  hc->hc_users = 1;
+  hc->hc_tickets = 1;
+  hc->hc_served = 0;
+  hc->hc_pipelinable = 0;
+  hc->hc_broken = 0;
+  TAILQ_INSERT_TAIL(&ho->ho_busy, hc, hc_origin_link);
+}
+
+
+/**
+ * Find a busy connection we can pipeline another request on.
+ * Must be called with http_connections_mutex locked
+ */
+static http_connection_t *
+http_origin_get_pipelinable(http_origin_t *ho)
+{
+  http_connection_t *hc, *best = NULL;
+
+  TAILQ_FOREACH(hc, &ho->ho_busy, hc_origin_link) {
+    if(!hc->hc_pipelinable || hc->hc_broken ||
+       hc->hc_users >= HTTP_PIPELINE_DEPTH)
+      continue;
+    if(best == NULL || hc->hc_users < best->hc_users)
+      best = hc;
+  }
+  return best;
+}
+
+
+/**
+ * Get a connection to the given host. If pipelining is allowed the
+ * returned connection might be busy with other requests, in that case
+ * *ticketp is set to -1 and the request must be written using
+ * http_pipeline_write()
  */
 static http_connection_t *
 http_connection_get(const char *hostname, int port, int ssl,
 		    char *errbuf, int errlen, int dbg, int timeout,
-                    cancellable_t *c, int allow_reuse)
+                    cancellable_t *c, int allow_reuse, int allow_pipelining,
+                    int64_t deadline, int *ticketp)
 {
   http_connection_t *hc, *next;
   tcpcon_t *tc;
+  char xerrbuf[256];
+  int waited = 0;
 
-  if(allow_reuse) {
+  if(errbuf == NULL || errlen == 0) {
+    errbuf = xerrbuf;
+    errlen = sizeof(xerrbuf);
+  }
 
-    time_t now;
+  *ticketp = 0;
 
-    time(&now);
+  hts_mutex_lock(&http_connections_mutex);
 
-    hts_mutex_lock(&http_connections_mutex);
+  http_origin_t *ho = http_origin_get(hostname, port, ssl);
+  ho->ho_requests++;
 
-    for(hc = TAILQ_FIRST(&http_connections); hc != NULL; hc = next) {
-      next = TAILQ_NEXT(hc, hc_link);
+  while(1) {
+
+    if(allow_reuse) {
+      time_t now;
+
+      time(&now);
+
+      for(hc = TAILQ_FIRST(&ho->ho_idle); hc != NULL; hc = next) {
+        next = TAILQ_NEXT(hc, hc_origin_link);
+
+        http_connection_unpark(hc);
+
+        if(now < hc->hc_reuse_before)
+          break;
 
-      if(now >= hc->hc_reuse_before) {
-        TAILQ_REMOVE(&http_connections, hc, hc_link);
-        http_parked_connections--;
         http_connection_destroy(hc, dbg, "Keep alive expired");
-        continue;
       }
 
-      if(!strcmp(hc->hc_hostname, hostname) && hc->hc_port == port &&
-         hc->hc_ssl == ssl) {
-        TAILQ_REMOVE(&http_connections, hc, hc_link);
-        http_parked_connections--;
+      if(hc != NULL) {
+        ho->ho_reused++;
+        ho->ho_active++;
+        http_connection_checkout(hc);
+        http_origin_update_stats(ho);
         hts_mutex_unlock(&http_connections_mutex);
         HTTP_TRACE(dbg, "Reusing connection to %s:%d (cid=%d)",
                    hc->hc_hostname, hc->hc_port, hc->hc_id);
@@ -306,17 +546,55 @@ http_connection_get(const char *hostname, int port, int ssl,
         return hc;
       }
     }
-    hts_mutex_unlock(&http_connections_mutex);
-  }
 
-  const int id = atomic_add_and_fetch(&http_connection_tally, 1);
+    if(ho->ho_active < http_max_connections)
+      break;
 
-  if(errbuf == NULL || errlen == 0) {
-    char xerrbuf[256];
-    errbuf = xerrbuf;
-    errlen = sizeof(xerrbuf);
+    const int64_t now = arch_get_ts();
+
+    if(now >= deadline) {
+      HTTP_TRACE(dbg, "Too many connections to %s:%d, connecting anyway",
+                 hostname, port);
+      break;
+    }
+
+    if(allow_pipelining && http_pipelining &&
+       (hc = http_origin_get_pipelinable(ho)) != NULL) {
+      hc->hc_users++;
+      ho->ho_pipelined++;
+      http_origin_update_stats(ho);
+      hts_mutex_unlock(&http_connections_mutex);
+      HTTP_TRACE(dbg, "Pipelining on connection to %s:%d (cid=%d)",
+                 hc->hc_hostname, hc->hc_port, hc->hc_id);
+      *ticketp = -1;
+      return hc;
+    }
+
+    if(cancellable_is_cancelled(c)) {
+      hts_mutex_unlock(&http_connections_mutex);
+      snprintf(errbuf, errlen, "Cancelled");
+      return NULL;
+    }
+
+    if(!waited) {
+      HTTP_TRACE(dbg, "Waiting for connection to %s:%d", hostname, port);
+      ho->ho_queued++;
+      waited = 1;
+    }
+
+    ho->ho_waiters++;
+    http_origin_update_stats(ho);
+    // Wake up now and then to check for cancellation
+    hts_cond_wait_timeout(&ho->ho_cond, &http_connections_mutex,
+                          MIN(200, (deadline - now) / 1000 + 1));
+    ho->ho_waiters--;
   }
 
+  ho->ho_active++;
+  http_origin_update_stats(ho);
+  hts_mutex_unlock(&http_connections_mutex);
+
+  const int id = atomic_add_and_fetch(&http_connection_tally, 1);
 
   int tcp_connect_flags = 0;
   if(dbg)
@@ -324,68 +602,159 @@ http_connection_get(const char *hostname, int port, int ssl,
   if(ssl)
     tcp_connect_flags |= TCP_SSL;
 
-  if((tc = tcp_connect(hostname, port, errbuf, errlen,
-                       timeout, tcp_connect_flags, c)) == NULL) {
+  const int64_t ts = arch_get_ts();
+
+  tc = tcp_connect(hostname, port, errbuf, errlen,
+                   timeout, tcp_connect_flags, c);
+
+  hts_mutex_lock(&http_connections_mutex);
+
+  if(tc == NULL) {
+    ho->ho_active--;
+    hts_cond_broadcast(&ho->ho_cond);
+    http_origin_update_stats(ho);
+    hts_mutex_unlock(&http_connections_mutex);
+
     HTTP_TRACE(dbg, "Connection to %s:%d failed -- %s%s",
                hostname, port, errbuf,
                cancellable_is_cancelled(c) ? ", Cancelled by user" : "");
     return NULL;
   }
-  HTTP_TRACE(dbg, "Connected to %s:%d (cid=%d)", hostname, port, id);
 
-  hc = malloc(sizeof(http_connection_t));
+  ho->ho_connects++;
+  ho->ho_connect_time += arch_get_ts() - ts;
+
+  hc = calloc(1, sizeof(http_connection_t));
   snprintf(hc->hc_hostname, sizeof(hc->hc_hostname), "%s", hostname);
   hc->hc_port = port;
   hc->hc_ssl = ssl;
   hc->hc_tc = tc;
-  hc->hc_reused = 0;
   hc->hc_id = id;
+  hc->hc_origin = ho;
+  hts_mutex_init(&hc->hc_write_mutex);
+  http_connection_checkout(hc);
+  http_origin_update_stats(ho);
+  hts_mutex_unlock(&http_connections_mutex);
+
+  HTTP_TRACE(dbg, "Connected to %s:%d (cid=%d)", hostname, port, id);
   return hc;
 }
 
 
 /**
- *
+ * Must be called with http_connections_mutex locked
  */
 static void
 http_connection_park(http_connection_t *hc, int dbg, int max_age)
 {
   time_t now;
   http_connection_t *next;
+  http_origin_t *ho = hc->hc_origin;
 
   time(&now);
 
-  tcp_set_cancellable(hc->hc_tc, NULL);
-
   HTTP_TRACE(dbg, "Parking connection to %s:%d (cid=%d)",
 	     hc->hc_hostname, hc->hc_port, hc->hc_id);
 
   hc->hc_reuse_before = now + max_age;
 
-  hts_mutex_lock(&http_connections_mutex);
   TAILQ_INSERT_TAIL(&http_connections, hc, hc_link);
   http_parked_connections++;
+  TAILQ_INSERT_TAIL(&ho->ho_idle, hc, hc_origin_link);
+  ho->ho_num_idle++;
 
-  if(http_parked_connections > 5) {
+  if(http_parked_connections > HTTP_MAX_PARKED_CONNECTIONS) {
     for(hc = TAILQ_FIRST(&http_connections); hc != NULL; hc = next) {
       next = TAILQ_NEXT(hc, hc_link);
 
       if(now >= hc->hc_reuse_before) {
-	TAILQ_REMOVE(&http_connections, hc, hc_link);
-	http_parked_connections--;
+        ho = hc->hc_origin;
+        http_connection_unpark(hc);
 	http_connection_destroy(hc, dbg, "Keep alive expired");
+        http_origin_update_stats(ho);
       }
     }
   }
 
-  while(http_parked_connections > 5) {
+  while(http_parked_connections > HTTP_MAX_PARKED_CONNECTIONS) {
     hc = TAILQ_FIRST(&http_connections);
     assert(hc != NULL);
-    TAILQ_REMOVE(&http_connections, hc, hc_link);
+    ho = hc->hc_origin;
+    http_connection_unpark(hc);
     http_connection_destroy(hc, dbg, "Too many idle connections");
-    http_parked_connections--;
+    http_origin_update_stats(ho);
   }
+}
+
+
+/**
+ * Give back a connection. 'ticket' is the number of the caller's
+ * request on the connection (-1 if it never got to send it) and
+ * 'reusable' tells if the caller read its response to completion.
+ *
+ * The last user parks the connection, unless a response was left
+ * unread in which case it's closed
+ */
+static void
+http_connection_release(http_connection_t *hc, int ticket, int reusable,
+                        int dbg, int max_age, const char *reason)
+{
+  http_origin_t *ho = hc->hc_origin;
+
+  hts_mutex_lock(&http_connections_mutex);
 
+  if(ticket == hc->hc_served) {
+    // We were the one reading from the connection
+    tcp_set_cancellable(hc->hc_tc, NULL);
+    if(reusable)
+      hc->hc_served++;
+    else
+      hc->hc_broken = 1;
+  } else if(ticket > hc->hc_served) {
+    // Request was sent but no one will ever read the response
+    hc->hc_broken = 1;
+  }
+
+  hc->hc_users--;
+  hts_cond_broadcast(&ho->ho_cond);
+
+  if(hc->hc_users > 0) {
+    HTTP_TRACE(dbg, "Leaving connection to %s:%d (cid=%d) to %d other%s",
+               hc->hc_hostname, hc->hc_port, hc->hc_id, hc->hc_users,
+               hc->hc_users > 1 ? "s" : "");
+  } else {
+
+    TAILQ_REMOVE(&ho->ho_busy, hc, hc_origin_link);
+    ho->ho_active--;
+
+    if(hc->hc_broken || hc->hc_served != hc->hc_tickets || !reusable)
+      http_connection_destroy(hc, dbg, reason);
+    else
+      http_connection_park(hc, dbg, max_age);
+  }
+
+  http_origin_update_stats(ho);
+  hts_mutex_unlock(&http_connections_mutex);
+}
+
+
+/**
+ * Called after the first request on a connection has been written.
+ * Only done for connections that have already been reused (so we
+ * know that the server does keep-alive) and not over TLS since the
+ * SSL session can't be written and read from different threads
+ */
+static void
+http_connection_allow_pipelining(http_connection_t *hc)
+{
+  if(!hc->hc_reused || hc->hc_ssl)
+    return;
+
+  hts_mutex_lock(&http_connections_mutex);
+  if(!hc->hc_broken) {
+    hc->hc_pipelinable = 1;
+    hts_cond_broadcast(&hc->hc_origin->ho_cond);
+  }
   hts_mutex_unlock(&http_connections_mutex);
 }
 
@@ -1445,6 +1814,15 @@ http_read_response(http_file_t *hf, struct http_header_list *headers)
       hf->hf_content_type = strdup(argv[1]);
     }
 
+    if((code == 200 || code == 206) && !strcasecmp(argv[0], "ETag")) {
+      free(hf->hf_etag);
+      hf->hf_etag = strdup(argv[1]);
+    }
+
+    if((code == 200 || code == 206) &&
+       !strcasecmp(argv[0], "Last-Modified"))
+      http_ctime(&hf->hf_mtime, argv[1]);
+
     if(code == 206 && !strcasecmp(argv[0], "Content-Range") &&
        hf->hf_filesize == -1) {
 
@@ -1487,12 +1865,87 @@ http_detach(http_file_t *hf, int reusable, const char *reason)
   if(hf->hf_connection == NULL)
     return;
 
-  if(reusable && !gconf.disable_http_reuse && hf->hf_read_timeout == 0) {
-    http_connection_park(hf->hf_connection, hf->hf_debug, hf->hf_max_age);
-  } else {
-    http_connection_destroy(hf->hf_connection, hf->hf_debug, reason);
-  }
+  reusable = reusable && !gconf.disable_http_reuse && hf->hf_read_timeout == 0;
+
+  http_connection_release(hf->hf_connection, hf->hf_ticket, reusable,
+                          hf->hf_debug, hf->hf_max_age, reason);
   hf->hf_connection = NULL;
+  hf->hf_ticket = 0;
+}
+
+
+/**
+ * Write a request on a connection that is shared with other requests.
+ * The order requests are written in decides the order of responses
+ * so the ticket is taken while holding the write lock
+ */
+static int
+http_pipeline_write(http_file_t *hf, htsbuf_queue_t *q)
+{
+  http_connection_t *hc = hf->hf_connection;
+  int r;
+
+  hts_mutex_lock(&hc->hc_write_mutex);
+  hts_mutex_lock(&http_connections_mutex);
+
+  if(hc->hc_broken) {
+    hts_mutex_unlock(&http_connections_mutex);
+    hts_mutex_unlock(&hc->hc_write_mutex);
+    htsbuf_queue_flush(q);
+    return -1;
+  }
+
+  hf->hf_ticket = hc->hc_tickets++;
+  hts_mutex_unlock(&http_connections_mutex);
+
+  r = tcp_write_queue(hc->hc_tc, q);
+  hts_mutex_unlock(&hc->hc_write_mutex);
+  return r;
+}
+
+
+/**
+ * Wait until all responses before ours have been read.
+ *
+ * Gives up when the origin deadline passes, the request ahead of us
+ * might be a large download. Our response is then left unread so the
+ * connection is closed once the others are done with it
+ */
+static int
+http_pipeline_wait(http_file_t *hf)
+{
+  http_connection_t *hc = hf->hf_connection;
+  int r = 0;
+
+  hts_mutex_lock(&http_connections_mutex);
+
+  while(hc->hc_served != hf->hf_ticket) {
+    if(hc->hc_broken || cancellable_is_cancelled(hf->hf_c)) {
+      r = -1;
+      break;
+    }
+
+    const int64_t now = arch_get_ts();
+    if(now >= hf->hf_origin_deadline) {
+      HTTP_TRACE(hf->hf_debug, "Pipelined request to %s:%d (cid=%d) "
+                 "timed out behind %d other%s", hc->hc_hostname, hc->hc_port,
+                 hc->hc_id, hf->hf_ticket - hc->hc_served,
+                 hf->hf_ticket - hc->hc_served > 1 ? "s" : "");
+      r = -1;
+      break;
+    }
+
+    hts_cond_wait_timeout(&hc->hc_origin->ho_cond, &http_connections_mutex,
+                          MIN(200, (hf->hf_origin_deadline - now) / 1000 + 1));
+  }
+
+  if(!r) {
+    tcp_set_cancellable(hc->hc_tc, hf->hf_c);
+    hf->hf_origin_deadline = 0;
+  }
+
+  hts_mutex_unlock(&http_connections_mutex);
+  return r;
 }
 
 
@@ -1675,9 +2128,18 @@ http_connect(http_file_t *hf, char *errbuf, int errlen, int allow_reuse)
 
   const int timeout = hf->hf_connect_timeout ?: 30000;
 
+  if(hf->hf_origin_deadline == 0)
+    hf->hf_origin_deadline = arch_get_ts() + HTTP_ORIGIN_WAIT * 1000LL;
+
   hf->hf_connection = http_connection_get(hostname, port, ssl, errbuf, errlen,
 					  hf->hf_debug, timeout, hf->hf_c,
-                                          allow_reuse);
+                                          allow_reuse, hf->hf_pipelining,
+                                          hf->hf_origin_deadline,
+                                          &hf->hf_ticket);
+
+  // A pipelined request keeps the deadline until it's its turn to read
+  if(hf->hf_ticket != -1)
+    hf->hf_origin_deadline = 0;
 
   if(hf->hf_read_timeout != 0 && hf->hf_connection != NULL)
     tcp_set_read_timeout(hf->hf_connection->hc_tc, hf->hf_read_timeout);
@@ -1816,6 +2278,7 @@ http_destroy(http_file_t *hf)
   free(hf->hf_auth_realm);
   free(hf->hf_location);
   free(hf->hf_content_type);
+  free(hf->hf_etag);
   prop_ref_dec(hf->hf_stats_speed);
   free(hf);
 }
@@ -2195,6 +2658,24 @@ http_fsize(fa_handle_t *handle)
 }
 
 
+/**
+ *
+ */
+static int
+http_get_validator(fa_handle_t *handle, char *buf, size_t bufsize)
+{
+  http_file_t *hf = (http_file_t *)handle;
+
+  if(hf->hf_etag != NULL)
+    snprintf(buf, bufsize, "etag:%s", hf->hf_etag);
+  else if(hf->hf_mtime != 0)
+    snprintf(buf, bufsize, "mtime:%ld", (long)hf->hf_mtime);
+  else
+    return -1;
+  return 0;
+}
+
+
 /**
  * Standard unix stat
  */
@@ -2391,6 +2872,7 @@ http_init(void)
   sha1_final(ctx, nonce);
 
   TAILQ_INIT(&http_connections);
+  LIST_INIT(&http_origins);
   hts_mutex_init(&http_connections_mutex);
   hts_mutex_init(&http_redirects_mutex);
   hts_mutex_init(&http_cookies_mutex);
@@ -2398,6 +2880,36 @@ http_init(void)
   load_cookies();
 }
 
+
+/**
+ *
+ */
+static void
+http_settings_init(void)
+{
+  htsmsg_t *s = htsmsg_store_load("httpclient") ?: htsmsg_create_map();
+
+  settings_create_separator(gconf.settings_network, _p("HTTP client"));
+
+  setting_create(SETTING_INT, gconf.settings_network, SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("Max connections per server")),
+                 SETTING_VALUE(http_max_connections),
+                 SETTING_RANGE(1, 16),
+                 SETTING_WRITE_INT(&http_max_connections),
+                 SETTING_HTSMSG("maxconnections", s, "httpclient"),
+                 NULL);
+
+  setting_create(SETTING_BOOL, gconf.settings_network, SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("Pipeline requests")),
+                 SETTING_VALUE(http_pipelining),
+                 SETTING_WRITE_BOOL(&http_pipelining),
+                 SETTING_HTSMSG("pipelining", s, "httpclient"),
+                 NULL);
+}
+
+INITME(INIT_GROUP_API, http_settings_init, NULL);
+
+
 /**
  *
  */
@@ -2410,6 +2922,7 @@ static fa_protocol_t fa_protocol_http = {
   .fap_read  = http_read,
   .fap_seek  = http_seek,
   .fap_fsize = http_fsize,
+  .fap_get_validator = http_get_validator,
   .fap_stat  = http_stat,
   .fap_load = http_load,
   .fap_get_last_component = http_get_last_component,
@@ -2431,6 +2944,7 @@ static fa_protocol_t fa_protocol_https = {
   .fap_read  = http_read,
   .fap_seek  = http_seek,
   .fap_fsize = http_fsize,
+  .fap_get_validator = http_get_validator,
   .fap_stat  = http_stat,
   .fap_load = http_load,
   .fap_get_last_component = http_get_last_component,
@@ -2752,6 +3266,7 @@ static fa_protocol_t fa_protocol_webdav = {
   .fap_read  = http_read,
   .fap_seek  = http_seek,
   .fap_fsize = http_fsize,
+  .fap_get_validator = http_get_validator,
   .fap_stat  = dav_stat,
   .fap_load = http_load,
   .fap_get_last_component = http_get_last_component,
@@ -2772,6 +3287,7 @@ static fa_protocol_t fa_protocol_webdavs = {
   .fap_read  = http_read,
   .fap_seek  = http_seek,
   .fap_fsize = http_fsize,
+  .fap_get_validator = http_get_validator,
   .fap_stat  = dav_stat,
   .fap_load = http_load,
   .fap_get_last_component = http_get_last_component,
@@ -3048,9 +3564,19 @@ http_req_do(http_req_aux_t *hra)
   struct http_query_arg *hqa;
   struct http_header_list cookies;
   http_file_t *hf = hra->hf;
+  int no_pipelining = 0;
+  const char *m;
+
+  hf->hf_origin_deadline = 0;
 
  retry:
 
+  m = hra->method ?: hra->post ? "POST": (hra->want_result ? "GET" : "HEAD");
+
+  hf->hf_pipelining = !no_pipelining && !hra->post &&
+    hf->hf_read_timeout == 0 && hf->hf_version == 1 &&
+    (!strcmp(m, "GET") || !strcmp(m, "HEAD"));
+
   http_connect(hf, hra->errbuf, hra->errlen, !hra->post);
   if(hf->hf_connection == NULL)
     goto cleanup;
@@ -3059,8 +3585,6 @@ http_req_do(http_req_aux_t *hra)
 
   htsbuf_queue_init(&q, 0);
 
-  const char *m = hra->method ?: hra->post ? "POST": (hra->want_result ? "GET" : "HEAD");
-
   htsbuf_append(&q, m, strlen(m));
   htsbuf_append(&q, " ", 1);
   htsbuf_append(&q, hf->hf_path, strlen(hf->hf_path));
@@ -3123,17 +3647,32 @@ http_req_do(http_req_aux_t *hra)
   if(hf->hf_debug)
     trace_request(&q, hf);
 
-  tcp_write_queue(hf->hf_connection->hc_tc, &q);
+  if(hf->hf_ticket == -1) {
+    // Connection is busy with other requests, queue up after them
+    if(http_pipeline_write(hf, &q) || http_pipeline_wait(hf)) {
+      http_detach(hf, 0, "Pipelining failed");
+      no_pipelining = 1;
+      goto retry;
+    }
+  } else {
+
+    tcp_write_queue(hf->hf_connection->hc_tc, &q);
 
-  if(hra->post) {
-    if(hf->hf_debug)
-      htsbuf_hexdump(&hra->postdata, "HTTP-POSTDATA");
+    if(hra->post) {
+      if(hf->hf_debug)
+        htsbuf_hexdump(&hra->postdata, "HTTP-POSTDATA");
+
+      tcp_write_queue_dontfree(hf->hf_connection->hc_tc, &hra->postdata);
+    }
 
-    tcp_write_queue_dontfree(hf->hf_connection->hc_tc, &hra->postdata);
+    if(hf->hf_pipelining)
+      http_connection_allow_pipelining(hf->hf_connection);
   }
 
   code = http_read_response(hf, hra->headers_out);
   if(code == -1 && hf->hf_connection->hc_reused) {
+    if(hf->hf_ticket > 0)
+      no_pipelining = 1;
     http_detach(hf, 0, "Read error on reused connection");
     goto retry;
   }
@@ -3509,7 +4048,7 @@ http_reqv(const char *url, va_list ap,
   hra->hf = hf;
 
   if(hra->async_callback != NULL) {
-    task_run(http_req_async, hra);
+    task_run_ex(http_req_async, hra, TASK_PRIO_INTERACTIVE, NULL, NULL);
     return 0;
   }
 
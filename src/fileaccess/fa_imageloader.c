@@ -31,7 +31,6 @@
 #include "fa_imageloader.h"
 #if ENABLE_LIBAV
 #include "fa_libav.h"
-#include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
 #include <libavformat/avformat.h>
 #include <libavutil/mathematics.h>
@@ -39,6 +38,7 @@
 #include "misc/callout.h"
 #include "image/pixmap.h"
 #include "image/jpeg.h"
+#include "image/image_scale.h"
 #include "backend/backend.h"
 #include "blobcache.h"
 
@@ -370,15 +370,11 @@ write_thumb(const AVCodecContext *src, const AVFrame *sframe,
   AVFrame *oframe = av_frame_alloc();
 
   avpicture_alloc((AVPicture *)oframe, ctx->pix_fmt, width, height);
-      
-  struct SwsContext *sws;
-  sws = sws_getContext(src->width, src->height, src->pix_fmt,
-                       width, height, ctx->pix_fmt, SWS_BILINEAR,
-                       NULL, NULL, NULL);
 
-  sws_scale(sws, (const uint8_t **)sframe->data, sframe->linesize,
-            0, src->height, &oframe->data[0], &oframe->linesize[0]);
-  sws_freeContext(sws);
+  image_scale((const uint8_t **)sframe->data, sframe->linesize,
+              src->pix_fmt, src->width, src->height,
+              oframe->data, oframe->linesize,
+              ctx->pix_fmt, width, height, 0);
 
   oframe->pts = AV_NOPTS_VALUE;
   AVPacket out;
@@ -546,28 +542,21 @@ fa_image_from_video2(const char *url, const image_meta_t *im,
       return NULL;
     }
 
-    struct SwsContext *sws;
-    sws = sws_getContext(ifv_ctx->width, ifv_ctx->height, ifv_ctx->pix_fmt,
-			 w, h, AV_PIX_FMT_BGR32, SWS_BILINEAR,
-                         NULL, NULL, NULL);
-    if(sws == NULL) {
-      ifv_close();
-      snprintf(errbuf, errlen, "Scaling failed");
-      pixmap_release(pm);
-      av_free(frame);
-      return NULL;
-    }
-    
     uint8_t *ptr[4] = {0,0,0,0};
     int strides[4] = {0,0,0,0};
 
     ptr[0] = pm->pm_data;
     strides[0] = pm->pm_linesize;
 
-    sws_scale(sws, (const uint8_t **)frame->data, frame->linesize,
-	      0, ifv_ctx->height, ptr, strides);
-
-    sws_freeContext(sws);
+    if(image_scale((const uint8_t **)frame->data, frame->linesize,
+                   ifv_ctx->pix_fmt, ifv_ctx->width, ifv_ctx->height,
+                   ptr, strides, AV_PIX_FMT_BGR32, w, h, 0)) {
+      ifv_close();
+      snprintf(errbuf, errlen, "Scaling failed");
+      pixmap_release(pm);
+      av_free(frame);
+      return NULL;
+    }
 
     write_thumb(ifv_ctx, frame, w, h, cacheid, mtime);
 
@@ -45,15 +45,15 @@ index_path(const char *url)
 
   void *db = metadb_get();
   sqlite3_stmt *stmt;
-  int rc = db_prepare(db, &stmt,
-                      "UPDATE item "
-                      "SET indexstatus = ?2 "
-                      "WHERE URL = ?1");
+  int rc = db_prepare_cached(db, &stmt,
+                             "UPDATE item "
+                             "SET indexstatus = ?2 "
+                             "WHERE URL = ?1");
   if(!rc) {
     sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
     sqlite3_bind_int(stmt, 2, err ? INDEX_STATUS_ERROR : INDEX_STATUS_STATED);
     db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
   }
   metadb_close(db);
   TRACE(TRACE_DEBUG, "Indexer", "Indexing %s done err=%d", url, err);
@@ -94,7 +94,7 @@ static int
 get_items(void *db, struct item_queue *q, const char *pfx, const char *query)
 {
   sqlite3_stmt *stmt;
-  int rc = db_prepare(db, &stmt, query);
+  int rc = db_prepare_cached(db, &stmt, query);
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -109,7 +109,7 @@ get_items(void *db, struct item_queue *q, const char *pfx, const char *query)
     i->contenttype = sqlite3_column_int(stmt, 1);
     i->mtime =       sqlite3_column_int(stmt, 2);
   }
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
   return 0;
 }
 
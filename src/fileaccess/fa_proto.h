@@ -85,6 +85,13 @@ typedef struct fa_protocol {
    */
   int64_t (*fap_fsize)(fa_handle_t *fh);
 
+  /**
+   * Write a string identifying the current version of the content
+   * (ETag, modification time, ...) to buf. Used to key persistent caches.
+   * Return -1 if the file can't be identified
+   */
+  int (*fap_get_validator)(fa_handle_t *fh, char *buf, size_t bufsize);
+
   /**
    * Truncate file
    */
@@ -41,6 +41,8 @@
 #include "notifications.h"
 #include "metadata/playinfo.h"
 #include "metadata/metadata_str.h"
+#include "misc/str.h"
+#include "task.h"
 
 #define SCAN_TRACE(x, ...) do {                                \
     if(gconf.enable_fa_scanner_debug)                          \
@@ -59,6 +61,8 @@ typedef enum {
 
 
 
+TAILQ_HEAD(probe_job_queue, probe_job);
+
 typedef struct scanner {
   atomic_t s_refcount;
 
@@ -78,6 +82,7 @@ typedef struct scanner {
   void *s_ref;
 
   void *s_metadb;
+  metadb_batch_t *s_batch; // Pending metadb writes, flushed by analyzer()
 
   struct prop_nf *s_pnf;
 
@@ -88,6 +93,12 @@ typedef struct scanner {
 
   prop_courier_t *s_pc;
 
+  hts_mutex_t s_probe_mutex;
+  hts_cond_t s_probe_cond;
+  struct probe_job_queue s_probe_done;
+  int s_probe_running;
+  task_prio_t s_probe_prio;
+
 } scanner_t;
 
 
@@ -264,10 +275,166 @@ type_from_filename(const char *filename)
 
 
 /**
+ * Deep probing (stat, metadb lookup and, if needed, opening the file)
+ * runs on the task pool. The scanner thread hands out entries to
+ * workers, bounded by SCANNER_MAX_INFLIGHT per scanner and by
+ * SCANNER_MAX_PER_HOST per server across all scanners, and picks up
+ * finished jobs in batches.
  *
+ * While a job is in flight the worker owns the entry's stat and
+ * metadata fields. Everything touching the prop tree or writing to
+ * metadb stays on the scanner thread.
+ */
+#define SCANNER_MAX_INFLIGHT 8
+#define SCANNER_MAX_PER_HOST 4
+
+typedef struct probe_host {
+  LIST_ENTRY(probe_host) ph_link;
+  int ph_refcount;
+  int ph_running;
+  char ph_name[0];
+} probe_host_t;
+
+static LIST_HEAD(, probe_host) probe_hosts;
+static HTS_MUTEX_DECL(probe_host_mutex);
+
+typedef struct probe_job {
+  TAILQ_ENTRY(probe_job) pj_link;
+  scanner_t *pj_scanner;
+  fa_dir_entry_t *pj_fde;
+  probe_host_t *pj_host;
+  metadata_index_status_t pj_indexstatus;
+} probe_job_t;
+
+
+/**
+ *
+ */
+static probe_host_t *
+probe_host_get(const char *url)
+{
+  char proto[16];
+  char hostname[128];
+  char name[160];
+  int port;
+  probe_host_t *ph;
+
+  url_split(proto, sizeof(proto), NULL, 0, hostname, sizeof(hostname),
+            &port, NULL, 0, url);
+  snprintf(name, sizeof(name), "%s://%s:%d", proto, hostname, port);
+
+  hts_mutex_lock(&probe_host_mutex);
+  LIST_FOREACH(ph, &probe_hosts, ph_link)
+    if(!strcmp(ph->ph_name, name))
+      break;
+
+  if(ph == NULL) {
+    ph = calloc(1, sizeof(probe_host_t) + strlen(name) + 1);
+    strcpy(ph->ph_name, name);
+    LIST_INSERT_HEAD(&probe_hosts, ph, ph_link);
+  }
+  ph->ph_refcount++;
+  hts_mutex_unlock(&probe_host_mutex);
+  return ph;
+}
+
+
+/**
+ *
+ */
+static void
+probe_host_put(probe_host_t *ph)
+{
+  hts_mutex_lock(&probe_host_mutex);
+  if(--ph->ph_refcount == 0) {
+    LIST_REMOVE(ph, ph_link);
+    free(ph);
+  }
+  hts_mutex_unlock(&probe_host_mutex);
+}
+
+
+/**
+ * Returns 1 if we got a slot
+ */
+static int
+probe_host_acquire(probe_host_t *ph)
+{
+  int r = 0;
+  hts_mutex_lock(&probe_host_mutex);
+  if(ph->ph_running < SCANNER_MAX_PER_HOST) {
+    ph->ph_running++;
+    r = 1;
+  }
+  hts_mutex_unlock(&probe_host_mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+probe_host_release(probe_host_t *ph)
+{
+  hts_mutex_lock(&probe_host_mutex);
+  ph->ph_running--;
+  hts_mutex_unlock(&probe_host_mutex);
+}
+
+
+/**
+ * Runs on the task pool, must not touch any props
+ */
+static void
+probe_task(void *aux)
+{
+  probe_job_t *pj = aux;
+  scanner_t *s = pj->pj_scanner;
+  fa_dir_entry_t *fde = pj->pj_fde;
+
+  pj->pj_indexstatus = INDEX_STATUS_NIL;
+
+  if(!fde->fde_ignore_cache && !fa_dir_entry_stat(fde) &&
+     (fde->fde_md == NULL || !fde->fde_md->md_cache_status)) {
+
+    if(fde->fde_md != NULL)
+      metadata_destroy(fde->fde_md);
+
+    void *db = metadb_get();
+    fde->fde_md = metadb_metadata_get(db, rstr_get(fde->fde_url),
+                                      fde->fde_stat.fs_mtime);
+    metadb_close(db);
+    SCAN_TRACE("%s: Metadata %sfound", rstr_get(fde->fde_url),
+               fde->fde_md ? "" : "not ");
+  }
+
+  if(fde->fde_md == NULL) {
+
+    if(fde->fde_type == CONTENT_DIR) {
+      fde->fde_md = fa_probe_dir(rstr_get(fde->fde_url));
+    } else {
+      fde->fde_md = fa_probe_metadata(rstr_get(fde->fde_url), NULL, 0,
+                                      rstr_get(fde->fde_filename), NULL);
+      pj->pj_indexstatus = INDEX_STATUS_FILE_ANALYZED;
+    }
+  }
+
+  probe_host_release(pj->pj_host);
+
+  hts_mutex_lock(&s->s_probe_mutex);
+  TAILQ_INSERT_TAIL(&s->s_probe_done, pj, pj_link);
+  s->s_probe_running--;
+  hts_cond_signal(&s->s_probe_cond);
+  hts_mutex_unlock(&s->s_probe_mutex);
+}
+
+
+/**
+ * Queue an entry for deep probing
  */
 static void
-deep_probe(fa_dir_entry_t *fde, scanner_t *s)
+deep_probe(fa_dir_entry_t *fde, scanner_t *s, struct probe_job_queue *q)
 {
   if(fde->fde_type == CONTENT_SHARE)
     return;
@@ -277,87 +444,82 @@ deep_probe(fa_dir_entry_t *fde, scanner_t *s)
   SCAN_TRACE("Deep probing %s -- content_type:%s",
              rstr_get(fde->fde_url), content2type(fde->fde_type));
 
-  if(fde->fde_type != CONTENT_UNKNOWN) {
+  if(fde->fde_type == CONTENT_UNKNOWN) {
+    if(fde->fde_prop != NULL)
+      set_type(fde->fde_prop, fde->fde_type);
+    return;
+  }
 
-    prop_t *meta = prop_create_r(fde->fde_prop, "metadata");
+  probe_job_t *pj = calloc(1, sizeof(probe_job_t));
+  pj->pj_scanner = s;
+  pj->pj_fde = fde;
+  pj->pj_host = probe_host_get(rstr_get(fde->fde_url));
+  TAILQ_INSERT_TAIL(q, pj, pj_link);
+}
 
-    if(!fde->fde_ignore_cache && !fa_dir_entry_stat(fde) &&
-       (fde->fde_md == NULL || !fde->fde_md->md_cache_status)) {
 
-      if(fde->fde_md != NULL)
-	metadata_destroy(fde->fde_md);
+/**
+ * Publish the result of a deep probe, runs on the scanner thread
+ */
+static void
+deep_probe_finish(probe_job_t *pj, scanner_t *s)
+{
+  fa_dir_entry_t *fde = pj->pj_fde;
+  prop_t *meta = prop_create_r(fde->fde_prop, "metadata");
 
-      fde->fde_md = metadb_metadata_get(getdb(s), rstr_get(fde->fde_url),
-					fde->fde_stat.fs_mtime);
-      SCAN_TRACE("%s: Metadata %sfound", rstr_get(fde->fde_url),
-                 fde->fde_md ? "" : "not ");
-    }
+  if(fde->fde_statdone && meta != NULL)
+    prop_set(meta, "timestamp", PROP_SET_INT, fde->fde_stat.fs_mtime);
 
-    if(fde->fde_statdone && meta != NULL)
-      prop_set(meta, "timestamp", PROP_SET_INT, fde->fde_stat.fs_mtime);
+  if(fde->fde_md != NULL) {
+    fde->fde_type = fde->fde_md->md_contenttype;
+    fde->fde_ignore_cache = 0;
 
-    metadata_index_status_t is = INDEX_STATUS_NIL;
+    if(meta != NULL) {
+      switch(fde->fde_type) {
 
-    if(fde->fde_md == NULL) {
+      case CONTENT_PLUGIN:
+        plugin_props_from_file(fde->fde_prop, rstr_get(fde->fde_url));
+        break;
+
+      case CONTENT_FONT:
+        fontstash_props_from_title(fde->fde_prop, rstr_get(fde->fde_url),
+                                   rstr_get(fde->fde_filename));
+        break;
 
-      if(fde->fde_type == CONTENT_DIR) {
-        fde->fde_md = fa_probe_dir(rstr_get(fde->fde_url));
-      } else {
-	fde->fde_md = fa_probe_metadata(rstr_get(fde->fde_url), NULL, 0,
-					rstr_get(fde->fde_filename), NULL);
-        is = INDEX_STATUS_FILE_ANALYZED;
+      default:
+        metadata_to_proptree(fde->fde_md, meta, 1);
+        break;
       }
     }
-    
-    if(fde->fde_md != NULL) {
-      fde->fde_type = fde->fde_md->md_contenttype;
-      fde->fde_ignore_cache = 0;
-
-      if(meta != NULL) {
-        switch(fde->fde_type) {
-
-        case CONTENT_PLUGIN:
-          plugin_props_from_file(fde->fde_prop, rstr_get(fde->fde_url));
-          break;
-	  
-        case CONTENT_FONT:
-          fontstash_props_from_title(fde->fde_prop, rstr_get(fde->fde_url),
-                                     rstr_get(fde->fde_filename));
-          break;
-          
-        default:
-          metadata_to_proptree(fde->fde_md, meta, 1);
-          break;
-        }
-      }
-      SCAN_TRACE("%s: Cache status: %d",
-                 rstr_get(fde->fde_url), fde->fde_md->md_cache_status);
-
-      switch(fde->fde_md->md_cache_status) {
-      case METADATA_CACHE_STATUS_NO:
-        SCAN_TRACE("Storing item %s in DB parent:%s mtime:%d",
-                   rstr_get(fde->fde_url), s->s_url,
-                   (int)fde->fde_stat.fs_mtime);
-	metadb_metadata_write(getdb(s), rstr_get(fde->fde_url),
-			      fde->fde_stat.fs_mtime,
-			      fde->fde_md, s->s_url, s->s_mtime,
-                              is);
-	break;
-      case METADATA_CACHE_STATUS_FULL:
-	// All set
-	break;
-      case METADATA_CACHE_STATUS_UNPARENTED:
-	// Reparent item
-	metadb_parent_item(getdb(s), rstr_get(fde->fde_url), s->s_url);
-	break;
-      }
+    SCAN_TRACE("%s: Cache status: %d",
+               rstr_get(fde->fde_url), fde->fde_md->md_cache_status);
+
+    switch(fde->fde_md->md_cache_status) {
+    case METADATA_CACHE_STATUS_NO:
+      SCAN_TRACE("Storing item %s in DB parent:%s mtime:%d",
+                 rstr_get(fde->fde_url), s->s_url,
+                 (int)fde->fde_stat.fs_mtime);
+      if(s->s_batch == NULL)
+        s->s_batch = metadb_batch_create();
+      metadb_batch_add(getdb(s), s->s_batch, rstr_get(fde->fde_url),
+                       fde->fde_stat.fs_mtime,
+                       fde->fde_md, s->s_url, s->s_mtime,
+                       pj->pj_indexstatus);
+      break;
+    case METADATA_CACHE_STATUS_FULL:
+      // All set
+      break;
+    case METADATA_CACHE_STATUS_UNPARENTED:
+      // Reparent item
+      metadb_parent_item(getdb(s), rstr_get(fde->fde_url), s->s_url);
+      break;
     }
-    prop_ref_dec(meta);
+  }
+  prop_ref_dec(meta);
 
-    if(fde->fde_prop != NULL && !fde->fde_bound_to_metadb) {
-      fde->fde_bound_to_metadb = 1;
-      playinfo_bind_url_to_prop(rstr_get(fde->fde_url), fde->fde_prop);
-    }
+  if(fde->fde_prop != NULL && !fde->fde_bound_to_metadb) {
+    fde->fde_bound_to_metadb = 1;
+    playinfo_bind_url_to_prop(rstr_get(fde->fde_url), fde->fde_prop);
   }
 
   if(fde->fde_prop != NULL)
@@ -365,6 +527,66 @@ deep_probe(fa_dir_entry_t *fde, scanner_t *s)
 }
 
 
+/**
+ * Hand out queued jobs to the task pool and publish the results as
+ * they come back. Returns when all jobs have finished.
+ *
+ * s_mode only changes when the scanner thread dispatches its courier
+ * so it can't change while we are in here. We don't dispatch it
+ * either as the callbacks may destroy entries that workers are using.
+ */
+static void
+deep_probe_run(scanner_t *s, struct probe_job_queue *q)
+{
+  struct probe_job_queue done;
+  probe_job_t *pj, *next;
+
+  TAILQ_INIT(&done);
+
+  hts_mutex_lock(&s->s_probe_mutex);
+
+  while(TAILQ_FIRST(q) != NULL || s->s_probe_running > 0 ||
+        TAILQ_FIRST(&s->s_probe_done) != NULL) {
+
+    if(!media_buffer_hungry) {
+      for(pj = TAILQ_FIRST(q); pj != NULL &&
+            s->s_probe_running < SCANNER_MAX_INFLIGHT; pj = next) {
+        next = TAILQ_NEXT(pj, pj_link);
+        if(!probe_host_acquire(pj->pj_host))
+          continue;
+        TAILQ_REMOVE(q, pj, pj_link);
+        s->s_probe_running++;
+        task_run_ex(probe_task, pj, s->s_probe_prio, NULL, NULL);
+      }
+    }
+
+    if(TAILQ_FIRST(&s->s_probe_done) == NULL) {
+      // If we're throttled by another scanner (or the media buffer)
+      // we won't be woken up when things clear so poll
+      if(s->s_probe_running == 0)
+        hts_cond_wait_timeout(&s->s_probe_cond, &s->s_probe_mutex,
+                              media_buffer_hungry ? 1000 : 50);
+      else
+        hts_cond_wait(&s->s_probe_cond, &s->s_probe_mutex);
+      continue;
+    }
+
+    TAILQ_MOVE(&done, &s->s_probe_done, pj_link);
+    hts_mutex_unlock(&s->s_probe_mutex);
+
+    while((pj = TAILQ_FIRST(&done)) != NULL) {
+      TAILQ_REMOVE(&done, pj, pj_link);
+      deep_probe_finish(pj, s);
+      probe_host_put(pj->pj_host);
+      free(pj);
+    }
+
+    hts_mutex_lock(&s->s_probe_mutex);
+  }
+  hts_mutex_unlock(&s->s_probe_mutex);
+}
+
+
 /**
  *
  */
@@ -390,6 +612,7 @@ static void
 analyzer(scanner_t *s, int probe)
 {
   fa_dir_entry_t *fde;
+  struct probe_job_queue q;
 
   /* Empty */
   if(s->s_fd->fd_count == 0)
@@ -398,6 +621,8 @@ analyzer(scanner_t *s, int probe)
   if(probe)
     tryplay(s);
 
+  TAILQ_INIT(&q);
+
   /* Scan all entries */
   RB_FOREACH(fde, &s->s_fd->fd_entries, fde_link) {
 
@@ -415,8 +640,15 @@ analyzer(scanner_t *s, int probe)
     }
 
     if(fde->fde_probestatus == FDE_PROBED_FILENAME && probe)
-      deep_probe(fde, s);
+      deep_probe(fde, s, &q);
   }
+
+  deep_probe_run(s, &q);
+
+  /* Write everything we learned in one go, entries (and their metadata)
+     stay put until next analyzer pass so it's safe to defer until here */
+  if(s->s_batch != NULL)
+    metadb_batch_flush(getdb(s), s->s_batch);
 }
 
 
@@ -432,6 +664,11 @@ scanner_create(const char *url, time_t mtime)
   s->s_url = strdup(url);
   s->s_mode = BROWSER_DIR;
   s->s_mtime = mtime;
+
+  hts_mutex_init(&s->s_probe_mutex);
+  hts_cond_init(&s->s_probe_cond, &s->s_probe_mutex);
+  TAILQ_INIT(&s->s_probe_done);
+  s->s_probe_prio = TASK_PRIO_BACKGROUND;
   return s;
 }
 
@@ -442,7 +679,10 @@ scanner_create(const char *url, time_t mtime)
 static void
 scanner_destroy(scanner_t *s)
 {
+  metadb_batch_destroy(s->s_metadb, s->s_batch);
   closedb(s);
+  hts_cond_destroy(&s->s_probe_cond);
+  hts_mutex_destroy(&s->s_probe_mutex);
   free(s->s_url);
   prop_courier_destroy(s->s_pc);
   free(s);
@@ -1261,6 +1501,7 @@ int
 fa_scanner_scan(const char *url, time_t mtime)
 {
   scanner_t *s = scanner_create(url, mtime);
+  s->s_probe_prio = TASK_PRIO_BULK; // Indexer
   int r = doscan(s, 0);
   scanner_destroy(s);
   return r;
@@ -224,7 +224,7 @@ video_player_loop(AVFormatContext *fctx, media_codec_t **cwvec,
 
       if(si == mp->mp_video.mq_stream) {
 	/* Current video stream */
-	mb = media_buf_from_avpkt_unlocked(mp, &pkt);
+	mb = media_buf_from_avpkt_move_unlocked(mp, &pkt);
 	mb->mb_data_type = MB_VIDEO;
 	mq = &mp->mp_video;
 
@@ -232,14 +232,14 @@ video_player_loop(AVFormatContext *fctx, media_codec_t **cwvec,
 	  mb->mb_duration = 1000000LL * fctx->streams[si]->avg_frame_rate.den /
 	    fctx->streams[si]->avg_frame_rate.num;
 	} else {
-	  mb->mb_duration = rescale(fctx, pkt.duration, si);
+	  mb->mb_duration = rescale(fctx, mb->mb_duration, si);
 	}
 
         mp->mp_framerate = fctx->streams[si]->avg_frame_rate;
 
       } else if(fctx->streams[si]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
 
-	mb = media_buf_from_avpkt_unlocked(mp, &pkt);
+	mb = media_buf_from_avpkt_move_unlocked(mp, &pkt);
 	mb->mb_data_type = MB_AUDIO;
 	mq = &mp->mp_audio;
 
@@ -247,7 +247,7 @@ video_player_loop(AVFormatContext *fctx, media_codec_t **cwvec,
 
 	int duration = pkt.convergence_duration ?: pkt.duration;
 
-	mb = media_buf_from_avpkt_unlocked(mp, &pkt);
+	mb = media_buf_from_avpkt_move_unlocked(mp, &pkt);
 	mb->mb_codecid = fctx->streams[si]->codec->codec_id;
 	mb->mb_font_context = freetype_context;
 	mb->mb_data_type = MB_SUBTITLE;
@@ -262,8 +262,9 @@ video_player_loop(AVFormatContext *fctx, media_codec_t **cwvec,
 	continue;
       }
 
-      mb->mb_pts      = rescale(fctx, pkt.pts, si);
-      mb->mb_dts      = rescale(fctx, pkt.dts, si);
+      // Payload and packet properties have been moved over to mb
+      mb->mb_pts      = rescale(fctx, mb->mb_pts, si);
+      mb->mb_dts      = rescale(fctx, mb->mb_dts, si);
 
       if(mq->mq_seektarget != AV_NOPTS_VALUE &&
 	 mb->mb_data_type != MB_SUBTITLE) {
@@ -277,16 +278,13 @@ video_player_loop(AVFormatContext *fctx, media_codec_t **cwvec,
 
       mb->mb_cw = cwvec[si] ? media_codec_ref(cwvec[si]) : NULL;
 
-      mb->mb_stream = pkt.stream_index;
-
       if(mb->mb_data_type == MB_VIDEO) {
 	mb->mb_drive_clock = 1;
         if(fctx->start_time != AV_NOPTS_VALUE)
           mb->mb_delta = fctx->start_time;
       }
 
-      mb->mb_keyframe = !!(pkt.flags & AV_PKT_FLAG_KEY);
-      av_free_packet(&pkt);
+      mb->mb_keyframe = !!(mb->mb_pkt.flags & AV_PKT_FLAG_KEY);
     }
 
     /*
@@ -544,7 +542,7 @@ be_file_playvideo(const char *url, media_pipe_t *mp,
     .foe_stats = mp->mp_prop_io
   };
 
-  fh = fa_open_ex(url, errbuf, errlen, FA_BUFFERED_BIG, &foe);
+  fh = fa_open_ex(url, errbuf, errlen, FA_BUFFERED_BIG | FA_CACHE, &foe);
   if(fh == NULL)
     return NULL;
 
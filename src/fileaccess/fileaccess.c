@@ -412,12 +412,23 @@ fa_set_read_timeout(void *fh_, int ms)
  */
 int
 fa_stat(const char *url, struct fa_stat *buf, char *errbuf, size_t errsize)
+{
+  return fa_stat_vpaths(url, NULL, buf, errbuf, errsize);
+}
+
+
+/**
+ *
+ */
+int
+fa_stat_vpaths(const char *url, const char **vpaths, struct fa_stat *buf,
+               char *errbuf, size_t errsize)
 {
   fa_protocol_t *fap;
   char *filename;
   int r;
 
-  if((filename = fa_resolve_proto(url, &fap, NULL, errbuf, errsize)) == NULL)
+  if((filename = fa_resolve_proto(url, &fap, vpaths, errbuf, errsize)) == NULL)
     return -1;
 
   r = fap->fap_stat(fap, filename, buf, errbuf, errsize, 0);
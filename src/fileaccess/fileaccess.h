@@ -208,6 +208,8 @@ int64_t fa_fsize(void *fh);
 int fa_ftruncate(void *fh, uint64_t newsize);
 
 int fa_stat(const char *url, struct fa_stat *buf, char *errbuf, size_t errsize);
+int fa_stat_vpaths(const char *url, const char **vpaths, struct fa_stat *buf,
+                   char *errbuf, size_t errsize);
 int fa_findfile(const char *path, const char *file, 
 		char *fullpath, size_t fullpathlen);
 void fa_set_read_timeout(void *fh_, int ms);
@@ -330,18 +332,21 @@ void fa_pathjoin(char *dst, size_t dstlen, const char *p1, const char *p2);
 
 void fa_url_get_last_component(char *dst, size_t dstlen, const char *url);
 
-// Cache (XXX: Remove me)
+// Persistent chunk cache
 
 void fa_cache_init(void);
 
 fa_handle_t *fa_cache_open(const char *url, char *errbuf,
-			   size_t errsize, int flags, struct prop *stats);
+			   size_t errsize, int flags,
+                           struct fa_open_extra *foe);
 
 // Buffered I/O
 
 fa_handle_t *fa_buffered_open(const char *url, char *errbuf, size_t errsize,
 			      int flags, struct fa_open_extra *foe);
 
+fa_handle_t *fa_buffered_wrap(fa_handle_t *fh, const char *url, int flags);
+
 // Memory backed files
 
 int memfile_register(const void *data, size_t len);
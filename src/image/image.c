@@ -22,7 +22,9 @@
 #include "main.h"
 #include "arch/atomic.h"
 #include "misc/buf.h"
+#include "misc/cancellable.h"
 #include "pixmap.h"
+#include "text/glyph_atlas.h"
 
 struct pixmap *(*accel_image_decode)(image_coded_type_t type,
 				     struct buf *buf,
@@ -82,6 +84,11 @@ image_clear_component(image_component_t *ic)
   case IMAGE_TEXT_INFO:
     free(ic->text_info.ti_charpos);
     break;
+
+  case IMAGE_GLYPHS:
+    glyph_atlas_release(ic->glyphs.icg_atlas);
+    free(ic->glyphs.icg_glyphs);
+    break;
   }
   ic->type = IMAGE_component_none;
 }
@@ -155,6 +162,11 @@ image_dump(const image_t *im, const char *prefix)
             ti->ti_flags & IMAGE_TEXT_WRAPPED   ? "Wrapped" : "",
             ti->ti_flags & IMAGE_TEXT_TRUNCATED ? "Truncated" : "");
       break;
+
+    case IMAGE_GLYPHS:
+      trace(TRACE_NO_PROP, TRACE_DEBUG, prefix,
+            "[%d]: Glyphs, %d quads", i, ic->glyphs.icg_num_glyphs);
+      break;
     }
   }
 }
@@ -302,6 +314,12 @@ image_decode(image_t *im, const image_meta_t *meta,
 
   assert(im->im_num_components == 1); // We can only deal with one for now
 
+  if(cancellable_is_cancelled(meta->im_cancellable)) {
+    snprintf(errbuf, errlen, "Cancelled");
+    image_release(im);
+    return NULL;
+  }
+
   switch(ic->type) {
   case IMAGE_component_none:
     return im;
@@ -25,6 +25,7 @@
 #include "compiler.h"
 
 struct buf;
+struct cancellable;
 
 /**
  * Control struct for loading images
@@ -44,6 +45,8 @@ typedef struct image_meta {
   uint16_t im_corner_radius;
   uint16_t im_shadow;
   uint16_t im_margin;
+  float im_region[4];  // x, y, w, h (0 - 1) to only decode part of image
+  struct cancellable *im_cancellable; // Checked between decoding steps
 } image_meta_t;
 
 
@@ -56,6 +59,7 @@ typedef enum image_component_type {
   IMAGE_CODED,
   IMAGE_VECTOR,
   IMAGE_TEXT_INFO,
+  IMAGE_GLYPHS,
 } image_component_type_t;
 
 
@@ -109,6 +113,27 @@ typedef struct image_component_text_info {
 } image_component_text_info_t;
 
 
+/**
+ * Text drawn as quads referencing a glyph atlas page.
+ * Coordinates are in image pixels (including margin), origin top left
+ */
+typedef struct image_glyph {
+  int16_t ig_x;
+  int16_t ig_y;
+  uint16_t ig_w;
+  uint16_t ig_h;
+  uint16_t ig_u;   // Position in atlas
+  uint16_t ig_v;
+  uint32_t ig_color;
+} image_glyph_t;
+
+typedef struct image_component_glyphs {
+  struct glyph_atlas *icg_atlas;
+  image_glyph_t *icg_glyphs;
+  int icg_num_glyphs;
+} image_component_glyphs_t;
+
+
 /**
  *
  */
@@ -120,6 +145,7 @@ typedef struct image_component {
     image_component_coded_t coded;
     image_component_vector_t vector;
     image_component_text_info_t text_info;
+    image_component_glyphs_t glyphs;
   };
 
 } image_component_t;
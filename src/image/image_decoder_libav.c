@@ -26,25 +26,30 @@
 #include "arch/atomic.h"
 #include "misc/minmax.h"
 #include "misc/buf.h"
+#include "misc/cancellable.h"
 #include "backend/backend.h"
 
 #include "jpeg.h"
 #include "pixmap.h"
 #include "image.h"
+#include "image_scale.h"
 #include "compiler.h"
 
 #include <libavcodec/avcodec.h>
-#include <libswscale/swscale.h>
 #include <libavutil/mem.h>
 #include <libavutil/common.h>
 #include <libavutil/pixdesc.h>
 
+#if ENABLE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
 
 
-static pixmap_t *pixmap_rescale_swscale(const AVPicture *pict, int src_pix_fmt,
-                                        int src_w, int src_h,
-                                        int dst_w, int dst_h,
-                                        int with_alpha, int margin);
+static pixmap_t *pixmap_rescale(const AVPicture *pict, int src_pix_fmt,
+                                int src_w, int src_h,
+                                int dst_w, int dst_h,
+                                int with_alpha, int margin);
 
 /**
  *
@@ -70,28 +75,26 @@ fulhack(const AVPicture *pict, int src_w, int src_h,
   AVPicture pict2 = {};
   pict2.data[0] = pm_pixel(pm, 0, 0);
   pict2.linesize[0] = pm->pm_linesize;
-  pixmap_t *pm2 = pixmap_rescale_swscale(&pict2, PIX_FMT_RGB24,
-                                         src_w, src_h, dst_w, dst_h,
-                                         with_alpha, margin);
+  pixmap_t *pm2 = pixmap_rescale(&pict2, PIX_FMT_RGB24,
+                                 src_w, src_h, dst_w, dst_h,
+                                 with_alpha, margin);
   pixmap_release(pm);
   return pm2;
 
 }
 
 /**
- * Rescaling with libswscale
+ * Rescale and convert to a format we can use
  */
 static pixmap_t *
-pixmap_rescale_swscale(const AVPicture *pict, int src_pix_fmt, 
-		       int src_w, int src_h,
-		       int dst_w, int dst_h,
-		       int with_alpha, int margin)
+pixmap_rescale(const AVPicture *pict, int src_pix_fmt,
+               int src_w, int src_h,
+               int dst_w, int dst_h,
+               int with_alpha, int margin)
 {
-  AVPicture pic;
   int dst_pix_fmt;
-  struct SwsContext *sws;
-  const uint8_t *ptr[4];
-  int strides[4];
+  uint8_t *dst[4] = {};
+  int dst_stride[4] = {};
   pixmap_t *pm;
 
   switch(src_pix_fmt) {
@@ -117,29 +120,12 @@ pixmap_rescale_swscale(const AVPicture *pict, int src_pix_fmt,
     break;
   }
 
-  const int swscale_debug = 0;
+  const int scale_debug = 0;
 
-  if(swscale_debug)
+  if(scale_debug)
     TRACE(TRACE_DEBUG, "info", "Converting %d x %d [%s] to %d x %d [%s]",
 	  src_w, src_h, av_get_pix_fmt_name(src_pix_fmt),
 	  dst_w, dst_h, av_get_pix_fmt_name(dst_pix_fmt));
-  
-  sws = sws_getContext(src_w, src_h, src_pix_fmt, 
-		       dst_w, dst_h, dst_pix_fmt,
-		       SWS_LANCZOS | 
-		       (swscale_debug ? SWS_PRINT_INFO : 0), NULL, NULL, NULL);
-  if(sws == NULL)
-    return NULL;
-
-  ptr[0] = pict->data[0];
-  ptr[1] = pict->data[1];
-  ptr[2] = pict->data[2];
-  ptr[3] = pict->data[3];
-
-  strides[0] = pict->linesize[0];
-  strides[1] = pict->linesize[1];
-  strides[2] = pict->linesize[2];
-  strides[3] = pict->linesize[3];
 
   switch(dst_pix_fmt) {
   case PIX_FMT_RGB24:
@@ -151,32 +137,20 @@ pixmap_rescale_swscale(const AVPicture *pict, int src_pix_fmt,
     break;
   }
 
-  if(pm == NULL) {
-    sws_freeContext(sws);
+  if(pm == NULL)
     return NULL;
-  }
 
   // Set scale destination with respect to margin
-  pic.data[0] = pm_pixel(pm, 0, 0);
-  pic.linesize[0] = pm->pm_linesize;
-  pic.linesize[1] = 0;
-  pic.linesize[2] = 0;
-  pic.linesize[3] = 0;
-  sws_scale(sws, ptr, strides, 0, src_h, pic.data, pic.linesize);
-#if 0  
-  if(pm->pm_type == PIXMAP_BGR32) {
-    uint32_t *dst = pm->pm_data;
-    int i;
-
-    for(i = 0; i < pm->pm_linesize * pm->pm_height; i+= 4) {
-      *dst |= 0xff000000;
-      dst++;
-    }
-
+  dst[0] = pm_pixel(pm, 0, 0);
+  dst_stride[0] = pm->pm_linesize;
+
+  if(image_scale((const uint8_t **)pict->data, pict->linesize,
+                 src_pix_fmt, src_w, src_h,
+                 dst, dst_stride, dst_pix_fmt, dst_w, dst_h,
+                 IMAGE_SCALE_HQ)) {
+    pixmap_release(pm);
+    return NULL;
   }
-#endif
-
-  sws_freeContext(sws);
   return pm;
 }
 
@@ -295,14 +269,14 @@ pixmap_from_avpic(AVPicture *pict, int pix_fmt,
   if(want_rescale || need_format_conv) {
     int want_alpha = im->im_no_rgb24 || im->im_corner_radius;
 
-    pm = pixmap_rescale_swscale(pict, pix_fmt, src_w, src_h, req_w, req_h,
-				want_alpha, im->im_margin);
+    pm = pixmap_rescale(pict, pix_fmt, src_w, src_h, req_w, req_h,
+			want_alpha, im->im_margin);
     if(pm != NULL)
       return pm;
 
     if(need_format_conv) {
-      pm = pixmap_rescale_swscale(pict, pix_fmt, src_w, src_h, src_w, src_h,
-				  want_alpha, im->im_margin);
+      pm = pixmap_rescale(pict, pix_fmt, src_w, src_h, src_w, src_h,
+			  want_alpha, im->im_margin);
       if(pm != NULL)
 	return pm;
 
@@ -380,6 +354,276 @@ pixmap_compute_rescale_dim(const image_meta_t *im,
 }
 
 
+/**
+ * Part of the image to decode (in source pixels) as requested by
+ * im_region. The entire image if no region is set
+ */
+static void
+image_region(const image_meta_t *im, int width, int height,
+             int *x, int *y, int *w, int *h)
+{
+  if(im->im_region[2] <= 0 || im->im_region[3] <= 0) {
+    *x = 0;
+    *y = 0;
+    *w = width;
+    *h = height;
+    return;
+  }
+
+  *x = av_clip(im->im_region[0] * width,  0, width  - 1);
+  *y = av_clip(im->im_region[1] * height, 0, height - 1);
+  *w = av_clip(im->im_region[2] * width  + 0.5f, 1, width  - *x);
+  *h = av_clip(im->im_region[3] * height + 0.5f, 1, height - *y);
+}
+
+
+#if ENABLE_LIBJPEG
+
+typedef struct jpeg_error {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jmp;
+} jpeg_error_t;
+
+
+/**
+ *
+ */
+static void
+jpeg_error_exit(j_common_ptr cinfo)
+{
+  jpeg_error_t *je = (jpeg_error_t *)cinfo->err;
+  longjmp(je->jmp, 1);
+}
+
+
+/**
+ *
+ */
+static void
+jpeg_output_message(j_common_ptr cinfo)
+{
+}
+
+
+/**
+ * Decode JPEG with libjpeg. Unlike the libav decoder it can do the
+ * scaling in the DCT domain (by 1/2, 1/4 or 1/8) so we never decode
+ * more pixels than needed for the requested size. Whatever is left is
+ * done by image_scale() as usual.
+ *
+ * If only a region of the image is requested (tiles when zooming) we
+ * only keep the rows and columns inside it. Together with the scaling
+ * this means peak memory depends on the requested size and not on the
+ * size of the source image (except for progressive JPEGs where libjpeg
+ * needs to buffer all coefficients)
+ *
+ * Returns NULL if libjpeg can't deal with the image, caller should
+ * then try libav instead (unless we were cancelled)
+ */
+static pixmap_t *
+jpeg_decode_scaled(buf_t *buf, const image_meta_t *im,
+                   char *errbuf, size_t errlen)
+{
+  struct jpeg_decompress_struct cinfo;
+  jpeg_error_t je;
+  uint8_t *volatile pixels = NULL;
+  uint8_t *volatile rowbuf = NULL;
+  pixmap_t *pm = NULL;
+  int w, h, pix_fmt;
+  int rx, ry, rw, rh;
+
+  cinfo.err = jpeg_std_error(&je.mgr);
+  je.mgr.error_exit = jpeg_error_exit;
+  je.mgr.output_message = jpeg_output_message;
+
+  jpeg_create_decompress(&cinfo);
+
+  if(setjmp(je.jmp)) {
+    char msg[JMSG_LENGTH_MAX];
+    je.mgr.format_message((j_common_ptr)&cinfo, msg);
+    snprintf(errbuf, errlen, "%s", msg);
+    jpeg_destroy_decompress(&cinfo);
+    free(pixels);
+    free(rowbuf);
+    return NULL;
+  }
+
+  jpeg_mem_src(&cinfo, (void *)buf_data(buf), buf_size(buf));
+  jpeg_read_header(&cinfo, TRUE);
+
+  switch(cinfo.jpeg_color_space) {
+  case JCS_GRAYSCALE:
+    if(im->im_can_mono) {
+      cinfo.out_color_space = JCS_GRAYSCALE;
+      pix_fmt = PIX_FMT_GRAY8;
+      break;
+    }
+    // FALLTHRU
+  case JCS_RGB:
+  case JCS_YCbCr:
+    cinfo.out_color_space = JCS_RGB;
+    pix_fmt = PIX_FMT_RGB24;
+    break;
+
+  default:
+    // CMYK and friends, let libav have a go at it
+    jpeg_destroy_decompress(&cinfo);
+    snprintf(errbuf, errlen, "Unsupported colorspace");
+    return NULL;
+  }
+
+  image_region(im, cinfo.image_width, cinfo.image_height,
+               &rx, &ry, &rw, &rh);
+
+  pixmap_compute_rescale_dim(im, rw, rh, &w, &h);
+
+  // Largest reduction that still leaves us with at least w * h pixels
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = 1;
+  for(int d = 8; d > 1; d /= 2) {
+    if((rw + d - 1) / d >= w && (rh + d - 1) / d >= h) {
+      cinfo.scale_denom = d;
+      break;
+    }
+  }
+
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&cinfo);
+
+  // Region in output (ie, scaled) pixels
+  const int ow = cinfo.output_width;
+  const int oh = cinfo.output_height;
+  const int bpp = cinfo.output_components;
+  const int sx = (int64_t)rx * ow / cinfo.image_width;
+  const int sy = (int64_t)ry * oh / cinfo.image_height;
+  const int sw = av_clip(((int64_t)rw * ow + cinfo.image_width - 1) /
+                         cinfo.image_width, 1, ow - sx);
+  const int sh = av_clip(((int64_t)rh * oh + cinfo.image_height - 1) /
+                         cinfo.image_height, 1, oh - sy);
+
+  // Same row alignment as pixmaps so pixmap_from_avpic() can copy
+  // rows straight over. Extra space at the end for scaler overreads
+  const int stride = (sw * bpp + PIXMAP_ROW_ALIGN - 1) &
+    ~(PIXMAP_ROW_ALIGN - 1);
+  pixels = malloc(stride * sh + 64);
+
+  // Rows outside of the region go via a scratch row
+  if(sw != ow || sh != oh)
+    rowbuf = malloc(ow * bpp);
+
+  if(pixels == NULL || ((sw != ow || sh != oh) && rowbuf == NULL)) {
+    jpeg_destroy_decompress(&cinfo);
+    free(pixels);
+    free(rowbuf);
+    snprintf(errbuf, errlen, "Out of memory");
+    return NULL;
+  }
+
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && \
+  LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+  // Avoids IDCT and color conversion for rows above the region
+  if(sy > 0)
+    jpeg_skip_scanlines(&cinfo, sy);
+#endif
+
+  while(cinfo.output_scanline < sy + sh) {
+
+    if((cinfo.output_scanline & 15) == 0 &&
+       cancellable_is_cancelled(im->im_cancellable)) {
+      snprintf(errbuf, errlen, "Cancelled");
+      jpeg_destroy_decompress(&cinfo);
+      free(pixels);
+      free(rowbuf);
+      return NULL;
+    }
+
+    const int y = cinfo.output_scanline;
+    JSAMPROW row = rowbuf != NULL ? rowbuf : pixels + y * stride;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+
+    if(rowbuf != NULL && y >= sy)
+      memcpy(pixels + (y - sy) * stride, rowbuf + sx * bpp, sw * bpp);
+  }
+
+  // Destroy will abort the decoder if we stopped before the last row
+  if(cinfo.output_scanline == cinfo.output_height)
+    jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  free(rowbuf);
+
+  AVPicture pict = {};
+  pict.data[0] = pixels;
+  pict.linesize[0] = stride;
+
+  pm = pixmap_from_avpic(&pict, pix_fmt, sw, sh, w, h, im);
+  free(pixels);
+
+  if(pm == NULL) {
+    snprintf(errbuf, errlen, "Out of memory");
+    return NULL;
+  }
+
+  pm->pm_aspect = (float)w / (float)h;
+  return pm;
+}
+#endif
+
+
+/**
+ * Grid views and such don't ask for much larger images than the
+ * thumbnail most cameras put in the EXIF data. If it's big enough (and
+ * not letterboxed to a different aspect) decode that instead of the
+ * full image.
+ */
+static pixmap_t *
+jpeg_decode_exif_thumb(buf_t *buf, const image_meta_t *im)
+{
+  jpeg_meminfo_t mi;
+  jpeginfo_t ji = {0}, tji = {0};
+  pixmap_t *pm = NULL;
+  char errbuf[64];
+  int w, h;
+
+  if(im->im_region[2] > 0)
+    return NULL;
+
+  mi.data = buf_data(buf);
+  mi.size = buf_size(buf);
+
+  if(jpeg_info(&ji, jpeginfo_mem_reader, &mi,
+               JPEG_INFO_DIMENSIONS | JPEG_INFO_THUMBNAIL,
+               buf_data(buf), buf_size(buf), errbuf, sizeof(errbuf)) ||
+     ji.ji_thumbnail == NULL || ji.ji_width < 1 || ji.ji_height < 1)
+    goto out;
+
+  buf_t *tb = ji.ji_thumbnail->im_components[0].coded.icc_buf;
+
+  mi.data = buf_data(tb);
+  mi.size = buf_size(tb);
+
+  if(jpeg_info(&tji, jpeginfo_mem_reader, &mi, JPEG_INFO_DIMENSIONS,
+               buf_data(tb), buf_size(tb), errbuf, sizeof(errbuf)))
+    goto out;
+
+  pixmap_compute_rescale_dim(im, ji.ji_width, ji.ji_height, &w, &h);
+
+  if(tji.ji_width < w || tji.ji_height < h)
+    goto out;
+
+  // Allow 2% difference in aspect
+  if(abs(tji.ji_width * ji.ji_height - tji.ji_height * ji.ji_width) * 50 >
+     tji.ji_height * ji.ji_width)
+    goto out;
+
+  pm = image_decode_libav(IMAGE_JPEG, tb, im, errbuf, sizeof(errbuf));
+
+ out:
+  jpeg_info_clear(&tji);
+  jpeg_info_clear(&ji);
+  return pm;
+}
+
+
 /**
  *
  */
@@ -400,6 +644,19 @@ image_decode_libav(image_coded_type_t type,
     codec = avcodec_find_decoder(AV_CODEC_ID_PNG);
     break;
   case IMAGE_JPEG:
+    {
+      pixmap_t *pm = jpeg_decode_exif_thumb(buf, im);
+      if(pm != NULL)
+        return pm;
+    }
+
+#if ENABLE_LIBJPEG
+    {
+      pixmap_t *pm = jpeg_decode_scaled(buf, im, errbuf, errlen);
+      if(pm != NULL || cancellable_is_cancelled(im->im_cancellable))
+        return pm;
+    }
+#endif
 
     mi.data = buf_data(buf);
     mi.size = buf_size(buf);
@@ -461,12 +718,34 @@ image_decode_libav(image_coded_type_t type,
 	 pm->pm_flags & PIXMAP_THUMBNAIL ? ", is thumb" : "");
 #endif
 
-  pixmap_compute_rescale_dim(im, ctx->width, ctx->height, &w, &h);
+  AVPicture *pict = (AVPicture *)frame;
+  AVPicture cropped;
+  int rx, ry, rw, rh;
+
+  image_region(im, ctx->width, ctx->height, &rx, &ry, &rw, &rh);
+
+  if(rw != ctx->width || rh != ctx->height) {
+    // Keep it aligned to chroma subsampling
+    rw += rx & 7;
+    rh += ry & 7;
+    rx &= ~7;
+    ry &= ~7;
+
+    if(av_picture_crop(&cropped, pict, ctx->pix_fmt, ry, rx) < 0) {
+      avcodec_close(ctx);
+      av_free(ctx);
+      av_frame_free(&frame);
+      snprintf(errbuf, errlen, "Unable to crop image");
+      return NULL;
+    }
+    pict = &cropped;
+  }
+
+  pixmap_compute_rescale_dim(im, rw, rh, &w, &h);
 
   pixmap_t *pm;
 
-  pm = pixmap_from_avpic((AVPicture *)frame, 
-			 ctx->pix_fmt, ctx->width, ctx->height, w, h, im);
+  pm = pixmap_from_avpic(pict, ctx->pix_fmt, rw, rh, w, h, im);
 
   if(pm != NULL) {
     pm->pm_aspect = (float)w / (float)h;
@@ -0,0 +1,333 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "image_scale.h"
+
+#include <libswscale/swscale.h>
+#include <libavutil/pixfmt.h>
+
+#if ENABLE_LIBYUV && !defined(__BIG_ENDIAN__)
+#define USE_LIBYUV
+#include <libyuv.h>
+#endif
+
+#define SWS_CACHE_SIZE 4
+
+typedef struct sws_key {
+  int src_w, src_h, src_fmt;
+  int dst_w, dst_h, dst_fmt;
+  int flags;
+} sws_key_t;
+
+typedef struct sws_cache_entry {
+  sws_key_t sce_key;
+  struct SwsContext *sce_ctx;
+} sws_cache_entry_t;
+
+// Most recently used first, unused entries at the end
+static sws_cache_entry_t sws_cache[SWS_CACHE_SIZE];
+static HTS_MUTEX_DECL(sws_cache_mutex);
+
+
+/**
+ * Get a context from the cache or create a new one. A context can't be
+ * used by more than one thread at a time so it's removed from the cache
+ * until it's given back with sws_cache_put()
+ */
+static struct SwsContext *
+sws_cache_get(const sws_key_t *key)
+{
+  struct SwsContext *ctx = NULL;
+  int i;
+
+  hts_mutex_lock(&sws_cache_mutex);
+  for(i = 0; i < SWS_CACHE_SIZE; i++) {
+    if(sws_cache[i].sce_ctx != NULL &&
+       !memcmp(&sws_cache[i].sce_key, key, sizeof(sws_key_t))) {
+      ctx = sws_cache[i].sce_ctx;
+      memmove(&sws_cache[i], &sws_cache[i + 1],
+              (SWS_CACHE_SIZE - i - 1) * sizeof(sws_cache_entry_t));
+      sws_cache[SWS_CACHE_SIZE - 1].sce_ctx = NULL;
+      break;
+    }
+  }
+  hts_mutex_unlock(&sws_cache_mutex);
+
+  if(ctx != NULL)
+    return ctx;
+
+  return sws_getContext(key->src_w, key->src_h, key->src_fmt,
+                        key->dst_w, key->dst_h, key->dst_fmt,
+                        key->flags & IMAGE_SCALE_HQ ?
+                        SWS_LANCZOS : SWS_BILINEAR,
+                        NULL, NULL, NULL);
+}
+
+
+/**
+ *
+ */
+static void
+sws_cache_put(const sws_key_t *key, struct SwsContext *ctx)
+{
+  hts_mutex_lock(&sws_cache_mutex);
+  struct SwsContext *evict = sws_cache[SWS_CACHE_SIZE - 1].sce_ctx;
+  memmove(&sws_cache[1], &sws_cache[0],
+          (SWS_CACHE_SIZE - 1) * sizeof(sws_cache_entry_t));
+  sws_cache[0].sce_key = *key;
+  sws_cache[0].sce_ctx = ctx;
+  hts_mutex_unlock(&sws_cache_mutex);
+
+  if(evict != NULL)
+    sws_freeContext(evict);
+}
+
+
+/**
+ *
+ */
+static int
+image_scale_swscale(const uint8_t * const src[4], const int src_stride[4],
+                    int src_fmt, int src_w, int src_h,
+                    uint8_t * const dst[4], const int dst_stride[4],
+                    int dst_fmt, int dst_w, int dst_h, int flags)
+{
+  sws_key_t key;
+
+  memset(&key, 0, sizeof(key));
+  key.src_w   = src_w;
+  key.src_h   = src_h;
+  key.src_fmt = src_fmt;
+  key.dst_w   = dst_w;
+  key.dst_h   = dst_h;
+  key.dst_fmt = dst_fmt;
+  key.flags   = flags & IMAGE_SCALE_HQ;
+
+  struct SwsContext *ctx = sws_cache_get(&key);
+  if(ctx == NULL)
+    return -1;
+
+  sws_scale(ctx, src, src_stride, 0, src_h, dst, dst_stride);
+  sws_cache_put(&key, ctx);
+  return 0;
+}
+
+
+#ifdef USE_LIBYUV
+
+/**
+ * libyuv's ARGB functions don't care about the order of the channels
+ * (except when converting to / from other formats)
+ */
+static int
+is_packed32(int fmt)
+{
+  switch(fmt) {
+  case AV_PIX_FMT_BGRA:
+  case AV_PIX_FMT_RGBA:
+  case AV_PIX_FMT_ABGR:
+  case AV_PIX_FMT_ARGB:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+
+/**
+ *
+ */
+static int
+is_yuv420(int fmt)
+{
+  return fmt == AV_PIX_FMT_YUV420P || fmt == AV_PIX_FMT_YUVJ420P;
+}
+
+
+/**
+ * Packed formats are only done by libyuv when it's not downscaling
+ * more than 2x, beyond that it does not filter properly. Planar
+ * scaling does box filtering so that's fine for any size. Too wide
+ * images end up with point sampling in libyuv, so skip those too.
+ *
+ * Returns 0 if done, -1 if the caller should use swscale instead
+ */
+static int
+image_scale_libyuv(const uint8_t * const src[4], const int src_stride[4],
+                   int src_fmt, int src_w, int src_h,
+                   uint8_t * const dst[4], const int dst_stride[4],
+                   int dst_fmt, int dst_w, int dst_h, int flags)
+{
+  const int same_size = src_w == dst_w && src_h == dst_h;
+  const int max_2x_down = dst_w * 2 >= src_w && dst_h * 2 >= src_h;
+
+  if(src_fmt == dst_fmt && is_packed32(src_fmt)) {
+    if(!max_2x_down || src_w * 4 >= kMaxStride || dst_w * 4 > kMaxStride)
+      return -1;
+
+    return ARGBScale(src[0], src_stride[0], src_w, src_h,
+                     dst[0], dst_stride[0], dst_w, dst_h,
+                     kFilterBilinear) ? -1 : 0;
+  }
+
+  if(src_fmt == AV_PIX_FMT_RGB24 && dst_fmt == AV_PIX_FMT_BGR32) {
+    if(same_size) {
+      image_rgb24_to_bgr32(dst[0], dst_stride[0], src[0], src_stride[0],
+                           src_w, src_h);
+      return 0;
+    }
+
+    if(!max_2x_down || src_w * 4 >= kMaxStride || dst_w * 4 > kMaxStride)
+      return -1;
+
+    uint8_t *tmp = malloc(src_w * src_h * 4);
+    if(tmp == NULL)
+      return -1;
+
+    image_rgb24_to_bgr32(tmp, src_w * 4, src[0], src_stride[0], src_w, src_h);
+    int r = ARGBScale(tmp, src_w * 4, src_w, src_h,
+                      dst[0], dst_stride[0], dst_w, dst_h, kFilterBilinear);
+    free(tmp);
+    return r ? -1 : 0;
+  }
+
+  if(!is_yuv420(src_fmt) || src_w > kMaxStride)
+    return -1;
+
+  if(!same_size && src_fmt == dst_fmt)
+    return I420Scale(src[0], src_stride[0],
+                     src[1], src_stride[1],
+                     src[2], src_stride[2],
+                     src_w, src_h,
+                     dst[0], dst_stride[0],
+                     dst[1], dst_stride[1],
+                     dst[2], dst_stride[2],
+                     dst_w, dst_h, kFilterBox) ? -1 : 0;
+
+  const uint8_t *planes[4] = {src[0], src[1], src[2], NULL};
+  int strides[4] = {src_stride[0], src_stride[1], src_stride[2], 0};
+  uint8_t *tmp = NULL;
+
+  if(!same_size) {
+    // Scale the planes first so any color conversion is done on
+    // the (usually much) smaller output
+    const int cw = (dst_w + 1) / 2;
+    const int ch = (dst_h + 1) / 2;
+
+    tmp = malloc(dst_w * dst_h + cw * ch * 2);
+    if(tmp == NULL)
+      return -1;
+
+    uint8_t *y = tmp;
+    uint8_t *u = y + dst_w * dst_h;
+    uint8_t *v = u + cw * ch;
+
+    if(I420Scale(src[0], src_stride[0],
+                 src[1], src_stride[1],
+                 src[2], src_stride[2],
+                 src_w, src_h,
+                 y, dst_w, u, cw, v, cw,
+                 dst_w, dst_h, kFilterBox)) {
+      free(tmp);
+      return -1;
+    }
+
+    planes[0] = y;
+    planes[1] = u;
+    planes[2] = v;
+    strides[0] = dst_w;
+    strides[1] = cw;
+    strides[2] = cw;
+  }
+
+  int r;
+
+  // libyuv only knows about limited range (ie, not YUVJ) for RGB
+  if(src_fmt == AV_PIX_FMT_YUV420P && dst_fmt == AV_PIX_FMT_RGB24)
+    r = I420ToRAW(planes[0], strides[0], planes[1], strides[1],
+                  planes[2], strides[2], dst[0], dst_stride[0],
+                  dst_w, dst_h);
+  else if(src_fmt == AV_PIX_FMT_YUV420P && dst_fmt == AV_PIX_FMT_BGR32)
+    r = I420ToABGR(planes[0], strides[0], planes[1], strides[1],
+                   planes[2], strides[2], dst[0], dst_stride[0],
+                   dst_w, dst_h);
+  else if(tmp != NULL)
+    r = image_scale_swscale(planes, strides, src_fmt, dst_w, dst_h,
+                            dst, dst_stride, dst_fmt, dst_w, dst_h, flags);
+  else
+    r = -1;
+
+  free(tmp);
+  return r ? -1 : 0;
+}
+
+#endif
+
+
+/**
+ *
+ */
+int
+image_scale(const uint8_t * const src[4], const int src_stride[4],
+            int src_fmt, int src_w, int src_h,
+            uint8_t * const dst[4], const int dst_stride[4],
+            int dst_fmt, int dst_w, int dst_h, int flags)
+{
+#ifdef USE_LIBYUV
+  if(!image_scale_libyuv(src, src_stride, src_fmt, src_w, src_h,
+                         dst, dst_stride, dst_fmt, dst_w, dst_h, flags))
+    return 0;
+#endif
+  return image_scale_swscale(src, src_stride, src_fmt, src_w, src_h,
+                             dst, dst_stride, dst_fmt, dst_w, dst_h, flags);
+}
+
+
+/**
+ *
+ */
+void
+image_rgb24_to_bgr32(uint8_t *dst, int dst_stride,
+                     const uint8_t *src, int src_stride,
+                     int width, int height)
+{
+  int y;
+
+  for(y = 0; y < height; y++) {
+    const uint8_t *s = src + y * src_stride;
+    uint8_t *d = dst + y * dst_stride;
+#ifdef USE_LIBYUV
+    // There is no direct RGB -> RGBA (in memory order) in libyuv, go
+    // via ARGB one row at a time so the second pass hits the cache
+    RAWToARGB(s, 0, d, 0, width, 1);
+    ARGBToABGR(d, 0, d, 0, width, 1);
+#else
+    uint32_t *d32 = (uint32_t *)d;
+    int x;
+    for(x = 0; x < width; x++) {
+      *d32++ = 0xff000000 | s[2] << 16 | s[1] << 8 | s[0];
+      s += 3;
+    }
+#endif
+  }
+}
@@ -0,0 +1,47 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Scaling and pixel format conversion of images
+ *
+ * Formats are libav pixel formats. The common cases (4 byte packed
+ * formats, RGB24 -> BGR32 and YUV420P -> RGB24 / BGR32) are done with
+ * libyuv's SIMD code when available. Everything else goes through
+ * libswscale with contexts kept around between calls since setting
+ * up a context is often more expensive than the actual scaling of a
+ * thumbnail.
+ */
+
+#define IMAGE_SCALE_HQ  0x1  // Best quality (decoded images), not thumbs
+
+int image_scale(const uint8_t * const src[4], const int src_stride[4],
+                int src_fmt, int src_w, int src_h,
+                uint8_t * const dst[4], const int dst_stride[4],
+                int dst_fmt, int dst_w, int dst_h, int flags);
+
+/**
+ * Packed RGB24 to BGR32 with alpha set to 0xff
+ */
+void image_rgb24_to_bgr32(uint8_t *dst, int dst_stride,
+                          const uint8_t *src, int src_stride,
+                          int width, int height);
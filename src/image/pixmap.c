@@ -27,13 +27,29 @@
 #include "main.h"
 #include "arch/atomic.h"
 #include "pixmap.h"
+#include "pixmap_simd.h"
+#include "image_scale.h"
 #include "misc/minmax.h"
 #include "image/jpeg.h"
 #include "backend/backend.h"
 
+#if ENABLE_HTTPSERVER
+#include "networking/http_server.h"
+#endif
+
 
 #define DIV255(x) (((((x)+255)>>8)+(x))>>8)
 
+/**
+ * Vectorized inner loops, NULL if the CPU has nothing to offer
+ */
+static const pixmap_kernels_t *pixmap_kernels;
+
+INITIALIZER(pixmap_kernels_init)
+{
+  pixmap_kernels = pixmap_kernels_probe();
+}
+
 /**
  *
  */
@@ -212,17 +228,10 @@ rgb24_to_bgr32(pixmap_t *src)
 {
   pixmap_t *dst = pixmap_create(src->pm_width, src->pm_height, PIXMAP_BGR32,
 				src->pm_margin);
-  int y;
-  
-  for(y = 0; y < src->pm_height; y++) {
-    const uint8_t *s = src->pm_data + y * src->pm_linesize;
-    uint32_t *d = (uint32_t *)(dst->pm_data + y * dst->pm_linesize);
-    int x;
-    for(x = 0; x < src->pm_width; x++) {
-      *d++ = 0xff000000 | s[2] << 16 | s[1] << 8 | s[0]; 
-      s+= 3;
-    }
-  }
+
+  image_rgb24_to_bgr32(dst->pm_data, dst->pm_linesize,
+                       src->pm_data, src->pm_linesize,
+                       src->pm_width, src->pm_height);
   return dst;
 }
 
@@ -301,7 +310,7 @@ pixmap_rounded_corners(pixmap_t *pm, int r, int which)
 static void
 composite_GRAY8_on_IA(uint8_t *dst, const uint8_t *src,
 			 int i0, int foo_, int bar_, int a0,
-			 int width)
+			 int width, const pixmap_kernels_t *pk)
 {
   int i, a, pa, y;
   int x;
@@ -333,7 +342,7 @@ composite_GRAY8_on_IA(uint8_t *dst, const uint8_t *src,
 static void
 composite_GRAY8_on_IA_full_alpha(uint8_t *dst, const uint8_t *src,
 				    int i0, int b0_, int g0_, int a0_,
-				    int width)
+				    int width, const pixmap_kernels_t *pk)
 {
   int i, a, pa, y;
   int x;
@@ -412,13 +421,19 @@ composite_GRAY8_on_BGR32(uint8_t *dst_, const uint8_t *src,
 static void
 composite_GRAY8_on_BGR32(uint8_t *dst_, const uint8_t *src,
 			 int CR, int CG, int CB, int CA,
-			 int width)
+			 int width, const pixmap_kernels_t *pk)
 {
-  int x;
+  int x = 0;
   uint32_t *dst = (uint32_t *)dst_;
   uint32_t u32;
 
-  for(x = 0; x < width; x++) {
+  if(pk != NULL) {
+    x = pk->pk_composite_GRAY8_on_BGR32(dst_, src, CR, CG, CB, CA, width);
+    src += x;
+    dst += x;
+  }
+
+  for(; x < width; x++) {
 
     int SA = DIV255(*src * CA);
     int SR = CR;
@@ -461,16 +476,16 @@ composite_GRAY8_on_BGR32(uint8_t *dst_, const uint8_t *src,
 /**
  *
  */
-void
-pixmap_composite(pixmap_t *dst, const pixmap_t *src,
-		 int xdisp, int ydisp, int rgba)
+static void
+pixmap_composite0(pixmap_t *dst, const pixmap_t *src,
+                  int xdisp, int ydisp, int rgba, const pixmap_kernels_t *pk)
 {
   int y, wy;
   uint8_t *d0;
   const uint8_t *s0;
   void (*fn)(uint8_t *dst, const uint8_t *src,
 	     int red, int green, int blue, int alpha,
-	     int width);
+	     int width, const pixmap_kernels_t *pk);
 
   int readstep = 0;
   int writestep = 0;
@@ -515,15 +530,27 @@ pixmap_composite(pixmap_t *dst, const pixmap_t *src,
   for(y = 0; y < src->pm_height; y++) {
     wy = y + ydisp;
     if(wy >= 0 && wy < dst->pm_height)
-      fn(d0 + wy * dst->pm_linesize, s0 + y * src->pm_linesize, r, g, b, a, xx);
+      fn(d0 + wy * dst->pm_linesize, s0 + y * src->pm_linesize, r, g, b, a, xx,
+         pk);
   }
 }
 
 
+/**
+ *
+ */
+void
+pixmap_composite(pixmap_t *dst, const pixmap_t *src,
+		 int xdisp, int ydisp, int rgba)
+{
+  pixmap_composite0(dst, src, xdisp, ydisp, rgba, pixmap_kernels);
+}
+
+
 
 static void
 box_blur_line_2chan(uint8_t *d, const uint32_t *a, const uint32_t *b,
-		    int width, int boxw, int m)
+		    int width, int boxw, int m, const pixmap_kernels_t *pk)
 {
   int x;
   unsigned int v;
@@ -562,7 +589,7 @@ box_blur_line_2chan(uint8_t *d, const uint32_t *a, const uint32_t *b,
 
 static void
 box_blur_line_4chan(uint8_t *d, const uint32_t *a, const uint32_t *b,
-		    int width, int boxw, int m)
+		    int width, int boxw, int m, const pixmap_kernels_t *pk)
 {
   int x;
   unsigned int v;
@@ -580,6 +607,12 @@ box_blur_line_4chan(uint8_t *d, const uint32_t *a, const uint32_t *b,
     *d++ = (v * m) >> 16;
   }
 
+  if(pk != NULL && x < width - boxw) {
+    int x0 = x;
+    x = pk->pk_box_blur_4chan(d, a, b, x, width - boxw, boxw, m);
+    d += (x - x0) * 4;
+  }
+
   for(; x < width - boxw; x++) {
     const int x1 = 4 * (x + boxw);
     const int x2 = 4 * (x - boxw);
@@ -611,14 +644,54 @@ box_blur_line_4chan(uint8_t *d, const uint32_t *a, const uint32_t *b,
 
 
 /**
- *
+ * Summed area table, 'ls' is both the source linesize and the stride
+ * of 'tmp'
  */
-void
-pixmap_box_blur(pixmap_t *pm, int boxw, int boxh)
+static void
+integral_image(unsigned int *tmp, const uint8_t *data, int w, int h,
+               int ls, int z)
 {
-  unsigned int *tmp, *t;
-  int x, y, i;
+  unsigned int *t;
   const uint8_t *s;
+  int x, y, i;
+
+  s = data;
+  t = tmp;
+
+  for(i = 0; i < z; i++)
+    *t++ = *s++;
+
+  for(x = 0; x < (w-1)*z; x++) {
+    t[0] = *s++ + t[-z];
+    t++;
+  }
+
+  for(y = 1; y < h; y++) {
+
+    s = data + y * ls;
+    t = tmp + y * ls;
+
+    for(i = 0; i < z; i++) {
+      t[0] = *s++ + t[-ls];
+      t++;
+    }
+
+    for(x = 0; x < (w-1)*z; x++) {
+      t[0] = *s++ + t[-z] + t[-ls] - t[-ls - z];
+      t++;
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static void
+pixmap_box_blur0(pixmap_t *pm, int boxw, int boxh, const pixmap_kernels_t *pk)
+{
+  unsigned int *tmp;
+  int y;
   const int w = pm->pm_width;
   const int h = pm->pm_height;
   const int ls = pm->pm_linesize;
@@ -627,7 +700,7 @@ pixmap_box_blur(pixmap_t *pm, int boxw, int boxh)
   boxw = MIN(boxw, w);
 
   void (*fn)(uint8_t *dst, const uint32_t *a, const uint32_t *b, int width,
-	     int boxw, int m);
+	     int boxw, int m, const pixmap_kernels_t *pk);
 
   switch(z) {
   case 2:
@@ -648,31 +721,12 @@ pixmap_box_blur(pixmap_t *pm, int boxw, int boxh)
   if(tmp == NULL)
     return;
 
-  s = pm->pm_data;
-  t = tmp;
-
-  for(i = 0; i < z; i++)
-    *t++ = *s++;
-
-  for(x = 0; x < (w-1)*z; x++) {
-    t[0] = *s++ + t[-z];
-    t++;
-  }
-
-  for(y = 1; y < h; y++) {
-
-    s = pm->pm_data + y * ls;
-    t = tmp + y * ls;
-
-    for(i = 0; i < z; i++) {
-      t[0] = *s++ + t[-ls];
-      t++;
-    }
-
-    for(x = 0; x < (w-1)*z; x++) {
-      t[0] = *s++ + t[-z] + t[-ls] - t[-ls - z];
-      t++;
-    }
+  if(z == 4 && pk != NULL) {
+    for(y = 0; y < h; y++)
+      pk->pk_integral_4chan(tmp + y * ls, y ? tmp + (y - 1) * ls : NULL,
+                            pm->pm_data + y * ls, w);
+  } else {
+    integral_image(tmp, pm->pm_data, w, h, ls, z);
   }
 
   int m = 65536 / ((boxw * 2 + 1) * (boxh * 2 + 1));
@@ -684,13 +738,23 @@ pixmap_box_blur(pixmap_t *pm, int boxw, int boxh)
 
     const unsigned int *a = tmp + ls * MAX(0, y - boxh);
     const unsigned int *b = tmp + ls * MIN(h - 1, y + boxh);
-    fn(d, a, b, w, boxw, m);
+    fn(d, a, b, w, boxw, m, pk);
   }
 
   free(tmp);
 }
 
 
+/**
+ *
+ */
+void
+pixmap_box_blur(pixmap_t *pm, int boxw, int boxh)
+{
+  pixmap_box_blur0(pm, boxw, boxh, pixmap_kernels);
+}
+
+
 
 /**
  *
@@ -734,7 +798,7 @@ mix_bgr32(uint32_t src, uint32_t dst)
  */
 static void
 drop_shadow_rgba(uint8_t *D, const uint32_t *a, const uint32_t *b,
-                 int width, int boxw, int m)
+                 int width, int boxw, int m, const pixmap_kernels_t *pk)
 {
   uint32_t *d = (uint32_t *)D;
 
@@ -752,6 +816,13 @@ drop_shadow_rgba(uint8_t *D, const uint32_t *a, const uint32_t *b,
     d++;
   }
 
+  if(pk != NULL && x < width - boxw) {
+    int x0 = x;
+    x = pk->pk_drop_shadow_bgr32((uint8_t *)d, a, b, x,
+                                 width - boxw, boxw, m);
+    d += x - x0;
+  }
+
   for(; x < width - boxw; x++) {
     const int x1 = (x + boxw);
     const int x2 = (x - boxw);
@@ -808,7 +879,7 @@ mix_ia(uint8_t *src, uint8_t *dst, int DR, int DA)
  */
 static void
 drop_shadow_ia(uint8_t *d, const uint32_t *a, const uint32_t *b,
-               int width, int boxw, int m)
+               int width, int boxw, int m, const pixmap_kernels_t *pk)
 {
 
   int x;
@@ -850,8 +921,9 @@ drop_shadow_ia(uint8_t *d, const uint32_t *a, const uint32_t *b,
 /**
  *
  */
-void
-pixmap_drop_shadow(pixmap_t *pm, int boxw, int boxh)
+static void
+pixmap_drop_shadow0(pixmap_t *pm, int boxw, int boxh,
+                    const pixmap_kernels_t *pk)
 {
   const uint8_t *s;
   unsigned int *tmp, *t;
@@ -868,7 +940,7 @@ pixmap_drop_shadow(pixmap_t *pm, int boxw, int boxh)
   boxw = MIN(boxw, w);
 
   void (*fn)(uint8_t *dst, const uint32_t *a, const uint32_t *b, int width,
-	     int boxw, int m);
+	     int boxw, int m, const pixmap_kernels_t *pk);
 
   switch(pm->pm_type) {
   case PIXMAP_BGR32:
@@ -918,12 +990,22 @@ pixmap_drop_shadow(pixmap_t *pm, int boxw, int boxh)
 
     const unsigned int *a = tmp + pm->pm_width * MAX(0, y - boxh);
     const unsigned int *b = tmp + pm->pm_width * MIN(h - 1, y + boxh);
-    fn(d, a, b, w, boxw, m);
+    fn(d, a, b, w, boxw, m, pk);
   }
   free(tmp);
 }
 
 
+/**
+ *
+ */
+void
+pixmap_drop_shadow(pixmap_t *pm, int boxw, int boxh)
+{
+  pixmap_drop_shadow0(pm, boxw, boxh, pixmap_kernels);
+}
+
+
 
 
 // gcc -O3 src/misc/pixmap.c -o /tmp/pixmap -Isrc -DLOCAL_MAIN
@@ -956,6 +1038,145 @@ main(int argc, char **argv)
 #endif
 
 
+#if ENABLE_HTTPSERVER
+
+/**
+ * Runs each operation with the plain C code and with every kernel set
+ * the CPU supports, reports throughput and checks that the output is
+ * identical.
+ *
+ * Run with: curl http://<host>:42000/showtime/pixmap/benchmark
+ */
+
+#define BENCH_WIDTH  1919  // Odd on purpose to exercise the scalar tails
+#define BENCH_HEIGHT 1080
+#define BENCH_ROUNDS 10
+
+static HTS_MUTEX_DECL(bench_mutex);
+
+static void
+bench_fill(pixmap_t *pm, unsigned int seed)
+{
+  int i;
+  for(i = 0; i < pm->pm_linesize * pm->pm_height; i++) {
+    seed = seed * 1103515245 + 12345;
+    pm->pm_data[i] = seed >> 16;
+  }
+}
+
+static pixmap_t *
+bench_copy(const pixmap_t *src)
+{
+  pixmap_t *pm = pixmap_create(src->pm_width, src->pm_height,
+                               src->pm_type, 0);
+  if(pm != NULL)
+    memcpy(pm->pm_data, src->pm_data, pm->pm_linesize * pm->pm_height);
+  return pm;
+}
+
+static void
+bench_op(htsbuf_queue_t *out, const char *name, int op)
+{
+  const pixmap_kernels_t *kv[8];
+  int n = pixmap_kernels_list(kv, 8);
+  pixmap_t *ref = NULL;
+  int i, r;
+
+  pixmap_t *src = pixmap_create(BENCH_WIDTH, BENCH_HEIGHT, PIXMAP_I, 0);
+  pixmap_t *dst = pixmap_create(BENCH_WIDTH, BENCH_HEIGHT, PIXMAP_BGR32, 0);
+  if(src == NULL || dst == NULL)
+    goto out;
+
+  bench_fill(src, 1);
+  bench_fill(dst, 2);
+
+  for(i = -1; i < n; i++) {
+    const pixmap_kernels_t *pk = i == -1 ? NULL : kv[i];
+    pixmap_t *pm = NULL;
+    int64_t best = INT64_MAX;
+
+    for(r = 0; r < BENCH_ROUNDS; r++) {
+      if(pm != NULL)
+        pixmap_release(pm);
+      if((pm = bench_copy(dst)) == NULL)
+        goto out;
+
+      int64_t ts = arch_get_ts();
+      switch(op) {
+      case 0:
+        pixmap_composite0(pm, src, 0, 0, 0xc0405080, pk);
+        break;
+      case 1:
+        pixmap_box_blur0(pm, 5, 5, pk);
+        break;
+      case 2:
+        pixmap_drop_shadow0(pm, 5, 5, pk);
+        break;
+      }
+      best = MIN(best, arch_get_ts() - ts);
+    }
+
+    htsbuf_qprintf(out, "%-12s %-6s %8.1f Mpixel/s", name,
+                   pk ? pk->pk_name : "C",
+                   (double)BENCH_WIDTH * BENCH_HEIGHT / MAX(best, 1));
+
+    if(ref == NULL) {
+      ref = pm;
+      htsbuf_qprintf(out, "\n");
+    } else {
+      htsbuf_qprintf(out, "  %s\n",
+                     memcmp(ref->pm_data, pm->pm_data,
+                            pm->pm_linesize * pm->pm_height) ?
+                     "MISMATCH" : "bit exact");
+      pixmap_release(pm);
+    }
+  }
+ out:
+  if(ref != NULL)
+    pixmap_release(ref);
+  if(src != NULL)
+    pixmap_release(src);
+  if(dst != NULL)
+    pixmap_release(dst);
+}
+
+
+/**
+ *
+ */
+static int
+pixmap_benchmark(http_connection_t *hc, const char *remain, void *opaque,
+                 http_cmd_t method)
+{
+  htsbuf_queue_t out;
+
+  htsbuf_queue_init(&out, 0);
+
+  hts_mutex_lock(&bench_mutex);
+  bench_op(&out, "composite", 0);
+  bench_op(&out, "box blur", 1);
+  bench_op(&out, "drop shadow", 2);
+  hts_mutex_unlock(&bench_mutex);
+
+  return http_send_reply(hc, 0, "text/plain; charset=utf-8", NULL, NULL, 0,
+                         &out);
+}
+
+
+/**
+ *
+ */
+static void
+pixmap_benchmark_init(void)
+{
+  http_path_add("/showtime/pixmap/benchmark", NULL, pixmap_benchmark, 1);
+}
+
+INITME(INIT_GROUP_API, pixmap_benchmark_init, NULL);
+
+#endif // ENABLE_HTTPSERVER
+
+
 /**
  *
  */
@@ -0,0 +1,675 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "pixmap_simd.h"
+
+/**
+ * A few notes that apply to all variants:
+ *
+ * Everything is done in 32 bit lanes, one lane per pixel (or channel
+ * for the box blur). All products are of two values <= 255 so they fit
+ * in 16 bits which lets us get away with 16 bit multiplies on SSE2.
+ *
+ * The alpha renormalization (SA * 255 / FA) is done in float. SA <= FA
+ * so the quotient is <= 255 and a non-integer quotient is at least 1/FA
+ * away from the next integer, far more than the rounding error of a
+ * single float division, so truncating gives the exact integer result.
+ *
+ * For the blur, v * m <= 255 * 65536 < 2^24 so v * (m / 65536) is exact
+ * in float too.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define X86_SIMD_TARGET(x) __attribute__((target(x)))
+
+/**
+ *
+ */
+X86_SIMD_TARGET("sse2") static __inline __m128i
+div255_sse2(__m128i x)
+{
+  const __m128i c255 = _mm_set1_epi32(255);
+  return _mm_srli_epi32(_mm_add_epi32(_mm_srli_epi32(_mm_add_epi32(x, c255),
+                                                     8), x), 8);
+}
+
+
+/**
+ * Blend four pixels, same as mix_bgr32() and friends in pixmap.c
+ */
+X86_SIMD_TARGET("sse2") static __inline __m128i
+blend_sse2(__m128i SR, __m128i SG, __m128i SB, __m128i SA,
+           __m128i DR, __m128i DG, __m128i DB, __m128i DA)
+{
+  const __m128i c255 = _mm_set1_epi32(255);
+  const __m128i zero = _mm_setzero_si128();
+
+  __m128i FA = _mm_add_epi32(SA, div255_sse2(_mm_mullo_epi16(_mm_sub_epi32(c255, SA), DA)));
+  __m128i transparent = _mm_cmpeq_epi32(FA, zero);
+
+  // Avoid division by zero, those pixels are masked out below anyway
+  __m128 fa = _mm_cvtepi32_ps(_mm_sub_epi32(FA, transparent));
+  __m128 n = _mm_cvtepi32_ps(_mm_mullo_epi16(SA, c255));
+  SA = _mm_cvttps_epi32(_mm_div_ps(n, fa));
+  DA = _mm_sub_epi32(c255, SA);
+
+  __m128i R = div255_sse2(_mm_add_epi32(_mm_mullo_epi16(SR, SA),
+                                        _mm_mullo_epi16(DR, DA)));
+  __m128i G = div255_sse2(_mm_add_epi32(_mm_mullo_epi16(SG, SA),
+                                        _mm_mullo_epi16(DG, DA)));
+  __m128i B = div255_sse2(_mm_add_epi32(_mm_mullo_epi16(SB, SA),
+                                        _mm_mullo_epi16(DB, DA)));
+
+  __m128i r = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(FA, 24),
+                                        _mm_slli_epi32(B, 16)),
+                           _mm_or_si128(_mm_slli_epi32(G, 8), R));
+  return _mm_andnot_si128(transparent, r);
+}
+
+
+/**
+ *
+ */
+X86_SIMD_TARGET("sse2") static int
+composite_GRAY8_on_BGR32_sse2(uint8_t *dst, const uint8_t *src,
+                              int CR, int CG, int CB, int CA, int width)
+{
+  const __m128i SR = _mm_set1_epi32(CR);
+  const __m128i SG = _mm_set1_epi32(CG);
+  const __m128i SB = _mm_set1_epi32(CB);
+  const __m128i vCA = _mm_set1_epi32(CA);
+  const __m128i cff = _mm_set1_epi32(0xff);
+  const __m128i zero = _mm_setzero_si128();
+  int x;
+
+  for(x = 0; x + 4 <= width; x += 4) {
+    uint32_t s4;
+    memcpy(&s4, src + x, 4);
+    __m128i s = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(s4),
+                                                     zero), zero);
+    __m128i SA = div255_sse2(_mm_mullo_epi16(s, vCA));
+
+    __m128i *p = (__m128i *)(dst + x * 4);
+    __m128i d = _mm_loadu_si128(p);
+
+    __m128i DR = _mm_and_si128(d, cff);
+    __m128i DG = _mm_and_si128(_mm_srli_epi32(d, 8), cff);
+    __m128i DB = _mm_and_si128(_mm_srli_epi32(d, 16), cff);
+    __m128i DA = _mm_srli_epi32(d, 24);
+
+    _mm_storeu_si128(p, blend_sse2(SR, SG, SB, SA, DR, DG, DB, DA));
+  }
+  return x;
+}
+
+
+/**
+ * (v * m) >> 16, see note at top
+ */
+X86_SIMD_TARGET("sse2") static __inline __m128i
+blur_scale_sse2(__m128i v, __m128 m)
+{
+  return _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(v), m));
+}
+
+
+/**
+ *
+ */
+X86_SIMD_TARGET("sse2") static __inline __m128i
+box_sum_sse2(const uint32_t *a, const uint32_t *b, int x1, int x2)
+{
+  __m128i v;
+  v = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(b + x1)),
+                    _mm_loadu_si128((const __m128i *)(a + x2)));
+  v = _mm_sub_epi32(v, _mm_loadu_si128((const __m128i *)(b + x2)));
+  return _mm_sub_epi32(v, _mm_loadu_si128((const __m128i *)(a + x1)));
+}
+
+
+/**
+ * One vector per pixel (4 channels), four pixels per iteration
+ */
+X86_SIMD_TARGET("sse2") static int
+box_blur_4chan_sse2(uint8_t *d, const uint32_t *a, const uint32_t *b,
+                    int x, int end, int boxw, int m)
+{
+  const __m128 vm = _mm_set1_ps(m / 65536.0f);
+
+  for(; x + 4 <= end; x += 4) {
+    const int x1 = 4 * (x + boxw);
+    const int x2 = 4 * (x - boxw);
+
+    __m128i r0 = blur_scale_sse2(box_sum_sse2(a, b, x1,      x2),      vm);
+    __m128i r1 = blur_scale_sse2(box_sum_sse2(a, b, x1 + 4,  x2 + 4),  vm);
+    __m128i r2 = blur_scale_sse2(box_sum_sse2(a, b, x1 + 8,  x2 + 8),  vm);
+    __m128i r3 = blur_scale_sse2(box_sum_sse2(a, b, x1 + 12, x2 + 12), vm);
+
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(r0, r1),
+                                 _mm_packs_epi32(r2, r3));
+    _mm_storeu_si128((__m128i *)d, r);
+    d += 16;
+  }
+  return x;
+}
+
+
+/**
+ *
+ */
+X86_SIMD_TARGET("sse2") static int
+drop_shadow_bgr32_sse2(uint8_t *d, const uint32_t *a, const uint32_t *b,
+                       int x, int end, int boxw, int m)
+{
+  const __m128 vm = _mm_set1_ps(m / 65536.0f);
+  const __m128i cff = _mm_set1_epi32(0xff);
+  const __m128i zero = _mm_setzero_si128();
+
+  for(; x + 4 <= end; x += 4) {
+    __m128i s = blur_scale_sse2(box_sum_sse2(a, b, x + boxw, x - boxw), vm);
+
+    __m128i *p = (__m128i *)d;
+    __m128i px = _mm_loadu_si128(p);
+
+    __m128i SR = _mm_and_si128(px, cff);
+    __m128i SG = _mm_and_si128(_mm_srli_epi32(px, 8), cff);
+    __m128i SB = _mm_and_si128(_mm_srli_epi32(px, 16), cff);
+    __m128i SA = _mm_srli_epi32(px, 24);
+
+    _mm_storeu_si128(p, blend_sse2(SR, SG, SB, SA, zero, zero, zero, s));
+    d += 16;
+  }
+  return x;
+}
+
+
+/**
+ * Running sum of the row in one vector (all four channels at once)
+ */
+X86_SIMD_TARGET("sse2") static void
+integral_4chan_sse2(uint32_t *t, const uint32_t *up, const uint8_t *s,
+                    int width)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i r = zero;
+  int x;
+
+  for(x = 0; x < width; x++) {
+    uint32_t s4;
+    memcpy(&s4, s + x * 4, 4);
+    r = _mm_add_epi32(r, _mm_unpacklo_epi16(
+                        _mm_unpacklo_epi8(_mm_cvtsi32_si128(s4), zero), zero));
+    __m128i v = r;
+    if(up != NULL)
+      v = _mm_add_epi32(v, _mm_loadu_si128((const __m128i *)(up + x * 4)));
+    _mm_storeu_si128((__m128i *)(t + x * 4), v);
+  }
+}
+
+
+static const pixmap_kernels_t pixmap_kernels_sse2 = {
+  .pk_name                     = "sse2",
+  .pk_composite_GRAY8_on_BGR32 = composite_GRAY8_on_BGR32_sse2,
+  .pk_box_blur_4chan           = box_blur_4chan_sse2,
+  .pk_drop_shadow_bgr32        = drop_shadow_bgr32_sse2,
+  .pk_integral_4chan           = integral_4chan_sse2,
+};
+
+
+/**
+ * AVX2, same as above with twice the width
+ */
+X86_SIMD_TARGET("avx2") static __inline __m256i
+div255_avx2(__m256i x)
+{
+  const __m256i c255 = _mm256_set1_epi32(255);
+  return _mm256_srli_epi32(_mm256_add_epi32(
+                             _mm256_srli_epi32(_mm256_add_epi32(x, c255), 8),
+                             x), 8);
+}
+
+
+/**
+ *
+ */
+X86_SIMD_TARGET("avx2") static __inline __m256i
+blend_avx2(__m256i SR, __m256i SG, __m256i SB, __m256i SA,
+           __m256i DR, __m256i DG, __m256i DB, __m256i DA)
+{
+  const __m256i c255 = _mm256_set1_epi32(255);
+  const __m256i zero = _mm256_setzero_si256();
+
+  __m256i FA = _mm256_add_epi32(SA, div255_avx2(_mm256_mullo_epi16(_mm256_sub_epi32(c255, SA), DA)));
+  __m256i transparent = _mm256_cmpeq_epi32(FA, zero);
+
+  __m256 fa = _mm256_cvtepi32_ps(_mm256_sub_epi32(FA, transparent));
+  __m256 n = _mm256_cvtepi32_ps(_mm256_mullo_epi16(SA, c255));
+  SA = _mm256_cvttps_epi32(_mm256_div_ps(n, fa));
+  DA = _mm256_sub_epi32(c255, SA);
+
+  __m256i R = div255_avx2(_mm256_add_epi32(_mm256_mullo_epi16(SR, SA),
+                                           _mm256_mullo_epi16(DR, DA)));
+  __m256i G = div255_avx2(_mm256_add_epi32(_mm256_mullo_epi16(SG, SA),
+                                           _mm256_mullo_epi16(DG, DA)));
+  __m256i B = div255_avx2(_mm256_add_epi32(_mm256_mullo_epi16(SB, SA),
+                                           _mm256_mullo_epi16(DB, DA)));
+
+  __m256i r = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(FA, 24),
+                                              _mm256_slli_epi32(B, 16)),
+                              _mm256_or_si256(_mm256_slli_epi32(G, 8), R));
+  return _mm256_andnot_si256(transparent, r);
+}
+
+
+/**
+ *
+ */
+X86_SIMD_TARGET("avx2") static int
+composite_GRAY8_on_BGR32_avx2(uint8_t *dst, const uint8_t *src,
+                              int CR, int CG, int CB, int CA, int width)
+{
+  const __m256i SR = _mm256_set1_epi32(CR);
+  const __m256i SG = _mm256_set1_epi32(CG);
+  const __m256i SB = _mm256_set1_epi32(CB);
+  const __m256i vCA = _mm256_set1_epi32(CA);
+  const __m256i cff = _mm256_set1_epi32(0xff);
+  int x;
+
+  for(x = 0; x + 8 <= width; x += 8) {
+    __m256i s = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x)));
+    __m256i SA = div255_avx2(_mm256_mullo_epi16(s, vCA));
+
+    __m256i *p = (__m256i *)(dst + x * 4);
+    __m256i d = _mm256_loadu_si256(p);
+
+    __m256i DR = _mm256_and_si256(d, cff);
+    __m256i DG = _mm256_and_si256(_mm256_srli_epi32(d, 8), cff);
+    __m256i DB = _mm256_and_si256(_mm256_srli_epi32(d, 16), cff);
+    __m256i DA = _mm256_srli_epi32(d, 24);
+
+    _mm256_storeu_si256(p, blend_avx2(SR, SG, SB, SA, DR, DG, DB, DA));
+  }
+  return x;
+}
+
+
+/**
+ *
+ */
+X86_SIMD_TARGET("avx2") static __inline __m256i
+box_sum_avx2(const uint32_t *a, const uint32_t *b, int x1, int x2)
+{
+  __m256i v;
+  v = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(b + x1)),
+                       _mm256_loadu_si256((const __m256i *)(a + x2)));
+  v = _mm256_sub_epi32(v, _mm256_loadu_si256((const __m256i *)(b + x2)));
+  return _mm256_sub_epi32(v, _mm256_loadu_si256((const __m256i *)(a + x1)));
+}
+
+
+/**
+ *
+ */
+X86_SIMD_TARGET("avx2") static __inline __m256i
+blur_scale_avx2(__m256i v, __m256 m)
+{
+  return _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(v), m));
+}
+
+
+/**
+ * Two pixels per vector, eight pixels per iteration
+ */
+X86_SIMD_TARGET("avx2") static int
+box_blur_4chan_avx2(uint8_t *d, const uint32_t *a, const uint32_t *b,
+                    int x, int end, int boxw, int m)
+{
+  const __m256 vm = _mm256_set1_ps(m / 65536.0f);
+
+  for(; x + 8 <= end; x += 8) {
+    const int x1 = 4 * (x + boxw);
+    const int x2 = 4 * (x - boxw);
+
+    __m256i r0 = blur_scale_avx2(box_sum_avx2(a, b, x1,      x2),      vm);
+    __m256i r1 = blur_scale_avx2(box_sum_avx2(a, b, x1 + 8,  x2 + 8),  vm);
+    __m256i r2 = blur_scale_avx2(box_sum_avx2(a, b, x1 + 16, x2 + 16), vm);
+    __m256i r3 = blur_scale_avx2(box_sum_avx2(a, b, x1 + 24, x2 + 24), vm);
+
+    // The packs work within 128 bit lanes, fix up the order afterwards
+    __m256i r = _mm256_packus_epi16(_mm256_packs_epi32(r0, r1),
+                                    _mm256_packs_epi32(r2, r3));
+    r = _mm256_permutevar8x32_epi32(r, _mm256_setr_epi32(0, 4, 1, 5,
+                                                         2, 6, 3, 7));
+    _mm256_storeu_si256((__m256i *)d, r);
+    d += 32;
+  }
+  return x;
+}
+
+
+/**
+ *
+ */
+X86_SIMD_TARGET("avx2") static int
+drop_shadow_bgr32_avx2(uint8_t *d, const uint32_t *a, const uint32_t *b,
+                       int x, int end, int boxw, int m)
+{
+  const __m256 vm = _mm256_set1_ps(m / 65536.0f);
+  const __m256i cff = _mm256_set1_epi32(0xff);
+  const __m256i zero = _mm256_setzero_si256();
+
+  for(; x + 8 <= end; x += 8) {
+    __m256i s = blur_scale_avx2(box_sum_avx2(a, b, x + boxw, x - boxw), vm);
+
+    __m256i *p = (__m256i *)d;
+    __m256i px = _mm256_loadu_si256(p);
+
+    __m256i SR = _mm256_and_si256(px, cff);
+    __m256i SG = _mm256_and_si256(_mm256_srli_epi32(px, 8), cff);
+    __m256i SB = _mm256_and_si256(_mm256_srli_epi32(px, 16), cff);
+    __m256i SA = _mm256_srli_epi32(px, 24);
+
+    _mm256_storeu_si256(p, blend_avx2(SR, SG, SB, SA, zero, zero, zero, s));
+    d += 32;
+  }
+  return x;
+}
+
+
+static const pixmap_kernels_t pixmap_kernels_avx2 = {
+  .pk_name                     = "avx2",
+  .pk_composite_GRAY8_on_BGR32 = composite_GRAY8_on_BGR32_avx2,
+  .pk_box_blur_4chan           = box_blur_4chan_avx2,
+  .pk_drop_shadow_bgr32        = drop_shadow_bgr32_avx2,
+  // The integral is a serial dependency along the row, 4 lanes is all
+  // we can use
+  .pk_integral_4chan           = integral_4chan_sse2,
+};
+
+
+/**
+ *
+ */
+int
+pixmap_kernels_list(const pixmap_kernels_t **v, int max)
+{
+  int n = 0;
+  __builtin_cpu_init();
+  if(n < max && __builtin_cpu_supports("avx2"))
+    v[n++] = &pixmap_kernels_avx2;
+  if(n < max && __builtin_cpu_supports("sse2"))
+    v[n++] = &pixmap_kernels_sse2;
+  return n;
+}
+
+
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+
+#include <arm_neon.h>
+
+/**
+ * If we're built for NEON we assume it's there (the rest of the
+ * binary, libav in particular, does too)
+ */
+
+/**
+ *
+ */
+static __inline uint32x4_t
+div255_neon(uint32x4_t x)
+{
+  return vshrq_n_u32(vaddq_u32(vshrq_n_u32(vaddq_u32(x, vdupq_n_u32(255)),
+                                           8), x), 8);
+}
+
+
+/**
+ * ARMv7 has no vector float division. Use the reciprocal estimate
+ * refined with two Newton-Raphson steps (good to ~2^-23) and compute
+ * (n + 0.5) / d instead of n / d. The true fractional part of that is
+ * at least 0.5/d away from any integer which is way more than the
+ * error of the estimate so truncation still gives floor(n / d).
+ */
+static __inline uint32x4_t
+renormalize_alpha_neon(uint32x4_t SA, uint32x4_t FA)
+{
+  float32x4_t d = vcvtq_f32_u32(FA);
+  float32x4_t r = vrecpeq_f32(d);
+  r = vmulq_f32(vrecpsq_f32(d, r), r);
+  r = vmulq_f32(vrecpsq_f32(d, r), r);
+
+  float32x4_t n = vcvtq_f32_u32(vmulq_n_u32(SA, 255));
+  n = vaddq_f32(n, vdupq_n_f32(0.5f));
+  return vcvtq_u32_f32(vmulq_f32(n, r));
+}
+
+
+/**
+ *
+ */
+static __inline uint32x4_t
+blend_neon(uint32x4_t SR, uint32x4_t SG, uint32x4_t SB, uint32x4_t SA,
+           uint32x4_t DR, uint32x4_t DG, uint32x4_t DB, uint32x4_t DA)
+{
+  const uint32x4_t c255 = vdupq_n_u32(255);
+
+  uint32x4_t FA = vaddq_u32(SA, div255_neon(vmulq_u32(vsubq_u32(c255, SA),
+                                                      DA)));
+  uint32x4_t transparent = vceqq_u32(FA, vdupq_n_u32(0));
+
+  // Avoid division by zero, those pixels are masked out below anyway
+  SA = renormalize_alpha_neon(SA, vsubq_u32(FA, transparent));
+  DA = vsubq_u32(c255, SA);
+
+  uint32x4_t R = div255_neon(vmlaq_u32(vmulq_u32(SR, SA), DR, DA));
+  uint32x4_t G = div255_neon(vmlaq_u32(vmulq_u32(SG, SA), DG, DA));
+  uint32x4_t B = div255_neon(vmlaq_u32(vmulq_u32(SB, SA), DB, DA));
+
+  uint32x4_t r = vorrq_u32(vorrq_u32(vshlq_n_u32(FA, 24),
+                                     vshlq_n_u32(B, 16)),
+                           vorrq_u32(vshlq_n_u32(G, 8), R));
+  return vbicq_u32(r, transparent);
+}
+
+
+/**
+ *
+ */
+static int
+composite_GRAY8_on_BGR32_neon(uint8_t *dst, const uint8_t *src,
+                              int CR, int CG, int CB, int CA, int width)
+{
+  const uint32x4_t SR = vdupq_n_u32(CR);
+  const uint32x4_t SG = vdupq_n_u32(CG);
+  const uint32x4_t SB = vdupq_n_u32(CB);
+  const uint32x4_t cff = vdupq_n_u32(0xff);
+  int x;
+
+  for(x = 0; x + 4 <= width; x += 4) {
+    uint32_t s4;
+    memcpy(&s4, src + x, 4);
+    uint8x8_t s8 = vreinterpret_u8_u32(vdup_n_u32(s4));
+    uint32x4_t s = vmovl_u16(vget_low_u16(vmovl_u8(s8)));
+    uint32x4_t SA = div255_neon(vmulq_n_u32(s, CA));
+
+    uint32_t *p = (uint32_t *)(dst + x * 4);
+    uint32x4_t d = vld1q_u32(p);
+
+    uint32x4_t DR = vandq_u32(d, cff);
+    uint32x4_t DG = vandq_u32(vshrq_n_u32(d, 8), cff);
+    uint32x4_t DB = vandq_u32(vshrq_n_u32(d, 16), cff);
+    uint32x4_t DA = vshrq_n_u32(d, 24);
+
+    vst1q_u32(p, blend_neon(SR, SG, SB, SA, DR, DG, DB, DA));
+  }
+  return x;
+}
+
+
+/**
+ *
+ */
+static __inline uint32x4_t
+box_sum_neon(const uint32_t *a, const uint32_t *b, int x1, int x2)
+{
+  uint32x4_t v = vaddq_u32(vld1q_u32(b + x1), vld1q_u32(a + x2));
+  v = vsubq_u32(v, vld1q_u32(b + x2));
+  return vsubq_u32(v, vld1q_u32(a + x1));
+}
+
+
+/**
+ *
+ */
+static __inline uint32x4_t
+blur_scale_neon(uint32x4_t v, float m)
+{
+  return vcvtq_u32_f32(vmulq_n_f32(vcvtq_f32_u32(v), m));
+}
+
+
+/**
+ *
+ */
+static int
+box_blur_4chan_neon(uint8_t *d, const uint32_t *a, const uint32_t *b,
+                    int x, int end, int boxw, int m)
+{
+  const float fm = m / 65536.0f;
+
+  for(; x + 4 <= end; x += 4) {
+    const int x1 = 4 * (x + boxw);
+    const int x2 = 4 * (x - boxw);
+
+    uint32x4_t r0 = blur_scale_neon(box_sum_neon(a, b, x1,      x2),      fm);
+    uint32x4_t r1 = blur_scale_neon(box_sum_neon(a, b, x1 + 4,  x2 + 4),  fm);
+    uint32x4_t r2 = blur_scale_neon(box_sum_neon(a, b, x1 + 8,  x2 + 8),  fm);
+    uint32x4_t r3 = blur_scale_neon(box_sum_neon(a, b, x1 + 12, x2 + 12), fm);
+
+    uint16x8_t lo = vcombine_u16(vmovn_u32(r0), vmovn_u32(r1));
+    uint16x8_t hi = vcombine_u16(vmovn_u32(r2), vmovn_u32(r3));
+    vst1q_u8(d, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+    d += 16;
+  }
+  return x;
+}
+
+
+/**
+ *
+ */
+static int
+drop_shadow_bgr32_neon(uint8_t *d, const uint32_t *a, const uint32_t *b,
+                       int x, int end, int boxw, int m)
+{
+  const float fm = m / 65536.0f;
+  const uint32x4_t cff = vdupq_n_u32(0xff);
+  const uint32x4_t zero = vdupq_n_u32(0);
+
+  for(; x + 4 <= end; x += 4) {
+    uint32x4_t s = blur_scale_neon(box_sum_neon(a, b, x + boxw, x - boxw), fm);
+
+    uint32_t *p = (uint32_t *)d;
+    uint32x4_t px = vld1q_u32(p);
+
+    uint32x4_t SR = vandq_u32(px, cff);
+    uint32x4_t SG = vandq_u32(vshrq_n_u32(px, 8), cff);
+    uint32x4_t SB = vandq_u32(vshrq_n_u32(px, 16), cff);
+    uint32x4_t SA = vshrq_n_u32(px, 24);
+
+    vst1q_u32(p, blend_neon(SR, SG, SB, SA, zero, zero, zero, s));
+    d += 16;
+  }
+  return x;
+}
+
+
+/**
+ *
+ */
+static void
+integral_4chan_neon(uint32_t *t, const uint32_t *up, const uint8_t *s,
+                    int width)
+{
+  uint32x4_t r = vdupq_n_u32(0);
+  int x;
+
+  for(x = 0; x < width; x++) {
+    uint32_t s4;
+    memcpy(&s4, s + x * 4, 4);
+    uint8x8_t s8 = vreinterpret_u8_u32(vdup_n_u32(s4));
+    r = vaddq_u32(r, vmovl_u16(vget_low_u16(vmovl_u8(s8))));
+    uint32x4_t v = r;
+    if(up != NULL)
+      v = vaddq_u32(v, vld1q_u32(up + x * 4));
+    vst1q_u32(t + x * 4, v);
+  }
+}
+
+
+static const pixmap_kernels_t pixmap_kernels_neon = {
+  .pk_name                     = "neon",
+  .pk_composite_GRAY8_on_BGR32 = composite_GRAY8_on_BGR32_neon,
+  .pk_box_blur_4chan           = box_blur_4chan_neon,
+  .pk_drop_shadow_bgr32        = drop_shadow_bgr32_neon,
+  .pk_integral_4chan           = integral_4chan_neon,
+};
+
+
+/**
+ *
+ */
+int
+pixmap_kernels_list(const pixmap_kernels_t **v, int max)
+{
+  int n = 0;
+  if(n < max)
+    v[n++] = &pixmap_kernels_neon;
+  return n;
+}
+
+#else
+
+/**
+ *
+ */
+int
+pixmap_kernels_list(const pixmap_kernels_t **v, int max)
+{
+  return 0;
+}
+
+#endif
+
+
+/**
+ *
+ */
+const pixmap_kernels_t *
+pixmap_kernels_probe(void)
+{
+  const pixmap_kernels_t *pk;
+  return pixmap_kernels_list(&pk, 1) ? pk : NULL;
+}
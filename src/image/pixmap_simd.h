@@ -0,0 +1,63 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Vectorized versions of the inner loops in pixmap.c
+ *
+ * The span functions process pixels [x, end) and return how far they
+ * got (they only do whole vectors), the scalar code in pixmap.c
+ * finishes the rest. Output must be bit exact with the scalar code.
+ */
+typedef struct pixmap_kernels {
+  const char *pk_name;
+
+  int (*pk_composite_GRAY8_on_BGR32)(uint8_t *dst, const uint8_t *src,
+                                     int CR, int CG, int CB, int CA,
+                                     int width);
+
+  int (*pk_box_blur_4chan)(uint8_t *d, const uint32_t *a, const uint32_t *b,
+                           int x, int end, int boxw, int m);
+
+  int (*pk_drop_shadow_bgr32)(uint8_t *d, const uint32_t *a,
+                              const uint32_t *b, int x, int end,
+                              int boxw, int m);
+
+  // Summed area table row for 4 channel pixmaps. 'up' is the previous
+  // row or NULL for the first one. Does the entire row
+  void (*pk_integral_4chan)(uint32_t *t, const uint32_t *up,
+                            const uint8_t *s, int width);
+
+} pixmap_kernels_t;
+
+
+/**
+ * Best set of kernels for the CPU we're running on, NULL if there is
+ * nothing better than the plain C code
+ */
+const pixmap_kernels_t *pixmap_kernels_probe(void);
+
+/**
+ * All kernel sets usable on this CPU, best first. Returns how many were
+ * stored in 'v'. Mostly for benchmarking
+ */
+int pixmap_kernels_list(const pixmap_kernels_t **v, int max);
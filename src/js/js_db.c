@@ -50,7 +50,7 @@ js_db_finalize(JSContext *cx, JSObject *obj)
     sqlite3_finalize(jd->jd_stmt);
 
   if(jd->jd_db != NULL)
-    sqlite3_close(jd->jd_db);
+    db_close(jd->jd_db);
 
   if(jd->jd_debug)
     TRACE(TRACE_DEBUG, "JS", "Database %s finalized", jd->jd_name);
@@ -119,7 +119,7 @@ js_db_close(JSContext *cx, JSObject *obj, uintN argc,
     jd->jd_stmt = NULL;
   }
 
-  sqlite3_close(jd->jd_db);
+  db_close(jd->jd_db);
   jd->jd_db = NULL;
 
   return JS_TRUE;
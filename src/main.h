@@ -29,11 +29,13 @@
 
 #include "compiler.h"
 
-#if __GNUC__ >= 4 && __GNUC_MINOR__ >=6
+#ifndef static_assert // C11 <assert.h> provides it
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
 #define static_assert(x, y) _Static_assert(x, y)
 #else
 #define static_assert(x, y)
 #endif
+#endif
 
 void parse_opts(int argc, char **argv);
 
@@ -230,6 +232,7 @@ typedef struct gconf {
   int disable_http_reuse;
   int enable_experimental;
   int enable_detailed_avdiff;
+  int enable_frametrace_overlay;
   int enable_force_ecmascript;
   int enable_hls_debug;
   int enable_ftp_client_debug;
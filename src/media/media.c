@@ -381,6 +381,9 @@ mp_release(media_pipe_t *mp)
   hts_mutex_destroy(&mp->mp_overlay_mutex);
 
   pool_destroy(mp->mp_mb_pool);
+#if ENABLE_LIBAV
+  media_buf_pools_destroy(mp);
+#endif
 
   if(mp->mp_satisfied == 0)
     atomic_dec(&media_buffer_hungry);
@@ -206,6 +206,12 @@ typedef struct media_pipe {
 
   pool_t *mp_mb_pool;
 
+  /**
+   * Refcounted payload buffers for media_buf's, see MB_PAYLOAD_MIN.
+   * Created on demand, protected by mp_mutex
+   */
+  struct AVBufferPool *mp_payload_pools[MB_PAYLOAD_POOLS];
+
 
   unsigned int mp_buffer_current; // Bytes current queued (total for all queues)
   unsigned int mp_buffer_delay;   // Current delay of buffer in µs
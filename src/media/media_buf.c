@@ -17,6 +17,8 @@
  *  This program is also available under a commercial proprietary license.
  *  For more information, contact andreas@lonelycoder.com
  */
+#include <string.h>
+
 #include "media.h"
 
 #if ENABLE_LIBAV
@@ -42,12 +44,70 @@ media_buf_dtor_avpacket(media_buf_t *mb)
 
 #define BUF_PAD 32
 
+
+/**
+ * Allocate a refcounted payload for 'pkt' from the media pipe's
+ * buffer pools. Steady state playback recycles the same buffers so
+ * no malloc is needed per packet.
+ *
+ * mp_mutex must be held
+ */
+static void
+media_buf_payload_alloc(media_pipe_t *mp, AVPacket *pkt, size_t size)
+{
+  const size_t need = size + FF_INPUT_BUFFER_PADDING_SIZE;
+  int c;
+
+  for(c = 0; c < MB_PAYLOAD_POOLS; c++)
+    if(need <= MB_PAYLOAD_MIN << c)
+      break;
+
+  if(c == MB_PAYLOAD_POOLS) {
+    av_new_packet(pkt, size);
+    return;
+  }
+
+  if(mp->mp_payload_pools[c] == NULL)
+    mp->mp_payload_pools[c] = av_buffer_pool_init(MB_PAYLOAD_MIN << c, NULL);
+
+  av_init_packet(pkt);
+  pkt->buf = av_buffer_pool_get(mp->mp_payload_pools[c]);
+  if(pkt->buf == NULL) {
+    av_new_packet(pkt, size);
+    return;
+  }
+  pkt->data = pkt->buf->data;
+  pkt->size = size;
+  memset(pkt->data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+}
+
+
+/**
+ * Buffers still referenced by decoders are released once they
+ * are unref'ed, the pools themselves go away with the last buffer
+ */
+void
+media_buf_pools_destroy(media_pipe_t *mp)
+{
+  int i;
+  for(i = 0; i < MB_PAYLOAD_POOLS; i++)
+    if(mp->mp_payload_pools[i] != NULL)
+      av_buffer_pool_uninit(&mp->mp_payload_pools[i]);
+}
+
+
+/**
+ *
+ */
 media_buf_t *
 media_buf_alloc_locked(media_pipe_t *mp, size_t size)
 {
   hts_mutex_assert(&mp->mp_mutex);
   media_buf_t *mb = pool_get(mp->mp_mb_pool);
-  av_new_packet(&mb->mb_pkt, size);
+  if(size > 0)
+    media_buf_payload_alloc(mp, &mb->mb_pkt, size);
+  else
+    av_new_packet(&mb->mb_pkt, 0);
   mb->mb_dtor = media_buf_dtor_avpacket;
   return mb;
 }
@@ -74,11 +134,45 @@ media_buf_from_avpkt_unlocked(media_pipe_t *mp, AVPacket *pkt)
 
   hts_mutex_lock(&mp->mp_mutex);
   mb = pool_get(mp->mp_mb_pool);
-  hts_mutex_unlock(&mp->mp_mutex);
+
+  if(pkt->buf == NULL) {
+    // Payload is owned by the demuxer, copy into one of our buffers
+    media_buf_payload_alloc(mp, &mb->mb_pkt, pkt->size);
+    hts_mutex_unlock(&mp->mp_mutex);
+    memcpy(mb->mb_data, pkt->data, pkt->size);
+    av_packet_copy_props(&mb->mb_pkt, pkt);
+  } else {
+    hts_mutex_unlock(&mp->mp_mutex);
+    av_packet_ref(&mb->mb_pkt, pkt);
+  }
 
   mb->mb_dtor = media_buf_dtor_avpacket;
+  return mb;
+}
+
+
+/**
+ * Same as media_buf_from_avpkt_unlocked() but steals the payload
+ * reference (and all other properties) from 'pkt' instead of adding
+ * a new one. 'pkt' is blank on return
+ */
+media_buf_t *
+media_buf_from_avpkt_move_unlocked(media_pipe_t *mp, AVPacket *pkt)
+{
+  media_buf_t *mb;
 
-  av_packet_ref(&mb->mb_pkt, pkt);
+  if(pkt->buf == NULL) {
+    mb = media_buf_from_avpkt_unlocked(mp, pkt);
+    av_packet_unref(pkt);
+    return mb;
+  }
+
+  hts_mutex_lock(&mp->mp_mutex);
+  mb = pool_get(mp->mp_mb_pool);
+  hts_mutex_unlock(&mp->mp_mutex);
+
+  mb->mb_dtor = media_buf_dtor_avpacket;
+  av_packet_move_ref(&mb->mb_pkt, pkt);
   return mb;
 }
 
@@ -24,6 +24,14 @@ struct AVPacket;
 struct media_pipe;
 struct media_queue;
 
+/**
+ * Payloads up to (MB_PAYLOAD_MIN << (MB_PAYLOAD_POOLS - 1)) bytes are
+ * allocated from per media_pipe pools with power of two size classes.
+ * Anything larger goes straight to av_malloc()
+ */
+#define MB_PAYLOAD_MIN   4096
+#define MB_PAYLOAD_POOLS 9
+
 /**
  *
  */
@@ -167,4 +175,9 @@ media_buf_t *media_buf_alloc_unlocked(struct media_pipe *mp,
 media_buf_t *media_buf_from_avpkt_unlocked(struct media_pipe *mp,
                                            struct AVPacket *pkt);
 
+media_buf_t *media_buf_from_avpkt_move_unlocked(struct media_pipe *mp,
+                                                struct AVPacket *pkt);
+
+void media_buf_pools_destroy(struct media_pipe *mp);
+
 void media_buf_dtor_frame_info(media_buf_t *mb);
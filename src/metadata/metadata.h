@@ -324,6 +324,19 @@ int metadb_metadata_writex(void *db, const char *url, time_t mtime,
                            time_t parent_mtime,
                            metadata_index_status_t indexstatus);
 
+typedef struct metadb_batch metadb_batch_t;
+
+metadb_batch_t *metadb_batch_create(void);
+
+void metadb_batch_add(void *db, metadb_batch_t *mb, const char *url,
+                      time_t mtime, const metadata_t *md, const char *parent,
+                      time_t parent_mtime,
+                      metadata_index_status_t indexstatus);
+
+void metadb_batch_flush(void *db, metadb_batch_t *mb);
+
+void metadb_batch_destroy(void *db, metadb_batch_t *mb);
+
 
 metadata_t *metadb_metadata_get(void *db, const char *url, time_t mtime);
 
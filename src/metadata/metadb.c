@@ -38,6 +38,10 @@
 #include "notifications.h"
 #include "metadata_sources.h"
 
+#if ENABLE_HTTPSERVER
+#include "networking/http_server.h"
+#endif
+
 // If not set to true by metadb_init() no metadb actions will occur
 static db_pool_t *metadb_pool;
 
@@ -112,7 +116,13 @@ metadb_init(void)
 
   //  unlink(buf);
 
-  metadb_pool = db_pool_create(buf, 2);
+  // Directory scanners look up metadata from up to 8 probe workers at
+  // once (SCANNER_MAX_INFLIGHT in fa_scanner.c). Handles beyond the
+  // pool size are closed when put back so with a pool of 2 most of
+  // those lookups would pay for sqlite3_open_v2() and a schema parse.
+  // The page cache is shared (SQLITE_OPEN_SHAREDCACHE) so idle handles
+  // are cheap
+  metadb_pool = db_pool_create(buf, 8);
   db = metadb_get();
   if(db == NULL)
     return;
@@ -173,8 +183,8 @@ db_item_get(sqlite3 *db, const char *url, time_t *mtimep)
   int64_t rval = METADATA_PERMANENT_ERROR;
   sqlite3_stmt *stmt;
 
-  rc = db_prepare(db, &stmt,
-		  "SELECT id,mtime from item where url=?1 ");
+  rc = db_prepare_cached(db, &stmt,
+			 "SELECT id,mtime from item where url=?1 ");
   if(rc)
     return METADATA_PERMANENT_ERROR;
   sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
@@ -188,7 +198,7 @@ db_item_get(sqlite3 *db, const char *url, time_t *mtimep)
   } else if(rc == SQLITE_LOCKED)
     rval = METADATA_DEADLOCK;
 
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
   return rval;
 }
 
@@ -203,11 +213,11 @@ db_item_create(sqlite3 *db, const char *url, int contenttype, time_t mtime,
   int rc;
   sqlite3_stmt *stmt;
 
-  rc = db_prepare(db, &stmt,
-		  "INSERT INTO item "
-		  "(url, contenttype, mtime, parent, indexstatus) "
-		  "VALUES "
-		  "(?1, ?2, ?3, ?4, ?5)");
+  rc = db_prepare_cached(db, &stmt,
+			 "INSERT INTO item "
+			 "(url, contenttype, mtime, parent, indexstatus) "
+			 "VALUES "
+			 "(?1, ?2, ?3, ?4, ?5)");
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -222,7 +232,7 @@ db_item_create(sqlite3 *db, const char *url, int contenttype, time_t mtime,
   sqlite3_bind_int(stmt, 5, indexstatus);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
 
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
@@ -245,12 +255,12 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
   int64_t rval = METADATA_PERMANENT_ERROR;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT id "
-		  "FROM artist "
-		  "WHERE title=?1 "
-		  "AND ds_id=?2"
-		  "AND (?3 OR ext_id = ?4)");
+  rc = db_prepare_cached(db, &sel,
+			 "SELECT id "
+			 "FROM artist "
+			 "WHERE title=?1 "
+			 "AND ds_id=?2"
+			 "AND (?3 OR ext_id = ?4)");
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -269,11 +279,11 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
 
     sqlite3_stmt *ins;
 
-    rc = db_prepare(db, &ins, 
-		    "INSERT INTO artist "
-		    "(title, ds_id, ext_id) "
-		    "VALUES "
-		    "(?1, ?2, ?3)");
+    rc = db_prepare_cached(db, &ins, 
+			   "INSERT INTO artist "
+			   "(title, ds_id, ext_id) "
+			   "VALUES "
+			   "(?1, ?2, ?3)");
 
     if(rc == SQLITE_OK) {
       sqlite3_bind_text(ins, 1, title, -1, SQLITE_STATIC);
@@ -281,7 +291,7 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
       if(ext_id)
 	sqlite3_bind_text(ins, 3, ext_id, -1, SQLITE_STATIC);
       rc = db_step(ins);
-      sqlite3_finalize(ins);
+      db_stmt_release(ins);
       if(rc == SQLITE_LOCKED)
 	rval = METADATA_DEADLOCK;
       if(rc == SQLITE_DONE)
@@ -291,7 +301,7 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
     rval = METADATA_DEADLOCK;
   }
 
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return rval;
 }
 
@@ -308,13 +318,13 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
   sqlite3_stmt *sel;
 
 
-  rc = db_prepare(db, &sel,
-		  "SELECT id "
-		  "FROM album "
-		  "WHERE title=?1 "
-		  "AND artist_id IS ?2 "
-		  "AND ds_id = ?3 "
-		  "AND (?4 OR ext_id = ?5)");
+  rc = db_prepare_cached(db, &sel,
+			 "SELECT id "
+			 "FROM album "
+			 "WHERE title=?1 "
+			 "AND artist_id IS ?2 "
+			 "AND ds_id = ?3 "
+			 "AND (?4 OR ext_id = ?5)");
 
   if(rc != SQLITE_OK)
     return  METADATA_PERMANENT_ERROR;
@@ -334,11 +344,11 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
     // No entry found, INSERT it
     sqlite3_stmt *ins;
 
-    rc = db_prepare(db, &ins,
-		    "INSERT INTO album "
-		    "(title, ds_id, artist_id, ext_id) "
-		    "VALUES "
-		    "(?1, ?3, ?2, ?4)");
+    rc = db_prepare_cached(db, &ins,
+			   "INSERT INTO album "
+			   "(title, ds_id, artist_id, ext_id) "
+			   "VALUES "
+			   "(?1, ?3, ?2, ?4)");
 
     if(rc == SQLITE_OK) {
       sqlite3_bind_text(ins, 1, album, -1, SQLITE_STATIC);
@@ -349,7 +359,7 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
 	sqlite3_bind_text(ins, 4, ext_id, -1, SQLITE_STATIC);
 
       rc = db_step(ins);
-      sqlite3_finalize(ins);
+      db_stmt_release(ins);
       if(rc == SQLITE_DONE)
 	rval = sqlite3_last_insert_rowid(db);
       if(rc == SQLITE_LOCKED)
@@ -358,7 +368,7 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
   } else if(rc == SQLITE_LOCKED)
     rval = METADATA_DEADLOCK;
 
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return rval;
 }
 
@@ -374,11 +384,11 @@ metadb_insert_albumart(void *db, int64_t album_id, const char *url,
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
-		  "INSERT INTO albumart "
-		  "(album_id, url, width, height) "
-		  "VALUES "
-		  "(?1, ?2, ?3, ?4)");
+  rc = db_prepare_cached(db, &ins,
+			 "INSERT INTO albumart "
+			 "(album_id, url, width, height) "
+			 "VALUES "
+			 "(?1, ?2, ?3, ?4)");
 
   if(rc != SQLITE_OK)
     return;
@@ -388,7 +398,7 @@ metadb_insert_albumart(void *db, int64_t album_id, const char *url,
   if(width) sqlite3_bind_int64(ins, 3, width);
   if(height) sqlite3_bind_int64(ins, 4, height);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_stmt_release(ins);
 }
 
 
@@ -402,11 +412,11 @@ metadb_insert_artistpic(void *db, int64_t artist_id, const char *url,
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
-		  "INSERT INTO artistpic "
-		  "(artist_id, url, width, height) "
-		  "VALUES "
-		  "(?1, ?2, ?3, ?4)");
+  rc = db_prepare_cached(db, &ins,
+			 "INSERT INTO artistpic "
+			 "(artist_id, url, width, height) "
+			 "VALUES "
+			 "(?1, ?2, ?3, ?4)");
 
   if(rc != SQLITE_OK)
     return;
@@ -416,7 +426,7 @@ metadb_insert_artistpic(void *db, int64_t artist_id, const char *url,
   if(width) sqlite3_bind_int64(ins, 3, width);
   if(height) sqlite3_bind_int64(ins, 4, height);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_stmt_release(ins);
 }
 
 /**
@@ -430,12 +440,12 @@ metadb_insert_videoart(void *db, int64_t videoitem_id, const char *url,
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
-		  "INSERT OR REPLACE INTO videoart "
-		  "(videoitem_id, url, width, height, "
-		  "type, weight, grp, titled) "
-		  "VALUES "
-		  "(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)");
+  rc = db_prepare_cached(db, &ins,
+			 "INSERT OR REPLACE INTO videoart "
+			 "(videoitem_id, url, width, height, "
+			 "type, weight, grp, titled) "
+			 "VALUES "
+			 "(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)");
 
   if(rc != SQLITE_OK)
     return;
@@ -450,7 +460,7 @@ metadb_insert_videoart(void *db, int64_t videoitem_id, const char *url,
   sqlite3_bind_int(ins, 8, titled);
 
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_stmt_release(ins);
 }
 
 
@@ -463,15 +473,15 @@ metadb_delete_videoart(void *db, int64_t videoitem_id)
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
-		  "DELETE FROM videoart WHERE videoitem_id = ?1");
+  rc = db_prepare_cached(db, &ins,
+			 "DELETE FROM videoart WHERE videoitem_id = ?1");
 
   if(rc != SQLITE_OK)
     return;
   
   sqlite3_bind_int64(ins, 1, videoitem_id);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_stmt_release(ins);
 }
 
 
@@ -494,12 +504,12 @@ metadb_insert_videocast(void *db, int64_t videoitem_id,
    sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
-		  "INSERT OR REPLACE INTO videocast "
-		  "(videoitem_id, name, character, department, job, "
-		  "\"order\", image, width, height, ext_id) "
-		  "VALUES "
-		  "(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10)");
+  rc = db_prepare_cached(db, &ins,
+			 "INSERT OR REPLACE INTO videocast "
+			 "(videoitem_id, name, character, department, job, "
+			 "\"order\", image, width, height, ext_id) "
+			 "VALUES "
+			 "(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10)");
 
   if(rc != SQLITE_OK)
     return;
@@ -515,7 +525,7 @@ metadb_insert_videocast(void *db, int64_t videoitem_id,
   if(height) sqlite3_bind_int(ins, 9, height);
   sqlite3_bind_text(ins, 10, ext_id, -1, SQLITE_STATIC);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_stmt_release(ins);
 }
 
 
@@ -528,15 +538,15 @@ metadb_delete_videocast(void *db, int64_t videoitem_id)
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
-		  "DELETE FROM videocast WHERE videoitem_id = ?1");
+  rc = db_prepare_cached(db, &ins,
+			 "DELETE FROM videocast WHERE videoitem_id = ?1");
 
   if(rc != SQLITE_OK)
     return;
   
   sqlite3_bind_int64(ins, 1, videoitem_id);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_stmt_release(ins);
 }
 
 
@@ -549,11 +559,11 @@ metadb_insert_videogenre(void *db, int64_t videoitem_id, const char *title)
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
-		  "INSERT OR REPLACE INTO videogenre "
-		  "(videoitem_id, title) "
-		  "VALUES "
-		  "(?1, ?2)");
+  rc = db_prepare_cached(db, &ins,
+			 "INSERT OR REPLACE INTO videogenre "
+			 "(videoitem_id, title) "
+			 "VALUES "
+			 "(?1, ?2)");
 
   if(rc != SQLITE_OK)
     return;
@@ -561,7 +571,7 @@ metadb_insert_videogenre(void *db, int64_t videoitem_id, const char *title)
   sqlite3_bind_int64(ins, 1, videoitem_id);
   sqlite3_bind_text(ins, 2, title, -1, SQLITE_STATIC);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_stmt_release(ins);
 }
 
 
@@ -596,20 +606,20 @@ metadb_insert_audioitem(sqlite3 *db, int64_t item_id, const metadata_t *md,
   for(i = 0; i < 2; i++) {
     sqlite3_stmt *stmt;
 
-    rc = db_prepare(db, &stmt,
-		    i == 0 ? 
-		    "INSERT OR FAIL INTO audioitem "
-		    "(item_id, title, album_id, artist_id, duration, ds_id, track) "
-		    "VALUES "
-		    "(?1, ?2, ?3, ?4, ?5, 1, ?6)"
-		    :
-		    "UPDATE audioitem SET "
-		    "title = ?2, "
-		    "album_id = ?3, "
-		    "artist_id = ?4, "
-		    "duration = ?5 "
-		    "WHERE item_id = ?1 AND ds_id = 1"
-		    );
+    rc = db_prepare_cached(db, &stmt,
+			   i == 0 ? 
+			   "INSERT OR FAIL INTO audioitem "
+			   "(item_id, title, album_id, artist_id, duration, ds_id, track) "
+			   "VALUES "
+			   "(?1, ?2, ?3, ?4, ?5, 1, ?6)"
+			   :
+			   "UPDATE audioitem SET "
+			   "title = ?2, "
+			   "album_id = ?3, "
+			   "artist_id = ?4, "
+			   "duration = ?5 "
+			   "WHERE item_id = ?1 AND ds_id = 1"
+			   );
 
     if(rc != SQLITE_OK)
       return METADATA_PERMANENT_ERROR;
@@ -630,7 +640,7 @@ metadb_insert_audioitem(sqlite3 *db, int64_t item_id, const metadata_t *md,
     sqlite3_bind_int(stmt, 6, md->md_track);
 
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
     if(rc == SQLITE_CONSTRAINT && i == 0)
       continue;
     break;
@@ -871,12 +881,12 @@ metadb_insert_stream(sqlite3 *db, int64_t videoitem_id,
     return 0;
   }
 
-  rc = db_prepare(db, &stmt,
-		  "INSERT INTO videostream "
-		  "(videoitem_id, streamindex, info, isolang, "
-		  "codec, mediatype, disposition, title) "
-		  "VALUES "
-		  "(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)");
+  rc = db_prepare_cached(db, &stmt,
+			 "INSERT INTO videostream "
+			 "(videoitem_id, streamindex, info, isolang, "
+			 "codec, mediatype, disposition, title) "
+			 "VALUES "
+			 "(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)");
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -895,7 +905,7 @@ metadb_insert_stream(sqlite3 *db, int64_t videoitem_id,
     sqlite3_bind_text(stmt, 8, rstr_get(ms->ms_title), -1, SQLITE_STATIC);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
   return rc2metadatacode(rc);
 }
 
@@ -910,8 +920,8 @@ metadb_set_streams(sqlite3 *db, int64_t videoitem_id, const metadata_t *md)
   sqlite3_stmt *stmt;
   int rc, r;
 
-  rc = db_prepare(db, &stmt,
-		  "DELETE FROM videostream WHERE videoitem_id = ?1");
+  rc = db_prepare_cached(db, &stmt,
+			 "DELETE FROM videostream WHERE videoitem_id = ?1");
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -919,7 +929,7 @@ metadb_set_streams(sqlite3 *db, int64_t videoitem_id, const metadata_t *md)
   sqlite3_bind_int64(stmt, 1, videoitem_id);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
   if(rc != SQLITE_DONE)
@@ -951,12 +961,12 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
     sqlite3_stmt *stmt;
 
     if(i == 1) {
-      rc = db_prepare(db, &stmt,
-		      "SELECT id "
-		      "FROM videoitem "
-		      "WHERE (?5 OR item_id = ?1) "
-		      "AND ds_id = ?2 "
-		      "AND (?3 OR ext_id = ?4)");
+      rc = db_prepare_cached(db, &stmt,
+			     "SELECT id "
+			     "FROM videoitem "
+			     "WHERE (?5 OR item_id = ?1) "
+			     "AND ds_id = ?2 "
+			     "AND (?3 OR ext_id = ?4)");
 
       if(rc != SQLITE_OK)
 	return METADATA_PERMANENT_ERROR;
@@ -970,7 +980,7 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
 
       rc = db_step(stmt);
       if(rc != SQLITE_ROW) {
-	sqlite3_finalize(stmt);
+	db_stmt_release(stmt);
 	if(rc == SQLITE_LOCKED)
 	  return METADATA_DEADLOCK;
 	TRACE(TRACE_ERROR, "SQLITE", "SQL Error 0x%x at %s:%d",
@@ -978,39 +988,39 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
 	return METADATA_PERMANENT_ERROR;
       }
       id = sqlite3_column_int64(stmt, 0);
-      sqlite3_finalize(stmt);
+      db_stmt_release(stmt);
     }
 
 
-    rc = db_prepare(db, &stmt,
-		    i == 0 ? 
-		    "INSERT OR FAIL INTO videoitem "
-		    "(item_id, ds_id, ext_id, "
-		    "title, duration, format, type, tagline, description, "
-		    "year, rating, rate_count, imdb_id, status, weight, "
-		    "querytype, cfgid, parent_id, idx) "
-		    "VALUES "
-		    "(?1, ?2, ?4, "
-		    "?5, ?6, ?7, ?8, ?9, ?10, "
-		    "?11, ?12, ?13, ?14, ?15, ?16, ?17, ?18, ?19, ?20)"
-		    :
-		    "UPDATE videoitem SET "
-		    "title = ?5, "
-		    "duration = ?6, "
-		    "format = ?7, "
-		    "type = ?8, "
-		    "tagline = ?9, "
-		    "description = ?10, "
-		    "year = ?11, "
-		    "rating = ?12, "
-		    "rate_count = ?13, "
-		    "imdb_id = ?14, "
-		    "status = ?15, "
-		    "cfgid = ?18, "
-		    "parent_id = ?19, "
-		    "idx = ?20 "
-		    "WHERE id = ?3 "
-		    );
+    rc = db_prepare_cached(db, &stmt,
+			   i == 0 ? 
+			   "INSERT OR FAIL INTO videoitem "
+			   "(item_id, ds_id, ext_id, "
+			   "title, duration, format, type, tagline, description, "
+			   "year, rating, rate_count, imdb_id, status, weight, "
+			   "querytype, cfgid, parent_id, idx) "
+			   "VALUES "
+			   "(?1, ?2, ?4, "
+			   "?5, ?6, ?7, ?8, ?9, ?10, "
+			   "?11, ?12, ?13, ?14, ?15, ?16, ?17, ?18, ?19, ?20)"
+			   :
+			   "UPDATE videoitem SET "
+			   "title = ?5, "
+			   "duration = ?6, "
+			   "format = ?7, "
+			   "type = ?8, "
+			   "tagline = ?9, "
+			   "description = ?10, "
+			   "year = ?11, "
+			   "rating = ?12, "
+			   "rate_count = ?13, "
+			   "imdb_id = ?14, "
+			   "status = ?15, "
+			   "cfgid = ?18, "
+			   "parent_id = ?19, "
+			   "idx = ?20 "
+			   "WHERE id = ?3 "
+			   );
 
     if(rc != SQLITE_OK)
       return METADATA_PERMANENT_ERROR;
@@ -1060,7 +1070,7 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
     sqlite3_bind_int64(stmt, 18, cfgid);
 
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
     if(rc == SQLITE_CONSTRAINT && i == 0)
       continue;
     if(i == 0)
@@ -1121,19 +1131,19 @@ metadb_insert_imageitem(sqlite3 *db, int64_t item_id, const metadata_t *md)
   for(i = 0; i < 2; i++) {
     sqlite3_stmt *stmt;
 
-    rc = db_prepare(db, &stmt,
-		    i == 0 ? 
-		    "INSERT OR FAIL INTO imageitem "
-		    "(item_id, original_time, manufacturer, equipment) "
-		    "VALUES "
-		    "(?1, ?2, ?3, ?4)"
-		    :
-		    "UPDATE imageitem SET "
-		    "original_time = ?2, "
-		    "manufacturer = ?3, "
-		    "equipment = ?4 "
-		    "WHERE item_id = ?1"
-		    );
+    rc = db_prepare_cached(db, &stmt,
+			   i == 0 ? 
+			   "INSERT OR FAIL INTO imageitem "
+			   "(item_id, original_time, manufacturer, equipment) "
+			   "VALUES "
+			   "(?1, ?2, ?3, ?4)"
+			   :
+			   "UPDATE imageitem SET "
+			   "original_time = ?2, "
+			   "manufacturer = ?3, "
+			   "equipment = ?4 "
+			   "WHERE item_id = ?1"
+			   );
 
     if(rc != SQLITE_OK)
       return METADATA_PERMANENT_ERROR;
@@ -1150,7 +1160,7 @@ metadb_insert_imageitem(sqlite3 *db, int64_t item_id, const metadata_t *md)
 		      -1, SQLITE_STATIC);
     
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
     if(rc == SQLITE_CONSTRAINT && i == 0)
       continue;
     break;
@@ -1219,7 +1229,7 @@ metadb_metadata_writex(void *db, const char *url, time_t mtime,
     char *x = strrchr(sql, ',');
     if(x != NULL) {
       *x = ' ';
-      rc = db_prepare(db, &stmt, sql);
+      rc = db_prepare_cached(db, &stmt, sql);
 
       if(rc != SQLITE_OK)
         return METADATA_PERMANENT_ERROR;
@@ -1232,8 +1242,8 @@ metadb_metadata_writex(void *db, const char *url, time_t mtime,
       sqlite3_bind_int(stmt,   5, indexstatus);
 
       rc = db_step(stmt);
-      sqlite3_finalize(stmt);
-      if(rc == METADATA_DEADLOCK)
+      db_stmt_release(stmt);
+      if(rc == SQLITE_LOCKED)
         return METADATA_DEADLOCK;
     }
   }
@@ -1265,11 +1275,8 @@ metadb_metadata_writex(void *db, const char *url, time_t mtime,
 /**
  *
  */
-void
-metadb_metadata_write(void *db, const char *url, time_t mtime,
-		      const metadata_t *md, const char *parent,
-		      time_t parent_mtime,
-                      metadata_index_status_t indexstatus)
+static int
+metadb_metadata_writable(const metadata_t *md)
 {
   switch(md->md_contenttype) {
   case CONTENT_AUDIO:
@@ -1278,10 +1285,24 @@ metadb_metadata_write(void *db, const char *url, time_t mtime,
   case CONTENT_DIR:
   case CONTENT_DVD:
   case CONTENT_SHARE:
-    break;
+    return 1;
   default:
-    return;
+    return 0;
   }
+}
+
+
+/**
+ *
+ */
+void
+metadb_metadata_write(void *db, const char *url, time_t mtime,
+		      const metadata_t *md, const char *parent,
+		      time_t parent_mtime,
+                      metadata_index_status_t indexstatus)
+{
+  if(!metadb_metadata_writable(md))
+    return;
 
   while(1) {
     if(db_begin(db))
@@ -1303,6 +1324,154 @@ metadb_metadata_write(void *db, const char *url, time_t mtime,
 }
 
 
+/**
+ * Batched metadata writes
+ *
+ * Items are queued and written in a single transaction when the batch
+ * fills up or is flushed explicitly. Each item is wrapped in a savepoint
+ * so a failing item is rolled back on its own without taking the rest
+ * of the batch with it (same semantics as metadb_metadata_write()).
+ *
+ * The metadata_t passed to metadb_batch_add() is not copied and must
+ * stay valid until the batch has been flushed.
+ */
+#define METADB_BATCH_SIZE 256
+
+typedef struct metadb_batch_item {
+  char *mbi_url;
+  char *mbi_parent;
+  time_t mbi_mtime;
+  time_t mbi_parent_mtime;
+  const metadata_t *mbi_md;
+  metadata_index_status_t mbi_indexstatus;
+} metadb_batch_item_t;
+
+struct metadb_batch {
+  int mb_count;
+  metadb_batch_item_t mb_items[METADB_BATCH_SIZE];
+};
+
+
+/**
+ *
+ */
+metadb_batch_t *
+metadb_batch_create(void)
+{
+  return calloc(1, sizeof(metadb_batch_t));
+}
+
+
+/**
+ *
+ */
+static void
+metadb_batch_clear(metadb_batch_t *mb)
+{
+  int i;
+  for(i = 0; i < mb->mb_count; i++) {
+    free(mb->mb_items[i].mbi_url);
+    free(mb->mb_items[i].mbi_parent);
+  }
+  mb->mb_count = 0;
+}
+
+
+/**
+ *
+ */
+void
+metadb_batch_flush(void *db, metadb_batch_t *mb)
+{
+  int i, r, failed;
+  int64_t ts;
+
+  if(mb->mb_count == 0)
+    return;
+
+ again:
+  ts = arch_get_ts();
+  failed = 0;
+
+  if(db_begin(db)) {
+    metadb_batch_clear(mb);
+    return;
+  }
+
+  for(i = 0; i < mb->mb_count; i++) {
+    const metadb_batch_item_t *mbi = &mb->mb_items[i];
+
+    if(db_one_statement(db, "SAVEPOINT mdbitem", NULL))
+      break;
+
+    r = metadb_metadata_writex(db, mbi->mbi_url, mbi->mbi_mtime, mbi->mbi_md,
+                               mbi->mbi_parent, mbi->mbi_parent_mtime,
+                               mbi->mbi_indexstatus);
+
+    if(r == METADATA_DEADLOCK) {
+      // Writes are idempotent so it's safe to just redo the whole batch
+      db_rollback_deadlock(db);
+      goto again;
+    }
+
+    if(r) {
+      db_one_statement(db, "ROLLBACK TO mdbitem", NULL);
+      failed++;
+    }
+    db_one_statement(db, "RELEASE mdbitem", NULL);
+  }
+
+  if(i == mb->mb_count)
+    db_commit(db);
+  else
+    db_rollback(db);
+
+  TRACE(TRACE_DEBUG, "METADB", "Wrote %d items (%d failed) in %d ms",
+        mb->mb_count, failed, (int)((arch_get_ts() - ts) / 1000));
+
+  metadb_batch_clear(mb);
+}
+
+
+/**
+ *
+ */
+void
+metadb_batch_add(void *db, metadb_batch_t *mb, const char *url, time_t mtime,
+                 const metadata_t *md, const char *parent,
+                 time_t parent_mtime, metadata_index_status_t indexstatus)
+{
+  metadb_batch_item_t *mbi;
+
+  if(!metadb_metadata_writable(md))
+    return;
+
+  if(mb->mb_count == METADB_BATCH_SIZE)
+    metadb_batch_flush(db, mb);
+
+  mbi = &mb->mb_items[mb->mb_count++];
+  mbi->mbi_url = strdup(url);
+  mbi->mbi_parent = parent ? strdup(parent) : NULL;
+  mbi->mbi_mtime = mtime;
+  mbi->mbi_parent_mtime = parent_mtime;
+  mbi->mbi_md = md;
+  mbi->mbi_indexstatus = indexstatus;
+}
+
+
+/**
+ * Flushes any pending items before freeing the batch
+ */
+void
+metadb_batch_destroy(void *db, metadb_batch_t *mb)
+{
+  if(mb == NULL)
+    return;
+  metadb_batch_flush(db, mb);
+  free(mb);
+}
+
+
 typedef struct get_cache {
   int64_t gc_album_id;
   rstr_t *gc_album_title;
@@ -1339,11 +1508,11 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT title "
-		  "FROM artist "
-		  "WHERE id = ?1 AND ds_id=1"
-		  );
+  rc = db_prepare_cached(db, &sel,
+			 "SELECT title "
+			 "FROM artist "
+			 "WHERE id = ?1 AND ds_id=1"
+			 );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -1353,7 +1522,7 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1361,7 +1530,7 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
 
   rstr_release(gc->gc_artist_title);
   gc->gc_artist_title = rstr_alloc((void *)sqlite3_column_text(sel, 0));
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -1381,10 +1550,10 @@ metadb_metadata_get_album(sqlite3 *db, get_cache_t *gc, int64_t id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT title "
-		  "FROM album "
-		  "WHERE id = ?1 AND ds_id=1");
+  rc = db_prepare_cached(db, &sel,
+			 "SELECT title "
+			 "FROM album "
+			 "WHERE id = ?1 AND ds_id=1");
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -1394,14 +1563,14 @@ metadb_metadata_get_album(sqlite3 *db, get_cache_t *gc, int64_t id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
   gc->gc_album_id = id;
   rstr_release(gc->gc_album_title);
   gc->gc_album_title = rstr_alloc((void *)sqlite3_column_text(sel, 0));
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -1416,11 +1585,11 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT title, album_id, artist_id, duration, track "
-		  "FROM audioitem "
-		  "WHERE item_id = ?1 AND ds_id = 1"
-		  );
+  rc = db_prepare_cached(db, &sel,
+			 "SELECT title, album_id, artist_id, duration, track "
+			 "FROM audioitem "
+			 "WHERE item_id = ?1 AND ds_id = 1"
+			 );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -1430,7 +1599,7 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1445,7 +1614,7 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   md->md_duration = sqlite3_column_int(sel, 3) / 1000.0f;
   md->md_track = sqlite3_column_int(sel, 4);
 
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -1460,12 +1629,12 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT id, title, duration, format, year "
-		  "FROM videoitem "
-		  "WHERE item_id = ?1 "
-		  "AND ds_id = ?2"
-		  );
+  rc = db_prepare_cached(db, &sel,
+			 "SELECT id, title, duration, format, year "
+			 "FROM videoitem "
+			 "WHERE item_id = ?1 "
+			 "AND ds_id = ?2"
+			 );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -1476,7 +1645,7 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1487,7 +1656,7 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   md->md_format = rstr_alloc((void *)sqlite3_column_text(sel, 3));
   md->md_year = sqlite3_column_int(sel, 4);
 
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return id;
 }
 
@@ -2043,13 +2212,13 @@ metadb_metadata_get_streams(sqlite3 *db, metadata_t *md, int64_t videoitem_id)
   int strack = 0;
   int vtrack = 0;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT streamindex, info, isolang, codec, "
-		  "mediatype, disposition, title "
-		  "FROM videostream "
-		  "WHERE videoitem_id = ?1 "
-		  "ORDER BY streamindex"
-		  );
+  rc = db_prepare_cached(db, &sel,
+			 "SELECT streamindex, info, isolang, codec, "
+			 "mediatype, disposition, title "
+			 "FROM videostream "
+			 "WHERE videoitem_id = ?1 "
+			 "ORDER BY streamindex"
+			 );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -2082,7 +2251,7 @@ metadb_metadata_get_streams(sqlite3 *db, metadata_t *md, int64_t videoitem_id)
 			sqlite3_column_int(sel, 5),
 			tn, -1);
   }
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -2096,11 +2265,11 @@ metadb_metadata_get_image(sqlite3 *db, metadata_t *md, int64_t item_id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT original_time, manufacturer, equipment "
-		  "FROM imageitem "
-		  "WHERE item_id = ?1"
-		  );
+  rc = db_prepare_cached(db, &sel,
+			 "SELECT original_time, manufacturer, equipment "
+			 "FROM imageitem "
+			 "WHERE item_id = ?1"
+			 );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -2110,14 +2279,14 @@ metadb_metadata_get_image(sqlite3 *db, metadata_t *md, int64_t item_id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
   md->md_time = sqlite3_column_int(sel, 0);
   md->md_manufacturer = rstr_alloc((void *)sqlite3_column_text(sel, 1));
   md->md_equipment = rstr_alloc((void *)sqlite3_column_text(sel, 2));
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -2182,10 +2351,10 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
   if(db_begin(db))
     return NULL;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT id,contenttype,parent from item "
-		  "where url=?1 AND "
-		  "mtime=?2");
+  rc = db_prepare_cached(db, &sel,
+			 "SELECT id,contenttype,parent from item "
+			 "where url=?1 AND "
+			 "mtime=?2");
 
   if(rc != SQLITE_OK) {
     db_rollback(db);
@@ -2198,7 +2367,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     db_rollback(db);
     return NULL;
   }
@@ -2217,7 +2386,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
       METADATA_CACHE_STATUS_FULL :
       METADATA_CACHE_STATUS_UNPARENTED;
 
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   db_rollback(db);
   return md;
 }
@@ -2399,4 +2568,160 @@ metadata_get_video_data(const char *url)
 }
 
 
+#if ENABLE_HTTPSERVER
+
+/**
+ * Imports a synthetic music library into a scratch database, once with
+ * one transaction per item (metadb_metadata_write()) and once through
+ * the batch API, then rescans it (all updates) in batched mode.
+ *
+ * Run with: curl http://<host>:42000/showtime/metadb/benchmark
+ */
+
+#define BENCH_ITEMS   30000
+#define BENCH_ARTISTS 300
+#define BENCH_ALBUMS  3000
+
+typedef struct bench_item {
+  char url[128];
+  char parent[128];
+  metadata_t *md;
+} bench_item_t;
+
+static HTS_MUTEX_DECL(bench_mutex);
+
+
+static sqlite3 *
+bench_open(const char *path)
+{
+  char schema[256];
+  char kvstore[256];
+  sqlite3 *db;
+
+  unlink(path);
+  if((db = db_open(path, DB_OPEN_CASE_SENSITIVE_LIKE)) == NULL)
+    return NULL;
+
+  snprintf(schema, sizeof(schema), "%s/resources/metadb", app_dataroot());
+  snprintf(kvstore, sizeof(kvstore), "%s/kvstore/kvstore.db",
+           gconf.persistent_path);
+
+  if(db_upgrade_schema(db, schema, "metadb", "kvstore", kvstore)) {
+    db_close(db);
+    return NULL;
+  }
+  return db;
+}
+
+
+static void
+bench_run(htsbuf_queue_t *out, const char *path, const char *name,
+          bench_item_t *items, int batched, int fresh)
+{
+  sqlite3 *db;
+  metadb_batch_t *mb = NULL;
+  int i;
+
+  if(fresh)
+    db = bench_open(path);
+  else
+    db = db_open(path, DB_OPEN_CASE_SENSITIVE_LIKE);
+
+  if(db == NULL) {
+    htsbuf_qprintf(out, "  %-24s Unable to open %s\n", name, path);
+    return;
+  }
+
+  if(batched)
+    mb = metadb_batch_create();
+
+  int64_t start = arch_get_ts();
+
+  for(i = 0; i < BENCH_ITEMS; i++) {
+    const bench_item_t *bi = &items[i];
+    if(batched)
+      metadb_batch_add(db, mb, bi->url, 1000000 + i, bi->md,
+                       bi->parent, 1000000, INDEX_STATUS_FILE_ANALYZED);
+    else
+      metadb_metadata_write(db, bi->url, 1000000 + i, bi->md,
+                            bi->parent, 1000000, INDEX_STATUS_FILE_ANALYZED);
+  }
+  metadb_batch_destroy(db, mb);
+
+  int64_t elapsed = arch_get_ts() - start;
+  int count = 0;
+  db_get_int_from_query(db, "SELECT COUNT(*) FROM audioitem", &count);
+  db_close(db);
+
+  htsbuf_qprintf(out, "  %-24s %6d items in %5d ms, %8.0f items/s "
+                 "(%d in db)\n", name, BENCH_ITEMS, (int)(elapsed / 1000),
+                 BENCH_ITEMS * 1000000.0 / elapsed, count);
+}
+
+
+static int
+metadb_benchmark(http_connection_t *hc, const char *remain, void *opaque,
+                 http_cmd_t method)
+{
+  char path[256];
+  char buf[64];
+  htsbuf_queue_t out;
+  bench_item_t *items = calloc(BENCH_ITEMS, sizeof(bench_item_t));
+  int i;
+
+  for(i = 0; i < BENCH_ITEMS; i++) {
+    bench_item_t *bi = &items[i];
+    const int album = i % BENCH_ALBUMS;
+    const int artist = album % BENCH_ARTISTS;
+    metadata_t *md = metadata_create();
+
+    snprintf(bi->parent, sizeof(bi->parent),
+             "file:///bench/artist%03d/album%04d", artist, album);
+    snprintf(bi->url, sizeof(bi->url), "%s/track%05d.mp3", bi->parent, i);
+
+    md->md_contenttype = CONTENT_AUDIO;
+    snprintf(buf, sizeof(buf), "Track %d", i);
+    md->md_title = rstr_alloc(buf);
+    snprintf(buf, sizeof(buf), "Album %d", album);
+    md->md_album = rstr_alloc(buf);
+    snprintf(buf, sizeof(buf), "Artist %d", artist);
+    md->md_artist = rstr_alloc(buf);
+    md->md_duration = 180 + i % 120;
+    md->md_track = i / BENCH_ALBUMS + 1;
+    bi->md = md;
+  }
+
+  snprintf(path, sizeof(path), "%s/metadb-bench.db", gconf.cache_path);
+
+  htsbuf_queue_init(&out, 0);
+  htsbuf_qprintf(&out, "metadb benchmark: %d tracks, %d albums, %d artists\n",
+                 BENCH_ITEMS, BENCH_ALBUMS, BENCH_ARTISTS);
+
+  hts_mutex_lock(&bench_mutex);
+  bench_run(&out, path, "one txn per item:", items, 0, 1);
+  bench_run(&out, path, "batched:",          items, 1, 1);
+  bench_run(&out, path, "batched rescan:",   items, 1, 0);
+  unlink(path);
+  hts_mutex_unlock(&bench_mutex);
+
+  for(i = 0; i < BENCH_ITEMS; i++)
+    metadata_destroy(items[i].md);
+  free(items);
+
+  return http_send_reply(hc, 0, "text/plain; charset=utf-8", NULL, NULL, 0,
+                         &out);
+}
+
+
+/**
+ *
+ */
+static void
+metadb_benchmark_init(void)
+{
+  http_path_add("/showtime/metadb/benchmark", NULL, metadb_benchmark, 1);
+}
+
+INITME(INIT_GROUP_API, metadb_benchmark_init, NULL);
 
+#endif // ENABLE_HTTPSERVER
@@ -38,6 +38,21 @@
 #include <sys/mman.h>
 #endif
 
+/**
+ * Thread caches are pointless when every item goes through malloc()
+ * or mmap(), and POOL_DEBUG wants to see every get/put. Emulated
+ * thread specifics are too slow to be worth it
+ */
+#if !defined(POOL_BY_MMAP) && !defined(POOL_BY_MALLOC) && \
+  !defined(POOL_DEBUG) && !ENABLE_EMU_THREAD_SPECIFICS
+#define POOL_USE_TCACHE
+#endif
+
+#define POOL_MAGAZINE_SIZE 32
+
+static LIST_HEAD(, pool) all_pools;
+static HTS_MUTEX_DECL(all_pools_mutex);
+
 
 
 /**
@@ -73,6 +88,27 @@ typedef struct pool_segment {
 } pool_segment_t;
 
 
+/**
+ * Per thread cache of free items. Holds up to two magazines worth of
+ * items. When empty it's refilled with one magazine from the shared
+ * freelist, when full one magazine is handed back.
+ */
+typedef struct pool_tcache {
+  LIST_ENTRY(pool_tcache) pt_link;
+  pool_t *pt_pool;
+  int pt_count;
+  int pt_folded;  // pt_count when last accounted in p_num_cached
+  int pt_gets;
+  int pt_hits;
+  void *pt_items[POOL_MAGAZINE_SIZE * 2];
+} pool_tcache_t;
+
+#ifdef POOL_USE_TCACHE
+static void pool_tcache_release(void *aux);
+static void pool_tcache_fold(pool_t *p, pool_tcache_t *tc);
+#endif
+
+
 #define ROUND_UP(p, round) ((p + round - 1) & ~(round - 1))
 
 /**
@@ -99,6 +135,7 @@ pool_segment_create(pool_t *p)
     prev = pi;
   }
   LIST_INSERT_HEAD(&p->p_segments, ps, ps_link);
+  p->p_num_segments++;
   assert(pi != NULL);
   p->p_item = pi;
 }
@@ -121,6 +158,18 @@ pool_init(pool_t *p, const char *name, size_t item_size, int flags)
 
   p->p_item_size = item_size;
   p->p_flags = flags;
+
+  if(flags & POOL_THREAD_CACHE) {
+    hts_mutex_init(&p->p_mutex);
+    LIST_INIT(&p->p_tcaches);
+#ifdef POOL_USE_TCACHE
+    hts_thread_key_create(&p->p_tcache_key, pool_tcache_release);
+#endif
+  }
+
+  hts_mutex_lock(&all_pools_mutex);
+  LIST_INSERT_HEAD(&all_pools, p, p_link);
+  hts_mutex_unlock(&all_pools_mutex);
 }
 
 
@@ -207,6 +256,26 @@ pool_destroy(pool_t *p)
   }
 #endif
 
+  hts_mutex_lock(&all_pools_mutex);
+  LIST_REMOVE(p, p_link);
+  hts_mutex_unlock(&all_pools_mutex);
+
+  if(p->p_flags & POOL_THREAD_CACHE) {
+#ifdef POOL_USE_TCACHE
+    pool_tcache_t *tc;
+    // Deleting the key doesn't run the destructor for threads still
+    // holding a cache, so free them here. The items they hold live in
+    // our segments which are released below
+    hts_thread_key_delete(p->p_tcache_key);
+    while((tc = LIST_FIRST(&p->p_tcaches)) != NULL) {
+      pool_tcache_fold(p, tc);
+      LIST_REMOVE(tc, pt_link);
+      free(tc);
+    }
+#endif
+    hts_mutex_destroy(&p->p_mutex);
+  }
+
   while((ps = LIST_FIRST(&p->p_segments)) != NULL) {
     LIST_REMOVE(ps, ps_link);
 #ifdef POOL_DEBUG
@@ -215,9 +284,9 @@ pool_destroy(pool_t *p)
     hfree(ps->ps_addr, ps->ps_alloc_size);
   }
     
-  if(p->p_num_out)
+  if(pool_num(p))
     TRACE(TRACE_INFO, "pool", "Destroying pool '%s', %d items out",
-	  p->p_name, p->p_num_out);
+	  p->p_name, pool_num(p));
 
   free(p);
 }
@@ -227,13 +296,13 @@ pool_destroy(pool_t *p)
 
 
 /**
- *
+ * Get an item from the shared freelist. Caller must serialize access
  */
-void *
+static void *
 #ifdef POOL_DEBUG
-pool_get_ex(pool_t *p, const char *file, int line)
+pool_get0(pool_t *p, const char *file, int line)
 #else
-pool_get(pool_t *p)
+pool_get0(pool_t *p)
 #endif
 {
   p->p_num_out++;
@@ -272,10 +341,10 @@ pool_get(pool_t *p)
 }
 
 /**
- *
+ * Return an item to the shared freelist. Caller must serialize access
  */
-void
-pool_put(pool_t *p, void *ptr)
+static void
+pool_put0(pool_t *p, void *ptr)
 {
 #if defined(POOL_BY_MMAP)
 
@@ -314,13 +383,198 @@ pool_put(pool_t *p, void *ptr)
 }
 
 
+#ifdef POOL_DEBUG
+#define POOL_GET0(p) pool_get0(p, file, line)
+#else
+#define POOL_GET0(p) pool_get0(p)
+#endif
+
+
+#ifdef POOL_USE_TCACHE
+
+/**
+ * Account the thread local counters in the pool. Called with p_mutex held
+ */
+static void
+pool_tcache_fold(pool_t *p, pool_tcache_t *tc)
+{
+  p->p_num_cached += tc->pt_count - tc->pt_folded;
+  tc->pt_folded = tc->pt_count;
+  p->p_gets += tc->pt_gets;
+  p->p_cache_hits += tc->pt_hits;
+  tc->pt_gets = 0;
+  tc->pt_hits = 0;
+}
+
+
+/**
+ * Called at thread exit, return everything to the shared freelist
+ */
+static void
+pool_tcache_release(void *aux)
+{
+  pool_tcache_t *tc = aux;
+  pool_t *p = tc->pt_pool;
+
+  hts_mutex_lock(&p->p_mutex);
+  while(tc->pt_count > 0)
+    pool_put0(p, tc->pt_items[--tc->pt_count]);
+  pool_tcache_fold(p, tc);
+  LIST_REMOVE(tc, pt_link);
+  hts_mutex_unlock(&p->p_mutex);
+  free(tc);
+}
+
+
+/**
+ *
+ */
+static pool_tcache_t *
+pool_tcache_get(pool_t *p)
+{
+  pool_tcache_t *tc = hts_thread_get_specific(p->p_tcache_key);
+  if(likely(tc != NULL))
+    return tc;
+
+  tc = calloc(1, sizeof(pool_tcache_t));
+  tc->pt_pool = p;
+  hts_mutex_lock(&p->p_mutex);
+  LIST_INSERT_HEAD(&p->p_tcaches, tc, pt_link);
+  hts_mutex_unlock(&p->p_mutex);
+  hts_thread_set_specific(p->p_tcache_key, tc);
+  return tc;
+}
+
+#endif
+
+
+/**
+ *
+ */
+void *
+#ifdef POOL_DEBUG
+pool_get_ex(pool_t *p, const char *file, int line)
+#else
+pool_get(pool_t *p)
+#endif
+{
+  void *r;
+
+  if(!(p->p_flags & POOL_THREAD_CACHE)) {
+    p->p_gets++;
+    return POOL_GET0(p);
+  }
+
+#ifdef POOL_USE_TCACHE
+  pool_tcache_t *tc = pool_tcache_get(p);
+
+  if(tc->pt_count == 0) {
+    hts_mutex_lock(&p->p_mutex);
+    while(tc->pt_count < POOL_MAGAZINE_SIZE)
+      tc->pt_items[tc->pt_count++] = pool_get0(p);
+    tc->pt_gets++;
+    pool_tcache_fold(p, tc);
+    hts_mutex_unlock(&p->p_mutex);
+  } else {
+    tc->pt_gets++;
+    tc->pt_hits++;
+  }
+
+  r = tc->pt_items[--tc->pt_count];
+  if(p->p_flags & POOL_ZERO_MEM)
+    memset(r, 0, p->p_item_size);
+#else
+  hts_mutex_lock(&p->p_mutex);
+  p->p_gets++;
+  r = POOL_GET0(p);
+  hts_mutex_unlock(&p->p_mutex);
+#endif
+  return r;
+}
+
+
+/**
+ *
+ */
+void
+pool_put(pool_t *p, void *ptr)
+{
+  if(!(p->p_flags & POOL_THREAD_CACHE)) {
+    pool_put0(p, ptr);
+    return;
+  }
+
+#ifdef POOL_USE_TCACHE
+  pool_tcache_t *tc = pool_tcache_get(p);
+
+  if(tc->pt_count == POOL_MAGAZINE_SIZE * 2) {
+    hts_mutex_lock(&p->p_mutex);
+    while(tc->pt_count > POOL_MAGAZINE_SIZE)
+      pool_put0(p, tc->pt_items[--tc->pt_count]);
+    pool_tcache_fold(p, tc);
+    hts_mutex_unlock(&p->p_mutex);
+  }
+  tc->pt_items[tc->pt_count++] = ptr;
+#else
+  hts_mutex_lock(&p->p_mutex);
+  pool_put0(p, ptr);
+  hts_mutex_unlock(&p->p_mutex);
+#endif
+}
+
+
 /**
  *
  */
 int
 pool_num(pool_t *p)
 {
-  return p->p_num_out;
+  return p->p_num_out - p->p_num_cached;
+}
+
+
+/**
+ *
+ */
+void
+pool_get_stats(pool_t *p, pool_stats_t *ps)
+{
+  const int locked = p->p_flags & POOL_THREAD_CACHE;
+
+  if(locked)
+    hts_mutex_lock(&p->p_mutex);
+
+  ps->ps_name       = p->p_name;
+  ps->ps_item_size  = p->p_item_size_req;
+  ps->ps_segments   = p->p_num_segments;
+  ps->ps_in_use     = p->p_num_out - p->p_num_cached;
+  ps->ps_cached     = p->p_num_cached;
+  ps->ps_gets       = p->p_gets;
+  ps->ps_cache_hits = p->p_cache_hits;
+
+  if(locked)
+    hts_mutex_unlock(&p->p_mutex);
+}
+
+
+/**
+ * Collect stats for (at most max) pools. Pools that are not thread
+ * cached are read without their owner's lock so numbers are advisory
+ */
+int
+pool_get_all_stats(pool_stats_t *vec, int max)
+{
+  pool_t *p;
+  int n = 0;
+
+  hts_mutex_lock(&all_pools_mutex);
+  LIST_FOREACH(p, &all_pools, p_link) {
+    if(n == max)
+      break;
+    pool_get_stats(p, &vec[n++]);
+  }
+  hts_mutex_unlock(&all_pools_mutex);
+  return n;
 }
 
 
@@ -24,6 +24,7 @@
 
 
 LIST_HEAD(pool_segment_list, pool_segment);
+LIST_HEAD(pool_tcache_list, pool_tcache);
 
 
 /**
@@ -36,15 +37,47 @@ typedef struct pool {
   size_t p_item_size;      // Actual size of memory allocated
   int p_flags;
 
-  hts_mutex_t p_mutex;
+  hts_mutex_t p_mutex;     // Only used for POOL_THREAD_CACHE
+  hts_key_t p_tcache_key;
+  struct pool_tcache_list p_tcaches;  // Protected by p_mutex
   struct pool_item *p_item;
 
-  int p_num_out;
+  int p_num_out;           // Items not on the shared freelist
+  int p_num_cached;        // Of those, parked in per thread magazines
+  int p_num_segments;
+  int64_t p_gets;
+  int64_t p_cache_hits;
   const char *p_name;
+  LIST_ENTRY(pool) p_link;
 } pool_t;
 
 
-#define POOL_ZERO_MEM  0x2
+#define POOL_ZERO_MEM      0x2
+
+/**
+ * Pool is safe to use from any thread without external locking.
+ * Each thread keeps a small magazine of free items in front of the
+ * shared freelist so most pool_get()/pool_put() never touch the
+ * pool mutex. pool_destroy() frees the magazines of all threads so
+ * no thread may touch the pool once it's destroyed.
+ */
+#define POOL_THREAD_CACHE  0x4
+
+
+/**
+ * Snapshot of pool allocation statistics. Counters for thread cached
+ * pools are folded in when magazines are refilled or flushed so they
+ * may lag slightly behind
+ */
+typedef struct pool_stats {
+  const char *ps_name;
+  size_t ps_item_size;
+  int ps_segments;
+  int ps_in_use;
+  int ps_cached;
+  int64_t ps_gets;
+  int64_t ps_cache_hits;
+} pool_stats_t;
 
 pool_t *pool_create(const char *name, size_t item_size, int flags);
 
@@ -69,6 +102,10 @@ void pool_destroy(pool_t *p);
 
 int pool_num(pool_t *p);
 
+void pool_get_stats(pool_t *p, pool_stats_t *ps);
+
+int pool_get_all_stats(pool_stats_t *vec, int max);
+
 #ifdef POOL_DEBUG
 void pool_foreach(pool_t *p, void (*fn)(void *ptr, void *opaque), void *opaque);
 #endif
@@ -23,7 +23,8 @@
 
 
 typedef struct asyncio_timer {
-  LIST_ENTRY(asyncio_timer) at_link;
+  LIST_ENTRY(asyncio_timer) at_link;  // Used by the pepper backend
+  unsigned int at_heap_index;         // Used by the posix backend
   int64_t at_expire;
   void (*at_fn)(void *opaque);
   void *at_opaque;
@@ -27,6 +27,11 @@
 #include <netinet/in.h>
 
 #include "main.h"
+
+#if ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include "arch/arch.h"
 #include "arch/threads.h"
 #include "asyncio.h"
@@ -39,21 +44,32 @@
 #define ASYNCIO_ERROR           0x4
 #define ASYNCIO_TIMEOUT         0x8
 
+#define ASYNCIO_MAX_EVENTS      64
+
 LIST_HEAD(asyncio_fd_list, asyncio_fd);
 LIST_HEAD(asyncio_worker_list, asyncio_worker);
-LIST_HEAD(asyncio_timer_list, asyncio_timer);
 TAILQ_HEAD(asyncio_dns_req_queue, asyncio_dns_req);
 
 static hts_thread_t asyncio_thread_id;
 
-static struct asyncio_timer_list asyncio_timers;
+/**
+ * Armed timers are kept in a binary min-heap ordered on expire time
+ */
+static asyncio_timer_t **asyncio_timer_heap;
+static unsigned int asyncio_timer_heap_size;
+static unsigned int asyncio_timer_heap_capacity;
 
 static hts_mutex_t asyncio_worker_mutex;
 static struct asyncio_worker_list asyncio_workers;
 
 static int asyncio_pipe[2];
+
+#if ENABLE_EPOLL
+static int asyncio_epfd;
+#else
 static struct asyncio_fd_list asyncio_fds;
 static int asyncio_num_fds;
+#endif
 
 struct prop_courier *asyncio_courier;
 
@@ -85,7 +101,9 @@ typedef struct asyncio_worker {
  *
  */
 struct asyncio_fd {
+#if !ENABLE_EPOLL
   LIST_ENTRY(asyncio_fd) af_link;
+#endif
   asyncio_fd_callback_t *af_callback;
   void *af_opaque;
   char *af_name;
@@ -101,7 +119,7 @@ struct asyncio_fd {
   htsbuf_queue_t af_sendq;
   htsbuf_queue_t af_recvq;
 
-  int64_t af_timeout;
+  asyncio_timer_t af_timer;  // Timeout and deferred errors
 
   int af_refcount;
   int af_fd;
@@ -230,12 +248,75 @@ asyncio_timer_init(asyncio_timer_t *at, void (*fn)(void *opaque),
 /**
  *
  */
-static int
-at_compar(const asyncio_timer_t *a, const asyncio_timer_t *b)
+static void
+timer_heap_set(unsigned int idx, asyncio_timer_t *at)
 {
-  if(a->at_expire < b->at_expire)
-    return -1;
-  return 1;
+  asyncio_timer_heap[idx] = at;
+  at->at_heap_index = idx;
+}
+
+
+/**
+ *
+ */
+static void
+timer_heap_sift_up(unsigned int idx)
+{
+  asyncio_timer_t *at = asyncio_timer_heap[idx];
+
+  while(idx > 0) {
+    unsigned int parent = (idx - 1) / 2;
+    if(asyncio_timer_heap[parent]->at_expire <= at->at_expire)
+      break;
+    timer_heap_set(idx, asyncio_timer_heap[parent]);
+    idx = parent;
+  }
+  timer_heap_set(idx, at);
+}
+
+
+/**
+ *
+ */
+static void
+timer_heap_sift_down(unsigned int idx)
+{
+  asyncio_timer_t *at = asyncio_timer_heap[idx];
+
+  while(1) {
+    unsigned int child = idx * 2 + 1;
+    if(child >= asyncio_timer_heap_size)
+      break;
+    if(child + 1 < asyncio_timer_heap_size &&
+       asyncio_timer_heap[child + 1]->at_expire <
+       asyncio_timer_heap[child]->at_expire)
+      child++;
+    if(at->at_expire <= asyncio_timer_heap[child]->at_expire)
+      break;
+    timer_heap_set(idx, asyncio_timer_heap[child]);
+    idx = child;
+  }
+  timer_heap_set(idx, at);
+}
+
+
+/**
+ *
+ */
+static void
+timer_heap_remove(asyncio_timer_t *at)
+{
+  unsigned int idx = at->at_heap_index;
+  asyncio_timer_t *last = asyncio_timer_heap[--asyncio_timer_heap_size];
+
+  at->at_expire = 0;
+
+  if(last == at)
+    return;
+
+  timer_heap_set(idx, last);
+  timer_heap_sift_up(idx);
+  timer_heap_sift_down(last->at_heap_index);
 }
 
 
@@ -246,11 +327,25 @@ static void
 asyncio_timer_arm(asyncio_timer_t *at, int64_t expire)
 {
   asyncio_verify_thread();
-  if(at->at_expire)
-    LIST_REMOVE(at, at_link);
+
+  if(at->at_expire) {
+    at->at_expire = expire;
+    timer_heap_sift_up(at->at_heap_index);
+    timer_heap_sift_down(at->at_heap_index);
+    return;
+  }
+
+  if(asyncio_timer_heap_size == asyncio_timer_heap_capacity) {
+    asyncio_timer_heap_capacity = MAX(64, asyncio_timer_heap_capacity * 2);
+    asyncio_timer_heap = realloc(asyncio_timer_heap,
+                                 asyncio_timer_heap_capacity *
+                                 sizeof(asyncio_timer_t *));
+  }
 
   at->at_expire = expire;
-  LIST_INSERT_SORTED(&asyncio_timers, at, at_link, at_compar, asyncio_timer_t);
+  timer_heap_set(asyncio_timer_heap_size, at);
+  asyncio_timer_heap_size++;
+  timer_heap_sift_up(at->at_heap_index);
 }
 
 
@@ -271,10 +366,8 @@ void
 asyncio_timer_disarm(asyncio_timer_t *at)
 {
   asyncio_verify_thread();
-  if(at->at_expire) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
-  }
+  if(at->at_expire)
+    timer_heap_remove(at);
 }
 
 
@@ -294,43 +387,107 @@ af_release(asyncio_fd_t *af)
   free(af);
 }
 
+/**
+ * Run all expired timers and return number of milliseconds until
+ * the next one expires (or -1 if no timer is armed)
+ */
+static int
+asyncio_run_timers(void)
+{
+  asyncio_timer_t *at;
+
+  while(asyncio_timer_heap_size > 0) {
+    at = asyncio_timer_heap[0];
+    if(at->at_expire > async_now)
+      return MIN(INT32_MAX, (at->at_expire - async_now + 999) / 1000);
+
+    timer_heap_remove(at);
+    at->at_fn(at->at_opaque);
+  }
+  return -1;
+}
+
+
 /**
  *
  */
 static void
+asyncio_fd_dispatch(asyncio_fd_t *af, int hup, int error, int events)
+{
+  if(af->af_callback == NULL)
+    return;
+
+  if(hup) {
+    af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ECONNRESET);
+    return;
+  }
+
+  if(error) {
+    int err;
+    socklen_t errlen = sizeof(int);
+
+    getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
+    af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
+    return;
+  }
+
+  if(events)
+    af->af_callback(af, af->af_opaque, events, 0);
+}
+
+
+#if ENABLE_EPOLL
+
+/**
+ * Interest is registered with the kernel in asyncio_set_events() so
+ * all we need to do here is wait and dispatch whatever became ready
+ */
+static void
 asyncio_dopoll(void)
 {
-  asyncio_timer_t *at;
+  struct epoll_event ev[ASYNCIO_MAX_EVENTS];
+  int timeout = asyncio_run_timers();
 
-  while((at = LIST_FIRST(&asyncio_timers)) != NULL &&
-        at->at_expire <= async_now) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
-    at->at_fn(at->at_opaque);
+  int n = epoll_wait(asyncio_epfd, ev, ASYNCIO_MAX_EVENTS, timeout);
+
+  async_now = arch_get_ts();
+
+  if(n <= 0)
+    return;
+
+  // Callbacks might delete any of the other fds, hold on to them
+  for(int i = 0; i < n; i++)
+    ((asyncio_fd_t *)ev[i].data.ptr)->af_refcount++;
+
+  for(int i = 0; i < n; i++) {
+    asyncio_fd_t *af = ev[i].data.ptr;
+    const uint32_t e = ev[i].events;
+
+    asyncio_fd_dispatch(af, e & EPOLLHUP, e & EPOLLERR,
+                        (e & EPOLLIN  ? ASYNCIO_READ  : 0) |
+                        (e & EPOLLOUT ? ASYNCIO_WRITE : 0));
   }
 
+  for(int i = 0; i < n; i++)
+    af_release(ev[i].data.ptr);
+}
+
+#else
+
+/**
+ *
+ */
+static void
+asyncio_dopoll(void)
+{
+  int timeout = asyncio_run_timers();
+
   asyncio_fd_t *af;
   struct pollfd *fds = alloca(asyncio_num_fds * sizeof(struct pollfd));
   asyncio_fd_t **afds  = alloca(asyncio_num_fds * sizeof(asyncio_fd_t *));
   int n = 0;
 
-  int timeout = INT32_MAX;
-
   LIST_FOREACH(af, &asyncio_fds, af_link) {
-    if(af->af_pending_errno) {
-      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, af->af_pending_errno);
-      goto release;
-    }
-
-    if(af->af_timeout) {
-      if(af->af_timeout <= async_now) {
-        af->af_timeout = 0;
-        af->af_callback(af, af->af_opaque, ASYNCIO_TIMEOUT, 0);
-        goto release;
-      }
-      timeout = MIN(timeout, (af->af_timeout - async_now + 999) / 1000);
-    }
-  
     fds[n].fd = af->af_fd;
     fds[n].events = af->af_poll_events;
     fds[n].revents = 0;
@@ -342,59 +499,27 @@ asyncio_dopoll(void)
 
   assert(n == asyncio_num_fds);
 
-  if((at = LIST_FIRST(&asyncio_timers)) != NULL)
-    timeout = MIN(timeout, (at->at_expire - async_now + 999) / 1000);
-
-  if(timeout == INT32_MAX)
-    timeout = -1;
-
   poll(fds, n, timeout);
 
   async_now = arch_get_ts();
 
   for(int i = 0; i < n; i++) {
-    af = afds[i];
+    const int e = fds[i].revents;
 
-    if(!(af->af_callback && fds[i].revents))
+    if(e == 0)
       continue;
 
-    if(fds[i].revents & POLLHUP) {
-      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ECONNRESET);
-      continue;
-    }
-
-    if(fds[i].revents & POLLERR) {
-      int err;
-      socklen_t errlen = sizeof(int);
-    
-      getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
-      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
-      continue;
-    }
-
-    af->af_callback(af,
-                    af->af_opaque,
-                    (fds[i].revents & POLLIN  ? ASYNCIO_READ  : 0) |
-                    (fds[i].revents & POLLOUT ? ASYNCIO_WRITE : 0), 0);
-
-    if(0) {
-      int64_t now = arch_get_ts();
-
-      if(now - async_now > 10000) {
-        TRACE(TRACE_ERROR, "ASYNCIO", "Long callback on socktet %s (%d µs)",
-              af->af_name, (int) (now - async_now));
-      }
-      async_now = now;
-    }
+    asyncio_fd_dispatch(afds[i], e & POLLHUP, e & POLLERR,
+                        (e & POLLIN  ? ASYNCIO_READ  : 0) |
+                        (e & POLLOUT ? ASYNCIO_WRITE : 0));
   }
 
-
- release:
-
   for(int i = 0; i < n; i++)
     af_release(afds[i]);
 }
 
+#endif
+
 
 /**
  *
@@ -405,10 +530,29 @@ asyncio_set_events(asyncio_fd_t *af, int events)
   asyncio_verify_thread();
   af->af_ext_events = events;
 
+#if ENABLE_EPOLL
+  int ev =
+    (events & ASYNCIO_READ  ? EPOLLIN              : 0) |
+    (events & ASYNCIO_WRITE ? EPOLLOUT             : 0) |
+    (events & ASYNCIO_ERROR ? (EPOLLHUP|EPOLLERR)  : 0);
+
+  if(ev == af->af_poll_events)
+    return;
+
+  af->af_poll_events = ev;
+
+  struct epoll_event e = {0};
+  e.events = ev;
+  e.data.ptr = af;
+  if(epoll_ctl(asyncio_epfd, EPOLL_CTL_MOD, af->af_fd, &e))
+    TRACE(TRACE_ERROR, "ASYNCIO", "%s: Unable to modify events -- %s",
+          af->af_name, strerror(errno));
+#else
   af->af_poll_events =
     (events & ASYNCIO_READ  ? POLLIN            : 0) |
     (events & ASYNCIO_WRITE ? POLLOUT           : 0) |
     (events & ASYNCIO_ERROR ? (POLLHUP|POLLERR) : 0);
+#endif
 }
 
 
@@ -432,6 +576,21 @@ asyncio_rem_events(asyncio_fd_t *af, int events)
 }
 
 
+/**
+ *
+ */
+static void
+af_timer_cb(void *opaque)
+{
+  asyncio_fd_t *af = opaque;
+
+  if(af->af_pending_errno)
+    af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, af->af_pending_errno);
+  else
+    af->af_callback(af, af->af_opaque, ASYNCIO_TIMEOUT, 0);
+}
+
+
 /**
  *
  */
@@ -446,14 +605,28 @@ asyncio_add_fd(int fd, int events, asyncio_fd_callback_t *cb, void *opaque,
   af->af_refcount = 1;
   af->af_fd = fd;
   af->af_name = strdup(name);
-  asyncio_set_events(af, events);
   af->af_callback = cb;
   af->af_opaque = opaque;
+  asyncio_timer_init(&af->af_timer, af_timer_cb, af);
 
   net_change_nonblocking(fd, 1);
 
+#if ENABLE_EPOLL
+  struct epoll_event e = {0};
+  af->af_ext_events = events;
+  af->af_poll_events = e.events =
+    (events & ASYNCIO_READ  ? EPOLLIN              : 0) |
+    (events & ASYNCIO_WRITE ? EPOLLOUT             : 0) |
+    (events & ASYNCIO_ERROR ? (EPOLLHUP|EPOLLERR)  : 0);
+  e.data.ptr = af;
+  if(epoll_ctl(asyncio_epfd, EPOLL_CTL_ADD, fd, &e))
+    TRACE(TRACE_ERROR, "ASYNCIO", "%s: Unable to add fd -- %s",
+          name, strerror(errno));
+#else
+  asyncio_set_events(af, events);
   LIST_INSERT_HEAD(&asyncio_fds, af, af_link);
   asyncio_num_fds++;
+#endif
   return af;
 }
 
@@ -465,11 +638,18 @@ void
 asyncio_del_fd(asyncio_fd_t *af)
 {
   asyncio_verify_thread();
-  if(af->af_fd != -1)
+  asyncio_timer_disarm(&af->af_timer);
+  if(af->af_fd != -1) {
+#if ENABLE_EPOLL
+    epoll_ctl(asyncio_epfd, EPOLL_CTL_DEL, af->af_fd, NULL);
+#endif
     close(af->af_fd);
+  }
   af->af_fd = -1;
+#if !ENABLE_EPOLL
   LIST_REMOVE(af, af_link);
   asyncio_num_fds--;
+#endif
   af->af_callback = NULL;
   af_release(af);
 }
@@ -481,7 +661,7 @@ asyncio_del_fd(asyncio_fd_t *af)
 void
 asyncio_set_timeout_delta_sec(asyncio_fd_t *af, int delta)
 {
-  af->af_timeout = delta * 1000000LL + async_now;
+  asyncio_timer_arm(&af->af_timer, delta * 1000000LL + async_now);
 }
 
 /**
@@ -573,6 +753,12 @@ asyncio_init_early(void)
   hts_mutex_init(&asyncio_dns_mutex);
 
   arch_pipe(asyncio_pipe);
+
+#if ENABLE_EPOLL
+  asyncio_epfd = epoll_create(ASYNCIO_MAX_EVENTS);
+  if(asyncio_epfd == -1)
+    panic("asyncio: Unable to create epoll fd -- %s", strerror(errno));
+#endif
 }
 
 /**
@@ -789,20 +975,20 @@ asyncio_tcp_connected(asyncio_fd_t *af, void *opaque, int events, int error)
   if(events & ASYNCIO_ERROR) {
     char buf[256];
     snprintf(buf, sizeof(buf), "%s", strerror(error));
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timer);
     af->af_error_callback(af->af_opaque, buf);
     return;
   }
 
   if(events & ASYNCIO_READ) {
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timer);
     do_read(af);
     return;
   }
 
   if(events & ASYNCIO_WRITE) {
 
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timer);
 
     if(af->af_connected) {
       do_write(af);
@@ -887,7 +1073,7 @@ asyncio_connect(const char *name, const net_addr_t *addr,
 
   af->af_error_callback = error_cb;
   af->af_read_callback  = read_cb;
-  af->af_timeout = arch_get_ts() + timeout * 1000;
+  asyncio_timer_arm(&af->af_timer, arch_get_ts() + timeout * 1000);
 
   int r = connect(fd, (struct sockaddr *)&si, sizeof(struct sockaddr_in));
   if(r == -1) {
@@ -898,6 +1084,7 @@ asyncio_connect(const char *name, const net_addr_t *addr,
       // Got fail directly, but we still want to notify the user about
       // the error asynchronously. Just to make things easier
       af->af_pending_errno = errno;
+      asyncio_timer_arm(&af->af_timer, async_now);
     }
   } else {
     asyncio_add_events(af, ASYNCIO_WRITE);
@@ -965,7 +1152,8 @@ static int adr_resolver_running;
 static int
 adr_resolve(asyncio_dns_req_t *adr)
 {
-  return net_resolve(adr->adr_hostname, &adr->adr_addr, &adr->adr_errmsg);
+  return net_resolve_host(adr->adr_hostname, &adr->adr_addr, 1,
+                          &adr->adr_errmsg) < 1;
 }
 
 
@@ -42,6 +42,7 @@ typedef enum {
 #define HTTP_STATUS_PRECONDITION_FAILED 412
 #define HTTP_STATUS_UNSUPPORTED_MEDIA_TYPE 415
 #define HTTP_NOT_IMPLEMENTED 501
+#define HTTP_STATUS_UNAVAILABLE  503
 
 LIST_HEAD(http_header_list, http_header);
 
@@ -86,6 +86,11 @@ void tcp_set_read_timeout(tcpcon_t *tc, int ms);
 
 int net_resolve(const char *hostname, net_addr_t *addr, const char **errmsg);
 
+#define NET_MAX_ADDRS 8
+
+int net_resolve_host(const char *hostname, net_addr_t *addrs, int max,
+                     const char **errmsg);
+
 int net_resolve_numeric(const char *hostname, net_addr_t *addr);
 
 void net_change_nonblocking(int fd, int on);
@@ -435,21 +435,25 @@ tcp_connect(const char *hostname, int port,
   tcpcon_t *tc;
   const int dbg = !!(flags & TCP_DEBUG);
   const char *errmsg;
-  net_addr_t addr = {0};
+  net_addr_t addrs[NET_MAX_ADDRS];
+  net_addr_t *addr = &addrs[0];
+  int num_addrs = 1;
+
+  memset(addrs, 0, sizeof(addrs));
 
 
   if(!strcmp(hostname, "localhost")) {
-    addr.na_family = 4;
-    addr.na_addr[0] = 127;
-    addr.na_addr[3] = 1;
+    addr->na_family = 4;
+    addr->na_addr[0] = 127;
+    addr->na_addr[3] = 1;
 
   } else if(gconf.proxy_host[0] && !(flags & TCP_NO_PROXY)) {
 
-    if(!net_resolve_numeric(hostname, &addr) && addr.na_family == 4) {
+    if(!net_resolve_numeric(hostname, addr) && addr->na_family == 4) {
 
       netif_t *ni = net_get_interfaces();
 
-      const uint32_t v4addr = rd32_be(addr.na_addr);
+      const uint32_t v4addr = rd32_be(addr->na_addr);
       if(ni != NULL) {
         for(int i = 0; ni[i].ipv4; i++) {
           printf("%x %x %x\n", v4addr, ni[i].maskv4, ni[i].ipv4);
@@ -476,27 +480,30 @@ tcp_connect(const char *hostname, int port,
     goto connected;
 
   } else {
-    if(net_resolve(hostname, &addr, &errmsg)) {
+    num_addrs = net_resolve_host(hostname, addrs, NET_MAX_ADDRS, &errmsg);
+    if(num_addrs < 0) {
 
       snprintf(errbuf, errlen, "Unable to resolve %s -- %s", hostname, errmsg);
 
       // If no dots in hostname, try to resolve using NetBIOS name lookup
-      if(strchr(hostname, '.') != NULL || nmb_resolve(hostname, &addr))
+      if(strchr(hostname, '.') != NULL || nmb_resolve(hostname, addr))
         return NULL;
+      num_addrs = 1;
     }
   }
 
  connect:
 
-  addr.na_port = port;
-  tc = tcp_connect_arch(&addr, errbuf, errlen, timeout, c, dbg);
+  for(int i = 0; i < num_addrs; i++)
+    addrs[i].na_port = port;
+  tc = tcp_connect_arch(addrs, num_addrs, errbuf, errlen, timeout, c, dbg);
   if(tc == NULL)
     return NULL;
 
  connected:
   if(flags & TCP_SSL) {
 
-    if(tcp_ssl_open(tc, errbuf, errlen)) {
+    if(tcp_ssl_open(tc, errbuf, errlen, hostname, port)) {
       tcp_close(tc);
       return NULL;
     }
@@ -63,12 +63,28 @@ struct tcpcon {
 
 void tcp_cancel(void *aux);
 
-tcpcon_t *tcp_connect_arch(const net_addr_t *addr, char *errbuf,
-                           size_t errbufsize, int timeout,
+/**
+ * Connect to any of the addresses, they are tried in order. Platforms
+ * that can will start the next attempt if the current one has not
+ * completed within NET_CONNECT_RACE_DELAY ms and use whichever
+ * connection completes first ("Happy Eyeballs")
+ */
+#define NET_CONNECT_RACE_DELAY 250
+
+tcpcon_t *tcp_connect_arch(const net_addr_t *addrs, int num_addrs,
+                           char *errbuf, size_t errbufsize, int timeout,
                            struct cancellable *c, int dbg);
 
+/**
+ * Resolve all addresses (IPv4 and IPv6) for the given host. Returns
+ * number of addresses or -1 on error. Uncached, use net_resolve_host()
+ */
+int net_resolve_all(const char *hostname, net_addr_t *addrs, int max,
+                    const char **errmsg);
+
 void tcp_close_arch(tcpcon_t *tc);
 
-int tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen);
+int tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen,
+                 const char *hostname, int port);
 
 void tcp_ssl_close(tcpcon_t *tc);
@@ -21,11 +21,42 @@
 
 #include "main.h"
 #include "net_i.h"
+#include "misc/queue.h"
+#include "prop/prop.h"
 
 
 static SSL_CTX *app_ssl_ctx;
 static pthread_mutex_t *ssl_locks;
 
+
+/**
+ * Client side session cache
+ *
+ * Sessions (ticket or session ID, whatever the server gave us) are kept
+ * per host:port so the next connection can do an abbreviated handshake.
+ * OpenSSL hands us new sessions via ssl_new_session() which also covers
+ * tickets that arrive after the handshake is done.
+ */
+#define SSL_SESSION_CACHE_SIZE 32
+
+TAILQ_HEAD(ssl_cached_session_queue, ssl_cached_session);
+
+typedef struct ssl_cached_session {
+  TAILQ_ENTRY(ssl_cached_session) scs_link;
+  char scs_key[HOSTNAME_MAX + 8];
+  SSL_SESSION *scs_session;
+} ssl_cached_session_t;
+
+static struct ssl_cached_session_queue ssl_sessions; // Most recent first
+static int ssl_num_sessions;
+static HTS_MUTEX_DECL(ssl_sessions_mutex);
+
+static int ssl_handshakes;
+static int ssl_resumed;
+static int64_t ssl_full_time;     // µs, sum over all full handshakes
+static int64_t ssl_resumed_time;  // µs, sum over all resumed handshakes
+static prop_t *ssl_stats_prop;
+
 static unsigned long
 ssl_tid_fn(void)
 {
@@ -82,14 +113,109 @@ ssl_write(tcpcon_t *tc, const void *data, size_t len)
 }
 
 
+/**
+ * Must be called with ssl_sessions_mutex locked
+ */
+static ssl_cached_session_t *
+ssl_session_find(const char *key)
+{
+  ssl_cached_session_t *scs;
+
+  TAILQ_FOREACH(scs, &ssl_sessions, scs_link)
+    if(!strcmp(scs->scs_key, key))
+      return scs;
+  return NULL;
+}
+
+
+/**
+ * Must be called with ssl_sessions_mutex locked
+ */
+static void
+ssl_session_remove(ssl_cached_session_t *scs)
+{
+  TAILQ_REMOVE(&ssl_sessions, scs, scs_link);
+  ssl_num_sessions--;
+  SSL_SESSION_free(scs->scs_session);
+  free(scs);
+}
+
+
+/**
+ * Must be called with ssl_sessions_mutex locked
+ */
+static void
+ssl_update_stats(void)
+{
+  if(ssl_stats_prop == NULL)
+    ssl_stats_prop =
+      prop_create(prop_create(prop_create(prop_get_global(), "system"),
+                              "io"), "tls");
+
+  prop_t *p = ssl_stats_prop;
+  const int full = ssl_handshakes - ssl_resumed;
+
+  prop_set(p, "handshakes", PROP_SET_INT, ssl_handshakes);
+  prop_set(p, "resumed", PROP_SET_INT, ssl_resumed);
+  prop_set(p, "cachedSessions", PROP_SET_INT, ssl_num_sessions);
+
+  // Averages in ms
+  if(full)
+    prop_set(p, "fullHandshakeTime", PROP_SET_FLOAT,
+             ssl_full_time / 1000.0f / full);
+  if(ssl_resumed)
+    prop_set(p, "resumedHandshakeTime", PROP_SET_FLOAT,
+             ssl_resumed_time / 1000.0f / ssl_resumed);
+}
+
+
+/**
+ * Called by OpenSSL when the server gives us a session we can resume
+ */
+static int
+ssl_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+  const char *key = SSL_get_app_data(ssl);
+  ssl_cached_session_t *scs;
+
+  if(key == NULL)
+    return 0;
+
+  hts_mutex_lock(&ssl_sessions_mutex);
+
+  if((scs = ssl_session_find(key)) != NULL) {
+    TAILQ_REMOVE(&ssl_sessions, scs, scs_link);
+    SSL_SESSION_free(scs->scs_session);
+  } else {
+    if(ssl_num_sessions == SSL_SESSION_CACHE_SIZE)
+      ssl_session_remove(TAILQ_LAST(&ssl_sessions, ssl_cached_session_queue));
+
+    scs = malloc(sizeof(ssl_cached_session_t));
+    snprintf(scs->scs_key, sizeof(scs->scs_key), "%s", key);
+    ssl_num_sessions++;
+  }
+
+  scs->scs_session = sess;
+  TAILQ_INSERT_HEAD(&ssl_sessions, scs, scs_link);
+  hts_mutex_unlock(&ssl_sessions_mutex);
+  return 1; // We keep the reference
+}
+
+
+/**
+ *
+ */
 int
-tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen)
+tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen,
+             const char *hostname, int port)
 {
   if(app_ssl_ctx == NULL) {
     snprintf(errbuf, errlen, "SSL not initialized");
     return -1;
   }
   char errmsg[120];
+  char key[HOSTNAME_MAX + 8];
+  ssl_cached_session_t *scs;
 
   if((tc->ssl = SSL_new(app_ssl_ctx)) == NULL) {
     ERR_error_string(ERR_get_error(), errmsg);
@@ -103,12 +229,44 @@ tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen)
     return -1;
   }
 
+  snprintf(key, sizeof(key), "%s:%d", hostname, port);
+  SSL_set_app_data(tc->ssl, strdup(key));
+
+  hts_mutex_lock(&ssl_sessions_mutex);
+  if((scs = ssl_session_find(key)) != NULL) {
+    SSL_set_session(tc->ssl, scs->scs_session);
+    TAILQ_REMOVE(&ssl_sessions, scs, scs_link);
+    TAILQ_INSERT_HEAD(&ssl_sessions, scs, scs_link);
+  }
+  hts_mutex_unlock(&ssl_sessions_mutex);
+
+  const int64_t ts = arch_get_ts();
+
   if(SSL_connect(tc->ssl) <= 0) {
     ERR_error_string(ERR_get_error(), errmsg);
     snprintf(errbuf, errlen, "SSL connect: %s", errmsg);
+
+    // Don't try the same session again, it might be what made us fail
+    hts_mutex_lock(&ssl_sessions_mutex);
+    if((scs = ssl_session_find(key)) != NULL)
+      ssl_session_remove(scs);
+    hts_mutex_unlock(&ssl_sessions_mutex);
     return -1;
   }
 
+  const int64_t delta = arch_get_ts() - ts;
+
+  hts_mutex_lock(&ssl_sessions_mutex);
+  ssl_handshakes++;
+  if(SSL_session_reused(tc->ssl)) {
+    ssl_resumed++;
+    ssl_resumed_time += delta;
+  } else {
+    ssl_full_time += delta;
+  }
+  ssl_update_stats();
+  hts_mutex_unlock(&ssl_sessions_mutex);
+
   SSL_set_mode(tc->ssl, SSL_MODE_AUTO_RETRY);
   tc->read = ssl_read;
   tc->write = ssl_write;
@@ -122,8 +280,10 @@ tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen)
 void
 tcp_ssl_close(tcpcon_t *tc)
 {
+  char *key = SSL_get_app_data(tc->ssl);
   SSL_shutdown(tc->ssl);
   SSL_free(tc->ssl);
+  free(key);
 }
 
 
@@ -137,6 +297,11 @@ net_ssl_init(void)
   SSL_load_error_strings();
   app_ssl_ctx = SSL_CTX_new(SSLv23_client_method());
 
+  TAILQ_INIT(&ssl_sessions);
+  SSL_CTX_set_session_cache_mode(app_ssl_ctx, SSL_SESS_CACHE_CLIENT |
+                                 SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(app_ssl_ctx, ssl_new_session);
+
   int i, n = CRYPTO_num_locks();
   ssl_locks = malloc(sizeof(pthread_mutex_t) * n);
   for(i = 0; i < n; i++)
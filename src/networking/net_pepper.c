@@ -188,13 +188,26 @@ net_resolve(const char *hostname, net_addr_t *addr, const char **err)
 }
 
 
+/**
+ * Only a single address is available from the resolver here
+ */
+int
+net_resolve_all(const char *hostname, net_addr_t *addrs, int max,
+                const char **err)
+{
+  if(max < 1 || net_resolve(hostname, addrs, err))
+    return -1;
+  return 1;
+}
+
+
 /**
  *
  */
-tcpcon_t *
-tcp_connect_arch(const net_addr_t *na,
-                 char *errbuf, size_t errlen,
-                 int timeout, cancellable_t *c, int dbg)
+static tcpcon_t *
+tcp_connect_one(const net_addr_t *na,
+                char *errbuf, size_t errlen,
+                int timeout, cancellable_t *c, int dbg)
 {
   PP_Resource sock = ppb_tcpsocket->Create(g_Instance);
   PP_Resource addr;
@@ -243,6 +256,28 @@ tcp_connect_arch(const net_addr_t *na,
 }
 
 
+/**
+ * No parallel connection attempts here, just try the addresses in order
+ */
+tcpcon_t *
+tcp_connect_arch(const net_addr_t *addrs, int num_addrs,
+                 char *errbuf, size_t errbufsize,
+                 int timeout, cancellable_t *c, int dbg)
+{
+  tcpcon_t *tc = NULL;
+  int i;
+
+  snprintf(errbuf, errbufsize, "No address to connect to");
+
+  for(i = 0; i < num_addrs && tc == NULL; i++) {
+    if(cancellable_is_cancelled(c))
+      break;
+    tc = tcp_connect_one(&addrs[i], errbuf, errbufsize, timeout, c, dbg);
+  }
+  return tc;
+}
+
+
 /**
  *
  */
@@ -88,7 +88,8 @@ raw_send( void *ctx, const unsigned char *buf, size_t len)
  *
  */
 int
-tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen)
+tcp_ssl_open(tcpcon_t *tc, char *errbuf, size_t errlen,
+             const char *hostname, int port)
 {
   tc->ssl = malloc(sizeof(ssl_context));
   if(ssl_init(tc->ssl)) {
@@ -36,6 +36,7 @@
 
 #include "main.h"
 #include "net_i.h"
+#include "misc/minmax.h"
 
 /**
  *
@@ -227,14 +228,83 @@ net_resolve(const char *hostname, net_addr_t *addr, const char **err)
 
 
 /**
- *
+ * IPv6 and IPv4 addresses are interleaved, starting with the family
+ * the system resolver put first (RFC 8305, section 4)
  */
-tcpcon_t *
-tcp_connect_arch(const net_addr_t *addr,
-                 char *errbuf, size_t errbufsize,
-                 int timeout, cancellable_t *c, int dbg)
+int
+net_resolve_all(const char *hostname, net_addr_t *addrs, int max,
+                const char **err)
+{
+  struct addrinfo hints, *res, *ai;
+  net_addr_t v4[NET_MAX_ADDRS], v6[NET_MAX_ADDRS];
+  int n4 = 0, n6 = 0, num = 0, first6 = -1, r;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+
+  // With AF_UNSPEC the A and AAAA queries are sent in parallel
+  if((r = getaddrinfo(hostname, NULL, &hints, &res)) != 0) {
+    *err = gai_strerror(r);
+    return -1;
+  }
+
+  for(ai = res; ai != NULL; ai = ai->ai_next) {
+    switch(ai->ai_family) {
+    case AF_INET:
+      if(n4 == NET_MAX_ADDRS)
+        break;
+      memset(&v4[n4], 0, sizeof(net_addr_t));
+      v4[n4].na_family = 4;
+      memcpy(v4[n4].na_addr,
+             &((const struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+      n4++;
+      if(first6 == -1)
+        first6 = 0;
+      break;
+
+    case AF_INET6:
+      if(n6 == NET_MAX_ADDRS)
+        break;
+      memset(&v6[n6], 0, sizeof(net_addr_t));
+      v6[n6].na_family = 6;
+      memcpy(v6[n6].na_addr,
+             &((const struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, 16);
+      n6++;
+      if(first6 == -1)
+        first6 = 1;
+      break;
+    }
+  }
+  freeaddrinfo(res);
+
+  if(n4 + n6 == 0) {
+    *err = "No usable address";
+    return -1;
+  }
+
+  int i4 = 0, i6 = 0;
+  int use6 = first6;
+  while(num < max && (i4 < n4 || i6 < n6)) {
+    if((use6 && i6 < n6) || i4 == n4)
+      addrs[num++] = v6[i6++];
+    else
+      addrs[num++] = v4[i4++];
+    use6 = !use6;
+  }
+  return num;
+}
+
+
+/**
+ * Start a non-blocking connect. Returns fd or -1 on error
+ */
+static int
+tcp_connect_start(const net_addr_t *addr, char *errbuf, size_t errbufsize,
+                  int *connected)
 {
-  int fd, r, err;
+  int fd;
 
   union {
     struct sockaddr_storage ss;
@@ -242,7 +312,6 @@ tcp_connect_arch(const net_addr_t *addr,
     struct sockaddr_in6 in6;
   } su;
 
-  socklen_t errlen = sizeof(int);
   socklen_t slen;
 
   memset(&su, 0, sizeof(su));
@@ -255,7 +324,7 @@ tcp_connect_arch(const net_addr_t *addr,
     slen = sizeof(struct sockaddr_in);
     break;
 
-  case AF_INET6:
+  case 6:
     su.in6.sin6_family = AF_INET6;
     su.in6.sin6_port = htons(addr->na_port);
     memcpy(&su.in6.sin6_addr, addr->na_addr, sizeof(struct in6_addr));
@@ -264,57 +333,126 @@ tcp_connect_arch(const net_addr_t *addr,
 
   default:
     snprintf(errbuf, errbufsize, "Invalid protocol family");
-    return NULL;
+    return -1;
   }
 
   if((fd = getstreamsocket(su.ss.ss_family, errbuf, errbufsize)) == -1)
-    return NULL;
+    return -1;
 
-  r = connect(fd, (struct sockaddr *)&su, slen);
+  if(connect(fd, (struct sockaddr *)&su, slen) == 0) {
+    *connected = 1;
+  } else if(errno == EINPROGRESS) {
+    *connected = 0;
+  } else {
+    snprintf(errbuf, errbufsize, "%s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
-  tcpcon_t *tc = calloc(1, sizeof(tcpcon_t));
-  tc->fd = fd;
-  tc->c = c;
-  htsbuf_queue_init(&tc->spill, 0);
 
-  if(c != NULL)
-    cancellable_bind(c, tcp_cancel, tc);
+/**
+ *
+ */
+tcpcon_t *
+tcp_connect_arch(const net_addr_t *addrs, int num_addrs,
+                 char *errbuf, size_t errbufsize,
+                 int timeout, cancellable_t *c, int dbg)
+{
+  struct pollfd pfd[NET_MAX_ADDRS];
+  int i, r, err, fd = -1, active = 0, started = 0;
+  socklen_t errlen = sizeof(int);
+  const int64_t deadline = arch_get_ts() + timeout * 1000LL;
+  int64_t next_start = 0;
+
+  num_addrs = MIN(num_addrs, NET_MAX_ADDRS);
 
-  if(r == -1) {
-    if(errno == EINPROGRESS) {
-      struct pollfd pfd;
+  snprintf(errbuf, errbufsize, "No address to connect to");
 
-      pfd.fd = fd;
-      pfd.events = POLLOUT;
-      pfd.revents = 0;
+  while(fd == -1) {
+    const int64_t now = arch_get_ts();
 
-      r = poll(&pfd, 1, timeout);
-      if(r < 1) {
+    if(started < num_addrs && (active == 0 || now >= next_start)) {
+      int connected;
+      const net_addr_t *na = &addrs[started++];
+      next_start = now + NET_CONNECT_RACE_DELAY * 1000;
 
+      r = tcp_connect_start(na, errbuf, errbufsize, &connected);
+      if(r == -1)
+        continue;
 
-	/* Timeout */
-        if(!r)
-          snprintf(errbuf, errbufsize, "Connection attempt timed out");
-        else
-          snprintf(errbuf, errbufsize, "poll() error: %s", strerror(errno));
+      if(dbg)
+        TRACE(TRACE_DEBUG, "TCP", "Connecting to %s (attempt %d)",
+              net_addr_str(na), started);
 
-        tcp_close(tc);
-	return NULL;
+      if(connected) {
+        fd = r;
+        break;
       }
+      pfd[active].fd = r;
+      pfd[active].events = POLLOUT;
+      pfd[active].revents = 0;
+      active++;
+      continue;
+    }
 
-      getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
-    } else {
-      err = errno;
+    if(active == 0)
+      return NULL; // All attempts failed, errbuf has the last error
+
+    if(cancellable_is_cancelled(c)) {
+      snprintf(errbuf, errbufsize, "Cancelled");
+      break;
+    }
+
+    if(now >= deadline) {
+      snprintf(errbuf, errbufsize, "Connection attempt timed out");
+      break;
+    }
+
+    int64_t wakeup = deadline;
+    if(started < num_addrs)
+      wakeup = MIN(wakeup, next_start);
+
+    // Wake up now and then to check for cancellation
+    r = poll(pfd, active, MIN(100, (wakeup - now + 999) / 1000));
+    if(r == -1 && errno != EINTR) {
+      snprintf(errbuf, errbufsize, "poll() error: %s", strerror(errno));
+      break;
+    }
+
+    for(i = active - 1; i >= 0 && r > 0; i--) {
+      if(!pfd[i].revents)
+        continue;
+
+      getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen);
+      if(err == 0) {
+        fd = pfd[i].fd;
+        pfd[i] = pfd[--active];
+        break;
+      }
+
+      snprintf(errbuf, errbufsize, "%s", strerror(err));
+      close(pfd[i].fd);
+      pfd[i] = pfd[--active];
+      next_start = now; // Try next address right away
     }
-  } else {
-    err = 0;
   }
 
-  if(err != 0) {
-    snprintf(errbuf, errbufsize, "%s", strerror(err));
-    tcp_close(tc);
+  // Close attempts that lost the race
+  for(i = 0; i < active; i++)
+    close(pfd[i].fd);
+
+  if(fd == -1)
     return NULL;
-  }
+
+  tcpcon_t *tc = calloc(1, sizeof(tcpcon_t));
+  tc->fd = fd;
+  tc->c = c;
+  htsbuf_queue_init(&tc->spill, 0);
+
+  if(c != NULL)
+    cancellable_bind(c, tcp_cancel, tc);
 
   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 
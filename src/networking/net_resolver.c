@@ -0,0 +1,280 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "net_i.h"
+#include "misc/queue.h"
+#include "misc/minmax.h"
+#include "prop/prop.h"
+
+/**
+ * Caching resolver
+ *
+ * The system resolver does not tell us the TTL of the records so
+ * entries are kept for a fixed time. Failures are cached too (for a
+ * shorter time) so a dead host does not cost a full resolver timeout
+ * on every retry.
+ *
+ * Concurrent lookups of the same name are done once, other threads
+ * wait for the result of the first one.
+ */
+
+#define RESOLVER_CACHE_SIZE   64
+#define RESOLVER_POSITIVE_TTL 60  // seconds
+#define RESOLVER_NEGATIVE_TTL 10  // seconds
+
+TAILQ_HEAD(resolver_entry_queue, resolver_entry);
+
+typedef struct resolver_entry {
+  TAILQ_ENTRY(resolver_entry) re_link;
+  char re_hostname[HOSTNAME_MAX];
+
+  int64_t re_expire;
+  char re_pending;  // Lookup in progress
+
+  int re_num_addrs; // -1 if lookup failed
+  const char *re_errmsg;
+  net_addr_t re_addrs[NET_MAX_ADDRS];
+
+} resolver_entry_t;
+
+static struct resolver_entry_queue resolver_entries; // Most recent first
+static int resolver_num_entries;
+static hts_mutex_t resolver_mutex;
+static hts_cond_t resolver_cond;
+
+
+/**
+ * Statistics
+ */
+static const int resolver_latency_limits[] = {
+  1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 0
+};
+
+#define RESOLVER_LATENCY_BUCKETS \
+  (sizeof(resolver_latency_limits) / sizeof(resolver_latency_limits[0]))
+
+static int resolver_lookups;
+static int resolver_hits;
+static int resolver_negative_hits;
+static int resolver_failures;
+static int resolver_latency[RESOLVER_LATENCY_BUCKETS];
+
+static prop_t *resolver_prop;
+static prop_t *resolver_latency_props[RESOLVER_LATENCY_BUCKETS];
+
+
+/**
+ * Must be called with resolver_mutex locked
+ */
+static void
+resolver_update_stats(void)
+{
+  int i;
+
+  if(resolver_prop == NULL) {
+    resolver_prop =
+      prop_create(prop_create(prop_create(prop_get_global(), "system"),
+                              "io"), "dns");
+
+    prop_t *l = prop_create(resolver_prop, "latency");
+    for(i = 0; i < RESOLVER_LATENCY_BUCKETS; i++) {
+      resolver_latency_props[i] = prop_create(l, NULL);
+      // 0 means the bucket has no upper bound
+      prop_set(resolver_latency_props[i], "limit", PROP_SET_INT,
+               resolver_latency_limits[i]);
+    }
+  }
+
+  prop_set(resolver_prop, "lookups", PROP_SET_INT, resolver_lookups);
+  prop_set(resolver_prop, "hits", PROP_SET_INT, resolver_hits);
+  prop_set(resolver_prop, "negativeHits", PROP_SET_INT,
+           resolver_negative_hits);
+  prop_set(resolver_prop, "failures", PROP_SET_INT, resolver_failures);
+  prop_set(resolver_prop, "cached", PROP_SET_INT, resolver_num_entries);
+
+  for(i = 0; i < RESOLVER_LATENCY_BUCKETS; i++)
+    prop_set(resolver_latency_props[i], "count", PROP_SET_INT,
+             resolver_latency[i]);
+}
+
+
+/**
+ * Must be called with resolver_mutex locked
+ */
+static void
+resolver_record_latency(int64_t us)
+{
+  int i;
+
+  for(i = 0; i < RESOLVER_LATENCY_BUCKETS - 1; i++)
+    if(us < resolver_latency_limits[i] * 1000)
+      break;
+  resolver_latency[i]++;
+}
+
+
+/**
+ * Must be called with resolver_mutex locked
+ */
+static void
+resolver_entry_destroy(resolver_entry_t *re)
+{
+  TAILQ_REMOVE(&resolver_entries, re, re_link);
+  resolver_num_entries--;
+  free(re);
+}
+
+
+/**
+ * Must be called with resolver_mutex locked
+ */
+static resolver_entry_t *
+resolver_entry_find(const char *hostname)
+{
+  resolver_entry_t *re;
+
+  TAILQ_FOREACH(re, &resolver_entries, re_link)
+    if(!strcmp(re->re_hostname, hostname))
+      return re;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static int
+resolver_copy(const resolver_entry_t *re, net_addr_t *addrs, int max,
+              const char **errmsg)
+{
+  if(re->re_num_addrs < 0) {
+    *errmsg = re->re_errmsg;
+    return -1;
+  }
+
+  const int num = MIN(re->re_num_addrs, max);
+  memcpy(addrs, re->re_addrs, num * sizeof(net_addr_t));
+  return num;
+}
+
+
+/**
+ * Resolve hostname into at most 'max' addresses in the order they
+ * should be connected to. Returns number of addresses or -1 on error
+ */
+int
+net_resolve_host(const char *hostname, net_addr_t *addrs, int max,
+                 const char **errmsg)
+{
+  resolver_entry_t *re;
+  int r;
+
+  if(strlen(hostname) >= HOSTNAME_MAX) {
+    *errmsg = "Hostname too long";
+    return -1;
+  }
+
+  hts_mutex_lock(&resolver_mutex);
+
+  resolver_lookups++;
+
+  while((re = resolver_entry_find(hostname)) != NULL && re->re_pending)
+    hts_cond_wait(&resolver_cond, &resolver_mutex);
+
+  if(re != NULL) {
+    if(re->re_expire > arch_get_ts()) {
+      if(re->re_num_addrs < 0)
+        resolver_negative_hits++;
+      else
+        resolver_hits++;
+
+      TAILQ_REMOVE(&resolver_entries, re, re_link);
+      TAILQ_INSERT_HEAD(&resolver_entries, re, re_link);
+
+      r = resolver_copy(re, addrs, max, errmsg);
+      resolver_update_stats();
+      hts_mutex_unlock(&resolver_mutex);
+      return r;
+    }
+    resolver_entry_destroy(re);
+  }
+
+  if(resolver_num_entries == RESOLVER_CACHE_SIZE) {
+    // Evict least recently used entry that's not being resolved
+    TAILQ_FOREACH_REVERSE(re, &resolver_entries, resolver_entry_queue,
+                          re_link) {
+      if(!re->re_pending) {
+        resolver_entry_destroy(re);
+        break;
+      }
+    }
+  }
+
+  re = calloc(1, sizeof(resolver_entry_t));
+  snprintf(re->re_hostname, sizeof(re->re_hostname), "%s", hostname);
+  re->re_pending = 1;
+  TAILQ_INSERT_HEAD(&resolver_entries, re, re_link);
+  resolver_num_entries++;
+
+  hts_mutex_unlock(&resolver_mutex);
+
+  const int64_t ts = arch_get_ts();
+  re->re_num_addrs = net_resolve_all(hostname, re->re_addrs, NET_MAX_ADDRS,
+                                     &re->re_errmsg);
+  const int64_t now = arch_get_ts();
+
+  hts_mutex_lock(&resolver_mutex);
+
+  resolver_record_latency(now - ts);
+
+  if(re->re_num_addrs < 0) {
+    resolver_failures++;
+    re->re_expire = now + RESOLVER_NEGATIVE_TTL * 1000000LL;
+    TRACE(TRACE_DEBUG, "DNS", "Unable to resolve %s -- %s",
+          hostname, re->re_errmsg);
+  } else {
+    re->re_expire = now + RESOLVER_POSITIVE_TTL * 1000000LL;
+  }
+
+  re->re_pending = 0;
+  hts_cond_broadcast(&resolver_cond);
+
+  r = resolver_copy(re, addrs, max, errmsg);
+  resolver_update_stats();
+  hts_mutex_unlock(&resolver_mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+net_resolver_init(void)
+{
+  TAILQ_INIT(&resolver_entries);
+  hts_mutex_init(&resolver_mutex);
+  hts_cond_init(&resolver_cond, &resolver_mutex);
+}
+
+INITME(INIT_GROUP_NET, net_resolver_init, NULL);
@@ -152,6 +152,7 @@ void prop_init_late(void);
 #define PROP_SUB_SINGLETON            0x800
 #define PROP_SUB_USER_INT             0x1000
 #define PROP_SUB_ALT_PATH             0x2000
+#define PROP_SUB_CHILD_VECTORS        0x4000 // Accepts batched child adds
 // Remember that flags field is uint16_t in prop_i.h so don't go above 0x8000
 
 
@@ -399,6 +400,7 @@ void prop_request_delete(prop_t *p);
 void prop_request_delete_multi(prop_vec_t *pv);
 
 #define PROP_COURIER_TRACE_TIMES 0x1
+#define PROP_COURIER_COALESCE    0x2
 
 prop_courier_t *prop_courier_create_thread(hts_mutex_t *entrymutex,
 					   const char *name,
@@ -411,6 +413,8 @@ prop_courier_t *prop_courier_create_notify(void (*notify)(void *opaque),
 
 prop_courier_t *prop_courier_create_waitable(void);
 
+void prop_courier_set_flags(prop_courier_t *pc, int flags);
+
 prop_courier_t *prop_courier_create_lockmgr(const char *name, 
 					    prop_lockmgr_t *mgr, void *lock,
 					    void (*prologue)(void),
@@ -250,11 +250,9 @@ prop_ref_dec_traced(prop_t *p, const char *file, int line)
   extern void prop_tag_dump(prop_t *p);
   prop_tag_dump(p);
 
-  hts_mutex_lock(&prop_mutex);
   assert(p->hp_tags == NULL);
   memset(p, 0xdd, sizeof(prop_t));
   pool_put(prop_pool, p);
-  hts_mutex_unlock(&prop_mutex);
 }
 
 
@@ -362,9 +360,7 @@ prop_ref_dec(prop_t *p)
   assert(p->hp_magic == PROP_MAGIC);
   memset(p, 0xdd, sizeof(prop_t));
 #endif
-  hts_mutex_lock(&prop_mutex);
   pool_put(prop_pool, p);
-  hts_mutex_unlock(&prop_mutex);
 }
 
 
@@ -889,6 +885,130 @@ prop_dispatch_one(prop_notify_t *n, int lockmode)
   return 0;
 }
 
+/**
+ *
+ */
+static int
+prop_notify_is_value(const prop_notify_t *n)
+{
+  switch(n->hpn_event) {
+  case PROP_SET_DIR:
+  case PROP_SET_VOID:
+  case PROP_SET_RSTRING:
+  case PROP_SET_CSTRING:
+  case PROP_SET_URI:
+  case PROP_SET_INT:
+  case PROP_SET_FLOAT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+
+/**
+ *
+ */
+static int
+prop_notify_is_plain_add(const prop_notify_t *n, const prop_sub_t *s)
+{
+  return n->hpn_sub == s && n->hpn_event == PROP_ADD_CHILD &&
+    n->hpn_flags == 0;
+}
+
+
+static unsigned int prop_coalesce_gen;
+
+
+/**
+ * Shrink a batch of notifications that is about to be dispatched on a
+ * courier created with PROP_COURIER_COALESCE.
+ *
+ * A value update is dropped if the same subscription has a newer value
+ * update later in the batch with nothing else for that subscription
+ * in between. Runs of plain PROP_ADD_CHILD for subscriptions that
+ * have PROP_SUB_CHILD_VECTORS set are folded into a single
+ * PROP_ADD_CHILD_VECTOR.
+ *
+ * PROP_SUB_MULTI subscriptions are left alone since their value
+ * updates may originate from different props.
+ *
+ * Must be called with prop_mutex held
+ */
+void
+prop_courier_coalesce(prop_courier_t *pc, struct prop_notify_queue *q)
+{
+  prop_notify_t *n, *m, *prev;
+  prop_sub_t *s;
+  unsigned int gen;
+  int cnt;
+
+  if(!(pc->pc_flags & PROP_COURIER_COALESCE))
+    return;
+
+  gen = ++prop_coalesce_gen;
+  if(gen == 0)
+    gen = ++prop_coalesce_gen;
+
+  // Walk backwards so the newest value for each subscription is seen first
+
+  for(n = TAILQ_LAST(q, prop_notify_queue); n != NULL; n = prev) {
+    prev = TAILQ_PREV(n, prop_notify_queue, hpn_link);
+    s = n->hpn_sub;
+
+    if(s->hps_flags & PROP_SUB_MULTI)
+      continue;
+
+    if(!prop_notify_is_value(n)) {
+      s->hps_coalesce_gen = 0;
+      continue;
+    }
+
+    if(s->hps_coalesce_gen == gen) {
+      TAILQ_REMOVE(q, n, hpn_link);
+      prop_notify_free(n);
+      continue;
+    }
+    s->hps_coalesce_gen = gen;
+  }
+
+  TAILQ_FOREACH(n, q, hpn_link) {
+    s = n->hpn_sub;
+
+    if(!(s->hps_flags & PROP_SUB_CHILD_VECTORS) ||
+       !prop_notify_is_plain_add(n, s))
+      continue;
+
+    cnt = 1;
+    m = TAILQ_NEXT(n, hpn_link);
+    while(m != NULL && prop_notify_is_plain_add(m, s)) {
+      m = TAILQ_NEXT(m, hpn_link);
+      cnt++;
+    }
+
+    if(cnt == 1)
+      continue;
+
+    // The vector takes over the prop references held by the notifications
+
+    prop_vec_t *pv = prop_vec_create(cnt);
+    pv->pv_vec[pv->pv_length++] = n->hpn_prop;
+
+    while((m = TAILQ_NEXT(n, hpn_link)) != NULL &&
+          prop_notify_is_plain_add(m, s)) {
+      pv->pv_vec[pv->pv_length++] = m->hpn_prop;
+      TAILQ_REMOVE(q, m, hpn_link);
+      prop_sub_ref_dec_locked(s);
+      pool_put(notify_pool, m);
+    }
+
+    n->hpn_event = PROP_ADD_CHILD_VECTOR;
+    n->hpn_propv = pv;
+    n->hpn_prop2 = NULL;
+  }
+}
+
+
 /**
  *
  */
@@ -961,7 +1081,12 @@ prop_courier(void *aux)
     TAILQ_INIT(&pc->pc_queue_exp);
 
     TAILQ_INIT(&q_nor);
-    if((n = TAILQ_FIRST(&pc->pc_queue_nor)) != NULL) {
+    if(pc->pc_flags & PROP_COURIER_COALESCE) {
+      // Take everything at once, otherwise there is nothing to coalesce
+      TAILQ_MERGE(&q_nor, &pc->pc_queue_nor, hpn_link);
+      prop_courier_coalesce(pc, &q_exp);
+      prop_courier_coalesce(pc, &q_nor);
+    } else if((n = TAILQ_FIRST(&pc->pc_queue_nor)) != NULL) {
       TAILQ_REMOVE(&pc->pc_queue_nor, n, hpn_link);
       TAILQ_INSERT_TAIL(&q_nor, n, hpn_link);
     }
@@ -3208,11 +3333,14 @@ prop_init(void)
   TAILQ_INIT(&prop_global_dispatch_dispatching_queue);
 
 
-  prop_pool   = pool_create("prop", sizeof(prop_t), 0);
-  notify_pool = pool_create("notify", sizeof(prop_notify_t), 0);
-  sub_pool    = pool_create("subs", sizeof(prop_sub_t), 0);
-  pot_pool    = pool_create("pots", sizeof(prop_originator_tracking_t), 0);
-  psd_pool    = pool_create("psds", sizeof(prop_sub_dispatch_t), 0);
+  prop_pool   = pool_create("prop", sizeof(prop_t), POOL_THREAD_CACHE);
+  notify_pool = pool_create("notify", sizeof(prop_notify_t),
+                            POOL_THREAD_CACHE);
+  sub_pool    = pool_create("subs", sizeof(prop_sub_t), POOL_THREAD_CACHE);
+  pot_pool    = pool_create("pots", sizeof(prop_originator_tracking_t),
+                            POOL_THREAD_CACHE);
+  psd_pool    = pool_create("psds", sizeof(prop_sub_dispatch_t),
+                            POOL_THREAD_CACHE);
 
   hts_mutex_lock(&prop_mutex);
   prop_global = prop_make("global", 1, NULL);
@@ -4823,6 +4951,18 @@ prop_courier_create_lockmgr(const char *name, prop_lockmgr_t *mgr, void *lock,
 }
 
 
+/**
+ *
+ */
+void
+prop_courier_set_flags(prop_courier_t *pc, int flags)
+{
+  hts_mutex_lock(&prop_mutex);
+  pc->pc_flags |= flags;
+  hts_mutex_unlock(&prop_mutex);
+}
+
+
 /**
  *
  */
@@ -4841,6 +4981,7 @@ prop_courier_wait(prop_courier_t *pc, struct prop_notify_queue *q, int timeout)
 
   TAILQ_MOVE(q, &pc->pc_queue_exp, hpn_link);
   TAILQ_MERGE(q, &pc->pc_queue_nor, hpn_link);
+  prop_courier_coalesce(pc, q);
   hts_mutex_unlock(&prop_mutex);
   return r;
 }
@@ -4935,6 +5076,7 @@ prop_courier_poll(prop_courier_t *pc)
   hts_mutex_lock(&prop_mutex);
   TAILQ_MOVE(&q, &pc->pc_queue_exp, hpn_link);
   TAILQ_MERGE(&q, &pc->pc_queue_nor, hpn_link);
+  prop_courier_coalesce(pc, &q);
   hts_mutex_unlock(&prop_mutex);
   prop_notify_dispatch(&q, 0);
 }
@@ -4954,6 +5096,7 @@ prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
   if(!hts_mutex_trylock(&prop_mutex)) {
     TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
     TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+    prop_courier_coalesce(pc, &pc->pc_dispatch_queue);
 
     for(n = TAILQ_FIRST(&pc->pc_free_queue); n != NULL; n = next) {
       next = TAILQ_NEXT(n, hpn_link);
@@ -5523,9 +5666,39 @@ prop_print_tree(prop_t *p, int followlinks)
 
 
 
-#ifdef PROP_SUB_STATS
 #include "misc/callout.h"
 
+static callout_t prop_pool_stats_callout;
+static prop_t *prop_stats_nodes;
+static prop_t *prop_stats_subs;
+static prop_t *prop_stats_hitrate;
+
+/**
+ * Publish prop allocator usage to the system info page
+ */
+static void
+prop_update_pool_stats(callout_t *c, void *aux)
+{
+  pool_stats_t props, subs, notifies;
+
+  pool_get_stats(prop_pool, &props);
+  pool_get_stats(sub_pool, &subs);
+  pool_get_stats(notify_pool, &notifies);
+
+  int64_t gets = props.ps_gets + subs.ps_gets + notifies.ps_gets;
+  int64_t hits = props.ps_cache_hits + subs.ps_cache_hits +
+    notifies.ps_cache_hits;
+
+  prop_set_int(prop_stats_nodes, props.ps_in_use);
+  prop_set_int(prop_stats_subs,  subs.ps_in_use);
+  prop_set_int(prop_stats_hitrate, gets ? hits * 100 / gets : 0);
+
+  callout_arm(&prop_pool_stats_callout, prop_update_pool_stats, NULL, 5);
+}
+
+
+#ifdef PROP_SUB_STATS
+
 static callout_t prop_stats_callout;
 
 static void
@@ -5574,6 +5747,12 @@ extern void prop_test(void);
 void
 prop_init_late(void)
 {
+  prop_t *p = prop_create(prop_create(prop_get_global(), "system"), "prop");
+  prop_stats_nodes   = prop_create(p, "nodes");
+  prop_stats_subs    = prop_create(p, "subscriptions");
+  prop_stats_hitrate = prop_create(p, "cachehits");
+  prop_update_pool_stats(NULL, NULL);
+
 #ifdef PROP_SUB_STATS
   callout_arm(&prop_stats_callout, prop_report_stats, NULL, 1);
 #endif
@@ -444,6 +444,12 @@ struct prop_sub {
    */
   uint16_t hps_flags;
 
+  /**
+   * Scratch mark used while coalescing a courier batch.
+   * Protected by global mutex
+   */
+  unsigned int hps_coalesce_gen;
+
   /**
    * Extra value for use by caller
    */
@@ -510,4 +516,6 @@ void prop_sub_ref_dec_locked(prop_sub_t *s);
 
 int prop_dispatch_one(prop_notify_t *n, int lockmode);
 
+void prop_courier_coalesce(prop_courier_t *pc, struct prop_notify_queue *q);
+
 #endif // PROP_I_H__
@@ -28,6 +28,7 @@
 
 #include "arch/atomic.h"
 
+#include "main.h"
 #include "prop.h"
 #include "prop_i.h"
 
@@ -318,6 +319,169 @@ prop_test2(void)
 
 
 
+/**
+ * Dispatch benchmark
+ *
+ * Hammers a threaded courier with value updates on a single prop and
+ * with child additions to a single dir, once in plain mode and once
+ * with PROP_COURIER_COALESCE, and prints notifications/sec, number of
+ * callbacks and dispatch latency (time from prop_set_int() until the
+ * value is seen by the subscriber)
+ */
+
+#define BENCH_UPDATES 200000
+#define BENCH_CHILDS   50000
+
+typedef struct prop_bench {
+  hts_mutex_t pb_mutex;
+  hts_cond_t pb_cond;
+  int pb_done;
+  int pb_callbacks;
+  int pb_childs;
+  int64_t pb_latency_sum;
+  int64_t pb_latency_max;
+} prop_bench_t;
+
+static int64_t bench_ts[BENCH_UPDATES];
+
+
+static void
+bench_done(prop_bench_t *pb)
+{
+  hts_mutex_lock(&pb->pb_mutex);
+  pb->pb_done = 1;
+  hts_cond_signal(&pb->pb_cond);
+  hts_mutex_unlock(&pb->pb_mutex);
+}
+
+
+static void
+bench_wait(prop_bench_t *pb)
+{
+  hts_mutex_lock(&pb->pb_mutex);
+  while(!pb->pb_done)
+    hts_cond_wait(&pb->pb_cond, &pb->pb_mutex);
+  hts_mutex_unlock(&pb->pb_mutex);
+}
+
+
+static void
+bench_value_cb(void *opaque, int v)
+{
+  prop_bench_t *pb = opaque;
+  int64_t lat = arch_get_ts() - bench_ts[v];
+
+  pb->pb_callbacks++;
+  pb->pb_latency_sum += lat;
+  if(lat > pb->pb_latency_max)
+    pb->pb_latency_max = lat;
+
+  if(v == BENCH_UPDATES - 1)
+    bench_done(pb);
+}
+
+
+static void
+bench_child_cb(void *opaque, prop_event_t event, ...)
+{
+  prop_bench_t *pb = opaque;
+  va_list ap;
+  va_start(ap, event);
+
+  switch(event) {
+  case PROP_ADD_CHILD:
+    pb->pb_childs++;
+    break;
+  case PROP_ADD_CHILD_VECTOR:
+    pb->pb_childs += prop_vec_len(va_arg(ap, prop_vec_t *));
+    break;
+  default:
+    va_end(ap);
+    return;
+  }
+  va_end(ap);
+  pb->pb_callbacks++;
+
+  if(pb->pb_childs == BENCH_CHILDS)
+    bench_done(pb);
+}
+
+
+static void
+prop_bench_run(int flags)
+{
+  prop_courier_t *pc = prop_courier_create_thread(NULL, "propbench", flags);
+  prop_bench_t pb = {};
+  prop_sub_t *s;
+  int64_t start, done;
+  int i;
+
+  const char *mode = flags & PROP_COURIER_COALESCE ? "coalesced" : "plain";
+
+  hts_mutex_init(&pb.pb_mutex);
+  hts_cond_init(&pb.pb_cond, &pb.pb_mutex);
+
+  // Value updates
+
+  prop_t *p = prop_create_root(NULL);
+  prop_set_int(p, 0);
+
+  s = prop_subscribe(PROP_SUB_NO_INITIAL_UPDATE,
+                     PROP_TAG_CALLBACK_INT, bench_value_cb, &pb,
+                     PROP_TAG_COURIER, pc,
+                     PROP_TAG_ROOT, p,
+                     NULL);
+
+  start = arch_get_ts();
+  for(i = 0; i < BENCH_UPDATES; i++) {
+    bench_ts[i] = arch_get_ts();
+    prop_set_int(p, i);
+  }
+  bench_wait(&pb);
+  done = arch_get_ts();
+
+  printf("prop bench (%s): %d value updates in %d callbacks, "
+         "%.0f notifications/s, latency avg=%"PRId64"us max=%"PRId64"us\n",
+         mode, BENCH_UPDATES, pb.pb_callbacks,
+         BENCH_UPDATES * 1000000.0 / (done - start),
+         pb.pb_latency_sum / pb.pb_callbacks, pb.pb_latency_max);
+
+  prop_unsubscribe(s);
+  prop_destroy(p);
+
+  // Child additions
+
+  pb.pb_done = 0;
+  pb.pb_callbacks = 0;
+
+  p = prop_create_root(NULL);
+
+  s = prop_subscribe(PROP_SUB_NO_INITIAL_UPDATE | PROP_SUB_CHILD_VECTORS,
+                     PROP_TAG_CALLBACK, bench_child_cb, &pb,
+                     PROP_TAG_COURIER, pc,
+                     PROP_TAG_ROOT, p,
+                     NULL);
+
+  start = arch_get_ts();
+  for(i = 0; i < BENCH_CHILDS; i++)
+    prop_create(p, NULL);
+  bench_wait(&pb);
+  done = arch_get_ts();
+
+  printf("prop bench (%s): %d child adds in %d callbacks, "
+         "%.0f childs/s\n",
+         mode, BENCH_CHILDS, pb.pb_callbacks,
+         BENCH_CHILDS * 1000000.0 / (done - start));
+
+  prop_unsubscribe(s);
+  prop_destroy(p);
+
+  prop_courier_destroy(pc);
+  hts_cond_destroy(&pb.pb_cond);
+  hts_mutex_destroy(&pb.pb_mutex);
+}
+
+
 /**
  *
  */
@@ -326,5 +490,7 @@ prop_test(void)
 {
   prop_test1();
   prop_test2();
+  prop_bench_run(0);
+  prop_bench_run(PROP_COURIER_COALESCE);
 }
 #endif
@@ -1413,6 +1413,9 @@ init_dev_settings(void)
 
   add_dev_bool(s, "Log AV-diff stats",
 	       "detailedavdiff", &gconf.enable_detailed_avdiff);
+
+  add_dev_bool(s, "Show frame timing overlay",
+	       "frametrace", &gconf.enable_frametrace_overlay);
 #ifdef PS3
   add_dev_bool(s, "Log memory usage",
 	       "memdebug", &gconf.enable_mem_debug);
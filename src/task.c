@@ -17,28 +17,131 @@
  *  This program is also available under a commercial proprietary license.
  *  For more information, contact andreas@lonelycoder.com
  */
+#include <stdio.h>
+
 #include "main.h"
 #include "arch/threads.h"
+#include "arch/atomic.h"
 
 #include "task.h"
 #include "misc/queue.h"
+#include "misc/pool.h"
+#include "misc/cancellable.h"
+
+#if ENABLE_HTTPSERVER
+#include "networking/http_server.h"
+#endif
 
 #define MAX_TASK_THREADS 16
 #define MAX_IDLE_TASK_THREADS 2
 
+/**
+ * Max number of workers that may execute tasks of a given class at
+ * the same time. Interactive work can always use every thread, the
+ * lower classes leave headroom so a burst of them can't starve
+ * anything above.
+ */
+static const unsigned int task_class_max_running[TASK_PRIO_num] = {
+  [TASK_PRIO_INTERACTIVE] = MAX_TASK_THREADS,
+  [TASK_PRIO_BACKGROUND]  = MAX_TASK_THREADS * 3 / 4,
+  [TASK_PRIO_BULK]        = MAX_TASK_THREADS / 4,
+};
+
 TAILQ_HEAD(task_queue, task);
 
 typedef struct task {
   TAILQ_ENTRY(task) t_link;
   task_fn_t *t_fn;
   void *t_opaque;
+  cancellable_t *t_cancellable;
+  task_fn_t *t_cancelled;
+  task_prio_t t_prio;
 } task_t;
 
-static struct task_queue tasks = TAILQ_HEAD_INITIALIZER(tasks);
+
+/**
+ * Each worker slot owns one queue per priority class. New tasks are
+ * spread over the slots that have a running worker. Both the owning
+ * thread and idle workers stealing from other slots take the oldest
+ * task so nothing is served LIFO under load. Slots outlive the
+ * threads that service them so tasks never get stranded when a
+ * thread exits.
+ */
+typedef struct task_worker {
+  hts_mutex_t tw_mutex;
+  struct task_queue tw_queues[TASK_PRIO_num];
+  int tw_active;
+} task_worker_t;
+
+static task_worker_t task_workers[MAX_TASK_THREADS];
+
 static unsigned int num_task_threads;
 static unsigned int num_task_threads_avail;
+static unsigned int task_pending;
+static unsigned int task_generation;
+static unsigned int task_rr;
+static atomic_t task_steal_rr;
+static atomic_t task_running[TASK_PRIO_num];
 static hts_mutex_t task_mutex;
 static hts_cond_t task_cond;
+static pool_t *task_pool;
+
+
+/**
+ *
+ */
+static task_t *
+task_pop(task_worker_t *tw, task_prio_t prio)
+{
+  task_t *t;
+  hts_mutex_lock(&tw->tw_mutex);
+  t = TAILQ_FIRST(&tw->tw_queues[prio]);
+  if(t != NULL)
+    TAILQ_REMOVE(&tw->tw_queues[prio], t, t_link);
+  hts_mutex_unlock(&tw->tw_mutex);
+  return t;
+}
+
+
+/**
+ * Grab the most important runnable task, first from our own slot,
+ * then by stealing from the others. Victims are scanned starting at a
+ * rotating slot so no slot is always visited last.
+ *
+ * A running slot for the class is reserved before looking so several
+ * workers can't pass the cap at the same time. The slot is given back
+ * if nothing was found (or when the returned task has completed)
+ */
+static task_t *
+task_dequeue(task_worker_t *self)
+{
+  int prio, i, start;
+  task_t *t;
+
+  for(prio = 0; prio < TASK_PRIO_num; prio++) {
+
+    if(atomic_add_and_fetch(&task_running[prio], 1) >
+       task_class_max_running[prio]) {
+      atomic_dec(&task_running[prio]);
+      continue;
+    }
+
+    if((t = task_pop(self, prio)) != NULL)
+      return t;
+
+    start = atomic_add_and_fetch(&task_steal_rr, 1);
+    for(i = 0; i < MAX_TASK_THREADS; i++) {
+      task_worker_t *tw = &task_workers[(start + i) % MAX_TASK_THREADS];
+      if(tw == self || TAILQ_FIRST(&tw->tw_queues[prio]) == NULL)
+        continue;
+      if((t = task_pop(tw, prio)) != NULL)
+        return t;
+    }
+
+    atomic_dec(&task_running[prio]);
+  }
+  return NULL;
+}
 
 
 /**
@@ -47,12 +150,16 @@ static hts_cond_t task_cond;
 static void *
 task_thread(void *aux)
 {
+  task_worker_t *tw = aux;
   task_t *t;
+  unsigned int gen;
 
   hts_mutex_lock(&task_mutex);
   while(1) {
-    t = TAILQ_FIRST(&tasks);
-    if(t == NULL) {
+
+    gen = task_generation;
+
+    if(task_pending == 0) {
 
       if(num_task_threads_avail == MAX_IDLE_TASK_THREADS)
         break;
@@ -62,14 +169,44 @@ task_thread(void *aux)
       num_task_threads_avail--;
       continue;
     }
-    TAILQ_REMOVE(&tasks, t, t_link);
 
     hts_mutex_unlock(&task_mutex);
-    t->t_fn(t->t_opaque);
-    free(t);
+    t = task_dequeue(tw);
     hts_mutex_lock(&task_mutex);
+
+    if(t == NULL) {
+      // Everything pending is throttled (or was grabbed by someone
+      // else). Wait unless new work arrived while we were scanning
+      if(gen == task_generation) {
+        num_task_threads_avail++;
+        hts_cond_wait(&task_cond, &task_mutex);
+        num_task_threads_avail--;
+      }
+      continue;
+    }
+
+    task_pending--;
+    hts_mutex_unlock(&task_mutex);
+
+    if(cancellable_is_cancelled(t->t_cancellable)) {
+      if(t->t_cancelled != NULL)
+        t->t_cancelled(t->t_opaque);
+    } else {
+      t->t_fn(t->t_opaque);
+    }
+
+    hts_mutex_lock(&task_mutex);
+    atomic_dec(&task_running[t->t_prio]);
+    pool_put(task_pool, t);
+
+    if(task_pending > 0 && num_task_threads_avail > 0) {
+      // A slot for a throttled class may just have opened up
+      task_generation++;
+      hts_cond_signal(&task_cond);
+    }
   }
 
+  tw->tw_active = 0;
   num_task_threads--;
   hts_mutex_unlock(&task_mutex);
   return NULL;
@@ -82,8 +219,39 @@ task_thread(void *aux)
 static void
 task_launch_thread(void)
 {
+  int i;
+  for(i = 0; i < MAX_TASK_THREADS; i++)
+    if(!task_workers[i].tw_active)
+      break;
+
+  if(i == MAX_TASK_THREADS)
+    return;
+
+  task_workers[i].tw_active = 1;
   num_task_threads++;
-  hts_thread_create_detached("tasks", task_thread, NULL, THREAD_PRIO_BGTASK);
+  hts_thread_create_detached("tasks", task_thread, &task_workers[i],
+                             THREAD_PRIO_BGTASK);
+}
+
+
+/**
+ * Pick the next slot that has a worker servicing it. Before any
+ * thread is running use the slot the first one will be started on.
+ * Called with task_mutex held
+ */
+static task_worker_t *
+task_pick_worker(void)
+{
+  int i;
+  for(i = 0; i < MAX_TASK_THREADS; i++) {
+    task_worker_t *tw = &task_workers[task_rr++ % MAX_TASK_THREADS];
+    if(tw->tw_active)
+      return tw;
+  }
+  for(i = 0; i < MAX_TASK_THREADS; i++)
+    if(!task_workers[i].tw_active)
+      break;
+  return &task_workers[i % MAX_TASK_THREADS];
 }
 
 
@@ -91,13 +259,30 @@ task_launch_thread(void)
  *
  */
 void
-task_run(task_fn_t *fn, void *opaque)
+task_run_ex(task_fn_t *fn, void *opaque, task_prio_t prio,
+            cancellable_t *c, task_fn_t *cancelled)
 {
-  task_t *t = calloc(1, sizeof(task_t));
+  task_t *t;
+  task_worker_t *tw;
+
+  hts_mutex_lock(&task_mutex);
+  t = pool_get(task_pool);
+  tw = task_pick_worker();
+  hts_mutex_unlock(&task_mutex);
+
   t->t_fn = fn;
   t->t_opaque = opaque;
+  t->t_prio = prio;
+  t->t_cancellable = c;
+  t->t_cancelled = cancelled;
+
+  hts_mutex_lock(&tw->tw_mutex);
+  TAILQ_INSERT_TAIL(&tw->tw_queues[prio], t, t_link);
+  hts_mutex_unlock(&tw->tw_mutex);
+
   hts_mutex_lock(&task_mutex);
-  TAILQ_INSERT_TAIL(&tasks, t, t_link);
+  task_pending++;
+  task_generation++;
 
   if(num_task_threads_avail > 0) {
     hts_cond_signal(&task_cond);
@@ -110,11 +295,186 @@ task_run(task_fn_t *fn, void *opaque)
 }
 
 
+/**
+ *
+ */
+void
+task_run(task_fn_t *fn, void *opaque)
+{
+  task_run_ex(fn, opaque, TASK_PRIO_BACKGROUND, NULL, NULL);
+}
+
+
 /**
  *
  */
 INITIALIZER(taskinit)
 {
+  int i, j;
   hts_mutex_init(&task_mutex);
   hts_cond_init(&task_cond, &task_mutex);
+
+  for(i = 0; i < MAX_TASK_THREADS; i++) {
+    hts_mutex_init(&task_workers[i].tw_mutex);
+    for(j = 0; j < TASK_PRIO_num; j++)
+      TAILQ_INIT(&task_workers[i].tw_queues[j]);
+  }
+  task_pool = pool_create("tasks", sizeof(task_t), 0);
+}
+
+
+#if ENABLE_HTTPSERVER
+
+/**
+ * Measures enqueue throughput and queue latency (time from task_run_ex()
+ * until the task starts executing) with a number of producer threads
+ * hammering the scheduler at once.
+ *
+ * Run with: curl http://<host>:42000/showtime/task/benchmark
+ */
+
+#define BENCH_PRODUCERS 4
+#define BENCH_TASKS_PER_PRODUCER 25000
+#define BENCH_TOTAL (BENCH_PRODUCERS * BENCH_TASKS_PER_PRODUCER)
+
+typedef struct bench {
+  hts_mutex_t b_mutex;
+  hts_cond_t b_cond;
+  int b_remain;
+  struct bench_item *b_items;
+  int64_t *b_latency;
+} bench_t;
+
+typedef struct bench_item {
+  bench_t *bi_bench;
+  int64_t bi_enqueued;
+} bench_item_t;
+
+typedef struct bench_producer {
+  bench_t *bp_bench;
+  int bp_id;
+} bench_producer_t;
+
+static HTS_MUTEX_DECL(bench_run_mutex);
+
+static void
+bench_task(void *aux)
+{
+  bench_item_t *bi = aux;
+  bench_t *b = bi->bi_bench;
+
+  b->b_latency[bi - b->b_items] = arch_get_ts() - bi->bi_enqueued;
+
+  // The waiter tears down 'b' as soon as it sees zero, so both the
+  // decrement and the signal must happen with the lock held
+  hts_mutex_lock(&b->b_mutex);
+  if(--b->b_remain == 0)
+    hts_cond_signal(&b->b_cond);
+  hts_mutex_unlock(&b->b_mutex);
 }
+
+static void *
+bench_producer(void *aux)
+{
+  bench_producer_t *bp = aux;
+  bench_item_t *bi = &bp->bp_bench->b_items[bp->bp_id *
+                                            BENCH_TASKS_PER_PRODUCER];
+  int i;
+
+  for(i = 0; i < BENCH_TASKS_PER_PRODUCER; i++, bi++) {
+    bi->bi_enqueued = arch_get_ts();
+    task_run_ex(bench_task, bi, i % TASK_PRIO_num, NULL, NULL);
+  }
+  return NULL;
+}
+
+static int
+bench_cmp(const void *A, const void *B)
+{
+  const int64_t *a = A;
+  const int64_t *b = B;
+  return *a < *b ? -1 : *a > *b;
+}
+
+static int
+task_benchmark(http_connection_t *hc, const char *remain, void *opaque,
+               http_cmd_t method)
+{
+  hts_thread_t tids[BENCH_PRODUCERS];
+  bench_producer_t bp[BENCH_PRODUCERS];
+  htsbuf_queue_t out;
+  bench_t b;
+  int i;
+
+  hts_mutex_lock(&bench_run_mutex);
+
+  hts_mutex_init(&b.b_mutex);
+  hts_cond_init(&b.b_cond, &b.b_mutex);
+  b.b_remain = BENCH_TOTAL;
+  b.b_items = calloc(BENCH_TOTAL, sizeof(bench_item_t));
+  b.b_latency = calloc(BENCH_TOTAL, sizeof(int64_t));
+
+  for(i = 0; i < BENCH_TOTAL; i++)
+    b.b_items[i].bi_bench = &b;
+
+  int64_t start = arch_get_ts();
+
+  for(i = 0; i < BENCH_PRODUCERS; i++) {
+    bp[i].bp_bench = &b;
+    bp[i].bp_id = i;
+    hts_thread_create_joinable("taskbench", &tids[i], bench_producer,
+                               &bp[i], THREAD_PRIO_BGTASK);
+  }
+
+  for(i = 0; i < BENCH_PRODUCERS; i++)
+    hts_thread_join(&tids[i]);
+
+  int64_t enqueued = arch_get_ts();
+
+  hts_mutex_lock(&b.b_mutex);
+  while(b.b_remain > 0)
+    hts_cond_wait(&b.b_cond, &b.b_mutex);
+  hts_mutex_unlock(&b.b_mutex);
+
+  int64_t done = arch_get_ts();
+
+  qsort(b.b_latency, BENCH_TOTAL, sizeof(int64_t), bench_cmp);
+
+  htsbuf_queue_init(&out, 0);
+  htsbuf_qprintf(&out, "task benchmark: %d tasks from %d producers\n",
+                 BENCH_TOTAL, BENCH_PRODUCERS);
+  htsbuf_qprintf(&out, "  enqueue: %.0f tasks/s\n",
+                 BENCH_TOTAL * 1000000.0 / (enqueued - start));
+  htsbuf_qprintf(&out, "  dequeue: %.0f tasks/s\n",
+                 BENCH_TOTAL * 1000000.0 / (done - start));
+  htsbuf_qprintf(&out, "  latency: p50=%"PRId64"us p99=%"PRId64"us "
+                 "p99.9=%"PRId64"us max=%"PRId64"us\n",
+                 b.b_latency[BENCH_TOTAL / 2],
+                 b.b_latency[BENCH_TOTAL * 99 / 100],
+                 b.b_latency[BENCH_TOTAL * 999 / 1000],
+                 b.b_latency[BENCH_TOTAL - 1]);
+
+  free(b.b_items);
+  free(b.b_latency);
+  hts_cond_destroy(&b.b_cond);
+  hts_mutex_destroy(&b.b_mutex);
+
+  hts_mutex_unlock(&bench_run_mutex);
+
+  return http_send_reply(hc, 0, "text/plain; charset=utf-8", NULL, NULL, 0,
+                         &out);
+}
+
+
+/**
+ *
+ */
+static void
+task_benchmark_init(void)
+{
+  http_path_add("/showtime/task/benchmark", NULL, task_benchmark, 1);
+}
+
+INITME(INIT_GROUP_API, task_benchmark_init, NULL);
+
+#endif // ENABLE_HTTPSERVER
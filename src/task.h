@@ -18,7 +18,34 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 #pragma once
+
+struct cancellable;
+
 typedef void (task_fn_t)(void *opaque);
 
+/**
+ * Scheduling classes. Lower value wins. Background and bulk tasks
+ * are capped in how many worker threads they may occupy at once so
+ * they never starve the classes above them
+ */
+typedef enum {
+  TASK_PRIO_INTERACTIVE,  // User is waiting for the result
+  TASK_PRIO_BACKGROUND,   // Metadata, thumbnails, etc
+  TASK_PRIO_BULK,         // Scanning, indexing, housekeeping
+  TASK_PRIO_num,
+} task_prio_t;
+
+/**
+ * Compatibility wrapper, same as task_run_ex() with TASK_PRIO_BACKGROUND
+ */
 void task_run(task_fn_t *fn, void *opaque);
 
+/**
+ * If 'c' has been cancelled when the task is about to execute
+ * 'cancelled' is invoked (if non-NULL) instead of 'fn' so the caller
+ * can release 'opaque'. 'c' must stay valid until either callback
+ * has been called.
+ */
+void task_run_ex(task_fn_t *fn, void *opaque, task_prio_t prio,
+                 struct cancellable *c, task_fn_t *cancelled);
+
@@ -26,6 +26,7 @@
 #include "image/pixmap.h"
 #include "image/image.h"
 #include "text.h"
+#include "glyph_atlas.h"
 #include "arch/arch.h"
 
 #include "fileaccess/fileaccess.h"
@@ -118,6 +119,10 @@ typedef struct glyph {
 
   FT_BBox bbox;
 
+  glyph_atlas_t *atlas;
+  int16_t atlas_x;
+  int16_t atlas_y;
+
 } glyph_t;
 
 static struct glyph_list glyph_hash[GLYPH_HASH_SIZE];
@@ -173,6 +178,7 @@ glyph_destroy(glyph_t *g)
     FT_Done_Glyph(g->bmp);
   if(g->outline)
     FT_Done_Glyph(g->outline);
+  glyph_atlas_release(g->atlas);
   free(g);
   num_glyphs--;
 }
@@ -655,6 +661,55 @@ draw_glyph(pixmap_t *pm, int left, int top, FT_Bitmap *bmp, int color)
 }
 
 
+/**
+ *
+ */
+static FT_BitmapGlyph
+glyph_get_bitmap(glyph_t *g)
+{
+  if(g->bmp == NULL) {
+    g->bmp = g->orig_glyph;
+    if(FT_Glyph_To_Bitmap(&g->bmp, FT_RENDER_MODE_NORMAL, NULL, 0))
+      g->bmp = NULL;
+  }
+  return (FT_BitmapGlyph)g->bmp;
+}
+
+
+/**
+ * Make sure the glyph is in a glyph atlas page. Glyphs without any
+ * pixels (space, etc) never are
+ */
+static int
+glyph_to_atlas(glyph_t *g)
+{
+  FT_BitmapGlyph bmp;
+
+  if(g->atlas != NULL) {
+    if(!g->atlas->ga_retired)
+      return 0;
+    glyph_atlas_release(g->atlas);
+    g->atlas = NULL;
+  }
+
+  if((bmp = glyph_get_bitmap(g)) == NULL)
+    return -1;
+
+  if(bmp->bitmap.width == 0 || bmp->bitmap.rows == 0)
+    return 0;
+
+  int x, y;
+  g->atlas = glyph_atlas_add(g->size << 8 | g->style, bmp->bitmap.buffer,
+                             bmp->bitmap.width, bmp->bitmap.rows,
+                             bmp->bitmap.pitch, &x, &y);
+  if(g->atlas == NULL)
+    return -1;
+  g->atlas_x = x;
+  g->atlas_y = y;
+  return 0;
+}
+
+
 /**
  *
  */
@@ -715,7 +770,8 @@ static void
 draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
 	    int siz_x, item_t *items, int start_x, int start_y,
 	    int origin_y, int margin, int pass,
-            image_component_text_info_t *ti)
+            image_component_text_info_t *ti,
+            image_component_glyphs_t *icg)
 {
   FT_Vector pen;
   line_t *li;
@@ -839,11 +895,8 @@ draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
 	  g->outline = NULL;
       }
 
-      if(g->bmp == NULL) {
-	g->bmp = g->orig_glyph;
-	if(FT_Glyph_To_Bitmap(&g->bmp, FT_RENDER_MODE_NORMAL, NULL, 0))
-	  g->bmp = NULL;
-      }
+      glyph_get_bitmap(g);
+
       if(pass == 0 && items[i].shadow && (g->outline != NULL || g->bmp != NULL)) {
 	FT_BitmapGlyph bmp = (FT_BitmapGlyph)(g->outline ?: g->bmp);
 	draw_glyph(pm,
@@ -864,11 +917,23 @@ draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
 
       if(pass == 2 && g->bmp != NULL) {
 	FT_BitmapGlyph bmp = (FT_BitmapGlyph)g->bmp;
-	draw_glyph(pm,
-		   bmp->left + margin + pen.x,
-		   target_height - bmp->top + margin - pen.y,
-		   &bmp->bitmap,
-		   items[i].color);
+
+	if(icg == NULL) {
+	  draw_glyph(pm,
+		     bmp->left + margin + pen.x,
+		     target_height - bmp->top + margin - pen.y,
+		     &bmp->bitmap,
+		     items[i].color);
+	} else if(g->atlas != NULL) {
+	  image_glyph_t *ig = &icg->icg_glyphs[icg->icg_num_glyphs++];
+	  ig->ig_x = bmp->left + margin + pen.x;
+	  ig->ig_y = target_height - bmp->top + margin - pen.y;
+	  ig->ig_w = bmp->bitmap.width;
+	  ig->ig_h = bmp->bitmap.rows;
+	  ig->ig_u = g->atlas_x;
+	  ig->ig_v = g->atlas_y;
+	  ig->ig_color = items[i].color;
+	}
 
 	if(ti != NULL && ti->ti_charpos != NULL) {
 	  ti->ti_charpos[i * 2 + 0] = bmp->left + pen.x;
@@ -889,6 +954,48 @@ draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
   }
 }
 
+/**
+ * Check if all glyphs can be drawn straight from a single glyph atlas
+ * page. Returns the page if so
+ *
+ * Strings whose glyphs ended up on different pages (or that need a
+ * horizontal rule) are rendered into a pixmap of their own instead.
+ * That's the normal case for text using a large character set such
+ * as CJK once the first page for a size has filled up; the glyphs
+ * are still cached, it only costs the per-string pixmap as before
+ * the atlas existed.
+ */
+static glyph_atlas_t *
+glyphs_to_atlas(struct line_queue *lq, item_t *items)
+{
+  glyph_atlas_t *ga = NULL;
+  line_t *li;
+  int i;
+
+  TAILQ_FOREACH(li, lq, link) {
+    if(li->type == LINE_TYPE_HR)
+      return NULL;
+
+    for(i = li->start; i < li->start + li->count; i++) {
+      glyph_t *g = items[i].g;
+      if(g == NULL)
+        continue;
+
+      if(glyph_to_atlas(g))
+        return NULL;
+
+      if(g->atlas == NULL)
+        continue;
+
+      if(ga != NULL && ga != g->atlas)
+        return NULL;
+      ga = g->atlas;
+    }
+  }
+  return ga;
+}
+
+
 /**
  *
  */
@@ -1367,6 +1474,15 @@ text_render0(const uint32_t *uc, const int len,
 
   margin = (margin + 63) / 64;
 
+  // Plain text (no shadow or outline) can be drawn as quads straight
+  // from the glyph atlas instead of rendering a pixmap of its own
+
+  glyph_atlas_t *atlas = NULL;
+
+  if(flags & TR_RENDER_GLYPH_ATLAS && !need_shadow_pass &&
+     !need_outline_pass && !(flags & (TR_RENDER_NO_OUTPUT | TR_RENDER_DEBUG)))
+    atlas = glyphs_to_atlas(&lq, items);
+
   // --- allocate and init image
 
   image_t *img = image_alloc(flags & TR_RENDER_NO_OUTPUT ? 1 : 2);
@@ -1376,8 +1492,15 @@ text_render0(const uint32_t *uc, const int len,
   img->im_margin = margin;
 
   pixmap_t *pm = NULL;
+  image_component_glyphs_t *icg = NULL;
 
-  if(!(flags & TR_RENDER_NO_OUTPUT)) {
+  if(atlas != NULL) {
+    icg = &img->im_components[1].glyphs;
+    img->im_components[1].type = IMAGE_GLYPHS;
+    icg->icg_atlas = glyph_atlas_retain(atlas);
+    icg->icg_glyphs = malloc(sizeof(image_glyph_t) * out);
+
+  } else if(!(flags & TR_RENDER_NO_OUTPUT)) {
     pm = pixmap_create(target_width, target_height,
                        color_output ? PIXMAP_BGR32 : PIXMAP_IA, margin);
 
@@ -1412,17 +1535,22 @@ text_render0(const uint32_t *uc, const int len,
 
     if(need_shadow_pass) {
       draw_glyphs(pm, &lq, target_height, siz_x, items, start_x, start_y,
-                  origin_y, margin, 0, NULL);
+                  origin_y, margin, 0, NULL, NULL);
       pixmap_box_blur(pm, 4, 4);
     }
 
     if(need_outline_pass)
       draw_glyphs(pm, &lq, target_height, siz_x, items, start_x, start_y,
-                  origin_y, margin, 1, NULL);
+                  origin_y, margin, 1, NULL, NULL);
 
 
     draw_glyphs(pm, &lq, target_height, siz_x, items, start_x, start_y,
-                origin_y, margin, 2, ti);
+                origin_y, margin, 2, ti, NULL);
+
+  } else if(icg != NULL) {
+
+    draw_glyphs(NULL, &lq, target_height, siz_x, items, start_x, start_y,
+                origin_y, margin, 2, ti, icg);
   }
   free(items);
 
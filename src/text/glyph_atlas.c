@@ -0,0 +1,289 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "glyph_atlas.h"
+#include "image/pixmap.h"
+#include "misc/minmax.h"
+
+#define GLYPH_ATLAS_MIN_SIZE 256
+#define GLYPH_ATLAS_MAX_SIZE 1024
+#define GLYPH_ATLAS_MAX_PAGES 24
+
+// Don't put a glyph on a shelf much taller than itself
+#define SHELF_FIT(h, shelf) \
+  ((h) <= (shelf) && (h) + (shelf) / 4 + 2 >= (shelf))
+
+TAILQ_HEAD(glyph_atlas_queue, glyph_atlas);
+
+static struct glyph_atlas_queue glyph_atlases;
+static int glyph_atlas_pages;
+static HTS_MUTEX_DECL(glyph_atlas_mutex);
+
+
+/**
+ *
+ */
+static void
+glyph_atlas_destroy(glyph_atlas_t *ga)
+{
+  pixmap_release(ga->ga_pm);
+  free(ga);
+}
+
+
+/**
+ *
+ */
+glyph_atlas_t *
+glyph_atlas_retain(glyph_atlas_t *ga)
+{
+  atomic_inc(&ga->ga_refcount);
+  return ga;
+}
+
+
+/**
+ *
+ */
+void
+glyph_atlas_release(glyph_atlas_t *ga)
+{
+  if(ga == NULL || atomic_dec(&ga->ga_refcount))
+    return;
+  glyph_atlas_destroy(ga);
+}
+
+
+/**
+ *
+ */
+static glyph_atlas_t *
+glyph_atlas_create(int key, int size)
+{
+  glyph_atlas_t *ga;
+
+  if(glyph_atlas_pages == GLYPH_ATLAS_MAX_PAGES) {
+    // Retire the oldest page, glyphs on it will be re-added to a new
+    // page next time they are used
+    ga = TAILQ_FIRST(&glyph_atlases);
+    TAILQ_REMOVE(&glyph_atlases, ga, ga_link);
+    glyph_atlas_pages--;
+    ga->ga_retired = 1;
+    glyph_atlas_release(ga);
+  }
+
+  pixmap_t *pm = pixmap_create(size, size, PIXMAP_IA, 0);
+  if(pm == NULL)
+    return NULL;
+
+  // Intensity is always full, coverage goes in alpha
+  uint8_t *p = pm->pm_data;
+  for(int i = 0; i < pm->pm_linesize * pm->pm_height; i += 2)
+    p[i] = 0xff;
+
+  ga = calloc(1, sizeof(glyph_atlas_t));
+  atomic_set(&ga->ga_refcount, 1);
+  ga->ga_pm = pm;
+  ga->ga_key = key;
+  ga->ga_width = size;
+  ga->ga_height = size;
+  TAILQ_INSERT_TAIL(&glyph_atlases, ga, ga_link);
+  glyph_atlas_pages++;
+
+  TRACE(TRACE_DEBUG, "Glyphatlas", "Created %d x %d page for key 0x%x",
+        size, size, key);
+  return ga;
+}
+
+
+/**
+ * Find room for a w * h box. Shelf packing, first fit
+ */
+static int
+glyph_atlas_alloc(glyph_atlas_t *ga, int w, int h, int *xp, int *yp)
+{
+  int i;
+
+  for(i = 0; i < ga->ga_num_shelves; i++) {
+    if(SHELF_FIT(h, ga->ga_shelves[i].height) &&
+       ga->ga_shelves[i].x + w <= ga->ga_width) {
+      *xp = ga->ga_shelves[i].x;
+      *yp = ga->ga_shelves[i].y;
+      ga->ga_shelves[i].x += w;
+      return 0;
+    }
+  }
+
+  if(ga->ga_num_shelves == ARRAYSIZE(ga->ga_shelves))
+    return -1;
+
+  int y = 0;
+  if(ga->ga_num_shelves > 0) {
+    i = ga->ga_num_shelves - 1;
+    y = ga->ga_shelves[i].y + ga->ga_shelves[i].height;
+  }
+
+  if(y + h > ga->ga_height)
+    return -1;
+
+  i = ga->ga_num_shelves++;
+  ga->ga_shelves[i].y = y;
+  ga->ga_shelves[i].height = h;
+  ga->ga_shelves[i].x = w;
+  *xp = 0;
+  *yp = y;
+  return 0;
+}
+
+
+/**
+ *
+ */
+glyph_atlas_t *
+glyph_atlas_add(int key, const uint8_t *bitmap, int width, int height,
+                int stride, int *xp, int *yp)
+{
+  glyph_atlas_t *ga;
+  int x, y;
+
+  // One pixel of padding on each side so filtering never picks up
+  // the neighbours
+  const int w = width + 2;
+  const int h = height + 2;
+
+  if(w > GLYPH_ATLAS_MAX_SIZE || h > GLYPH_ATLAS_MAX_SIZE)
+    return NULL;
+
+  hts_mutex_lock(&glyph_atlas_mutex);
+
+  TAILQ_FOREACH(ga, &glyph_atlases, ga_link)
+    if(ga->ga_key == key && !glyph_atlas_alloc(ga, w, h, &x, &y))
+      break;
+
+  if(ga == NULL) {
+    // Room for at least 8 rows of glyphs
+    int size = GLYPH_ATLAS_MIN_SIZE;
+    while(size < GLYPH_ATLAS_MAX_SIZE && (h * 8 > size || w * 8 > size))
+      size *= 2;
+
+    ga = glyph_atlas_create(key, size);
+    if(ga == NULL || glyph_atlas_alloc(ga, w, h, &x, &y)) {
+      hts_mutex_unlock(&glyph_atlas_mutex);
+      return NULL;
+    }
+  }
+
+  x++;
+  y++;
+
+  pixmap_t *pm = ga->ga_pm;
+  for(int i = 0; i < height; i++) {
+    uint8_t *d = pm->pm_data + (y + i) * pm->pm_linesize + x * 2 + 1;
+    const uint8_t *s = bitmap + i * stride;
+    for(int j = 0; j < width; j++)
+      d[j * 2] = s[j];
+  }
+
+  ga->ga_generation++;
+
+  const int d = ga->ga_generation % GLYPH_ATLAS_DIRTY_RECTS;
+  ga->ga_dirty[d].x1 = x;
+  ga->ga_dirty[d].y1 = y;
+  ga->ga_dirty[d].x2 = x + width;
+  ga->ga_dirty[d].y2 = y + height;
+
+  glyph_atlas_retain(ga);
+  hts_mutex_unlock(&glyph_atlas_mutex);
+
+  *xp = x;
+  *yp = y;
+  return ga;
+}
+
+
+/**
+ *
+ */
+pixmap_t *
+glyph_atlas_get_dirty(glyph_atlas_t *ga, int *generation, int *xp, int *yp)
+{
+  pixmap_t *pm = NULL;
+  int x1, y1, x2, y2;
+
+  hts_mutex_lock(&glyph_atlas_mutex);
+
+  const int from = *generation;
+  const int to = ga->ga_generation;
+
+  if(from == to)
+    goto out;
+
+  if(from < 0 || to - from > GLYPH_ATLAS_DIRTY_RECTS) {
+    x1 = 0;
+    y1 = 0;
+    x2 = ga->ga_width;
+    y2 = ga->ga_height;
+  } else {
+    x1 = ga->ga_width;
+    y1 = ga->ga_height;
+    x2 = 0;
+    y2 = 0;
+    for(int g = from + 1; g <= to; g++) {
+      const int d = g % GLYPH_ATLAS_DIRTY_RECTS;
+      x1 = MIN(x1, ga->ga_dirty[d].x1);
+      y1 = MIN(y1, ga->ga_dirty[d].y1);
+      x2 = MAX(x2, ga->ga_dirty[d].x2);
+      y2 = MAX(y2, ga->ga_dirty[d].y2);
+    }
+    // Widen to multiples of 8 pixels so the copy has no row padding
+    // (page sizes are powers of two so this never goes outside)
+    x1 &= ~7;
+    x2 = (x2 + 7) & ~7;
+  }
+
+  pm = pixmap_create(x2 - x1, y2 - y1, PIXMAP_IA, 0);
+  if(pm == NULL)
+    goto out;
+
+  const pixmap_t *src = ga->ga_pm;
+  for(int i = 0; i < pm->pm_height; i++)
+    memcpy(pm->pm_data + i * pm->pm_linesize,
+           src->pm_data + (y1 + i) * src->pm_linesize + x1 * 2,
+           pm->pm_width * 2);
+
+  *generation = to;
+  *xp = x1;
+  *yp = y1;
+ out:
+  hts_mutex_unlock(&glyph_atlas_mutex);
+  return pm;
+}
+
+
+/**
+ *
+ */
+INITIALIZER(glyph_atlas_init)
+{
+  TAILQ_INIT(&glyph_atlases);
+}
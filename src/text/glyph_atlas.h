@@ -0,0 +1,96 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "arch/atomic.h"
+#include "misc/queue.h"
+
+struct pixmap;
+
+/**
+ * A glyph atlas is a PIXMAP_IA page where rasterized glyphs of the
+ * same size and style are packed next to each other. Text is then
+ * drawn as quads referencing the page instead of being rendered into
+ * a pixmap of its own.
+ *
+ * Pages are only ever appended to. When there are too many of them
+ * the oldest one is retired: it's no longer used for new glyphs but
+ * stays around (untouched) for as long as anyone holds a reference.
+ * Space held by glyphs that are no longer used is thus never handed
+ * out again, it's reclaimed only when the whole page is retired.
+ *
+ * The rects touched by the last few additions are kept so the
+ * renderer can upload just the part of the page that changed.
+ */
+#define GLYPH_ATLAS_DIRTY_RECTS 16
+
+typedef struct glyph_atlas {
+  TAILQ_ENTRY(glyph_atlas) ga_link;
+  atomic_t ga_refcount;
+
+  struct pixmap *ga_pm;
+  int ga_key;
+  int ga_generation;   // Bumped every time a glyph is added
+  int16_t ga_width;
+  int16_t ga_height;
+  uint8_t ga_retired;
+
+  uint8_t ga_num_shelves;
+  struct {
+    int16_t y;
+    int16_t height;
+    int16_t x;
+  } ga_shelves[32];
+
+  // Indexed by generation % GLYPH_ATLAS_DIRTY_RECTS
+  struct {
+    int16_t x1, y1, x2, y2;
+  } ga_dirty[GLYPH_ATLAS_DIRTY_RECTS];
+
+} glyph_atlas_t;
+
+
+/**
+ * Copy a glyph bitmap (8 bit coverage) into a page for 'key'.
+ * Returns the page (with a reference held for the caller) and the
+ * position of the glyph in '*xp', '*yp'. NULL if the glyph is too
+ * large for any page.
+ */
+glyph_atlas_t *glyph_atlas_add(int key, const uint8_t *bitmap,
+                               int width, int height, int stride,
+                               int *xp, int *yp);
+
+glyph_atlas_t *glyph_atlas_retain(glyph_atlas_t *ga);
+
+void glyph_atlas_release(glyph_atlas_t *ga);
+
+/**
+ * Copy out the part of the page that has changed since '*generation'
+ * (-1 for the entire page) and store the current generation back
+ * into it. The position of the copy within the page is returned in
+ * '*xp', '*yp'. NULL if nothing has changed.
+ *
+ * The copy is taken with the atlas lock held so the caller can upload
+ * it without blocking glyph rendering in other threads.
+ */
+struct pixmap *glyph_atlas_get_dirty(glyph_atlas_t *ga, int *generation,
+                                     int *xp, int *yp);
@@ -88,6 +88,7 @@ glw_update_sizes(glw_root_t *gr)
     glw_text_flush(gr);
     glw_icon_flush(gr);
     glw_update_em(gr);
+    glw_need_refresh(gr, 0);
     TRACE(TRACE_DEBUG, "GLW",
           "UI size scale changed to %d (user adjustment: %d)",
           val, glw_settings.gs_size);
@@ -99,6 +100,7 @@ glw_update_sizes(glw_root_t *gr)
   if(gr->gr_underscan_h != val) {
     prop_set(gr->gr_prop_ui, "underscan_h", PROP_SET_INT, val);
     gr->gr_underscan_h = val;
+    glw_need_refresh(gr, 0);
   }
 
 
@@ -108,6 +110,7 @@ glw_update_sizes(glw_root_t *gr)
   if(gr->gr_underscan_v != val) {
     prop_set(gr->gr_prop_ui, "underscan_v", PROP_SET_INT, val);
     gr->gr_underscan_v = val;
+    glw_need_refresh(gr, 0);
   }
 }
 
@@ -135,6 +138,7 @@ glw_init3(glw_root_t *gr,
 
   gr->gr_prop_dispatcher = dispatcher;
   gr->gr_courier = courier;
+  prop_courier_set_flags(courier, PROP_COURIER_COALESCE);
 
   gr->gr_prop_maxtime = -1;
 
@@ -263,6 +267,7 @@ glw_fini(glw_root_t *gr)
   free(gr->gr_render_jobs);
   free(gr->gr_render_order);
   free(gr->gr_vertex_buffer);
+  free(gr->gr_batch_vertex_buffer);
   free(gr->gr_skin);
 }
 
@@ -297,6 +302,8 @@ glw_load_universe(glw_root_t *gr)
 				    universe, NULL, NULL, page,
 				    NULL, NULL, NULL, NULL, 0);
 
+  glw_view_load_report(gr);
+
   rstr_release(universe);
 }
 
@@ -319,6 +326,56 @@ update_in_path(glw_t *w)
 }
 
 
+/**
+ * Flag 'w' as needing layout and its parents as having something
+ * below them that needs layout
+ */
+void
+glw_dirty(glw_t *w)
+{
+  w->glw_flags |= GLW_DIRTY;
+
+  for(w = w->glw_parent; w != NULL; w = w->glw_parent)
+    w->glw_flags |= GLW_CHILD_DIRTY;
+}
+
+
+/**
+ * Can we keep the layout 'w' got last frame
+ */
+static int
+glw_layout_is_retained(const glw_t *w, const glw_rctx_t *rc)
+{
+  return
+    !(w->glw_flags & (GLW_DIRTY | GLW_CHILD_DIRTY | GLW_VOLATILE)) &&
+    w->glw_layout_width      == rc->rc_width &&
+    w->glw_layout_height     == rc->rc_height &&
+    w->glw_layout_offscreen  == rc->rc_offscreen &&
+    w->glw_layout_layer      == rc->rc_layer &&
+    w->glw_layout_overscanning == rc->rc_overscanning &&
+    w->glw_layout_alpha      == rc->rc_alpha &&
+    w->glw_layout_sharpness  == rc->rc_sharpness;
+}
+
+
+/**
+ * Keep everything that was laid out below 'w' last frame active
+ */
+static void
+glw_layout_retain_r(glw_root_t *gr, glw_t *w)
+{
+  glw_t *c;
+
+  TAILQ_FOREACH(c, &w->glw_childs, glw_parent_link) {
+    if(!(c->glw_flags & GLW_ACTIVE))
+      continue;
+    LIST_REMOVE(c, glw_active_link);
+    LIST_INSERT_HEAD(&gr->gr_active_list, c, glw_active_link);
+    glw_layout_retain_r(gr, c);
+  }
+}
+
+
 /**
  *
  */
@@ -334,12 +391,36 @@ glw_layout0(glw_t *w, const glw_rctx_t *rc)
     w->glw_flags |= GLW_ACTIVE;
     mask |= GLW_VIEW_EVAL_ACTIVE;
     glw_signal0(w, GLW_SIGNAL_ACTIVE, NULL);
+
+  } else if(gr->gr_partial_layout && glw_layout_is_retained(w, rc)) {
+    glw_layout_retain_r(gr, w);
+    // Skipped widgets (text, etc) might have vetoed this
+    gr->gr_can_externalize = 0;
+    return;
   }
 
+  w->glw_flags &= ~(GLW_DIRTY | GLW_CHILD_DIRTY | GLW_VOLATILE);
+
   if(unlikely(w->glw_dynamic_eval & mask))
     glw_view_eval_layout(w, rc, mask);
 
   w->glw_class->gc_layout(w, rc);
+
+  w->glw_layout_width        = rc->rc_width;
+  w->glw_layout_height       = rc->rc_height;
+  w->glw_layout_offscreen    = rc->rc_offscreen;
+  w->glw_layout_layer        = rc->rc_layer;
+  w->glw_layout_overscanning = rc->rc_overscanning;
+  w->glw_layout_alpha        = rc->rc_alpha;
+  w->glw_layout_sharpness    = rc->rc_sharpness;
+
+  if(w->glw_dynamic_eval & GLW_VIEW_EVAL_LAYOUT ||
+     w->glw_class->gc_flags & GLW_LAYOUT_EVERY_FRAME ||
+     w->glw_class->gc_newframe != NULL)
+    w->glw_flags |= GLW_VOLATILE;
+
+  if(w->glw_flags & GLW_VOLATILE && w->glw_parent != NULL)
+    w->glw_parent->glw_flags |= GLW_VOLATILE;
 }
 
 
@@ -491,6 +572,10 @@ glw_prepare_frame(glw_root_t *gr, int flags)
 {
   glw_t *w;
 
+  glw_frametrace_new_frame(gr);
+  glw_view_benchmark_poll(gr);
+  glw_ft_begin(&gr->gr_frametrace, GLW_FT_PREPARE);
+
   glw_update_sizes(gr);
 
   gr->gr_frame_start        = arch_get_ts();
@@ -522,8 +607,11 @@ glw_prepare_frame(glw_root_t *gr, int flags)
   prop_set_int(gr->gr_prop_width, gr->gr_width);
   prop_set_int(gr->gr_prop_height, gr->gr_height);
 
-  if(gr->gr_prop_dispatcher != NULL)
+  if(gr->gr_prop_dispatcher != NULL) {
+    glw_ft_begin(&gr->gr_frametrace, GLW_FT_DISPATCH);
     gr->gr_prop_dispatcher(gr->gr_courier, gr->gr_prop_maxtime);
+    glw_ft_end(&gr->gr_frametrace, GLW_FT_DISPATCH);
+  }
 
   LIST_FOREACH(w, &gr->gr_every_frame_list, glw_every_frame_link)
     w->glw_class->gc_newframe(w, flags);
@@ -556,11 +644,27 @@ glw_prepare_frame(glw_root_t *gr, int flags)
   }
 
   if(gr->gr_scheduled_refresh <= gr->gr_frame_start) {
-    gr->gr_need_refresh = GLW_REFRESH_FLAG_LAYOUT | GLW_REFRESH_FLAG_RENDER;
+    gr->gr_need_refresh = GLW_REFRESH_FLAG_LAYOUT | GLW_REFRESH_FLAG_RENDER |
+      GLW_REFRESH_FLAG_FULL;
     gr->gr_scheduled_refresh = INT64_MAX;
   }
 
   glw_view_loader_eval(gr);
+
+  /*
+   * If everything that happened since last frame was tracked down to
+   * the widgets affected we only need to layout those (and their
+   * parents). The rest of the tree keeps its layout from last frame
+   */
+  gr->gr_partial_layout =
+    !(gr->gr_need_refresh & GLW_REFRESH_FLAG_FULL) &&
+    gr->gr_layout_width == gr->gr_width &&
+    gr->gr_layout_height == gr->gr_height;
+
+  gr->gr_layout_width  = gr->gr_width;
+  gr->gr_layout_height = gr->gr_height;
+
+  glw_ft_end(&gr->gr_frametrace, GLW_FT_PREPARE);
 }
 
 
@@ -570,7 +674,9 @@ glw_prepare_frame(glw_root_t *gr, int flags)
 void
 glw_post_scene(glw_root_t *gr)
 {
+  glw_ft_begin(&gr->gr_frametrace, GLW_FT_RENDERER);
   glw_renderer_render(gr);
+  glw_ft_end(&gr->gr_frametrace, GLW_FT_RENDERER);
 }
 
 /*
@@ -751,6 +857,33 @@ glw_signal_handler_unregister(glw_t *w, glw_callback_t *func, void *opaque)
 }
 
 
+/**
+ * Signals that may change how the receiving widget is laid out or
+ * rendered. Others (ACTIVE and INACTIVE are sent from layout itself,
+ * DESTROY, WRAP_CHECK, ...) don't need to mark it dirty
+ */
+#define SIGBIT(x) (1 << GLW_SIGNAL_ ## x)
+
+static const unsigned int glw_signal_dirties =
+  SIGBIT(CHILD_CREATED) |
+  SIGBIT(CHILD_DESTROYED) |
+  SIGBIT(CHILD_MOVED) |
+  SIGBIT(FOCUS_CHILD_INTERACTIVE) |
+  SIGBIT(FOCUS_CHILD_AUTOMATIC) |
+  SIGBIT(SLIDER_METRICS) |
+  SIGBIT(SCROLL) |
+  SIGBIT(FHP_PATH_CHANGED) |
+  SIGBIT(CHILD_CONSTRAINTS_CHANGED) |
+  SIGBIT(CHILD_HIDDEN) |
+  SIGBIT(CHILD_UNHIDDEN) |
+  SIGBIT(CAN_SCROLL_CHANGED) |
+  SIGBIT(FULLWINDOW_CONSTRAINT_CHANGED) |
+  SIGBIT(READINESS) |
+  SIGBIT(MOVE);
+
+static_assert(GLW_SIGNAL_num <= 32, "Too many signals for glw_signal_dirties");
+
+
 /**
  *
  */
@@ -760,6 +893,9 @@ glw_signal0(glw_t *w, glw_signal_t sig, void *extra)
   glw_signal_handler_t *x, *gsh = LIST_FIRST(&w->glw_signal_handlers);
   int r;
 
+  if(glw_signal_dirties & (1 << sig))
+    glw_dirty(w);
+
   if(w->glw_class->gc_signal_handler != NULL)
     w->glw_class->gc_signal_handler(w, NULL, sig, extra);
 
@@ -1942,6 +2078,33 @@ glw_repositionf(glw_rctx_t *rc, float left, float top,
 }
 
 
+/**
+ * Set distance to the visible area for a child at 'pos' (of 'size')
+ * in a scrolling container showing [0, visible). Things behind the
+ * scroll direction are twice as far away as they seem
+ */
+void
+glw_set_offscreen(glw_rctx_t *rc, const glw_rctx_t *parent,
+                  float pos, int size, int visible, float direction)
+{
+  float d;
+
+  if(pos >= visible) {
+    d = pos - visible + 1;
+    if(direction < 0)
+      d *= 2;
+  } else if(pos + size <= 0) {
+    d = 1 - (pos + size);
+    if(direction > 0)
+      d *= 2;
+  } else {
+    d = 0;
+  }
+
+  rc->rc_offscreen = GLW_MIN(parent->rc_offscreen + d, INT16_MAX);
+}
+
+
 /**
  *
  */
@@ -2882,7 +3045,7 @@ glw_attrib_set_int16_4(int16_t *dst, const int16_t *src)
 void
 glw_need_refresh0(glw_root_t *gr, int how, const char *file, int line)
 {
-  int flags = GLW_REFRESH_FLAG_LAYOUT;
+  int flags = GLW_REFRESH_FLAG_LAYOUT | GLW_REFRESH_FLAG_FULL;
 
   if(how != GLW_REFRESH_LAYOUT_ONLY)
     flags |= GLW_REFRESH_FLAG_RENDER;
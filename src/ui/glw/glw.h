@@ -36,6 +36,7 @@
 #include "main.h"
 #include "settings.h"
 #include "misc/minmax.h"
+#include "glw_frametrace.h"
 
 #ifdef DEBUG
 #define GLW_TRACE(x, ...) do {                                     \
@@ -387,6 +388,9 @@ typedef struct glw_class {
 #define GLW_NAVIGATION_SEARCH_BOUNDARY 0x1
 #define GLW_CAN_HIDE_CHILDS            0x2
 #define GLW_UNCONSTRAINED              0x4
+#define GLW_LAYOUT_EVERY_FRAME         0x8 /* Layout has side effects
+                                              (texture refs, etc), must
+                                              never be skipped */
 
   /**
    * Constructor
@@ -774,6 +778,11 @@ typedef struct glw_root {
   int gr_need_refresh;
   int64_t gr_scheduled_refresh;
 
+  // Set if unchanged subtrees can keep their layout this frame
+  int gr_partial_layout;
+  int gr_layout_width;
+  int gr_layout_height;
+
   /**
    * Screensaver
    */
@@ -803,6 +812,7 @@ typedef struct glw_root {
   hts_cond_t gr_gtb_work_cond;
   hts_thread_t gr_font_thread;
   int gr_font_thread_running;
+  LIST_HEAD(, glw_glyph_atlas) gr_glyph_atlases;
 
   rstr_t *gr_default_font;
   int gr_font_domain;
@@ -825,6 +835,7 @@ typedef struct glw_root {
 #define LQ_num        5
 
   struct glw_loadable_texture_queue gr_tex_load_queue[LQ_num];
+  struct glw_loadable_texture_queue gr_tex_loading_queue;
 
   struct glw_loadable_texture_list gr_tex_active_list;
   struct glw_loadable_texture_list gr_tex_flush_list;
@@ -914,6 +925,23 @@ typedef struct glw_root {
   int gr_vertex_buffer_capacity;
   int gr_vertex_offset;
 
+  // Vertices in final (batched) order, swapped with gr_vertex_buffer
+  float *gr_batch_vertex_buffer;
+  int gr_batch_vertex_buffer_capacity;
+
+  /**
+   * Statistics for the last rendered frame
+   */
+  struct {
+    int jobs;           // As submitted by widgets
+    int draw_calls;     // After batching
+    int vertices;
+    int state_changes;  // Program, texture, blend and frontface switches
+  } gr_render_stats;
+
+  glw_frametrace_t gr_frametrace;
+  int gr_frametrace_overlay;
+
   int gr_blendmode;
   int gr_frontface;
 
@@ -979,6 +1007,10 @@ typedef struct glw_rctx {
 
   int16_t rc_zindex; // higher number is infront lower numbers (just as HTML)
 
+  // How far (in pixels) outside the visible part of the scrolling
+  // containers we are. 0 when on screen. Used to prioritize loading
+  int16_t rc_offscreen;
+
   uint8_t rc_layer;
 
   // Used when rendering low res passes in bloom filter
@@ -1112,6 +1144,10 @@ typedef struct glw {
 #define GLW_CAN_SCROLL           0x4000
 #define GLW_MARK                 0x8000
 
+#define GLW_DIRTY                0x10000  // Need layout
+#define GLW_CHILD_DIRTY          0x20000  // Something below need layout
+#define GLW_VOLATILE             0x40000  // Subtree must be laid out
+                                          // every frame
 #define GLW_CLIPPED              0x1000000
 
 
@@ -1162,6 +1198,17 @@ typedef struct glw {
 
   uint8_t glw_dynamic_eval;   // GLW_VIEW_EVAL_ -flags
 
+  /**
+   * The rctx we were last laid out with, see glw_layout0()
+   */
+  uint8_t glw_layout_layer;
+  uint8_t glw_layout_overscanning;
+  int16_t glw_layout_width;
+  int16_t glw_layout_height;
+  int16_t glw_layout_offscreen;
+  float glw_layout_alpha;
+  float glw_layout_sharpness;
+
 #ifdef DEBUG
   rstr_t *glw_file;
   int glw_line;
@@ -1434,6 +1481,9 @@ void glw_reposition(glw_rctx_t *rc, int left, int top, int right, int bottom);
 void glw_repositionf(glw_rctx_t *rc, float left, float top,
 		     float right, float bottom);
 
+void glw_set_offscreen(glw_rctx_t *rc, const glw_rctx_t *parent,
+                       float pos, int size, int visible, float direction);
+
 void glw_align_1(glw_rctx_t *rc, int a);
 
 void glw_align_2(glw_rctx_t *rc, int a);
@@ -1560,6 +1610,7 @@ void glw_project(glw_rect_t *r, const glw_rctx_t *rc, const glw_root_t *gr);
 
 #define GLW_REFRESH_FLAG_LAYOUT 0x1
 #define GLW_REFRESH_FLAG_RENDER 0x2
+#define GLW_REFRESH_FLAG_FULL   0x4 // Not tied to a widget, layout everything
 
 #define GLW_REFRESH_LAYOUT_ONLY 2
 
@@ -1575,7 +1626,7 @@ void glw_need_refresh0(glw_root_t *gr, int how, const char *file, int line);
 static __inline void
 glw_need_refresh(glw_root_t *gr, int how)
 {
-  int flags = GLW_REFRESH_FLAG_LAYOUT;
+  int flags = GLW_REFRESH_FLAG_LAYOUT | GLW_REFRESH_FLAG_FULL;
 
   if(how != GLW_REFRESH_LAYOUT_ONLY)
     flags |= GLW_REFRESH_FLAG_RENDER;
@@ -1584,6 +1635,25 @@ glw_need_refresh(glw_root_t *gr, int how)
 
 #endif
 
+void glw_dirty(glw_t *w);
+
+/**
+ * Same as glw_need_refresh() but for changes that only affect the
+ * layout of 'w' itself (and thereby its parents). Other subtrees are
+ * left alone by glw_layout0()
+ */
+static __inline void
+glw_need_refresh_widget(glw_t *w, int how)
+{
+  int flags = GLW_REFRESH_FLAG_LAYOUT;
+
+  if(how != GLW_REFRESH_LAYOUT_ONLY)
+    flags |= GLW_REFRESH_FLAG_RENDER;
+
+  glw_dirty(w);
+  w->glw_root->gr_need_refresh |= flags;
+}
+
 static __inline void
 glw_schedule_refresh(glw_root_t *gr, int64_t when)
 {
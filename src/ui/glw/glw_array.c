@@ -272,8 +272,11 @@ glw_array_layout(glw_t *w, const glw_rctx_t *rc)
     }
 
     if(ypos - a->filtered_pos > -height &&
-       ypos - a->filtered_pos <  height * 2)
+       ypos - a->filtered_pos <  height * 2) {
+      glw_set_offscreen(&rc0, rc, ypos - a->filtered_pos, rc0.rc_height,
+                        height, a->current_pos - a->filtered_pos);
       glw_layout0(c, &rc0);
+    }
 
     if(c == a->scroll_to_me) {
       a->scroll_to_me = NULL;
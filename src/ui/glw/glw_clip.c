@@ -307,7 +307,7 @@ glw_stencil_layout(glw_t *w, const glw_rctx_t *rc)
   if(glt == NULL)
     return;
 
-  glw_tex_layout(w->glw_root, glt);
+  glw_tex_layout(w->glw_root, glt, rc->rc_offscreen);
   TAILQ_FOREACH(c, &w->glw_childs, glw_parent_link) {
     if(c->glw_flags & GLW_HIDDEN)
       continue;
@@ -465,6 +465,7 @@ glw_stencil_ctor(glw_t *w)
 static glw_class_t glw_stencil = {
   .gc_name = "stencil",
   .gc_instance_size = sizeof(glw_stencil_t),
+  .gc_flags = GLW_LAYOUT_EVERY_FRAME,
   .gc_layout = glw_stencil_layout,
   .gc_render = glw_stencil_render,
   .gc_signal_handler = glw_stencil_callback,
@@ -0,0 +1,269 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "glw.h"
+#include "glw_frametrace.h"
+#include "networking/http_server.h"
+
+#define FT_RING_SIZE   1024  // Must be power of 2
+#define FT_PCT_FRAMES  256   // Number of frames to compute percentiles over
+#define FT_PCT_INTERVAL 32   // Frames between updates of the overlay
+
+static glw_frame_record_t ft_ring[FT_RING_SIZE];
+static unsigned int ft_head;  // Number of frames ever pushed
+static HTS_MUTEX_DECL(ft_mutex);
+
+static const char *ft_phase_names[GLW_FT_num] = {
+  [GLW_FT_PREPARE]  = "prepare",
+  [GLW_FT_DISPATCH] = "dispatch",
+  [GLW_FT_LAYOUT]   = "layout",
+  [GLW_FT_RENDER]   = "render",
+  [GLW_FT_RENDERER] = "renderer",
+  [GLW_FT_UPLOAD]   = "upload",
+  [GLW_FT_SWAP]     = "swap",
+};
+
+
+/**
+ * Copy out the 'max' most recent frames, oldest first
+ */
+static int
+ft_snapshot(glw_frame_record_t *out, int max)
+{
+  hts_mutex_lock(&ft_mutex);
+
+  int num = MIN(ft_head, max);
+  unsigned int first = ft_head - num;
+  for(int i = 0; i < num; i++)
+    out[i] = ft_ring[(first + i) & (FT_RING_SIZE - 1)];
+
+  hts_mutex_unlock(&ft_mutex);
+  return num;
+}
+
+
+/**
+ *
+ */
+static int
+u32_cmp(const void *A, const void *B)
+{
+  const uint32_t *a = A;
+  const uint32_t *b = B;
+  return *a < *b ? -1 : *a > *b;
+}
+
+
+/**
+ *
+ */
+static void
+ft_set_percentiles(prop_t *p, uint32_t *v, int num)
+{
+  if(num == 0) {
+    prop_set(p, "p50", PROP_SET_VOID);
+    prop_set(p, "p90", PROP_SET_VOID);
+    prop_set(p, "p99", PROP_SET_VOID);
+    return;
+  }
+  qsort(v, num, sizeof(uint32_t), u32_cmp);
+  prop_set(p, "p50", PROP_SET_FLOAT, v[num * 50 / 100] / 1000.0f);
+  prop_set(p, "p90", PROP_SET_FLOAT, v[num * 90 / 100] / 1000.0f);
+  prop_set(p, "p99", PROP_SET_FLOAT, v[num * 99 / 100] / 1000.0f);
+}
+
+
+/**
+ * Publish percentiles (in ms) of frame and phase times for frames that
+ * actually rendered something
+ */
+static void
+ft_update_props(glw_root_t *gr)
+{
+  glw_frame_record_t *frames = malloc(sizeof(glw_frame_record_t) *
+                                      FT_PCT_FRAMES);
+  uint32_t v[FT_PCT_FRAMES];
+  int num_frames = ft_snapshot(frames, FT_PCT_FRAMES);
+  int i, j, n;
+
+  prop_t *p = prop_create(gr->gr_prop_ui, "frametrace");
+
+  n = 0;
+  for(i = 0; i < num_frames; i++)
+    if(frames[i].gfr_duration[GLW_FT_RENDERER])
+      v[n++] = frames[i].gfr_total;
+  ft_set_percentiles(prop_create(p, "frame"), v, n);
+
+  for(j = 0; j < GLW_FT_num; j++) {
+    n = 0;
+    for(i = 0; i < num_frames; i++)
+      if(frames[i].gfr_duration[GLW_FT_RENDERER])
+        v[n++] = frames[i].gfr_duration[j];
+    ft_set_percentiles(prop_create(p, ft_phase_names[j]), v, n);
+  }
+  free(frames);
+}
+
+
+/**
+ * Finish the current frame and start a new one. Must be called first
+ * thing in glw_prepare_frame()
+ */
+void
+glw_frametrace_new_frame(glw_root_t *gr)
+{
+  glw_frame_record_t *cur = &gr->gr_frametrace.gft_cur;
+  const int64_t now = arch_get_ts();
+
+  if(cur->gfr_start) {
+    cur->gfr_total = now - cur->gfr_start;
+
+    if(cur->gfr_duration[GLW_FT_RENDERER]) {
+      const uint32_t end = cur->gfr_begin[GLW_FT_RENDERER] +
+        cur->gfr_duration[GLW_FT_RENDERER];
+
+      cur->gfr_begin[GLW_FT_SWAP] = end;
+      cur->gfr_duration[GLW_FT_SWAP] =
+        cur->gfr_total > end ? cur->gfr_total - end : 0;
+
+      cur->gfr_jobs          = gr->gr_render_stats.jobs;
+      cur->gfr_draw_calls    = gr->gr_render_stats.draw_calls;
+      cur->gfr_state_changes = gr->gr_render_stats.state_changes;
+      cur->gfr_vertices      = gr->gr_render_stats.vertices;
+    }
+
+    hts_mutex_lock(&ft_mutex);
+    ft_ring[ft_head & (FT_RING_SIZE - 1)] = *cur;
+    ft_head++;
+    hts_mutex_unlock(&ft_mutex);
+  }
+
+  memset(cur, 0, sizeof(glw_frame_record_t));
+  cur->gfr_start = now;
+
+  if(gr->gr_frames % FT_PCT_INTERVAL)
+    return;
+
+  if(gconf.enable_frametrace_overlay != gr->gr_frametrace_overlay) {
+    gr->gr_frametrace_overlay = gconf.enable_frametrace_overlay;
+    prop_set(prop_create(gr->gr_prop_ui, "frametrace"), "enabled",
+             PROP_SET_INT, gr->gr_frametrace_overlay);
+  }
+
+  if(gr->gr_frametrace_overlay)
+    ft_update_props(gr);
+}
+
+
+#if ENABLE_HTTPSERVER
+
+/**
+ *
+ */
+static void
+ft_event(htsbuf_queue_t *out, int *first, const char *name, int tid,
+         int64_t ts, uint32_t dur)
+{
+  htsbuf_qprintf(out,
+                 "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                 "\"ts\":%"PRId64",\"dur\":%u",
+                 *first ? "" : ",", name, tid, ts, dur);
+  *first = 0;
+}
+
+
+/**
+ * Dump the ring buffer as Chrome trace-event JSON
+ */
+static int
+ft_dump_http(http_connection_t *hc, const char *remain, void *opaque,
+             http_cmd_t method)
+{
+  htsbuf_queue_t out;
+  glw_frame_record_t *frames = malloc(sizeof(glw_frame_record_t) *
+                                      FT_RING_SIZE);
+  int num_frames = ft_snapshot(frames, FT_RING_SIZE);
+  int first = 1;
+
+  htsbuf_queue_init(&out, 0);
+
+  htsbuf_qprintf(&out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  htsbuf_qprintf(&out,
+                 "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":1,\"args\":{\"name\":\"Frames\"}},"
+                 "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":2,\"args\":{\"name\":\"Phases\"}},"
+                 "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":3,\"args\":{\"name\":\"Texture uploads\"}}");
+  first = 0;
+
+  for(int i = 0; i < num_frames; i++) {
+    const glw_frame_record_t *gfr = &frames[i];
+
+    ft_event(&out, &first, "frame", 1, gfr->gfr_start, gfr->gfr_total);
+    htsbuf_qprintf(&out,
+                   ",\"args\":{\"jobs\":%d,\"drawCalls\":%d,"
+                   "\"stateChanges\":%d,\"vertices\":%u,"
+                   "\"uploads\":%d,\"uploadBytes\":%u}}",
+                   gfr->gfr_jobs, gfr->gfr_draw_calls,
+                   gfr->gfr_state_changes, gfr->gfr_vertices,
+                   gfr->gfr_uploads, gfr->gfr_upload_bytes);
+
+    for(int j = 0; j < GLW_FT_num; j++) {
+      if(gfr->gfr_duration[j] == 0)
+        continue;
+      // Uploads are spread out over the frame, we only know the sum
+      ft_event(&out, &first, ft_phase_names[j], j == GLW_FT_UPLOAD ? 3 : 2,
+               gfr->gfr_start + gfr->gfr_begin[j], gfr->gfr_duration[j]);
+      htsbuf_qprintf(&out, "}");
+    }
+
+    if(gfr->gfr_duration[GLW_FT_RENDERER])
+      htsbuf_qprintf(&out,
+                     ",\n{\"name\":\"renderer\",\"ph\":\"C\",\"pid\":1,"
+                     "\"ts\":%"PRId64",\"args\":{\"drawCalls\":%d,"
+                     "\"vertices\":%u}}",
+                     gfr->gfr_start, gfr->gfr_draw_calls,
+                     gfr->gfr_vertices);
+  }
+
+  htsbuf_qprintf(&out, "\n]}\n");
+  free(frames);
+
+  return http_send_reply(hc, 0, "application/json", NULL, NULL, 0, &out);
+}
+
+
+/**
+ *
+ */
+static void
+glw_frametrace_init(void)
+{
+  http_path_add("/showtime/glw/frametrace", NULL, ft_dump_http, 1);
+}
+
+INITME(INIT_GROUP_API, glw_frametrace_init, NULL);
+
+#endif // ENABLE_HTTPSERVER
@@ -0,0 +1,108 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "arch/arch.h"
+
+/**
+ * Per frame timing
+ *
+ * Each frame records when its phases started and how long they took.
+ * Finished frames are pushed into a ring buffer which can be fetched
+ * as Chrome trace-event JSON (load it in chrome://tracing) from
+ * http://<host>:42000/showtime/glw/frametrace
+ *
+ * Percentiles over the most recent frames are published in
+ * $ui.frametrace when the overlay is enabled in developer settings.
+ */
+typedef enum {
+  GLW_FT_PREPARE,   // glw_prepare_frame()
+  GLW_FT_DISPATCH,  // Prop courier dispatch (part of prepare)
+  GLW_FT_LAYOUT,
+  GLW_FT_RENDER,    // Walking the widget tree, creating render jobs
+  GLW_FT_RENDERER,  // glw_renderer_render(), sorting and GPU submission
+  GLW_FT_UPLOAD,    // Texture uploads (summed up over the frame)
+  GLW_FT_SWAP,      // From end of rendering until next frame starts
+  GLW_FT_num,
+} glw_ft_phase_t;
+
+
+typedef struct glw_frame_record {
+  int64_t gfr_start;
+
+  uint32_t gfr_total;                 // µs until next frame started
+  uint32_t gfr_begin[GLW_FT_num];     // µs from gfr_start
+  uint32_t gfr_duration[GLW_FT_num];  // µs
+
+  uint16_t gfr_jobs;
+  uint16_t gfr_draw_calls;
+  uint16_t gfr_state_changes;
+  uint16_t gfr_uploads;
+  uint32_t gfr_vertices;
+  uint32_t gfr_upload_bytes;
+} glw_frame_record_t;
+
+
+typedef struct glw_frametrace {
+  glw_frame_record_t gft_cur;
+  int64_t gft_phase_start[GLW_FT_num];
+} glw_frametrace_t;
+
+
+/**
+ *
+ */
+static __inline void
+glw_ft_begin(glw_frametrace_t *gft, glw_ft_phase_t phase)
+{
+  int64_t now = arch_get_ts();
+  gft->gft_phase_start[phase] = now;
+  if(gft->gft_cur.gfr_duration[phase] == 0)
+    gft->gft_cur.gfr_begin[phase] = now - gft->gft_cur.gfr_start;
+}
+
+
+/**
+ *
+ */
+static __inline void
+glw_ft_end(glw_frametrace_t *gft, glw_ft_phase_t phase)
+{
+  int64_t d = arch_get_ts() - gft->gft_phase_start[phase];
+  // Make sure a phase that did run never ends up with zero duration
+  gft->gft_cur.gfr_duration[phase] += d > 0 ? d : 1;
+}
+
+
+/**
+ *
+ */
+static __inline void
+glw_ft_upload(glw_frametrace_t *gft, int bytes)
+{
+  gft->gft_cur.gfr_uploads++;
+  gft->gft_cur.gfr_upload_bytes += bytes;
+}
+
+struct glw_root;
+
+void glw_frametrace_new_frame(struct glw_root *gr);
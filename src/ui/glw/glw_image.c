@@ -824,7 +824,7 @@ glw_image_layout(glw_t *w, const glw_rctx_t *rc)
   }
 
   if((glt = gi->gi_pending) != NULL) {
-    glw_tex_layout(gr, glt);
+    glw_tex_layout(gr, glt, rc->rc_offscreen);
 
     if(glw_is_tex_inited(&glt->glt_texture) ||
        glt->glt_state == GLT_STATE_ERROR) {
@@ -845,7 +845,7 @@ glw_image_layout(glw_t *w, const glw_rctx_t *rc)
 
   glw_lp(&gi->gi_autofade, w->glw_root, !gi->gi_loading_new_url, 0.25);
 
-  glw_tex_layout(gr, glt);
+  glw_tex_layout(gr, glt, rc->rc_offscreen);
 
   if(glt->glt_state == GLT_STATE_ERROR) {
     if(!gi->gi_is_ready) {
@@ -1498,6 +1498,7 @@ glw_image_get_details(glw_t *w, char *path, size_t pathlen, float *alpha)
 static glw_class_t glw_image = {
   .gc_name = "image",
   .gc_instance_size = sizeof(glw_image_t),
+  .gc_flags = GLW_LAYOUT_EVERY_FRAME,
   .gc_layout = glw_image_layout,
   .gc_render = glw_image_render,
   .gc_dtor = glw_image_dtor,
@@ -1526,6 +1527,7 @@ GLW_REGISTER_CLASS(glw_image);
 static glw_class_t glw_icon = {
   .gc_name = "icon",
   .gc_instance_size = sizeof(glw_image_t),
+  .gc_flags = GLW_LAYOUT_EVERY_FRAME,
   .gc_layout = glw_image_layout,
   .gc_render = glw_image_render,
   .gc_ctor = glw_icon_ctor,
@@ -1554,6 +1556,7 @@ GLW_REGISTER_CLASS(glw_icon);
 static glw_class_t glw_backdrop = {
   .gc_name = "backdrop",
   .gc_instance_size = sizeof(glw_image_t),
+  .gc_flags = GLW_LAYOUT_EVERY_FRAME,
   .gc_layout = glw_image_layout,
   .gc_render = glw_image_render,
   .gc_ctor = glw_image_ctor,
@@ -1582,6 +1585,7 @@ GLW_REGISTER_CLASS(glw_backdrop);
 static glw_class_t glw_frontdrop = {
   .gc_name = "frontdrop",
   .gc_instance_size = sizeof(glw_image_t),
+  .gc_flags = GLW_LAYOUT_EVERY_FRAME,
   .gc_layout = glw_image_layout,
   .gc_render = glw_image_render,
   .gc_ctor = glw_image_ctor,
@@ -1610,6 +1614,7 @@ GLW_REGISTER_CLASS(glw_frontdrop);
 static glw_class_t glw_repeatedimage = {
   .gc_name = "repeatedimage",
   .gc_instance_size = sizeof(glw_image_t),
+  .gc_flags = GLW_LAYOUT_EVERY_FRAME,
   .gc_layout = glw_image_layout,
   .gc_render = glw_image_render,
   .gc_ctor = glw_image_ctor,
@@ -217,8 +217,11 @@ glw_list_layout_y(glw_t *w, const glw_rctx_t *rc)
     cd->height = rc0.rc_height;
 
     if(ypos - l->filtered_pos > -height0 &&
-       ypos - l->filtered_pos <  height0 * 2)
+       ypos - l->filtered_pos <  height0 * 2) {
+      glw_set_offscreen(&rc0, rc, ypos - l->filtered_pos, rc0.rc_height,
+                        height0, l->current_pos - l->filtered_pos);
       glw_layout0(c, &rc0);
+    }
 
     ypos += rc0.rc_height;
     ypos += l->spacing;
@@ -289,6 +292,8 @@ glw_list_layout_x(glw_t *w, const glw_rctx_t *rc)
 
     if(xpos - l->filtered_pos > -width0 &&
        xpos - l->filtered_pos <  width0 * 2) {
+      glw_set_offscreen(&rc0, rc, xpos - l->filtered_pos, rc0.rc_width,
+                        width0, l->current_pos - l->filtered_pos);
       glw_layout0(c, &rc0);
     }
 
@@ -202,10 +202,16 @@ render_unlocked(glw_root_t *gr)
       continue;
 
     const struct glw_backend_texture *t0 = rj->t0;
+    const glw_program_t *prev_gp = gbr->gbr_current;
+    const struct glw_backend_texture *prev_t0 = rs.t0;
+    const struct glw_backend_texture *prev_t1 = rs.t1;
 
     glw_program_t *gp =
       load_program(gr, t0, rj->t1, rj->blur, rj->flags, rj->gpa, &rs, rj);
 
+    gr->gr_render_stats.state_changes +=
+      (prev_gp != gbr->gbr_current) + (prev_t0 != rs.t0) + (prev_t1 != rs.t1);
+
     if(gbr->gbr_use_stencil_buffer)
       glStencilFunc(GL_GEQUAL, ro->zindex, 0xFF);
 
@@ -238,6 +244,7 @@ render_unlocked(glw_root_t *gr)
       glEnd();
 
       glDisable(t0->gltype);
+      gr->gr_render_stats.draw_calls++;
 #endif
       continue;
 
@@ -267,6 +274,7 @@ render_unlocked(glw_root_t *gr)
     }
     if(unlikely(current_blendmode != rj->blendmode)) {
       current_blendmode = rj->blendmode;
+      gr->gr_render_stats.state_changes++;
       switch(current_blendmode) {
       case GLW_BLEND_NORMAL:
 	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
@@ -284,10 +292,13 @@ render_unlocked(glw_root_t *gr)
 
     if(unlikely(current_frontface != rj->frontface)) {
       current_frontface = rj->frontface;
+      gr->gr_render_stats.state_changes++;
       glFrontFace(current_frontface == GLW_CW ? GL_CW : GL_CCW);
     }
 
     glDrawArrays(rj->primitive_type, rj->vertex_offset, rj->num_vertices);
+    gr->gr_render_stats.draw_calls++;
+    gr->gr_render_stats.vertices += rj->num_vertices;
   }
   if(current_blendmode != GLW_BLEND_NORMAL) {
     glBlendFuncSeparate(GL_SRC_COLOR, GL_ONE,
@@ -1313,7 +1313,9 @@ glw_blendmode(struct glw_root *gr, int mode)
 
 
 /**
- *
+ * Sort on depth first, then try to put jobs sharing textures next to
+ * each other. Jobs that are otherwise equal are kept in the order they
+ * were submitted
  */
 static int
 render_order_cmp(const void *A, const void *B)
@@ -1326,14 +1328,148 @@ render_order_cmp(const void *A, const void *B)
   const glw_render_job_t *aj = a->job;
   const glw_render_job_t *bj = b->job;
 
-  if(aj->t0 < bj->t0)
-    return -1;
+  if(aj->t0 != bj->t0)
+    return aj->t0 < bj->t0 ? -1 : 1;
 
-  if(aj->t0 > bj->t0)
-    return 1;
+  if(aj->t1 != bj->t1)
+    return aj->t1 < bj->t1 ? -1 : 1;
+
+  return aj < bj ? -1 : aj > bj;
+}
+
+
+/**
+ * Move vertices to eye space so jobs with different modelview matrices
+ * can share a draw call
+ */
+static void
+vertices_to_eyespace(float *v, int num_vertices, const Mtx m)
+{
+  PMtx pmtx;
+
+  glw_pmtx_mul_prepare(pmtx, m);
+
+  for(int i = 0; i < num_vertices; i++) {
+    Vec4 V;
+    glw_pmtx_mul_vec4_i(V, pmtx, glw_vec4_get(v));
+    glw_vec4_store(v, V);
+    v += VERTEX_SIZE;
+  }
+}
 
-  return 0;
 
+/**
+ * Can job 'b' be drawn as part of job 'a'
+ */
+static int
+render_job_can_merge(const glw_render_order_t *ao,
+                     const glw_render_order_t *bo)
+{
+  const glw_render_job_t *a = ao->job;
+  const glw_render_job_t *b = bo->job;
+
+  return
+    ao->zindex == bo->zindex &&
+    a->gpa == NULL && b->gpa == NULL &&
+    a->primitive_type == GLW_DRAW_TRIANGLES &&
+    b->primitive_type == GLW_DRAW_TRIANGLES &&
+    a->t0 == b->t0 &&
+    a->t1 == b->t1 &&
+    a->flags == b->flags &&
+    a->blendmode == b->blendmode &&
+    a->frontface == b->frontface &&
+    a->blur == b->blur &&
+    a->alpha == b->alpha &&
+    a->width == b->width &&
+    a->height == b->height &&
+    !memcmp(&a->rgb_mul, &b->rgb_mul, sizeof(struct glw_rgb)) &&
+    !memcmp(&a->rgb_off, &b->rgb_off, sizeof(struct glw_rgb));
+}
+
+
+/**
+ * Merge consecutive (in render order) jobs that only differ in
+ * modelview matrix into one job. Vertices are rewritten into a second
+ * buffer in render order so every job ends up as one contiguous range
+ */
+static void
+glw_renderer_batch(glw_root_t *gr)
+{
+  if(gr->gr_batch_vertex_buffer_capacity < gr->gr_vertex_offset) {
+    gr->gr_batch_vertex_buffer_capacity = gr->gr_vertex_buffer_capacity;
+    gr->gr_batch_vertex_buffer =
+      realloc(gr->gr_batch_vertex_buffer,
+              sizeof(float) * VERTEX_SIZE *
+              gr->gr_batch_vertex_buffer_capacity);
+  }
+
+  float *dst = gr->gr_batch_vertex_buffer;
+  glw_render_order_t *head = NULL;
+  int offset = 0;
+  int num_jobs = 0;
+
+  for(int i = 0; i < gr->gr_num_render_jobs; i++) {
+    const glw_render_order_t *ro = gr->gr_render_order + i;
+    glw_render_job_t *rj = ro->job;
+    const int n = rj->num_vertices;
+
+    if(n == 0)
+      continue;
+
+    float *v = dst + offset * VERTEX_SIZE;
+    memcpy(v, gr->gr_vertex_buffer + rj->vertex_offset * VERTEX_SIZE,
+           n * VERTEX_SIZE * sizeof(float));
+
+    if(head != NULL && render_job_can_merge(head, ro)) {
+      glw_render_job_t *hj = head->job;
+
+      if(!hj->eyespace) {
+        vertices_to_eyespace(dst + hj->vertex_offset * VERTEX_SIZE,
+                             hj->num_vertices, hj->m);
+        hj->eyespace = 1;
+      }
+
+      if(!rj->eyespace)
+        vertices_to_eyespace(v, n, rj->m);
+
+      hj->num_vertices += n;
+
+    } else {
+      rj->vertex_offset = offset;
+      head = gr->gr_render_order + num_jobs;
+      *head = *ro;
+      num_jobs++;
+    }
+    offset += n;
+  }
+
+  float *tmp = gr->gr_vertex_buffer;
+  gr->gr_vertex_buffer = gr->gr_batch_vertex_buffer;
+  gr->gr_batch_vertex_buffer = tmp;
+
+  int cap = gr->gr_vertex_buffer_capacity;
+  gr->gr_vertex_buffer_capacity = gr->gr_batch_vertex_buffer_capacity;
+  gr->gr_batch_vertex_buffer_capacity = cap;
+
+  gr->gr_vertex_offset = offset;
+  gr->gr_num_render_jobs = num_jobs;
+}
+
+
+/**
+ *
+ */
+static void
+glw_renderer_update_stats(glw_root_t *gr)
+{
+  if(gr->gr_frames & 0xf)
+    return;
+
+  prop_t *p = prop_create(gr->gr_prop_ui, "renderer");
+  prop_set(p, "jobs",         PROP_SET_INT, gr->gr_render_stats.jobs);
+  prop_set(p, "drawCalls",    PROP_SET_INT, gr->gr_render_stats.draw_calls);
+  prop_set(p, "vertices",     PROP_SET_INT, gr->gr_render_stats.vertices);
+  prop_set(p, "stateChanges", PROP_SET_INT, gr->gr_render_stats.state_changes);
 }
 
 
@@ -1351,5 +1487,14 @@ glw_renderer_render(glw_root_t *gr)
   qsort(gr->gr_render_order, gr->gr_num_render_jobs,
         sizeof(glw_render_order_t), render_order_cmp);
 
+  gr->gr_render_stats.jobs = gr->gr_num_render_jobs;
+  gr->gr_render_stats.draw_calls = 0;
+  gr->gr_render_stats.vertices = 0;
+  gr->gr_render_stats.state_changes = 0;
+
+  glw_renderer_batch(gr);
+
   gr->gr_be_render_unlocked(gr);
+
+  glw_renderer_update_stats(gr);
 }
@@ -111,7 +111,7 @@ typedef struct glw_render_job {
   float alpha;
   float blur;
   int vertex_offset;
-  int16_t num_vertices;
+  int num_vertices;
   int16_t width;
   int16_t height;
   int16_t primitive_type;
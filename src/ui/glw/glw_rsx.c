@@ -417,6 +417,8 @@ rsx_render_unlocked(glw_root_t *gr)
     rsx_set_fp(gr, rfp);
 
     realityVertexBegin(ctx, rj->primitive_type);
+    gr->gr_render_stats.draw_calls++;
+    gr->gr_render_stats.vertices += rj->num_vertices;
 
     const float *v = &vertices[rj->vertex_offset * VERTEX_SIZE];
 
@@ -35,9 +35,23 @@
 #include "glw_text_bitmap.h"
 #include "misc/str.h"
 #include "text/text.h"
+#include "text/glyph_atlas.h"
 #include "event.h"
 #include "image/image.h"
 
+/**
+ * A glyph atlas page uploaded as a texture. Shared between all text
+ * widgets drawing from it
+ */
+typedef struct glw_glyph_atlas {
+  LIST_ENTRY(glw_glyph_atlas) gga_link;
+  glyph_atlas_t *gga_atlas;
+  glw_backend_texture_t gga_texture;
+  int gga_generation;
+  int gga_refcount;
+} glw_glyph_atlas_t;
+
+
 /**
  *
  */
@@ -52,9 +66,10 @@ typedef struct glw_text_bitmap {
   prop_str_type_t gtb_type;
 
   glw_backend_texture_t gtb_texture;
-
+  glw_glyph_atlas_t *gtb_atlas;
 
   glw_renderer_t gtb_text_renderer;
+  glw_renderer_t gtb_glyph_renderer;
   glw_renderer_t gtb_cursor_renderer;
 
   TAILQ_ENTRY(glw_text_bitmap) gtb_workq_link;
@@ -81,6 +96,7 @@ typedef struct glw_text_bitmap {
   uint8_t gtb_need_layout;
   uint8_t gtb_deferred_realize;
   uint8_t gtb_caption_dirty;
+  uint8_t gtb_new_image;
 
   int16_t gtb_edit_ptr;
 
@@ -117,6 +133,161 @@ static void gtb_caption_refresh(glw_text_bitmap_t *gtb);
 static glw_class_t glw_text, glw_label;
 
 
+/**
+ *
+ */
+static glw_glyph_atlas_t *
+gga_get(glw_root_t *gr, glyph_atlas_t *ga)
+{
+  glw_glyph_atlas_t *gga;
+
+  LIST_FOREACH(gga, &gr->gr_glyph_atlases, gga_link) {
+    if(gga->gga_atlas == ga) {
+      gga->gga_refcount++;
+      return gga;
+    }
+  }
+
+  gga = calloc(1, sizeof(glw_glyph_atlas_t));
+  gga->gga_atlas = glyph_atlas_retain(ga);
+  gga->gga_generation = -1;
+  gga->gga_refcount = 1;
+  LIST_INSERT_HEAD(&gr->gr_glyph_atlases, gga, gga_link);
+  return gga;
+}
+
+
+/**
+ *
+ */
+static void
+gga_release(glw_root_t *gr, glw_glyph_atlas_t *gga)
+{
+  if(gga == NULL || --gga->gga_refcount)
+    return;
+
+  glw_tex_destroy(gr, &gga->gga_texture);
+  glyph_atlas_release(gga->gga_atlas);
+  LIST_REMOVE(gga, gga_link);
+  free(gga);
+}
+
+
+/**
+ * Upload the part of the page where glyphs have been added since
+ * last time. The pixels are copied out under the atlas lock so other
+ * threads can keep adding glyphs while we talk to the GPU
+ */
+static void
+gga_upload(glw_root_t *gr, glw_glyph_atlas_t *gga)
+{
+  int x, y;
+  pixmap_t *pm = glyph_atlas_get_dirty(gga->gga_atlas, &gga->gga_generation,
+                                       &x, &y);
+  if(pm == NULL)
+    return;
+
+  if(glw_is_tex_inited(&gga->gga_texture))
+    glw_tex_upload_sub(gr, &gga->gga_texture, pm, x, y);
+  else
+    glw_tex_upload(gr, &gga->gga_texture, pm, 0);
+  pixmap_release(pm);
+}
+
+
+/**
+ * Build one quad per glyph, clipped to the visible part of the text.
+ * Same fade out as the single texture version when cut
+ */
+static void
+gtb_layout_glyphs(glw_text_bitmap_t *gtb, const glw_rctx_t *rc,
+                  const image_component_glyphs_t *icg,
+                  int left, int top, int width, int height, int fade)
+{
+  glw_renderer_t *r = &gtb->gtb_glyph_renderer;
+  const float aw = gtb->gtb_atlas->gga_atlas->ga_width;
+  const float ah = gtb->gtb_atlas->gga_atlas->ga_height;
+  const float fa = 1 + width / 20.0f;
+  int i, n = 0;
+
+  glw_renderer_free(r);
+  glw_renderer_init(r, icg->icg_num_glyphs * 4, icg->icg_num_glyphs * 2,
+                    NULL);
+
+  for(i = 0; i < icg->icg_num_glyphs; i++) {
+    const image_glyph_t *ig = &icg->icg_glyphs[i];
+
+    int x1 = ig->ig_x;
+    int y1 = ig->ig_y;
+    int x2 = x1 + ig->ig_w;
+    int y2 = y1 + ig->ig_h;
+    int u = ig->ig_u;
+    int v = ig->ig_v;
+
+    if(x1 < 0) {
+      u -= x1;
+      x1 = 0;
+    }
+    if(y1 < 0) {
+      v -= y1;
+      y1 = 0;
+    }
+    x2 = MIN(x2, width);
+    y2 = MIN(y2, height);
+
+    if(x1 >= x2 || y1 >= y2)
+      continue;
+
+    const float s1 = u / aw;
+    const float t1 = v / ah;
+    const float s2 = (u + x2 - x1) / aw;
+    const float t2 = (v + y2 - y1) / ah;
+
+    const float X1 = -1.0f + 2.0f * (left + x1) / (float)rc->rc_width;
+    const float X2 = -1.0f + 2.0f * (left + x2) / (float)rc->rc_width;
+    const float Y1 = -1.0f + 2.0f * (top - y2)  / (float)rc->rc_height;
+    const float Y2 = -1.0f + 2.0f * (top - y1)  / (float)rc->rc_height;
+
+    const float cr = (ig->ig_color & 0xff) / 255.0f;
+    const float cg = ((ig->ig_color >> 8) & 0xff) / 255.0f;
+    const float cb = ((ig->ig_color >> 16) & 0xff) / 255.0f;
+    const float ca = (ig->ig_color >> 24) / 255.0f;
+
+    float a1 = ca, a2 = ca;
+    if(fade) {
+      a1 *= MIN(1.0f, fa * (1.0f - x1 / (float)width));
+      a2 *= MIN(1.0f, fa * (1.0f - x2 / (float)width));
+    }
+
+    const int o = n * 4;
+
+    glw_renderer_vtx_pos(r, o + 0, X1, Y1, 0.0);
+    glw_renderer_vtx_st (r, o + 0, s1, t2);
+    glw_renderer_vtx_col(r, o + 0, cr, cg, cb, a1);
+
+    glw_renderer_vtx_pos(r, o + 1, X2, Y1, 0.0);
+    glw_renderer_vtx_st (r, o + 1, s2, t2);
+    glw_renderer_vtx_col(r, o + 1, cr, cg, cb, a2);
+
+    glw_renderer_vtx_pos(r, o + 2, X2, Y2, 0.0);
+    glw_renderer_vtx_st (r, o + 2, s2, t1);
+    glw_renderer_vtx_col(r, o + 2, cr, cg, cb, a2);
+
+    glw_renderer_vtx_pos(r, o + 3, X1, Y2, 0.0);
+    glw_renderer_vtx_st (r, o + 3, s1, t1);
+    glw_renderer_vtx_col(r, o + 3, cr, cg, cb, a1);
+
+    glw_renderer_triangle(r, n * 2 + 0, o + 0, o + 1, o + 2);
+    glw_renderer_triangle(r, n * 2 + 1, o + 0, o + 2, o + 3);
+    n++;
+  }
+
+  // Glyphs clipped away entirely are simply not drawn
+  r->gr_num_vertices = n * 4;
+  r->gr_num_triangles = n * 2;
+}
+
+
 /**
  *
  */
@@ -140,7 +311,23 @@ glw_text_bitmap_layout(glw_t *w, const glw_rctx_t *rc)
 
   // Upload texture
 
-  image_component_t *ic = image_find_component(gtb->gtb_image, IMAGE_PIXMAP);
+  image_component_t *ic;
+
+  if(gtb->gtb_new_image) {
+    gtb->gtb_new_image = 0;
+    gga_release(gr, gtb->gtb_atlas);
+    gtb->gtb_atlas = NULL;
+
+    ic = image_find_component(gtb->gtb_image, IMAGE_GLYPHS);
+    if(ic != NULL) {
+      gtb->gtb_atlas = gga_get(gr, ic->glyphs.icg_atlas);
+      gtb->gtb_margin = gtb->gtb_image->im_margin;
+      glw_tex_destroy(gr, &gtb->gtb_texture);
+      gtb->gtb_need_layout = 1;
+    }
+  }
+
+  ic = image_find_component(gtb->gtb_image, IMAGE_PIXMAP);
   if(ic != NULL) {
     glw_tex_upload(gr, &gtb->gtb_texture, ic->pm, 0);
     gtb->gtb_margin = ic->pm->pm_margin;
@@ -148,8 +335,19 @@ glw_text_bitmap_layout(glw_t *w, const glw_rctx_t *rc)
     gtb->gtb_need_layout = 1;
   }
 
-  const int tex_width  = glw_tex_width(&gtb->gtb_texture);
-  const int tex_height = glw_tex_height(&gtb->gtb_texture);
+  image_component_glyphs_t *icg = NULL;
+  int tex_width, tex_height;
+
+  if(gtb->gtb_atlas != NULL) {
+    gga_upload(gr, gtb->gtb_atlas);
+    ic = image_find_component(gtb->gtb_image, IMAGE_GLYPHS);
+    icg = &ic->glyphs;
+    tex_width  = gtb->gtb_image->im_width;
+    tex_height = gtb->gtb_image->im_height;
+  } else {
+    tex_width  = glw_tex_width(&gtb->gtb_texture);
+    tex_height = glw_tex_height(&gtb->gtb_texture);
+  }
 
   ic = image_find_component(gtb->gtb_image, IMAGE_TEXT_INFO);
   image_component_text_info_t *ti = ic ? &ic->text_info : NULL;
@@ -207,6 +405,7 @@ glw_text_bitmap_layout(glw_t *w, const glw_rctx_t *rc)
 
     int text_width  = tex_width;
     int text_height = tex_height;
+    int fade = 0;
 
     float x1, y1, x2, y2;
 
@@ -226,6 +425,7 @@ glw_text_bitmap_layout(glw_t *w, const glw_rctx_t *rc)
                text_width);
 
       if(!(gtb->gtb_flags & GTB_ELLIPSIZE)) {
+	fade = 1;
 	glw_renderer_vtx_col(&gtb->gtb_text_renderer, 0, 1,1,1,1+text_width/20);
 	glw_renderer_vtx_col(&gtb->gtb_text_renderer, 1, 1,1,1,0);
 	glw_renderer_vtx_col(&gtb->gtb_text_renderer, 2, 1,1,1,0);
@@ -287,6 +487,10 @@ glw_text_bitmap_layout(glw_t *w, const glw_rctx_t *rc)
       }
     }
 
+    if(icg != NULL)
+      gtb_layout_glyphs(gtb, rc, icg, left, top, text_width, text_height,
+                        fade);
+
     x1 = -1.0f + 2.0f * left   / (float)rc->rc_width;
     y1 = -1.0f + 2.0f * bottom / (float)rc->rc_height;
     x2 = -1.0f + 2.0f * right  / (float)rc->rc_width;
@@ -357,7 +561,7 @@ glw_text_bitmap_layout(glw_t *w, const glw_rctx_t *rc)
     (w->glw_class == &glw_text && glw_is_focused(w));
 
   if(gtb->gtb_paint_cursor && rc->rc_alpha > 0.01)
-    glw_need_refresh(gr, 0);
+    glw_need_refresh_widget(w, 0);
 
   gtb->gtb_need_layout = 0;
 
@@ -394,7 +598,13 @@ glw_text_bitmap_render(glw_t *w, const glw_rctx_t *rc)
   if(alpha < 0.01f)
     return;
 
-  if(glw_is_tex_inited(&gtb->gtb_texture) && gtb->gtb_image != NULL) {
+  if(gtb->gtb_atlas != NULL && gtb->gtb_image != NULL) {
+    if(gtb->gtb_glyph_renderer.gr_num_triangles > 0)
+      glw_renderer_draw(&gtb->gtb_glyph_renderer, w->glw_root, rc,
+                        &gtb->gtb_atlas->gga_texture, NULL,
+                        &gtb->gtb_color, NULL, alpha, blur, NULL);
+
+  } else if(glw_is_tex_inited(&gtb->gtb_texture) && gtb->gtb_image != NULL) {
     glw_renderer_draw(&gtb->gtb_text_renderer, w->glw_root, rc,
 		      &gtb->gtb_texture, NULL,
 		      &gtb->gtb_color, NULL, alpha, blur, NULL);
@@ -432,8 +642,10 @@ glw_text_bitmap_dtor(glw_t *w)
   LIST_REMOVE(gtb, gtb_global_link);
 
   glw_tex_destroy(w->glw_root, &gtb->gtb_texture);
+  gga_release(gr, gtb->gtb_atlas);
 
   glw_renderer_free(&gtb->gtb_text_renderer);
+  glw_renderer_free(&gtb->gtb_glyph_renderer);
   glw_renderer_free(&gtb->gtb_cursor_renderer);
 
   switch(gtb->gtb_state) {
@@ -515,6 +727,8 @@ static void
 gtb_inactive(glw_text_bitmap_t *gtb)
 {
   glw_tex_destroy(gtb->w.glw_root, &gtb->gtb_texture);
+  gga_release(gtb->w.glw_root, gtb->gtb_atlas);
+  gtb->gtb_atlas = NULL;
 
   // Make sure it is rerendered once we get back to life
   if(gtb->gtb_state == GTB_VALID)
@@ -679,7 +893,7 @@ gtb_realize(glw_text_bitmap_t *gtb)
 
   if(direct) {
     gtb->gtb_state = GTB_NEED_RENDER;
-    glw_need_refresh(gr, 0);
+    glw_need_refresh_widget(&gtb->w, 0);
   } else {
     TAILQ_INSERT_TAIL(&gr->gr_gtb_dim_queue, gtb, gtb_workq_link);
     gtb->gtb_state = GTB_QUEUED_FOR_DIMENSIONING;
@@ -1116,6 +1330,7 @@ do_render(glw_text_bitmap_t *gtb, glw_root_t *gr, int no_output)
     max_width = gr->gr_width;
     flags |= TR_RENDER_NO_OUTPUT;
   } else {
+    flags |= TR_RENDER_GLYPH_ATLAS;
     max_width =
       gtb->gtb_saved_width - gtb->gtb_padding[0] - gtb->gtb_padding[2];
   }
@@ -1204,7 +1419,7 @@ do_render(glw_text_bitmap_t *gtb, glw_root_t *gr, int no_output)
 
   glw_unref(&gtb->w);
 
-  glw_need_refresh(gr, 0);
+  glw_need_refresh_widget(&gtb->w, 0);
 
   if(gtb->w.glw_flags2 & GLW2_DEBUG)
     printf("  Returned image is %d x %d margin:%d\n",
@@ -1214,6 +1429,7 @@ do_render(glw_text_bitmap_t *gtb, glw_root_t *gr, int no_output)
     gtb->gtb_state = GTB_VALID;
     image_release(gtb->gtb_image);
     gtb->gtb_image = im;
+    gtb->gtb_new_image = 1;
     if(im != NULL && gtb->gtb_maxlines > 1) {
       gtb_set_constraints(gr, gtb, im);
     }
@@ -1335,6 +1551,7 @@ glw_text_bitmap_init(glw_root_t *gr)
 {
   TAILQ_INIT(&gr->gr_gtb_dim_queue);
   TAILQ_INIT(&gr->gr_gtb_render_queue);
+  LIST_INIT(&gr->gr_glyph_atlases);
 
   hts_cond_init(&gr->gr_gtb_work_cond, &gr->gr_mutex);
 
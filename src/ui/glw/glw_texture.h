@@ -84,6 +84,9 @@ typedef struct glw_loadable_texture {
 
   int glt_size;
 
+  int glt_prio_frame;
+  int16_t glt_prio;     // Distance from the visible area, lower is better
+
 } glw_loadable_texture_t;
 
 void glw_tex_init(glw_root_t *gr);
@@ -98,7 +101,7 @@ glw_loadable_texture_t *glw_tex_create(glw_root_t *gr, rstr_t *url,
 
 void glw_tex_deref(glw_root_t *gr, glw_loadable_texture_t *ht);
 
-void glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt);
+void glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt, int prio);
 
 void glw_tex_purge(glw_root_t *gr);
 
@@ -123,6 +126,13 @@ void glw_tex_backend_layout(glw_root_t *gr, glw_loadable_texture_t *glt);
 void glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
 		    const pixmap_t *pm, int flags);
 
+/**
+ * Replace the part of an already uploaded texture at 'x', 'y' with
+ * 'pm'. The pixmap type must match what the texture was created from
+ */
+void glw_tex_upload_sub(glw_root_t *gr, glw_backend_texture_t *tex,
+			const pixmap_t *pm, int x, int y);
+
 void glw_tex_destroy(glw_root_t *gr, glw_backend_texture_t *tex);
 
 #endif /* GLW_TEXTURE_H */
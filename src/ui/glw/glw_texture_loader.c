@@ -109,6 +109,54 @@ glw_tex_unstash(glw_root_t *gr, glw_loadable_texture_t *glt)
 
 
 
+/**
+ * If something on screen is waiting to be loaded, abort loads of
+ * textures far outside the visible area. If they are still laid out
+ * they will be requeued by glw_tex_layout() once the loader has
+ * backed out
+ */
+static void
+glw_tex_preempt(glw_root_t *gr)
+{
+  glw_loadable_texture_t *glt;
+  int i, waiting = 0;
+
+  if(TAILQ_FIRST(&gr->gr_tex_loading_queue) == NULL)
+    return;
+
+  for(i = LQ_TENTATIVE; i <= LQ_OTHER && !waiting; i++) {
+    TAILQ_FOREACH(glt, &gr->gr_tex_load_queue[i], glt_work_link) {
+      if(glt->glt_prio == 0) {
+        waiting = 1;
+        break;
+      }
+    }
+  }
+
+  if(!waiting)
+    return;
+
+  TAILQ_FOREACH(glt, &gr->gr_tex_loading_queue, glt_work_link) {
+    if(glt->glt_state != GLT_STATE_LOADING || glt->glt_url == NULL ||
+       glt->glt_prio <= gr->gr_height / 2 ||
+       glt->glt_q == &gr->gr_tex_load_queue[LQ_SKIN] ||
+       glt->glt_q == &gr->gr_tex_load_queue[LQ_REFRESH])
+      continue;
+
+    if(gconf.enable_image_debug)
+      TRACE(TRACE_DEBUG, "GLW", "Preempting load of %s (distance %d)",
+            rstr_get(glt->glt_url), glt->glt_prio);
+
+    LIST_REMOVE(glt, glt_flush_link);
+    glt->glt_state = GLT_STATE_LOAD_ABORT;
+    glt_cancel(glt);
+  }
+}
+
+
+/**
+ *
+ */
 void
 glw_tex_autoflush(glw_root_t *gr)
 {
@@ -148,6 +196,8 @@ glw_tex_autoflush(glw_root_t *gr)
 
   LIST_MOVE(&gr->gr_tex_flush_list, &gr->gr_tex_active_list, glt_flush_link);
   LIST_INIT(&gr->gr_tex_active_list);
+
+  glw_tex_preempt(gr);
 }
 
 
@@ -160,6 +210,26 @@ typedef struct loaderaux {
 } loaderaux_t;
 
 
+/**
+ * Pick the texture closest to the visible area. If there are several
+ * on screen, take the one that has been waiting the longest
+ */
+static glw_loadable_texture_t *
+loader_pick(struct glw_loadable_texture_queue *q)
+{
+  glw_loadable_texture_t *glt, *best = NULL;
+
+  TAILQ_FOREACH(glt, q, glt_work_link) {
+    if(best == NULL || glt->glt_prio < best->glt_prio) {
+      best = glt;
+      if(best->glt_prio == 0)
+        break;
+    }
+  }
+  return best;
+}
+
+
 /**
  *
  */
@@ -175,7 +245,7 @@ loader_get_work(loaderaux_t *la)
     if(gr->gr_tex_threads_running == 0)
       return NULL;
     for(i = 0; i <= last_queue; i++)
-      if((glt = TAILQ_FIRST(&gr->gr_tex_load_queue[i])) != NULL)
+      if((glt = loader_pick(&gr->gr_tex_load_queue[i])) != NULL)
 	return glt;
 
     hts_cond_wait(&gr->gr_tex_load_cond, &gr->gr_mutex);
@@ -249,12 +319,17 @@ loader_thread(void *aux)
 
       cancellable_reset(&glt->glt_cancellable);
 
+      // So glw_tex_preempt() can find us
+      TAILQ_INSERT_TAIL(&gr->gr_tex_loading_queue, glt, glt_work_link);
+
       glw_unlock(gr);
       img = backend_imageloader(url, &im, gr->gr_vpaths, errbuf, sizeof(errbuf),
                                 ccptr, &glt->glt_cancellable);
 
       glw_lock(gr);
 
+      TAILQ_REMOVE(&gr->gr_tex_loading_queue, glt, glt_work_link);
+
 #if 0
       if(pm != NULL && pm != NOT_MODIFIED) {
 	static int fail_simulator;
@@ -375,6 +450,7 @@ glw_tex_init(glw_root_t *gr)
   hts_cond_init(&gr->gr_tex_load_cond, &gr->gr_mutex);
 
   TAILQ_INIT(&gr->gr_tex_rel_queue);
+  TAILQ_INIT(&gr->gr_tex_loading_queue);
   TAILQ_INIT(&gr->gr_tex_stash[0].q);
   TAILQ_INIT(&gr->gr_tex_stash[1].q);
 
@@ -579,8 +655,14 @@ gl_tex_req_load(glw_root_t *gr, glw_loadable_texture_t *glt)
  *
  */
 void
-glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt)
+glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt, int prio)
 {
+  // Texture may be used by several widgets, the closest one wins
+  if(glt->glt_prio_frame != gr->gr_frames || prio < glt->glt_prio) {
+    glt->glt_prio_frame = gr->gr_frames;
+    glt->glt_prio = prio;
+  }
+
   if(glt->glt_pixmap != NULL)
     glw_tex_backend_layout(gr, glt);
 
@@ -66,6 +66,7 @@ glw_tex_backend_layout(glw_root_t *gr, glw_loadable_texture_t *glt)
 
   p = glt->glt_pixmap->pm_data;
 
+  glw_ft_begin(&gr->gr_frametrace, GLW_FT_UPLOAD);
   glGenTextures(1, glt->glt_texture.textures);
   glBindTexture(m, glt->glt_texture.textures[0]);
 
@@ -105,6 +106,10 @@ glw_tex_backend_layout(glw_root_t *gr, glw_loadable_texture_t *glt)
 
   glBindTexture(m, 0);
 
+  glw_ft_end(&gr->gr_frametrace, GLW_FT_UPLOAD);
+  glw_ft_upload(&gr->gr_frametrace,
+                glt->glt_pixmap->pm_linesize * glt->glt_ys);
+
   glw_tex_backend_free_loader_resources(glt);
 }
 
@@ -193,8 +198,51 @@ glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
   tex->width  = pm->pm_width;
   tex->height = pm->pm_height;
 
+  glw_ft_begin(&gr->gr_frametrace, GLW_FT_UPLOAD);
   glTexImage2D(m, 0, format, pm->pm_width, pm->pm_height,
 	       0, format, GL_UNSIGNED_BYTE, pm->pm_data);
+  glw_ft_end(&gr->gr_frametrace, GLW_FT_UPLOAD);
+  glw_ft_upload(&gr->gr_frametrace, pm->pm_linesize * pm->pm_height);
+}
+
+
+/**
+ *
+ */
+void
+glw_tex_upload_sub(glw_root_t *gr, glw_backend_texture_t *tex,
+		   const pixmap_t *pm, int x, int y)
+{
+  int format;
+  int m = GL_TEXTURE_2D;
+
+  if(tex->textures[0] == 0)
+    return;
+
+  switch(pm->pm_type) {
+  case PIXMAP_BGR32:
+    format     = GL_RGBA;
+    break;
+
+  case PIXMAP_RGB24:
+    format     = GL_RGB;
+    break;
+
+  case PIXMAP_IA:
+    format     = GL_LUMINANCE_ALPHA;
+    break;
+
+  default:
+    return;
+  }
+
+  glBindTexture(m, tex->textures[0]);
+
+  glw_ft_begin(&gr->gr_frametrace, GLW_FT_UPLOAD);
+  glTexSubImage2D(m, 0, x, y, pm->pm_width, pm->pm_height,
+		  format, GL_UNSIGNED_BYTE, pm->pm_data);
+  glw_ft_end(&gr->gr_frametrace, GLW_FT_UPLOAD);
+  glw_ft_upload(&gr->gr_frametrace, pm->pm_linesize * pm->pm_height);
 }
 
 
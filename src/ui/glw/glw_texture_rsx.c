@@ -299,6 +299,33 @@ glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
 }
 
 
+/**
+ * Textures are linear so just copy the rows in place
+ */
+void
+glw_tex_upload_sub(glw_root_t *gr, glw_backend_texture_t *tex,
+		   const pixmap_t *pm, int x, int y)
+{
+  int i;
+
+  if(tex->size == 0)
+    return;
+
+  if(pm->pm_type != PIXMAP_IA) {
+    TRACE(TRACE_ERROR, "GLW", "Unable to upload sub texture fmt %d, %d x %d",
+	  pm->pm_type, pm->pm_width, pm->pm_height);
+    return;
+  }
+
+  uint8_t *dst = rsx_to_ppu(tex->tex.offset);
+  dst += y * tex->tex.stride + x * 2;
+
+  for(i = 0; i < pm->pm_height; i++)
+    memcpy(dst + i * tex->tex.stride, pm->pm_data + i * pm->pm_linesize,
+	   pm->pm_width * 2);
+}
+
+
 /**
  *
  */
@@ -142,7 +142,7 @@ tex_newframe(glw_video_t *gv, video_decoder_t *vd, int flags)
     surface_init(gv, gvs);
   }
 
-  glw_need_refresh(gv->w.glw_root, 0);
+  glw_need_refresh_widget(&gv->w, 0);
 
   return glw_video_newframe_blend(gv, vd, flags, &gv_surface_pixmap_release, 1);
 }
@@ -29,6 +29,7 @@
 #include "glw_view.h"
 
 #include "fileaccess/fileaccess.h"
+#include "arch/arch.h"
 
 typedef struct glw_view {
   glw_t w;
@@ -43,9 +44,18 @@ typedef struct glw_view {
 static void
 glw_view_layout(glw_t *w, const glw_rctx_t *rc)
 {
+  glw_root_t *gr = w->glw_root;
   glw_t *c = TAILQ_FIRST(&w->glw_childs);
-  if(c != NULL)
-    return glw_layout0(c, rc);
+  if(c == NULL)
+    return;
+
+  if(w == gr->gr_universe) {
+    glw_ft_begin(&gr->gr_frametrace, GLW_FT_LAYOUT);
+    glw_layout0(c, rc);
+    glw_ft_end(&gr->gr_frametrace, GLW_FT_LAYOUT);
+  } else {
+    glw_layout0(c, rc);
+  }
 }
 
 
@@ -85,9 +95,18 @@ glw_view_dtor(glw_t *w)
 static void
 glw_view_render(glw_t *w, const glw_rctx_t *rc)
 {
+  glw_root_t *gr = w->glw_root;
   glw_t *c = TAILQ_FIRST(&w->glw_childs);
-  if(c != NULL)
+  if(c == NULL)
+    return;
+
+  if(w == gr->gr_universe) {
+    glw_ft_begin(&gr->gr_frametrace, GLW_FT_RENDER);
+    glw_render0(c, rc);
+    glw_ft_end(&gr->gr_frametrace, GLW_FT_RENDER);
+  } else {
     glw_render0(c, rc);
+  }
 }
 
 
@@ -140,6 +159,8 @@ typedef struct glw_cached_view {
   int gcv_error_line;
   int gcv_refcount;
   int gcv_loaded;
+  int gcv_precompiled;
+  int gcv_load_time;  // in µs
 } glw_cached_view_t;
 
 
@@ -213,6 +234,9 @@ gcv_load(glw_root_t *gr, glw_cached_view_t *gcv, int may_unlock)
   char errbuf[512];
   buf_t *buf;
   errorinfo_t ei;
+  glw_view_blob_t *gvb = NULL;
+  token_t *l = NULL;
+  const int64_t ts = arch_get_ts();
 
   gcv->gcv_loaded = 1; // A view is also "loaded" when there is an error
 
@@ -233,6 +257,9 @@ gcv_load(glw_root_t *gr, glw_cached_view_t *gcv, int may_unlock)
                   NULL);
   }
 
+  if(buf != NULL)
+    gvb = glw_view_blob_open(gr, file, buf_cstr(buf), buf_len(buf));
+
   if(may_unlock)
     glw_lock(gr);
 
@@ -248,11 +275,19 @@ gcv_load(glw_root_t *gr, glw_cached_view_t *gcv, int may_unlock)
   sof->type = TOKEN_START;
   sof->file = rstr_dup(file);
 
-  token_t *l = glw_view_lexer(gr, buf_cstr(buf), &ei, file, sof);
-  buf_release(buf);
+  if(gvb != NULL) {
+    l = glw_view_blob_tokens(gr, gvb, sof);
+    glw_view_blob_close(gvb);
+    gcv->gcv_precompiled = l != NULL;
+  }
+
   if(l == NULL) {
-    glw_view_free_chain(gr, sof);
-    goto bad;
+    l = glw_view_lexer(gr, buf_cstr(buf), &ei, file, sof);
+    if(l == NULL) {
+      buf_release(buf);
+      glw_view_free_chain(gr, sof);
+      goto bad;
+    }
   }
 
   token_t *eof = glw_view_token_alloc(gr);
@@ -260,19 +295,32 @@ gcv_load(glw_root_t *gr, glw_cached_view_t *gcv, int may_unlock)
   eof->file = rstr_dup(file);
   l->next = eof;
 
-  if(glw_view_preproc(gr, sof, &ei, may_unlock) ||
-     glw_view_parse(sof, &ei, gr)) {
+  if(!gcv->gcv_precompiled) {
+    if(glw_view_preproc(gr, sof, &ei, may_unlock)) {
+      buf_release(buf);
+      glw_view_free_chain(gr, sof);
+      goto bad;
+    }
+    glw_view_blob_store(gr, file, buf_cstr(buf), buf_len(buf),
+                        sof, may_unlock);
+  }
+
+  buf_release(buf);
+
+  if(glw_view_parse(sof, &ei, gr)) {
     glw_view_free_chain(gr, sof);
     goto bad;
   }
 
   gcv->gcv_sof = sof;
+  gcv->gcv_load_time = arch_get_ts() - ts;
   return;
 
  bad:
   gcv->gcv_error = strdup(ei.error);
   gcv->gcv_error_file = strdup(ei.file);
   gcv->gcv_error_line = ei.line;
+  gcv->gcv_load_time = arch_get_ts() - ts;
 }
 
 
@@ -480,3 +528,30 @@ glw_view_cache_flush(glw_root_t *gr)
     gcv_release(gr, gcv);
   }
 }
+
+
+/**
+ * Dump time spent loading each view (reading, lexing, preprocessing
+ * and parsing) to the log
+ */
+void
+glw_view_load_report(glw_root_t *gr)
+{
+  glw_cached_view_t *gcv;
+  int total = 0, num = 0, precompiled = 0;
+
+  LIST_FOREACH(gcv, &gr->gr_views, gcv_link) {
+    if(!gcv->gcv_loaded)
+      continue;
+    TRACE(TRACE_DEBUG, "GLW", "%6d.%03d ms  %s%s",
+          gcv->gcv_load_time / 1000, gcv->gcv_load_time % 1000,
+          rstr_get(gcv->gcv_url),
+          gcv->gcv_precompiled ? " (precompiled)" : "");
+    total += gcv->gcv_load_time;
+    precompiled += gcv->gcv_precompiled;
+    num++;
+  }
+
+  TRACE(TRACE_DEBUG, "GLW", "Loaded %d views (%d precompiled) in %d.%03d ms",
+        num, precompiled, total / 1000, total % 1000);
+}
@@ -320,6 +320,30 @@ token_t *glw_view_clone_chain(glw_root_t *gr, token_t *src, token_t **lp);
 
 void glw_view_cache_flush(glw_root_t *gr);
 
+void glw_view_load_report(glw_root_t *gr);
+
+#if ENABLE_HTTPSERVER
+void glw_view_benchmark_poll(glw_root_t *gr);
+#else
+#define glw_view_benchmark_poll(gr)
+#endif
+
+/**
+ * Precompiled (lexed and preprocessed) views, see glw_view_blob.c
+ */
+typedef struct glw_view_blob glw_view_blob_t;
+
+glw_view_blob_t *glw_view_blob_open(glw_root_t *gr, rstr_t *url,
+                                    const void *src, size_t srclen);
+
+token_t *glw_view_blob_tokens(glw_root_t *gr, glw_view_blob_t *gvb,
+                              token_t *prev);
+
+void glw_view_blob_close(glw_view_blob_t *gvb);
+
+void glw_view_blob_store(glw_root_t *gr, rstr_t *url, const void *src,
+                         size_t srclen, token_t *sof, int may_unlock);
+
 struct glw_prop_sub_list;
 void glw_prop_subscription_destroy_list(glw_root_t *gr, 
 					struct glw_prop_sub_list *l);
@@ -303,7 +303,7 @@ glw_set_weight(glw_t *w, float v, glw_style_t *origin)
   }
 
   glw_conf_constraints(w, 0, 0, v, GLW_CONSTRAINT_CONF_W);
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -322,7 +322,7 @@ glw_set_alpha(glw_t *w, float v, glw_style_t *origin)
     return;
 
   w->glw_alpha = v;
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -342,7 +342,7 @@ glw_set_blur(glw_t *w, float v, glw_style_t *origin)
   if(w->glw_sharpness == v)
     return;
   w->glw_sharpness = v;
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -350,15 +350,17 @@ glw_set_blur(glw_t *w, float v, glw_style_t *origin)
  *
  */
 static void
-attr_need_refresh(glw_root_t *gr, const token_t *t,
+attr_need_refresh(glw_t *w, const token_t *t,
                   const char *attribname, int how)
 {
-
+  glw_root_t *gr = w->glw_root;
   int flags = GLW_REFRESH_FLAG_LAYOUT;
 
   if(how != GLW_REFRESH_LAYOUT_ONLY)
     flags |= GLW_REFRESH_FLAG_RENDER;
 
+  glw_dirty(w);
+
   if((gr->gr_need_refresh & flags) == flags)
     return;
 
@@ -394,7 +396,7 @@ set_number_int(glw_t *w, const token_attrib_t *a, const token_t *t, int v)
   }
 
   if(r)
-    attr_need_refresh(w->glw_root, t, a->name, r);
+    attr_need_refresh(w, t, a->name, r);
 }
 
 
@@ -418,7 +420,7 @@ set_number_float(glw_t *w, const token_attrib_t *a, const token_t *t, float v)
   }
 
   if(r)
-    attr_need_refresh(w->glw_root, t, a->name, r);
+    attr_need_refresh(w, t, a->name, r);
 }
 
 
@@ -454,7 +456,7 @@ set_number_em(glw_t *w, const token_attrib_t *a, const token_t *t,
   }
 
   if(r)
-    attr_need_refresh(gr, t, a->name, r);
+    attr_need_refresh(w, t, a->name, r);
 }
 
 
@@ -568,7 +570,7 @@ glw_set_width(glw_t *w, int v, glw_style_t *origin)
   }
 
   glw_conf_constraints(w, v, 0, 0, GLW_CONSTRAINT_CONF_X);
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -584,7 +586,7 @@ glw_set_height(glw_t *w, int v, glw_style_t *origin)
   }
 
   glw_conf_constraints(w, 0, v, 0, GLW_CONSTRAINT_CONF_Y);
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -601,7 +603,7 @@ glw_set_align(glw_t *w, int v, glw_style_t *origin)
 
   if(w->glw_alignment != v) {
     w->glw_alignment = v;
-    glw_need_refresh(w->glw_root, 0);
+    glw_need_refresh_widget(w, 0);
   }
 }
 
@@ -612,7 +614,7 @@ void
 glw_set_divider(glw_t *w, int v)
 {
   glw_conf_constraints(w, 0, 0, 0, GLW_CONSTRAINT_CONF_D);
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -630,7 +632,7 @@ glw_set_zoffset(glw_t *w, int v)
   }
   */
   w->glw_zoffset = v;
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -705,7 +707,7 @@ set_float3(glw_view_eval_context_t *ec, const token_attrib_t *a,
     return 0;
   }
   if(r)
-    attr_need_refresh(w->glw_root, t, a->name, r);
+    attr_need_refresh(w, t, a->name, r);
 
   return 0;
 }
@@ -775,7 +777,7 @@ set_float4(glw_view_eval_context_t *ec, const token_attrib_t *a,
     return 0;
   }
   if(r)
-    attr_need_refresh(w->glw_root, t, a->name, r);
+    attr_need_refresh(w, t, a->name, r);
 
   return 0;
 }
@@ -849,7 +851,7 @@ set_int16_4(glw_view_eval_context_t *ec, const token_attrib_t *a,
     return 0;
   }
   if(r)
-    attr_need_refresh(w->glw_root, t, a->name, r);
+    attr_need_refresh(w, t, a->name, r);
 
   return 0;
 }
@@ -915,7 +917,7 @@ set_transition_effect(glw_view_eval_context_t *ec, const token_attrib_t *a,
 
   if(ec->w->glw_class->gc_set_int != NULL)
     ec->w->glw_class->gc_set_int(ec->w, GLW_ATTRIB_TRANSITION_EFFECT, v, NULL);
-  glw_need_refresh(ec->w->glw_root, 0);
+  glw_need_refresh_widget(ec->w, 0);
   return 0;
 }
 
@@ -980,7 +982,7 @@ mod_hidden(glw_view_eval_context_t *ec, const token_attrib_t *a,
       return 0;
     glw_unhide(w);
   }
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
   return 0;
 }
 
@@ -1004,7 +1006,7 @@ mod_flags2(glw_t *w, int set, int clr)
 
   if((set | clr) && gc->gc_mod_flags2 != NULL)
     gc->gc_mod_flags2(w, set, clr);
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -1016,7 +1018,7 @@ mod_text_flags(glw_t *w, int set, int clr)
 {
   if(w->glw_class->gc_mod_text_flags != NULL)
     w->glw_class->gc_mod_text_flags(w, set, clr, NULL);
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -1028,7 +1030,7 @@ mod_img_flags(glw_t *w, int set, int clr)
 {
   if(w->glw_class->gc_mod_image_flags != NULL)
     w->glw_class->gc_mod_image_flags(w, set, clr, NULL);
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -1040,7 +1042,7 @@ mod_video_flags(glw_t *w, int set, int clr)
 {
   if(w->glw_class->gc_mod_video_flags != NULL)
     w->glw_class->gc_mod_video_flags(w, set, clr);
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
 }
 
 
@@ -1140,7 +1142,7 @@ set_source(glw_view_eval_context_t *ec, const token_attrib_t *a,
   if(w->glw_class->gc_set_source != NULL)
     w->glw_class->gc_set_source(w, r, NULL);
 
-  glw_need_refresh(w->glw_root, 0);
+  glw_need_refresh_widget(w, 0);
   rstr_release(r);
   return 0;
 }
@@ -1256,7 +1258,7 @@ set_style(glw_view_eval_context_t *ec, const token_attrib_t *a,
   }
 
   if(r)
-    attr_need_refresh(ec->w->glw_root, t, a->name, r);
+    attr_need_refresh(ec->w, t, a->name, r);
   return 0;
 }
 
@@ -1429,7 +1431,7 @@ unresolved_set_float(glw_t *w, const char *attrib, const token_t *t,
   }
 
   if(r)
-    attr_need_refresh(w->glw_root, t, attrib, r);
+    attr_need_refresh(w, t, attrib, r);
 }
 
 
@@ -1456,7 +1458,7 @@ unresolved_set_int(glw_t *w, const char *attrib, const token_t *t,
   }
 
   if(r)
-    attr_need_refresh(w->glw_root, t, attrib, r);
+    attr_need_refresh(w, t, attrib, r);
 }
 
 
@@ -1479,7 +1481,7 @@ unresolved_set_str(glw_t *w, const char *attrib, const token_t *t,
   }
 
   if(r)
-    attr_need_refresh(w->glw_root, t, attrib, r);
+    attr_need_refresh(w, t, attrib, r);
 }
 
 
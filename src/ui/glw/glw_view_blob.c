@@ -0,0 +1,474 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <alloca.h>
+
+#include "main.h"
+#include "glw.h"
+#include "glw_view.h"
+#include "blobcache.h"
+#include "misc/sha.h"
+#include "misc/str.h"
+#include "fileaccess/fileaccess.h"
+
+/**
+ * Precompiled views
+ *
+ * The output of the lexer and the preprocessor (a flat list of tokens
+ * with all #include's, #import's and macros expanded) is serialized
+ * into the blobcache. Next time the same view is opened we skip
+ * reading all the included files and running the lexer and
+ * preprocessor over them. The parser still runs as its output refers
+ * to things that only exist in this process (attributes, functions and
+ * translated strings).
+ *
+ * An entry is keyed by the skin, the URL and a hash of the view source
+ * itself. Files pulled in by the preprocessor are recorded along with
+ * their size and modification time and the entry is ignored if any of
+ * them has changed.
+ *
+ * Serialized format (native byte order, it never leaves the device):
+ *
+ *  header
+ *  num_files * { u16 length, path, i64 size, i64 mtime }
+ *  num_tokens * { u8 type, u8 flags, u16 file, i32 line, payload }
+ *
+ * Payload is a float for TOKEN_FLOAT, an i32 for TOKEN_INT and a
+ * u32 length followed by the string for TOKEN_RSTRING and
+ * TOKEN_IDENTIFIER.
+ */
+
+#define GVB_MAGIC   0x67766231 // 'gvb1'
+#define GVB_STASH   "glwview"
+#define GVB_MAXAGE  (86400 * 30)
+#define GVB_MAX_FILES 256
+
+typedef struct gvb_header {
+  uint32_t magic;
+  uint32_t num_files;
+  uint32_t num_tokens;
+  uint32_t token_size;  // Size of the token section in bytes
+} gvb_header_t;
+
+
+typedef struct glw_view_blob {
+  const uint8_t *gvb_data;
+  size_t gvb_size;
+  const uint8_t *gvb_tokens;
+  int gvb_num_files;
+  int gvb_num_tokens;
+  rstr_t *gvb_files[0];
+} glw_view_blob_t;
+
+
+/**
+ * Tokens that carry no value, only their type
+ */
+static int
+gvb_plain_token(int type)
+{
+  return (type >= TOKEN_HASH && type <= TOKEN_COLON) || type == TOKEN_VOID;
+}
+
+
+/**
+ *
+ */
+static void
+gvb_key(glw_root_t *gr, rstr_t *url, const void *src, size_t srclen,
+        char *key, size_t keylen)
+{
+  uint8_t digest[20];
+  char hex[41];
+
+  sha1_decl(shactx);
+  sha1_init(shactx);
+  sha1_update(shactx, src, srclen);
+  sha1_final(shactx, digest);
+  bin2hex(hex, sizeof(hex), digest, sizeof(digest));
+
+  snprintf(key, keylen, "%s:%s:%s:%s",
+           htsversion, gr->gr_skin, rstr_get(url), hex);
+}
+
+
+/**
+ *
+ */
+static int
+gvb_file_changed(glw_root_t *gr, const char *path, int64_t size, int64_t mtime)
+{
+  struct fa_stat fs;
+
+  if(fa_stat_vpaths(path, gr->gr_vpaths, &fs, NULL, 0))
+    return 1;
+  return fs.fs_size != size || fs.fs_mtime != mtime;
+}
+
+
+/**
+ * Look for a precompiled version of 'src' and verify that all files it
+ * was built from are unchanged. Does not need the GLW lock
+ */
+glw_view_blob_t *
+glw_view_blob_open(glw_root_t *gr, rstr_t *url, const void *src, size_t srclen)
+{
+  char key[512];
+  size_t size;
+  const uint8_t *data, *p, *end;
+  gvb_header_t hdr;
+  glw_view_blob_t *gvb;
+  int i;
+
+  gvb_key(gr, url, src, srclen, key, sizeof(key));
+
+  if((data = blobcache_map(key, GVB_STASH, &size)) == NULL)
+    return NULL;
+
+  end = data + size;
+
+  if(size < sizeof(hdr))
+    goto bad;
+
+  memcpy(&hdr, data, sizeof(hdr));
+  p = data + sizeof(hdr);
+
+  if(hdr.magic != GVB_MAGIC || hdr.num_files > GVB_MAX_FILES)
+    goto bad;
+
+  gvb = calloc(1, sizeof(glw_view_blob_t) + hdr.num_files * sizeof(rstr_t *));
+  gvb->gvb_data = data;
+  gvb->gvb_size = size;
+
+  for(i = 0; i < hdr.num_files; i++) {
+    uint16_t len;
+    int64_t fsize, mtime;
+
+    if(p + sizeof(len) > end)
+      goto bad_files;
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+
+    if(p + len + 2 * sizeof(int64_t) > end)
+      goto bad_files;
+
+    gvb->gvb_files[i] = rstr_allocl((const char *)p, len);
+    gvb->gvb_num_files = i + 1;
+    p += len;
+
+    memcpy(&fsize, p, sizeof(fsize));
+    p += sizeof(fsize);
+    memcpy(&mtime, p, sizeof(mtime));
+    p += sizeof(mtime);
+
+    // The view itself is covered by the hash in the key
+    if(i > 0 &&
+       gvb_file_changed(gr, rstr_get(gvb->gvb_files[i]), fsize, mtime)) {
+      TRACE(TRACE_DEBUG, "GLW", "Precompiled %s is stale, %s has changed",
+            rstr_get(url), rstr_get(gvb->gvb_files[i]));
+      goto bad_files;
+    }
+  }
+
+  if(p + hdr.token_size != end)
+    goto bad_files;
+
+  gvb->gvb_tokens = p;
+  gvb->gvb_num_tokens = hdr.num_tokens;
+  return gvb;
+
+ bad_files:
+  glw_view_blob_close(gvb);
+  return NULL;
+
+ bad:
+  blobcache_unmap(data, size);
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+glw_view_blob_close(glw_view_blob_t *gvb)
+{
+  int i;
+  for(i = 0; i < gvb->gvb_num_files; i++)
+    rstr_release(gvb->gvb_files[i]);
+  blobcache_unmap(gvb->gvb_data, gvb->gvb_size);
+  free(gvb);
+}
+
+
+/**
+ * Recreate the token list after 'prev'
+ *
+ * Returns pointer to last token, or NULL if the blob is corrupt (in
+ * which case nothing is added)
+ */
+token_t *
+glw_view_blob_tokens(glw_root_t *gr, glw_view_blob_t *gvb, token_t *prev)
+{
+  const uint8_t *p = gvb->gvb_tokens;
+  const uint8_t *end = gvb->gvb_data + gvb->gvb_size;
+  token_t *first = prev;
+  token_t *t;
+  uint16_t file;
+  int32_t line;
+  uint32_t len;
+  int i;
+
+  for(i = 0; i < gvb->gvb_num_tokens; i++) {
+    if(p + 8 > end)
+      goto bad;
+
+    memcpy(&file, p + 2, sizeof(file));
+    memcpy(&line, p + 4, sizeof(line));
+
+    if(file >= gvb->gvb_num_files)
+      goto bad;
+
+    t = glw_view_token_alloc(gr);
+    t->type = p[0];
+    t->file = rstr_dup(gvb->gvb_files[file]);
+    t->line = line;
+    prev->next = t;
+    prev = t;
+
+    const int flags = p[1];
+    p += 8;
+
+    switch(t->type) {
+    case TOKEN_FLOAT:
+      if(p + sizeof(float) > end)
+        goto bad;
+      memcpy(&t->t_float, p, sizeof(float));
+      p += sizeof(float);
+      break;
+
+    case TOKEN_INT:
+      if(p + sizeof(int32_t) > end)
+        goto bad;
+      memcpy(&t->t_int, p, sizeof(int32_t));
+      p += sizeof(int32_t);
+      break;
+
+    case TOKEN_RSTRING:
+      t->t_rstrtype = flags;
+      // FALLTHRU
+    case TOKEN_IDENTIFIER:
+      if(p + sizeof(len) > end)
+        goto bad;
+      memcpy(&len, p, sizeof(len));
+      p += sizeof(len);
+      if(p + len > end)
+        goto bad;
+      t->t_rstring = rstr_allocl((const char *)p, len);
+      p += len;
+      break;
+
+    default:
+      if(!gvb_plain_token(t->type)) {
+        t->type = TOKEN_NOP;
+        goto bad;
+      }
+      break;
+    }
+  }
+  return prev;
+
+ bad:
+  glw_view_free_chain(gr, first->next);
+  first->next = NULL;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static int
+gvb_file_index(rstr_t **files, int *num_files, rstr_t *f)
+{
+  int i;
+  for(i = 0; i < *num_files; i++)
+    if(files[i] == f || rstr_eq(files[i], f))
+      return i;
+
+  if(*num_files == GVB_MAX_FILES)
+    return -1;
+
+  files[i] = f;
+  (*num_files)++;
+  return i;
+}
+
+
+/**
+ * Serialize the preprocessed token list starting after 'sof' (up to
+ * the terminating TOKEN_END) and store it in the blobcache
+ *
+ * If 'may_unlock' is set the GLW lock is released while we stat() the
+ * included files
+ */
+void
+glw_view_blob_store(glw_root_t *gr, rstr_t *url, const void *src,
+                    size_t srclen, token_t *sof, int may_unlock)
+{
+  rstr_t *files[GVB_MAX_FILES];
+  int num_files = 1;
+  int num_tokens = 0;
+  size_t token_size = 0;
+  const token_t *t;
+  gvb_header_t hdr;
+  char key[512];
+  int i;
+
+  files[0] = url;
+
+  // First pass, figure out how much space we need
+  for(t = sof->next; t->type != TOKEN_END; t = t->next) {
+
+    if(gvb_file_index(files, &num_files, t->file) < 0)
+      return;
+
+    token_size += 8;
+    switch(t->type) {
+    case TOKEN_FLOAT:
+      token_size += sizeof(float);
+      break;
+    case TOKEN_INT:
+      token_size += sizeof(int32_t);
+      break;
+    case TOKEN_RSTRING:
+    case TOKEN_IDENTIFIER:
+      token_size += sizeof(uint32_t) + strlen(rstr_get(t->t_rstring));
+      break;
+    default:
+      if(gvb_plain_token(t->type))
+        break;
+      TRACE(TRACE_DEBUG, "GLW", "Unable to precompile %s, got token %s",
+            rstr_get(url), token2name((token_t *)t));
+      return;
+    }
+    num_tokens++;
+  }
+
+  size_t files_size = 0;
+  for(i = 0; i < num_files; i++)
+    files_size += sizeof(uint16_t) + strlen(rstr_get(files[i])) +
+      2 * sizeof(int64_t);
+
+  buf_t *b = buf_create(sizeof(hdr) + files_size + token_size);
+  if(b == NULL)
+    return;
+
+  uint8_t *p = b->b_ptr;
+
+  hdr.magic = GVB_MAGIC;
+  hdr.num_files = num_files;
+  hdr.num_tokens = num_tokens;
+  hdr.token_size = token_size;
+  memcpy(p, &hdr, sizeof(hdr));
+  p += sizeof(hdr);
+
+  // Token section goes last, write it while we still hold the lock
+  uint8_t *tp = p + files_size;
+
+  for(t = sof->next; t->type != TOKEN_END; t = t->next) {
+    const uint16_t file = gvb_file_index(files, &num_files, t->file);
+    const int32_t line = t->line;
+    uint32_t len;
+
+    tp[0] = t->type;
+    tp[1] = t->type == TOKEN_RSTRING ? t->t_rstrtype : 0;
+    memcpy(tp + 2, &file, sizeof(file));
+    memcpy(tp + 4, &line, sizeof(line));
+    tp += 8;
+
+    switch(t->type) {
+    case TOKEN_FLOAT:
+      memcpy(tp, &t->t_float, sizeof(float));
+      tp += sizeof(float);
+      break;
+    case TOKEN_INT:
+      memcpy(tp, &t->t_int, sizeof(int32_t));
+      tp += sizeof(int32_t);
+      break;
+    case TOKEN_RSTRING:
+    case TOKEN_IDENTIFIER:
+      len = strlen(rstr_get(t->t_rstring));
+      memcpy(tp, &len, sizeof(len));
+      tp += sizeof(len);
+      memcpy(tp, rstr_get(t->t_rstring), len);
+      tp += len;
+      break;
+    default:
+      break;
+    }
+  }
+
+  for(i = 0; i < num_files; i++)
+    files[i] = rstr_dup(files[i]);
+
+  if(may_unlock)
+    glw_unlock(gr);
+
+  for(i = 0; i < num_files; i++) {
+    struct fa_stat fs;
+    const char *path = rstr_get(files[i]);
+    const uint16_t len = strlen(path);
+
+    if(i == 0) {
+      fs.fs_size = -1;
+      fs.fs_mtime = 0;
+    } else if(fa_stat_vpaths(path, gr->gr_vpaths, &fs, NULL, 0)) {
+      break;
+    }
+
+    const int64_t fsize = fs.fs_size;
+    const int64_t mtime = fs.fs_mtime;
+
+    memcpy(p, &len, sizeof(len));
+    p += sizeof(len);
+    memcpy(p, path, len);
+    p += len;
+    memcpy(p, &fsize, sizeof(fsize));
+    p += sizeof(fsize);
+    memcpy(p, &mtime, sizeof(mtime));
+    p += sizeof(mtime);
+  }
+
+  if(i == num_files) {
+    gvb_key(gr, url, src, srclen, key, sizeof(key));
+    blobcache_put(key, GVB_STASH, b, GVB_MAXAGE, NULL, 0, 0);
+  }
+
+  buf_release(b);
+
+  for(i = 0; i < num_files; i++)
+    rstr_release(files[i]);
+
+  if(may_unlock)
+    glw_lock(gr);
+}
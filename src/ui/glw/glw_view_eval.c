@@ -37,6 +37,10 @@
 #include "glw_text_bitmap.h"
 #include "prop/prop_window.h"
 
+#if ENABLE_HTTPSERVER
+#include "networking/http_server.h"
+#endif
+
 LIST_HEAD(clone_list, glw_clone);
 TAILQ_HEAD(vectorizer_element_queue, vectorizer_element);
 
@@ -311,6 +315,33 @@ eval_alloc(token_t *src, glw_view_eval_context_t *ec, token_type_t type)
 }
 
 
+/**
+ * Result token for operators with a scalar (int, float, numeric vector
+ * or void) result. It's owned by the operator token and reused every
+ * time it's evaluated, saving an alloc + free for every operation.
+ *
+ * Nothing may keep a reference to the result past the current
+ * evaluation (same as for tokens from eval_alloc())
+ */
+static token_t *
+eval_reg(token_t *self, glw_view_eval_context_t *ec, token_type_t type)
+{
+  token_t *r = self->t_extra;
+
+  if(r == NULL) {
+    r = glw_view_token_alloc(ec->gr);
+    r->file = rstr_dup(self->file);
+    r->line = self->line;
+    self->t_extra = r;
+  } else {
+    memset(&r->arg, 0, sizeof(r->arg));
+    memset(&r->u, 0, sizeof(r->u));
+  }
+  r->type = type;
+  return r;
+}
+
+
 /**
  *
  */
@@ -581,15 +612,15 @@ eval_op(glw_view_eval_context_t *ec, struct token *self)
   if(a->type == TOKEN_INT && b->type == TOKEN_INT) {
 
     if(i_fn == NULL) {
-      r = eval_alloc(self, ec, TOKEN_FLOAT);
+      r = eval_reg(self, ec, TOKEN_FLOAT);
       r->t_float = f_fn(a->t_int, b->t_int);
     } else {
-      r = eval_alloc(self, ec, TOKEN_INT);
+      r = eval_reg(self, ec, TOKEN_INT);
       r->t_int = i_fn(a->t_int, b->t_int);
     }
 
   } else if(token_floatish(a) && token_floatish(b)) {
-    r = eval_alloc(self, ec, TOKEN_FLOAT);
+    r = eval_reg(self, ec, TOKEN_FLOAT);
     r->t_float = f_fn(token2float(ec, a), token2float(ec, b));
 
   } else if(a->type == TOKEN_VECTOR_FLOAT && b->type == TOKEN_VECTOR_FLOAT) {
@@ -599,7 +630,7 @@ eval_op(glw_view_eval_context_t *ec, struct token *self)
 			      "Arithmetic op is invalid for "
 			      "non-equal sized vectors");
 
-    r = eval_alloc(self, ec, TOKEN_VECTOR_FLOAT);
+    r = eval_reg(self, ec, TOKEN_VECTOR_FLOAT);
 
     r->t_elements = a->t_elements;
     for(i = 0; i < a->t_elements; i++)
@@ -610,7 +641,7 @@ eval_op(glw_view_eval_context_t *ec, struct token *self)
 
     float v = token2float(ec, b);
 
-    r = eval_alloc(self, ec, TOKEN_VECTOR_FLOAT);
+    r = eval_reg(self, ec, TOKEN_VECTOR_FLOAT);
 
     r->t_elements = a->t_elements;
     for(i = 0; i < a->t_elements; i++)
@@ -620,13 +651,13 @@ eval_op(glw_view_eval_context_t *ec, struct token *self)
 
     float v = token2float(ec, a);
 
-    r = eval_alloc(self, ec, TOKEN_VECTOR_FLOAT);
+    r = eval_reg(self, ec, TOKEN_VECTOR_FLOAT);
 
     r->t_elements = b->t_elements;
     for(i = 0; i < b->t_elements; i++)
       r->t_float_vector[i] = f_fn(v, b->t_float_vector[i]);
   } else {
-    r = eval_alloc(self, ec, TOKEN_VOID);
+    r = eval_reg(self, ec, TOKEN_VOID);
   }
 
   eval_push(ec, r);
@@ -672,7 +703,7 @@ eval_bool_op(glw_view_eval_context_t *ec, struct token *self)
     break;
   }
 
-  r = eval_alloc(self, ec, TOKEN_INT);
+  r = eval_reg(self, ec, TOKEN_INT);
   r->t_int = fn(aa, bb);
   eval_push(ec, r);
   return 0;
@@ -690,7 +721,7 @@ eval_bool_not(glw_view_eval_context_t *ec, struct token *self)
   if((a = token_resolve(ec, a)) == NULL)
     return -1;
 
-  r = eval_alloc(self, ec, TOKEN_INT);
+  r = eval_reg(self, ec, TOKEN_INT);
   r->t_int = !token2bool(a);
   eval_push(ec, r);
   return 0;
@@ -737,7 +768,7 @@ eval_eq(glw_view_eval_context_t *ec, struct token *self, int neq)
     }
   }
 
-  r = eval_alloc(self, ec, TOKEN_INT);
+  r = eval_reg(self, ec, TOKEN_INT);
   r->t_int = rr ^ neq;
   eval_push(ec, r);
   return 0;
@@ -763,7 +794,7 @@ eval_lt(glw_view_eval_context_t *ec, struct token *self, int gt)
   else
     rr = token2float(ec, a) < token2float(ec, b);
 
-  r = eval_alloc(self, ec, TOKEN_INT);
+  r = eval_reg(self, ec, TOKEN_INT);
   r->t_int = rr;
   eval_push(ec, r);
   return 0;
@@ -2313,7 +2344,8 @@ subscribe_prop(glw_view_eval_context_t *ec, struct token *self, int type)
     abort();
   }
 
-  int f = 0;
+  // All our callbacks deal with PROP_ADD_CHILD_VECTOR
+  int f = PROP_SUB_CHILD_VECTORS;
 
   switch(type) {
   case GPS_VALUE:
@@ -2499,7 +2531,7 @@ make_vector(glw_view_eval_context_t *ec, token_t *t)
     return glw_view_seterr(ec->ei, t, "Invalid numeric vector length (%d)",
 			   t->t_num_args);
 
-  r = eval_alloc(t, ec, TOKEN_VECTOR_FLOAT);
+  r = eval_reg(t, ec, TOKEN_VECTOR_FLOAT);
   r->t_elements = t->t_num_args;
 
   for(i = t->t_num_args - 1; i >= 0; i--) {
@@ -2534,6 +2566,7 @@ glw_view_eval_rpn0(token_t *t0, glw_view_eval_context_t *ec)
     case TOKEN_RESOLVED_ATTRIBUTE:
     case TOKEN_UNRESOLVED_ATTRIBUTE:
     case TOKEN_VOID:
+    case TOKEN_VECTOR_FLOAT:
     case TOKEN_PROPERTY_REF:
     case TOKEN_PROPERTY_OWNER:
     case TOKEN_PROPERTY_NAME:
@@ -5193,7 +5226,7 @@ glwf_sinewave(glw_view_eval_context_t *ec, struct token *self,
   if(self->t_extra_float >= M_PI * 2)
     self->t_extra_float -= M_PI * 2;
 
-  glw_need_refresh(gr, 0);
+  glw_need_refresh_widget(ec->w, 0);
 
   r = eval_alloc(self, ec, TOKEN_FLOAT);
   r->t_float = sin(self->t_extra_float);
@@ -6698,3 +6731,128 @@ glw_view_function_resolve(glw_root_t *gr, errorinfo_t *ei, token_t *t)
   glw_view_seterr(ei, t, "Unknown function: %s", fname);
   return NULL;
 }
+
+
+#if ENABLE_HTTPSERVER
+
+/**
+ * Re-evaluates every dynamic expression in the widget tree a number of
+ * times and reports how many expressions per second the evaluator
+ * manages. Numbers from before and after a change to the parser or
+ * evaluator should be compared on the same set of loaded views.
+ *
+ * Run with: curl http://<host>:42000/showtime/glw/viewbenchmark
+ *
+ * The request is picked up by the next frame (in glw_prepare_frame())
+ * so the benchmark runs on the UI thread with the GLW lock held
+ */
+
+#define BENCH_ROUNDS 100
+
+static HTS_MUTEX_DECL(bench_mutex);
+static hts_cond_t bench_cond;
+static int bench_requested;
+static int bench_generation;
+static int bench_exprs;
+static int64_t bench_time;
+
+static int
+bench_widget(glw_t *w)
+{
+  glw_t *c;
+  token_t *t;
+  int exprs = 0;
+
+  for(t = w->glw_dynamic_expressions; t != NULL; t = t->next)
+    if(t->t_dynamic_eval)
+      exprs++;
+
+  glw_view_eval_dynamics(w, 0xff);
+
+  TAILQ_FOREACH(c, &w->glw_childs, glw_parent_link)
+    exprs += bench_widget(c);
+  return exprs;
+}
+
+
+/**
+ *
+ */
+void
+glw_view_benchmark_poll(glw_root_t *gr)
+{
+  int i, exprs = 0;
+
+  if(!bench_requested)
+    return;
+
+  glw_lock_assert();
+
+  int64_t start = arch_get_ts();
+
+  for(i = 0; i < BENCH_ROUNDS; i++)
+    exprs += bench_widget(gr->gr_universe);
+
+  int64_t d = arch_get_ts() - start;
+
+  hts_mutex_lock(&bench_mutex);
+  bench_exprs = exprs;
+  bench_time = d;
+  bench_requested = 0;
+  bench_generation++;
+  hts_cond_broadcast(&bench_cond);
+  hts_mutex_unlock(&bench_mutex);
+}
+
+
+/**
+ *
+ */
+static int
+glw_view_benchmark_http(http_connection_t *hc, const char *remain,
+                        void *opaque, http_cmd_t method)
+{
+  htsbuf_queue_t out;
+
+  hts_mutex_lock(&bench_mutex);
+  const int gen = bench_generation;
+  bench_requested = 1;
+
+  while(gen == bench_generation)
+    if(hts_cond_wait_timeout(&bench_cond, &bench_mutex, 10000))
+      break;
+
+  const int ok = gen != bench_generation;
+  const int exprs = bench_exprs;
+  const int64_t d = bench_time;
+  hts_mutex_unlock(&bench_mutex);
+
+  if(!ok)
+    return HTTP_STATUS_UNAVAILABLE;
+
+  htsbuf_queue_init(&out, 0);
+  htsbuf_qprintf(&out,
+                 "glw view benchmark: %d expressions in %d.%03d ms, "
+                 "%d evals/s\n",
+                 exprs, (int)(d / 1000), (int)(d % 1000),
+                 d ? (int)(exprs * 1000000LL / d) : 0);
+
+  return http_send_reply(hc, 0, "text/plain; charset=utf-8", NULL, NULL, 0,
+                         &out);
+}
+
+
+/**
+ *
+ */
+static void
+glw_view_benchmark_init(void)
+{
+  hts_cond_init(&bench_cond, &bench_mutex);
+  http_path_add("/showtime/glw/viewbenchmark", NULL,
+                glw_view_benchmark_http, 1);
+}
+
+INITME(INIT_GROUP_API, glw_view_benchmark_init, NULL);
+
+#endif // ENABLE_HTTPSERVER
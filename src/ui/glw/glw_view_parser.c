@@ -106,6 +106,210 @@ static const int tokenprecedence[TOKEN_num] = {
 };
 
 
+/**
+ *
+ */
+static int
+token_is_constant(const token_t *t)
+{
+  return t->type == TOKEN_INT || t->type == TOKEN_FLOAT;
+}
+
+
+/**
+ *
+ */
+static float
+constant_float(const token_t *t)
+{
+  return t->type == TOKEN_INT ? t->t_int : t->t_float;
+}
+
+
+/**
+ * Number of operands 'op' consumes if it can be evaluated at parse
+ * time, 0 if it can't
+ */
+static int
+fold_num_operands(const token_t *op)
+{
+  switch(op->type) {
+  case TOKEN_ADD:
+  case TOKEN_SUB:
+  case TOKEN_MULTIPLY:
+  case TOKEN_DIVIDE:
+  case TOKEN_MODULO:
+  case TOKEN_BOOLEAN_AND:
+  case TOKEN_BOOLEAN_OR:
+  case TOKEN_BOOLEAN_XOR:
+  case TOKEN_EQ:
+  case TOKEN_NEQ:
+  case TOKEN_LT:
+  case TOKEN_GT:
+    return 2;
+  case TOKEN_BOOLEAN_NOT:
+    return 1;
+  case TOKEN_LEFT_BRACKET:
+    return op->t_num_args >= 1 && op->t_num_args <= 4 ? op->t_num_args : 0;
+  default:
+    return 0;
+  }
+}
+
+
+/**
+ * Evaluate 'op' on the constant operands starting at 'a' and turn 'op'
+ * into the result. Must give the exact same result as the evaluator
+ * (see eval_op() and friends in glw_view_eval.c)
+ *
+ * Returns -1 if the operation should be left for runtime
+ */
+static int
+fold_op(token_t *op, const token_t *a)
+{
+  const token_t *b = a->next;
+  int i, r;
+
+  switch(op->type) {
+  case TOKEN_ADD:
+  case TOKEN_SUB:
+  case TOKEN_MULTIPLY:
+  case TOKEN_MODULO:
+    if(a->type == TOKEN_INT && b->type == TOKEN_INT) {
+      switch(op->type) {
+      case TOKEN_ADD:      r = a->t_int + b->t_int; break;
+      case TOKEN_SUB:      r = a->t_int - b->t_int; break;
+      case TOKEN_MULTIPLY: r = a->t_int * b->t_int; break;
+      default:
+        if(b->t_int == 0 || b->t_int == -1)
+          return -1;
+        r = a->t_int % b->t_int;
+        break;
+      }
+      op->type = TOKEN_INT;
+      op->t_int = r;
+      return 0;
+    }
+    // FALLTHRU
+  case TOKEN_DIVIDE: {
+    const float fa = constant_float(a);
+    const float fb = constant_float(b);
+    float f;
+    switch(op->type) {
+    case TOKEN_ADD:      f = fa + fb; break;
+    case TOKEN_SUB:      f = fa - fb; break;
+    case TOKEN_MULTIPLY: f = fa * fb; break;
+    case TOKEN_DIVIDE:   f = fa / fb; break;
+    default:
+      if((int)fb == 0 || (int)fb == -1)
+        return -1;
+      f = (int)fa % (int)fb;
+      break;
+    }
+    op->type = TOKEN_FLOAT;
+    op->t_float = f;
+    return 0;
+  }
+
+  case TOKEN_BOOLEAN_AND:
+    r = !!constant_float(a) & !!constant_float(b);
+    break;
+  case TOKEN_BOOLEAN_OR:
+    r = !!constant_float(a) | !!constant_float(b);
+    break;
+  case TOKEN_BOOLEAN_XOR:
+    r = !!constant_float(a) ^ !!constant_float(b);
+    break;
+  case TOKEN_BOOLEAN_NOT:
+    r = !constant_float(a);
+    break;
+
+  case TOKEN_EQ:
+  case TOKEN_NEQ:
+    if(a->type == TOKEN_INT && b->type == TOKEN_INT)
+      r = a->t_int == b->t_int;
+    else
+      r = constant_float(a) == constant_float(b);
+    r ^= op->type == TOKEN_NEQ;
+    break;
+
+  case TOKEN_LT:
+    r = constant_float(a) < constant_float(b);
+    break;
+  case TOKEN_GT:
+    r = constant_float(a) > constant_float(b);
+    break;
+
+  case TOKEN_LEFT_BRACKET:
+    op->type = TOKEN_VECTOR_FLOAT;
+    op->t_elements = op->t_num_args;
+    op->t_num_args = 0;
+    for(i = 0; i < op->t_elements; i++, a = a->next)
+      op->t_float_vector[i] = constant_float(a);
+    return 0;
+
+  default:
+    return -1;
+  }
+
+  op->type = TOKEN_INT;
+  op->t_int = r;
+  return 0;
+}
+
+
+/**
+ * Constant folding of an RPN expression
+ *
+ * Any operator whose operands are all numeric constants is replaced
+ * with its result. This is repeated until nothing more can be folded,
+ * so things like '[0.5 * 2, 1, 1]' ends up as a single VECTOR_FLOAT
+ * token which in turn makes optimize_attribute_assignment() kick in.
+ *
+ * Strings, em-units and void are never folded, their value depend
+ * on things only known at runtime (or they are too rare to bother)
+ */
+static void
+fold_constants(token_t **head, glw_root_t *gr)
+{
+  token_t **run, **p, *t, *n;
+  int runlen, num;
+
+ again:
+  run = head;
+  runlen = 0;
+
+  for(p = head; (t = *p) != NULL; p = &t->next) {
+
+    if(token_is_constant(t)) {
+      if(runlen++ == 0)
+        run = p;
+      continue;
+    }
+
+    num = fold_num_operands(t);
+    if(num > 0 && num <= runlen) {
+
+      // Skip to the first operand
+      for(; runlen > num; runlen--)
+        run = &(*run)->next;
+
+      if(!fold_op(t, *run)) {
+        n = *run;
+        *run = t;
+        while(n != t) {
+          token_t *x = n;
+          n = n->next;
+          glw_view_token_free(gr, x);
+        }
+        goto again;
+      }
+    }
+    runlen = 0;
+  }
+}
+
+
 /**
  * Convert an infix expression into an RPN expression
  *
@@ -265,6 +469,8 @@ parse_shunting_yard(token_t *expr, errorinfo_t *ei, glw_root_t *gr)
   }
 
 
+  fold_constants(&outq.head, gr);
+
   expr->child = outq.head;
   /*
    * Assignments to the 'style' property are always pure because
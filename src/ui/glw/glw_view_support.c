@@ -83,33 +83,38 @@ glw_view_token_free(glw_root_t *gr, token_t *t)
   case TOKEN_BLOCK_CLOSE:
   case TOKEN_LEFT_PARENTHESIS:
   case TOKEN_RIGHT_PARENTHESIS:
-  case TOKEN_LEFT_BRACKET:
   case TOKEN_RIGHT_BRACKET:
   case TOKEN_DOT:
+  case TOKEN_DOLLAR:
+  case TOKEN_AMPERSAND:
+  case TOKEN_NULL_COALESCE:
+  case TOKEN_EXPR:
+  case TOKEN_RPN:
+  case TOKEN_PURE_RPN:
+  case TOKEN_BLOCK:
+  case TOKEN_NOP:
+  case TOKEN_COLON:
+  case TOKEN_VECTOR:
+  case TOKEN_MOD_FLAGS:
+    break;
+
+  case TOKEN_LEFT_BRACKET:
   case TOKEN_ADD:
   case TOKEN_SUB:
   case TOKEN_MULTIPLY:
   case TOKEN_DIVIDE:
   case TOKEN_MODULO:
-  case TOKEN_DOLLAR:
-  case TOKEN_AMPERSAND:
   case TOKEN_BOOLEAN_AND:
   case TOKEN_BOOLEAN_OR:
   case TOKEN_BOOLEAN_XOR:
   case TOKEN_BOOLEAN_NOT:
   case TOKEN_EQ:
   case TOKEN_NEQ:
-  case TOKEN_NULL_COALESCE:
   case TOKEN_LT:
   case TOKEN_GT:
-  case TOKEN_EXPR:
-  case TOKEN_RPN:
-  case TOKEN_PURE_RPN:
-  case TOKEN_BLOCK:
-  case TOKEN_NOP:
-  case TOKEN_COLON:
-  case TOKEN_VECTOR:
-  case TOKEN_MOD_FLAGS:
+    // Result register, see eval_reg()
+    if(t->t_extra != NULL)
+      glw_view_token_free(gr, t->t_extra);
     break;
 
   case TOKEN_RSTRING:
@@ -259,6 +264,11 @@ glw_view_token_copy(glw_root_t *gr, token_t *src)
     break;
 
   case TOKEN_VECTOR_FLOAT:
+    memcpy(dst->t_float_vector, src->t_float_vector,
+           sizeof(dst->t_float_vector));
+    dst->t_elements = src->t_elements;
+    break;
+
   case TOKEN_EVENT:
   case TOKEN_VECTOR:
   case TOKEN_num: